@@ -0,0 +1,153 @@
+#define _GNU_SOURCE  // For dladdr()
+#include "alloc_stats.h"
+#include "log.h"
+
+#ifdef ALLOC_STATS
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <glib-unix.h>
+#include <link.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ALLOC_SITES        1024  // Must be a power of two
+#define ALLOC_MAX_FRAMES   16
+#define ALLOC_SITES_TO_LOG 20
+
+// Frames to skip in a backtrace taken in call_site(): call_site() itself, record_allocation()
+// and the malloc wrapper.
+#define ALLOC_HOOK_FRAMES 3
+
+struct alloc_site {
+    uintptr_t address;  // Zero if the slot is free. Accessed using __atomic builtins only
+    guint64 calls;
+    guint64 bytes;
+};
+
+// An open-addressing hash table, filled from any thread without locks. Slots are claimed with a
+// compare-and-swap on the address and never released.
+static struct alloc_site sites[ALLOC_SITES];
+static guint64 total_calls;
+static guint64 unattributed_calls;  // Call site outside the executable, or the table was full
+
+// Set while an allocation is being recorded, since backtrace() may allocate on its first call.
+static __thread bool in_hook;
+
+extern char __executable_start;
+extern char etext;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static bool in_executable(const void* address) {
+    return (const char*)address >= &__executable_start && (const char*)address < &etext;
+}
+
+static __attribute__((noinline)) uintptr_t call_site(void) {
+    void* frames[ALLOC_MAX_FRAMES];
+    const int depth = backtrace(frames, ALLOC_MAX_FRAMES);
+    for (int i = ALLOC_HOOK_FRAMES; i < depth; i++)
+        if (in_executable(frames[i]))
+            return (uintptr_t)frames[i];
+    return 0;
+}
+
+static struct alloc_site* find_or_claim_site(uintptr_t address) {
+    const guint start = (address >> 2) * 2654435761u;
+    for (guint i = 0; i < ALLOC_SITES; i++) {
+        struct alloc_site* site = &sites[(start + i) & (ALLOC_SITES - 1)];
+        uintptr_t current = __atomic_load_n(&site->address, __ATOMIC_ACQUIRE);
+        if (current == 0 &&
+            __atomic_compare_exchange_n(
+                &site->address, &current, address, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return site;
+        // The slot was taken, possibly by another thread just now, and current is its address.
+        if (current == address)
+            return site;
+    }
+    return NULL;
+}
+
+static __attribute__((noinline)) void record_allocation(size_t size) {
+    if (in_hook)
+        return;
+    in_hook = true;
+    __atomic_fetch_add(&total_calls, 1, __ATOMIC_RELAXED);
+    const uintptr_t address = call_site();
+    struct alloc_site* site = address ? find_or_claim_site(address) : NULL;
+    if (site) {
+        __atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->bytes, size, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&unattributed_calls, 1, __ATOMIC_RELAXED);
+    }
+    in_hook = false;
+}
+
+void* malloc(size_t size) {
+    record_allocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    record_allocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    record_allocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+static int compare_calls(const void* a, const void* b) {
+    const guint64 x = ((const struct alloc_site*)a)->calls;
+    const guint64 y = ((const struct alloc_site*)b)->calls;
+    return (x < y) - (x > y);  // Most calls first
+}
+
+// Store the load address of the executable, which dl_iterate_phdr() reports first, so that the
+// logged addresses can be passed to addr2line whether the executable is position independent or
+// not.
+static int get_load_bias(struct dl_phdr_info* info, size_t, void* load_bias_void_ptr) {
+    *(uintptr_t*)load_bias_void_ptr = info->dlpi_addr;
+    return 1;
+}
+
+void alloc_stats_log(void) {
+    static struct alloc_site snapshot[ALLOC_SITES];
+    for (guint i = 0; i < ALLOC_SITES; i++) {
+        snapshot[i].address = __atomic_load_n(&sites[i].address, __ATOMIC_ACQUIRE);
+        snapshot[i].calls = __atomic_load_n(&sites[i].calls, __ATOMIC_RELAXED);
+        snapshot[i].bytes = __atomic_load_n(&sites[i].bytes, __ATOMIC_RELAXED);
+    }
+    qsort(snapshot, ALLOC_SITES, sizeof(snapshot[0]), compare_calls);
+    uintptr_t load_bias = 0;
+    dl_iterate_phdr(get_load_bias, &load_bias);
+
+    log_info("Allocations: %" G_GUINT64_FORMAT " in total, %" G_GUINT64_FORMAT " unattributed",
+             __atomic_load_n(&total_calls, __ATOMIC_RELAXED),
+             __atomic_load_n(&unattributed_calls, __ATOMIC_RELAXED));
+    for (guint i = 0; i < ALLOC_SITES_TO_LOG && snapshot[i].calls; i++) {
+        Dl_info info = {0};
+        dladdr((void*)snapshot[i].address, &info);
+        log_info("  %8" G_GUINT64_FORMAT " calls %10" G_GUINT64_FORMAT " bytes at 0x%lx (%s)",
+                 snapshot[i].calls,
+                 snapshot[i].bytes,
+                 (unsigned long)(snapshot[i].address - load_bias),
+                 info.dli_sname ? info.dli_sname : "?");
+    }
+}
+
+static gboolean log_on_signal(void*) {
+    alloc_stats_log();
+    return G_SOURCE_CONTINUE;
+}
+
+void alloc_stats_init(void) {
+    g_unix_signal_add(SIGUSR2, log_on_signal, NULL);
+}
+
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+// Allocation accounting, enabled by building with ALLOC_STATS=1. Every malloc, calloc and realloc
+// in the process is counted against its call site, which is the innermost caller inside this
+// executable. Allocations made by GLib on behalf of the application are thereby attributed to
+// the application code that asked for them. Without ALLOC_STATS, these functions do nothing.
+
+#ifdef ALLOC_STATS
+// Log the call sites with the most allocations whenever SIGUSR2 is received.
+void alloc_stats_init(void);
+
+// Log the call sites with the most allocations since startup, with their addresses in the
+// executable, to be resolved with addr2line.
+void alloc_stats_log(void);
+#else
+static inline void alloc_stats_init(void) {}
+static inline void alloc_stats_log(void) {}
+#endif
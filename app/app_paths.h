@@ -1,5 +1,17 @@
 #pragma once
 
+// The host build (make host) points these at a scratch directory.
+#ifndef APP_DIRECTORY
 #define APP_DIRECTORY "/usr/local/packages/" APP_NAME
-#define APP_LOCALDATA APP_DIRECTORY "/localdata"
-#define DAEMON_JSON   "daemon.json"
+#endif
+#ifndef XDG_RUNTIME_ROOT
+#define XDG_RUNTIME_ROOT "/var/run/user"
+#endif
+#define APP_LOCALDATA    APP_DIRECTORY "/localdata"
+#define DAEMON_JSON      "daemon.json"
+#define CLIENT_ALLOWLIST "client-allowlist.txt"
+#define CLIENT_CRL       "crl.pem"
+#define REGISTRY_AUTH    "registry-auth.json"
+
+// Where an uploaded REGISTRY_AUTH is stored, for the Docker CLI, whose home is APP_DIRECTORY.
+#define REGISTRY_AUTH_PATH APP_DIRECTORY "/.docker/config.json"
@@ -0,0 +1,406 @@
+#define LOG_MODULE log_module_supervisor
+#include "container_start.h"
+#include "docker_api.h"
+#include "json.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define API_TIMEOUT_MS      10000
+#define POLL_INTERVAL_MS    250
+#define START_TIMEOUT_SEC   120  // Per container, until running, and healthy if it has a check
+#define DEFAULT_CONCURRENCY 2    // Per wave, unless a container of the wave has a concurrency label
+#define MAX_CONCURRENCY     16
+
+const char* const container_start_state_names[CONTAINER_START_STATE_COUNT] = {
+    [container_start_waiting] = "waiting",
+    [container_start_starting] = "starting",
+    [container_start_running] = "running",
+    [container_start_already_running] = "already_running",
+    [container_start_failed] = "failed",
+    [container_start_timed_out] = "timed_out",
+};
+
+// A labeled container, as listed by dockerd
+struct container {
+    char id[72];
+    char name[CONTAINER_START_NAME_SIZE];
+    char state[16];   // E.g. "created", "exited" or "running"
+    int priority;
+    int concurrency;  // Or 0 if the container has no concurrency label
+    gint64 started;   // From g_get_monotonic_time(), while starting
+};
+
+// Shared by the thread that starts and stops the scheduler, the scheduler thread, and the FCGI
+// thread through container_start_get_stats().
+static struct {
+    GMutex mutex;
+    GCond wakeup;                        // Signaled when stopping
+    bool stopping;                       // Guarded by mutex
+    struct container_start_stats stats;  // Guarded by mutex
+    GThread* thread;
+    char* docker_socket;
+    gint64 ready;  // When dockerd answered, from g_get_monotonic_time()
+} scheduler;
+
+// Return the integer in a label value, or fallback if it is not one.
+static int label_value(const char* value, gsize value_length, const char* label, int fallback) {
+    char text[16];
+    json_copy_string(value, value_length, text, sizeof(text));
+    char* end;
+    const long number = strtol(text, &end, 10);
+    if (!*text || *end || number < -1000000 || number > 1000000) {
+        log_warning("Ignoring %s=%s, which is not an integer", label, text);
+        return fallback;
+    }
+    return (int)number;
+}
+
+static void parse_label(const char* key,
+                        gsize key_length,
+                        const char* value,
+                        gsize value_length,
+                        void* container_void_ptr) {
+    struct container* container = container_void_ptr;
+    if (json_is_key(key, key_length, CONTAINER_START_PRIORITY_LABEL)) {
+        container->priority =
+            label_value(value, value_length, CONTAINER_START_PRIORITY_LABEL, container->priority);
+    } else if (json_is_key(key, key_length, CONTAINER_START_CONCURRENCY_LABEL)) {
+        const int concurrency =
+            label_value(value, value_length, CONTAINER_START_CONCURRENCY_LABEL, 0);
+        container->concurrency = CLAMP(concurrency, 0, MAX_CONCURRENCY);
+    }
+}
+
+// Meant to be used as a json_element_callback for "Names", which are like ["/web"].
+static void parse_name(const char* value, gsize value_length, void* container_void_ptr) {
+    struct container* container = container_void_ptr;
+    if (*container->name)
+        return;
+    json_copy_string(value, value_length, container->name, sizeof(container->name));
+    if (*container->name == '/')
+        memmove(container->name, container->name + 1, strlen(container->name));
+}
+
+static void parse_summary(const char* key,
+                          gsize key_length,
+                          const char* value,
+                          gsize value_length,
+                          void* container_void_ptr) {
+    struct container* container = container_void_ptr;
+    char reason[64];
+    if (json_is_key(key, key_length, "Id"))
+        json_copy_string(value, value_length, container->id, sizeof(container->id));
+    else if (json_is_key(key, key_length, "State"))
+        json_copy_string(value, value_length, container->state, sizeof(container->state));
+    else if (json_is_key(key, key_length, "Names"))
+        json_foreach_element(value, value_length, parse_name, container, reason, sizeof(reason));
+    else if (json_is_key(key, key_length, "Labels") && *value == '{')
+        json_foreach_member(value, value_length, parse_label, container, reason, sizeof(reason));
+}
+
+// Meant to be used as a json_element_callback for the list of containers.
+static void parse_container(const char* value, gsize value_length, void* containers_void_ptr) {
+    GArray* containers = containers_void_ptr;
+    struct container container = {0};
+    char reason[64];
+    if (json_foreach_member(
+            value, value_length, parse_summary, &container, reason, sizeof(reason)) &&
+        *container.id && containers->len < CONTAINER_START_MAX)
+        g_array_append_val(containers, container);
+}
+
+// Highest priority first, and then by name, so that the order is the same on every boot.
+static gint compare_containers(gconstpointer a_void_ptr, gconstpointer b_void_ptr) {
+    const struct container* a = a_void_ptr;
+    const struct container* b = b_void_ptr;
+    if (a->priority != b->priority)
+        return a->priority > b->priority ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+// Return the labeled containers in start order, or NULL on error. Free with g_array_free().
+static GArray* list_containers(void) {
+    g_autofree char* filters =
+        g_uri_escape_string("{\"label\":[\"" CONTAINER_START_PRIORITY_LABEL "\"]}", NULL, FALSE);
+    g_autofree char* path = g_strdup_printf("/containers/json?all=true&filters=%s", filters);
+    g_autofree char* body = NULL;
+    const int status =
+        docker_api_request(scheduler.docker_socket, "GET", path, NULL, &body, API_TIMEOUT_MS);
+    if (status != 200) {
+        log_error("Failed to list the containers to start, status %d", status);
+        return NULL;
+    }
+
+    GArray* containers = g_array_new(FALSE, FALSE, sizeof(struct container));
+    char reason[64];
+    if (!json_foreach_element(
+            body, strlen(body), parse_container, containers, reason, sizeof(reason))) {
+        log_error("Failed to parse the list of containers: %s", reason);
+        g_array_free(containers, TRUE);
+        return NULL;
+    }
+    g_array_sort(containers, compare_containers);
+    return containers;
+}
+
+// What matters of GET /containers/{id}/json
+struct inspection {
+    bool running;
+    char status[16];  // E.g. "running", "restarting" or "exited"
+    char health[16];  // E.g. "starting", "healthy" or "unhealthy", or empty without a health check
+};
+
+static void parse_health(const char* key,
+                         gsize key_length,
+                         const char* value,
+                         gsize value_length,
+                         void* inspection_void_ptr) {
+    struct inspection* inspection = inspection_void_ptr;
+    if (json_is_key(key, key_length, "Status"))
+        json_copy_string(value, value_length, inspection->health, sizeof(inspection->health));
+}
+
+static void parse_state(const char* key,
+                        gsize key_length,
+                        const char* value,
+                        gsize value_length,
+                        void* inspection_void_ptr) {
+    struct inspection* inspection = inspection_void_ptr;
+    char reason[64];
+    if (json_is_key(key, key_length, "Running"))
+        inspection->running = g_str_has_prefix(value, "true");
+    else if (json_is_key(key, key_length, "Status"))
+        json_copy_string(value, value_length, inspection->status, sizeof(inspection->status));
+    else if (json_is_key(key, key_length, "Health") && *value == '{')
+        json_foreach_member(value, value_length, parse_health, inspection, reason, sizeof(reason));
+}
+
+static void parse_inspection(const char* key,
+                             gsize key_length,
+                             const char* value,
+                             gsize value_length,
+                             void* inspection_void_ptr) {
+    char reason[64];
+    if (json_is_key(key, key_length, "State") && *value == '{')
+        json_foreach_member(
+            value, value_length, parse_state, inspection_void_ptr, reason, sizeof(reason));
+}
+
+// Return the state that a starting container has reached.
+static enum container_start_state check_container(const struct container* container) {
+    g_autofree char* path = g_strdup_printf("/containers/%s/json", container->id);
+    g_autofree char* body = NULL;
+    const int status =
+        docker_api_request(scheduler.docker_socket, "GET", path, NULL, &body, API_TIMEOUT_MS);
+    struct inspection inspection = {0};
+    char reason[64];
+    if (status == 404) {
+        log_warning("Container %s was removed while starting", container->name);
+        return container_start_failed;
+    }
+    if (status == 200 && json_foreach_member(body,
+                                             strlen(body),
+                                             parse_inspection,
+                                             &inspection,
+                                             reason,
+                                             sizeof(reason))) {
+        if (inspection.running && (!*inspection.health || !strcmp(inspection.health, "healthy")))
+            return container_start_running;
+        if (inspection.running && !strcmp(inspection.health, "unhealthy")) {
+            log_warning("Container %s is unhealthy", container->name);
+            return container_start_failed;
+        }
+        if (!strcmp(inspection.status, "exited") || !strcmp(inspection.status, "dead")) {
+            log_warning("Container %s %s while starting", container->name, inspection.status);
+            return container_start_failed;
+        }
+    }
+    const gint64 elapsed_ms = (g_get_monotonic_time() - container->started) / 1000;
+    if (elapsed_ms > START_TIMEOUT_SEC * 1000) {
+        log_warning("Container %s is not %s after %d s, starting the next ones",
+                    container->name,
+                    *inspection.health ? "healthy" : "running",
+                    START_TIMEOUT_SEC);
+        return container_start_timed_out;
+    }
+    return container_start_starting;
+}
+
+static void set_state(guint index, enum container_start_state state) {
+    g_mutex_lock(&scheduler.mutex);
+    struct container_start_result* result = &scheduler.stats.results[index];
+    result->state = state;
+    if (state == container_start_running)
+        result->time_to_running_ms = (g_get_monotonic_time() - scheduler.ready) / 1000;
+    g_mutex_unlock(&scheduler.mutex);
+}
+
+// Wait for at most POLL_INTERVAL_MS. Return false if stopping.
+static bool wait_for_next_poll(void) {
+    g_mutex_lock(&scheduler.mutex);
+    const gint64 deadline = g_get_monotonic_time() + POLL_INTERVAL_MS * G_USEC_PER_SEC / 1000;
+    while (!scheduler.stopping && g_cond_wait_until(&scheduler.wakeup, &scheduler.mutex, deadline))
+        continue;
+    const bool stopping = scheduler.stopping;
+    g_mutex_unlock(&scheduler.mutex);
+    return !stopping;
+}
+
+static enum container_start_state start_container(struct container* container) {
+    g_autofree char* path = g_strdup_printf("/containers/%s/start", container->id);
+    const int status =
+        docker_api_request(scheduler.docker_socket, "POST", path, NULL, NULL, API_TIMEOUT_MS);
+    // 304 means that dockerd started it in the meantime, which is waited for the same way.
+    if (status != 204 && status != 304) {
+        log_error("Failed to start container %s, status %d", container->name, status);
+        return container_start_failed;
+    }
+    log_info("Starting container %s, with priority %d", container->name, container->priority);
+    container->started = g_get_monotonic_time();
+    return container_start_starting;
+}
+
+// Start the containers of the wave from first to before end that are not running, at most
+// concurrency at a time, and return when they have all reached a final state. Return false if
+// stopping.
+static bool start_wave(GArray* containers, guint first, guint end, int concurrency) {
+    guint next = first;
+    GArray* starting = g_array_new(FALSE, FALSE, sizeof(guint));  // Indexes into containers
+    bool stopping = false;
+    while (!stopping && (next < end || starting->len > 0)) {
+        while (next < end && starting->len < (guint)concurrency) {
+            const guint index = next++;
+            struct container* container = &g_array_index(containers, struct container, index);
+            if (strcmp(container->state, "running") == 0)
+                continue;
+            const enum container_start_state state = start_container(container);
+            set_state(index, state);
+            if (state == container_start_starting)
+                g_array_append_val(starting, index);
+        }
+        if (starting->len == 0)
+            continue;
+
+        stopping = !wait_for_next_poll();
+        for (guint i = 0; i < starting->len && !stopping;) {
+            const guint index = g_array_index(starting, guint, i);
+            const struct container* container = &g_array_index(containers, struct container, index);
+            const enum container_start_state state = check_container(container);
+            if (state == container_start_starting) {
+                i++;
+                continue;
+            }
+            set_state(index, state);
+            if (state == container_start_running)
+                log_info("Container %s is running after %" G_GINT64_FORMAT " ms",
+                         container->name,
+                         (g_get_monotonic_time() - container->started) / 1000);
+            g_array_remove_index(starting, i);
+        }
+    }
+    g_array_free(starting, TRUE);
+    return !stopping;
+}
+
+static void* run_schedule(void*) {
+    GArray* containers = list_containers();
+    if (!containers) {
+        g_mutex_lock(&scheduler.mutex);
+        scheduler.stats.done = true;
+        g_mutex_unlock(&scheduler.mutex);
+        return NULL;
+    }
+
+    g_mutex_lock(&scheduler.mutex);
+    scheduler.stats.count = containers->len;
+    for (guint i = 0; i < containers->len; i++) {
+        const struct container* container = &g_array_index(containers, struct container, i);
+        struct container_start_result* result = &scheduler.stats.results[i];
+        g_strlcpy(result->name, container->name, sizeof(result->name));
+        result->priority = container->priority;
+        // dockerd starts those with restart policy "always" or "unless-stopped" itself, and after
+        // an unclean shutdown also those with "on-failure" that were running, so only "no" makes
+        // the waves hold.
+        result->state = strcmp(container->state, "running") == 0 ? container_start_already_running
+                                                                   : container_start_waiting;
+        if (result->state == container_start_already_running)
+            log_warning("Container %s was started by dockerd before its priority wave, since its "
+                        "restart policy is not \"no\"",
+                        container->name);
+    }
+    g_mutex_unlock(&scheduler.mutex);
+
+    int waves = 0;
+    bool stopping = false;
+    for (guint first = 0; first < containers->len && !stopping;) {
+        const int priority = g_array_index(containers, struct container, first).priority;
+        int concurrency = 0;
+        guint end = first;
+        for (; end < containers->len; end++) {
+            const struct container* container = &g_array_index(containers, struct container, end);
+            if (container->priority != priority)
+                break;
+            if (container->concurrency && (!concurrency || container->concurrency < concurrency))
+                concurrency = container->concurrency;
+        }
+
+        guint to_start = 0;
+        for (guint i = first; i < end; i++)
+            if (strcmp(g_array_index(containers, struct container, i).state, "running") != 0)
+                to_start++;
+        if (to_start > 0) {
+            log_info("Starting wave %d of %u containers with priority %d, %d at a time",
+                     ++waves,
+                     to_start,
+                     priority,
+                     concurrency ? concurrency : DEFAULT_CONCURRENCY);
+            stopping = !start_wave(containers,
+                                   first,
+                                   end,
+                                   concurrency ? concurrency : DEFAULT_CONCURRENCY);
+        }
+        first = end;
+    }
+
+    g_mutex_lock(&scheduler.mutex);
+    scheduler.stats.done = true;
+    g_mutex_unlock(&scheduler.mutex);
+    if (waves)
+        log_info("Started %d waves of labeled containers in %" G_GINT64_FORMAT " ms",
+                 waves,
+                 (g_get_monotonic_time() - scheduler.ready) / 1000);
+    g_array_free(containers, TRUE);
+    return NULL;
+}
+
+void container_start_run(const char* docker_socket) {
+    container_start_stop();
+    g_mutex_lock(&scheduler.mutex);
+    scheduler.stopping = false;
+    scheduler.stats = (struct container_start_stats){0};
+    g_mutex_unlock(&scheduler.mutex);
+    scheduler.docker_socket = g_strdup(docker_socket);
+    scheduler.ready = g_get_monotonic_time();
+    scheduler.thread = g_thread_new("container_start", run_schedule, NULL);
+}
+
+void container_start_stop(void) {
+    if (!scheduler.thread)
+        return;
+
+    g_mutex_lock(&scheduler.mutex);
+    scheduler.stopping = true;
+    g_cond_signal(&scheduler.wakeup);
+    g_mutex_unlock(&scheduler.mutex);
+
+    g_thread_join(scheduler.thread);
+    scheduler.thread = NULL;
+    g_clear_pointer(&scheduler.docker_socket, g_free);
+}
+
+void container_start_get_stats(struct container_start_stats* stats) {
+    g_mutex_lock(&scheduler.mutex);
+    *stats = scheduler.stats;
+    g_mutex_unlock(&scheduler.mutex);
+}
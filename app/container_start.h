@@ -0,0 +1,52 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// Starts the containers that have a start priority label in waves, highest priority first, once
+// dockerd is ready, so that critical services do not wait behind everything else on a cold boot.
+// A wave is the containers of one priority, started a few at a time, and the next wave starts when
+// they are all running, and healthy if they have a health check. Containers without the label are
+// left to the restart policy of dockerd, so the labeled ones should have the restart policy "no"
+// or "on-failure".
+
+#define CONTAINER_START_PRIORITY_LABEL    "com.axis.acap.start.priority"
+#define CONTAINER_START_CONCURRENCY_LABEL "com.axis.acap.start.concurrency"
+
+#define CONTAINER_START_MAX       64  // Containers beyond this are left to dockerd
+#define CONTAINER_START_NAME_SIZE 128
+
+enum container_start_state {
+    container_start_waiting,
+    container_start_starting,         // Started, but not yet running, or not yet healthy
+    container_start_running,          // Running, and healthy if it has a health check
+    container_start_already_running,  // Running before the scheduler started it
+    container_start_failed,           // Could not be started, or exited while starting
+    container_start_timed_out,        // Still not running, or not healthy, after the timeout
+    CONTAINER_START_STATE_COUNT,
+};
+
+extern const char* const container_start_state_names[CONTAINER_START_STATE_COUNT];
+
+struct container_start_result {
+    char name[CONTAINER_START_NAME_SIZE];
+    int priority;
+    enum container_start_state state;
+    gint64 time_to_running_ms;  // From dockerd being ready, when state is container_start_running
+};
+
+struct container_start_stats {
+    bool done;  // All waves have been started, or the scheduler was stopped
+    guint count;
+    struct container_start_result results[CONTAINER_START_MAX];  // In start order
+};
+
+// Start the labeled containers of dockerd on docker_socket in the background. Call when dockerd
+// has answered, each time it has been started.
+void container_start_run(const char* docker_socket);
+
+// Stop starting containers, and return when the thread has ended. The stats are kept until the next
+// run.
+void container_start_stop(void);
+
+// Can be called from any thread.
+void container_start_get_stats(struct container_start_stats* stats);
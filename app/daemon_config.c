@@ -0,0 +1,153 @@
+#define LOG_MODULE log_module_supervisor
+#include "daemon_config.h"
+#include "app_paths.h"
+#include "json.h"
+#include "log.h"
+#include "registry_cache.h"
+#include <glib.h>
+#include <string.h>
+
+#define OPTION_MIRRORS                  "registry-mirrors"
+#define OPTION_INSECURE_REGISTRIES      "insecure-registries"
+#define OPTION_MAX_CONCURRENT_DOWNLOADS "max-concurrent-downloads"
+#define OPTION_MAX_DOWNLOAD_ATTEMPTS    "max-download-attempts"
+#define OPTION_PROXIES                  "proxies"
+
+struct merge {
+    const char* mirrors;              // From the settings, including any registry cache
+    const char* insecure_registries;  // From the settings, including any registry cache
+    GString* json;
+    bool empty;        // No member has been appended to json yet
+    bool has_proxies;  // daemon.json has proxies
+};
+
+static bool set_in_settings(const struct merge* merge, const char* key, gsize key_length) {
+    return (json_is_key(key, key_length, OPTION_MIRRORS) && *merge->mirrors) ||
+           (json_is_key(key, key_length, OPTION_INSECURE_REGISTRIES) &&
+            *merge->insecure_registries) ||
+           json_is_key(key, key_length, OPTION_MAX_CONCURRENT_DOWNLOADS) ||
+           json_is_key(key, key_length, OPTION_MAX_DOWNLOAD_ATTEMPTS);
+}
+
+static void append_member_name(struct merge* merge, const char* name, gsize name_length) {
+    g_string_append(merge->json, merge->empty ? "\n  \"" : ",\n  \"");
+    g_string_append_len(merge->json, name, name_length);
+    g_string_append(merge->json, "\": ");
+    merge->empty = false;
+}
+
+// Copy each member of daemon.json that is not replaced by a setting.
+static void copy_member(const char* key,
+                        gsize key_length,
+                        const char* value,
+                        gsize value_length,
+                        void* merge_void_ptr) {
+    struct merge* merge = merge_void_ptr;
+    if (set_in_settings(merge, key, key_length)) {
+        log_info("Replacing %.*s in %s with the value of the parameter",
+                 (int)key_length,
+                 key,
+                 DAEMON_JSON);
+        return;
+    }
+    merge->has_proxies |= json_is_key(key, key_length, OPTION_PROXIES);
+    append_member_name(merge, key, key_length);
+    g_string_append_len(merge->json, value, value_length);
+}
+
+// Append list, separated by commas or spaces, as an array of strings. If must_be_url is true,
+// items that do not start with http:// or https:// are left out, since dockerd would refuse to
+// start with them.
+static void
+append_list(struct merge* merge, const char* option, const char* list, bool must_be_url) {
+    append_member_name(merge, option, strlen(option));
+    g_string_append_c(merge->json, '[');
+    gchar** items = g_strsplit_set(list, ", \t", -1);
+    bool first = true;
+    for (gchar** item = items; *item; item++) {
+        if (!**item)
+            continue;
+        if (must_be_url && !g_str_has_prefix(*item, "http://") &&
+            !g_str_has_prefix(*item, "https://")) {
+            log_warning("Ignoring %s %s, which is not an http:// or https:// URL", option, *item);
+            continue;
+        }
+        if (!first)
+            g_string_append_c(merge->json, ',');
+        json_append_string(merge->json, *item);
+        first = false;
+    }
+    g_strfreev(items);
+    g_string_append_c(merge->json, ']');
+}
+
+static void append_int(struct merge* merge, const char* option, int value) {
+    append_member_name(merge, option, strlen(option));
+    g_string_append_printf(merge->json, "%d", value);
+}
+
+// Return host:port of the registry cache, with the default port if none is given, or NULL if no
+// registry cache is used.
+static char* registry_cache_host(const struct registry_settings* settings) {
+    g_autofree char* address = g_strstrip(g_strdup(settings->cache_address));
+    if (!*address)
+        return NULL;
+    if (strchr(address, ':'))
+        return g_steal_pointer(&address);
+    return g_strdup_printf("%s:%d", address, REGISTRY_CACHE_PORT);
+}
+
+bool daemon_config_write(const char* path, const struct registry_settings* settings) {
+    g_autofree gchar* contents = NULL;
+    gsize length = 0;
+    GError* error = NULL;
+    if (!g_file_get_contents(APP_LOCALDATA "/" DAEMON_JSON, &contents, &length, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            log_error("Failed to read %s: %s", DAEMON_JSON, error->message);
+            g_clear_error(&error);
+            return false;
+        }
+        g_clear_error(&error);
+        contents = g_strdup("{}");
+        length = strlen(contents);
+    }
+
+    // The registry cache serves plain HTTP on the local network.
+    g_autofree char* cache = registry_cache_host(settings);
+    g_autofree char* mirrors = cache ? g_strdup_printf("http://%s,%s", cache, settings->mirrors)
+                                     : g_strdup(settings->mirrors);
+    g_autofree char* insecure_registries =
+        cache ? g_strdup_printf("%s,%s", cache, settings->insecure_registries)
+              : g_strdup(settings->insecure_registries);
+
+    struct merge merge = {mirrors, insecure_registries, g_string_new("{"), true, false};
+    char reason[128];
+    if (!json_foreach_member(contents, length, copy_member, &merge, reason, sizeof(reason))) {
+        log_error("%s is not a JSON object: %s", DAEMON_JSON, reason);
+        g_string_free(merge.json, TRUE);
+        return false;
+    }
+    if (*mirrors)
+        append_list(&merge, OPTION_MIRRORS, mirrors, true);
+    if (*insecure_registries)
+        append_list(&merge, OPTION_INSECURE_REGISTRIES, insecure_registries, false);
+    append_int(&merge, OPTION_MAX_CONCURRENT_DOWNLOADS, settings->max_concurrent_downloads);
+    append_int(&merge, OPTION_MAX_DOWNLOAD_ATTEMPTS, settings->max_download_attempts);
+    if (*settings->https_proxy && merge.has_proxies) {
+        log_warning("Image pulls are not limited, since %s sets %s", DAEMON_JSON, OPTION_PROXIES);
+    } else if (*settings->https_proxy) {
+        append_member_name(&merge, OPTION_PROXIES, strlen(OPTION_PROXIES));
+        g_string_append(merge.json, "{\"https-proxy\": ");
+        json_append_string(merge.json, settings->https_proxy);
+        g_string_append_c(merge.json, '}');
+    }
+    g_string_append(merge.json, "\n}\n");
+
+    // Written to a temporary file and renamed, so that dockerd never reads half a file.
+    const bool success = g_file_set_contents(path, merge.json->str, merge.json->len, &error);
+    if (!success)
+        log_error("Failed to write %s: %s", path, error->message);
+    g_clear_error(&error);
+    g_string_free(merge.json, TRUE);
+    return success;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+
+#define REGISTRY_LIST_SIZE    512
+#define REGISTRY_ADDRESS_SIZE 256
+
+// How dockerd pulls images, from parameters. dockerd reloads all of these on SIGHUP.
+struct registry_settings {
+    char mirrors[REGISTRY_LIST_SIZE];              // Comma-separated URLs, or empty
+    char insecure_registries[REGISTRY_LIST_SIZE];  // Comma-separated host[:port] or CIDR, or empty
+    int max_concurrent_downloads;                  // Layers downloaded at once, per pull
+    int max_download_attempts;                     // Per layer
+    char cache_address[REGISTRY_ADDRESS_SIZE];     // host[:port] of a site registry cache, or empty
+    char https_proxy[REGISTRY_ADDRESS_SIZE];       // URL of the pull throttle, or empty. Not
+                                                   // reloaded by dockerd, unlike the others.
+};
+
+// Write the configuration that dockerd is started with, and reads again on SIGHUP, to path:
+// daemon.json from localdata, or an empty object if there is none, with the registry settings
+// added. Mirrors and insecure registries are only added if set, and replace the same options in
+// daemon.json. A registry cache is added first among the mirrors, and as an insecure registry. An
+// HTTPS proxy is not added if daemon.json has proxies of its own.
+// Log and return false on error, e.g. if daemon.json is not a JSON object.
+bool daemon_config_write(const char* path, const struct registry_settings* settings);
@@ -0,0 +1,184 @@
+#include "docker_api.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <glib.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Fill in address from socket_path, which is either the path of a Unix socket, or
+// tcp://<IPv4 address>:<port>. Return the size of the address, or 0 if socket_path is invalid.
+static socklen_t parse_address(const char* socket_path, struct sockaddr_storage* address) {
+    if (g_str_has_prefix(socket_path, "tcp://")) {
+        struct sockaddr_in* in = (struct sockaddr_in*)address;
+        g_autofree char* host = g_strdup(socket_path + strlen("tcp://"));
+        char* port = strrchr(host, ':');
+        if (!port)
+            return 0;
+        *port++ = '\0';
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(port));
+        return inet_pton(AF_INET, host, &in->sin_addr) == 1 ? sizeof(*in) : 0;
+    }
+    struct sockaddr_un* un = (struct sockaddr_un*)address;
+    un->sun_family = AF_UNIX;
+    return g_strlcpy(un->sun_path, socket_path, sizeof(un->sun_path)) < sizeof(un->sun_path)
+               ? sizeof(*un)
+               : 0;
+}
+
+static int connect_to(const char* socket_path, int timeout_ms) {
+    struct sockaddr_storage address = {0};
+    const socklen_t address_size = parse_address(socket_path, &address);
+    if (!address_size) {
+        log_error("Invalid socket %s", socket_path);
+        return -1;
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    const struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr*)&address, address_size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        const ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Connect and send a request, with extra header lines, each ending with "\r\n", if headers is not
+// NULL. Return the connected socket, or -1 on error.
+static int send_request(const char* socket_path,
+                        const char* method,
+                        const char* path,
+                        const char* headers,
+                        const char* json_body,
+                        int timeout_ms) {
+    const int fd = connect_to(socket_path, timeout_ms);
+    if (fd < 0)
+        return -1;
+
+    // HTTP/1.0 makes dockerd close the connection after the response, without chunked encoding.
+    g_autofree char* head = g_strdup_printf(
+        "%s %s HTTP/1.0\r\nHost: docker\r\nContent-Type: application/json\r\n"
+        "%sContent-Length: %zu\r\n\r\n",
+        method,
+        path,
+        headers ? headers : "",
+        json_body ? strlen(json_body) : 0);
+    if (!write_all(fd, head, strlen(head)) ||
+        (json_body && !write_all(fd, json_body, strlen(json_body)))) {
+        log_debug("Failed to send %s %s to %s: %s", method, path, socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int docker_api_request(const char* socket_path,
+                       const char* method,
+                       const char* path,
+                       const char* json_body,
+                       char** response_body,
+                       int timeout_ms) {
+    const int fd = send_request(socket_path, method, path, NULL, json_body, timeout_ms);
+    if (fd < 0)
+        return -1;
+
+    GString* response = g_string_sized_new(512);
+    char buffer[4096];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0 ||
+           (bytes_read < 0 && errno == EINTR))
+        if (bytes_read > 0)
+            g_string_append_len(response, buffer, bytes_read);
+    close(fd);
+
+    int status = -1;
+    const char* body = strstr(response->str, "\r\n\r\n");
+    if (bytes_read < 0 || !body || sscanf(response->str, "HTTP/%*d.%*d %d", &status) != 1) {
+        log_debug("No valid response to %s %s from %s", method, path, socket_path);
+        status = -1;
+    } else if (response_body) {
+        *response_body = g_strdup(body + strlen("\r\n\r\n"));
+    }
+    g_string_free(response, TRUE);
+    return status;
+}
+
+int docker_api_stream(const char* socket_path,
+                      const char* method,
+                      const char* path,
+                      const char* headers,
+                      const char* json_body,
+                      docker_api_line_callback callback,
+                      void* user_data,
+                      int timeout_ms) {
+    const int fd = send_request(socket_path, method, path, headers, json_body, timeout_ms);
+    if (fd < 0)
+        return -1;
+
+    GString* buffer = g_string_sized_new(4096);
+    char chunk[4096];
+    int status = -1;
+    bool in_body = false;
+    bool stopped = false;
+    ssize_t bytes_read;
+    while (!stopped && ((bytes_read = read(fd, chunk, sizeof(chunk))) > 0 ||
+                        (bytes_read < 0 && errno == EINTR))) {
+        if (bytes_read < 0)
+            continue;
+        g_string_append_len(buffer, chunk, bytes_read);
+        if (!in_body) {
+            const char* body = strstr(buffer->str, "\r\n\r\n");
+            if (!body)
+                continue;
+            if (sscanf(buffer->str, "HTTP/%*d.%*d %d", &status) != 1)
+                break;
+            g_string_erase(buffer, 0, body + strlen("\r\n\r\n") - buffer->str);
+            in_body = true;
+        }
+        char* newline;
+        while (!stopped && (newline = memchr(buffer->str, '\n', buffer->len))) {
+            *newline = '\0';
+            if (newline > buffer->str && newline[-1] == '\r')
+                newline[-1] = '\0';
+            stopped = *buffer->str && !callback(buffer->str, user_data);
+            g_string_erase(buffer, 0, newline + 1 - buffer->str);
+        }
+    }
+    close(fd);
+
+    const bool complete = !stopped && bytes_read == 0 && in_body;
+    if (complete && buffer->len)
+        callback(buffer->str, user_data);  // The last line, without a line break
+    else if (!complete && !stopped)
+        log_debug("No complete response to %s %s from %s", method, path, socket_path);
+    g_string_free(buffer, TRUE);
+    return complete ? status : -1;
+}
+
+bool docker_api_ping(const char* socket_path, int timeout_ms) {
+    g_autofree char* body = NULL;
+    return docker_api_request(socket_path, "GET", "/_ping", NULL, &body, timeout_ms) == 200 &&
+           strcmp(body, "OK") == 0;
+}
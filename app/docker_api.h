@@ -0,0 +1,35 @@
+#pragma once
+#include <stdbool.h>
+
+// Minimal blocking client for the Docker Engine API on a unix socket. socket_path can also be
+// tcp://<IPv4 address>:<port>, for other HTTP services such as the registry cache.
+
+// Send a request, with an optional JSON body, and wait at most timeout_ms for each step of the
+// exchange. Return the HTTP status code, or -1 if no response could be read. If response_body is
+// not NULL, it is set to the response body on success and must be freed with g_free().
+int docker_api_request(const char* socket_path,
+                       const char* method,
+                       const char* path,
+                       const char* json_body,
+                       char** response_body,
+                       int timeout_ms);
+
+// Called with each line of a streamed response body, without the line break. Return false to close
+// the connection, which makes dockerd cancel the request.
+typedef bool (*docker_api_line_callback)(const char* line, void* user_data);
+
+// Like docker_api_request(), but pass the response body to callback line by line as it arrives,
+// such as the progress messages of a pull. The timeout applies to each read, so the response can
+// take any time as long as it keeps coming. Return -1 also if callback returned false. headers are
+// extra header lines, each ending with "\r\n", or NULL.
+int docker_api_stream(const char* socket_path,
+                      const char* method,
+                      const char* path,
+                      const char* headers,
+                      const char* json_body,
+                      docker_api_line_callback callback,
+                      void* user_data,
+                      int timeout_ms);
+
+// Return true if dockerd answers GET /_ping with "OK".
+bool docker_api_ping(const char* socket_path, int timeout_ms);
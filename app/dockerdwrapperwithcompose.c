@@ -15,18 +15,38 @@
  */
 
 #define _GNU_SOURCE  // For sigabbrev_np()
+#define LOG_MODULE  log_module_supervisor
+#include "alloc_stats.h"
 #include "app_paths.h"
+#include "container_start.h"
+#include "daemon_config.h"
+#include "docker_api.h"
 #include "fcgi_server.h"
 #include "http_request.h"
+#include "image_pull.h"
+#include "localdata_index.h"
 #include "log.h"
+#include "managed_file.h"
+#include "on_demand.h"
+#include "param_io.h"
+#include "process_output.h"
+#include "process_record.h"
+#include "pull_throttle.h"
+#include "registry_cache.h"
 #include "sd_disk_storage.h"
 #include "tls.h"
+#include "tls_client_auth.h"
+#include "tls_proxy.h"
+#include "trace.h"
 #include <arpa/inet.h>
 #include <axsdk/axparameter.h>
 #include <errno.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
 #include <glib.h>
 #include <mntent.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -34,13 +54,26 @@
 #include <sysexits.h>
 #include <unistd.h>
 
-#define PARAM_APPLICATION_LOG_LEVEL "ApplicationLogLevel"
-#define PARAM_DOCKERD_LOG_LEVEL     "DockerdLogLevel"
-#define PARAM_IPC_SOCKET            "IPCSocket"
-#define PARAM_SD_CARD_SUPPORT       "SDCardSupport"
-#define PARAM_TCP_SOCKET            "TCPSocket"
-#define PARAM_USE_TLS               "UseTLS"
-#define PARAM_STATUS                "Status"
+#define PARAM_APPLICATION_LOG_LEVEL    "ApplicationLogLevel"
+#define PARAM_APPLICATION_LOG_MODULES  "ApplicationLogModules"
+#define PARAM_DOCKERD_LOG_LEVEL        "DockerdLogLevel"
+#define PARAM_INSECURE_REGISTRIES      "InsecureRegistries"
+#define PARAM_IPC_SOCKET               "IPCSocket"
+#define PARAM_LOG_FORMAT               "LogFormat"
+#define PARAM_MAX_CONCURRENT_DOWNLOADS "MaxConcurrentDownloads"
+#define PARAM_MAX_DOWNLOAD_ATTEMPTS    "MaxDownloadAttempts"
+#define PARAM_ON_DEMAND_IDLE           "OnDemandIdleMinutes"
+#define PARAM_PULL_BANDWIDTH           "PullBandwidthKbps"
+#define PARAM_PULL_WINDOW              "PullWindow"
+#define PARAM_REGISTRY_CACHE           "RegistryCache"
+#define PARAM_REGISTRY_CACHE_ADDRESS   "RegistryCacheAddress"
+#define PARAM_REGISTRY_CACHE_SIZE      "RegistryCacheSizeMB"
+#define PARAM_REGISTRY_MIRRORS         "RegistryMirrors"
+#define PARAM_SD_CARD_SUPPORT          "SDCardSupport"
+#define PARAM_TCP_SOCKET               "TCPSocket"
+#define PARAM_TLS_PROXY                "TLSProxy"
+#define PARAM_USE_TLS                  "UseTLS"
+#define PARAM_STATUS                   "Status"
 
 typedef enum {
     STATUS_NOT_STARTED = 0,  // Index in the array, not the actual status code
@@ -52,6 +85,9 @@ typedef enum {
     STATUS_NO_SD_CARD,
     STATUS_SD_CARD_WRONG_FS,
     STATUS_SD_CARD_WRONG_PERMISSION,
+    STATUS_TLS_CERT_EXPIRING,
+    STATUS_DOCKERD_IDLE,
+    STATUS_TLS_FILES_INCONSISTENT,
     STATUS_CODE_COUNT,
 } status_code_t;
 
@@ -63,19 +99,34 @@ static const char* const status_code_strs[STATUS_CODE_COUNT] = {"-1 NOT STARTED"
                                                                 "4 NO SOCKET",
                                                                 "5 NO SD CARD",
                                                                 "6 SD CARD WRONG FS",
-                                                                "7 SD CARD WRONG PERMISSION"};
+                                                                "7 SD CARD WRONG PERMISSION",
+                                                                "8 TLS CERT EXPIRING",
+                                                                "9 DOCKERD IDLE",
+                                                                "10 TLS FILES INCONSISTENT"};
 
 struct settings {
     char* data_root;
     bool use_tls;
+    bool use_tls_proxy;  // Terminate TLS in the application instead of in dockerd
     bool use_tcp_socket;
     bool use_ipc_socket;
+    char* registry_cache_directory;  // On the SD card, or NULL if no registry cache is hosted
+    guint64 registry_cache_max_size;
+    guint on_demand_idle_sec;  // Start dockerd on the first connection, and stop it when idle, or 0
 };
 
 struct app_state {
     volatile int allow_dockerd_to_start_atomic;
     char* sd_card_area;
     AXParameter* param_handle;
+    bool tls_in_use;  // dockerd was last started with TLS
+    struct registry_settings registry;
+    char* registry_cache_directory;  // As in struct settings, when dockerd was last started
+    guint64 registry_cache_max_size;
+    guint64 pull_rate;           // Bytes per second that pulls from registries are limited to, or 0
+    const char* dockerd_socket;  // The socket of dockerd itself, when dockerd was last started
+    bool idle_stopping;          // dockerd was told to stop, since it was idle
+    bool activation_pending;     // A connection arrived while dockerd was stopping
 };
 
 static bool dockerd_allowed_to_start(const struct app_state* app_state) {
@@ -101,12 +152,90 @@ static GMainLoop* loop = NULL;
 static int application_exit_code = EX_KEEP_RUNNING;
 
 static pid_t rootlesskit_pid = 0;
+static gint64 rootlesskit_start_time = 0;  // From g_get_monotonic_time()
+static int rootlesskit_pidfd = -1;         // If taken over, since it is then not a child
+
+// drain_output reads the FIFOs of dockerd once the application has ended, and until the next
+// instance stops it. It waits for the end of the pipe at output_drain_fd.
+#define OUTPUT_DRAIN_HASH "drain_output"  // Its record has no settings
+static int output_drain_fd = -1;
+
+// The last status set by set_status_parameter()
+static status_code_t current_status = STATUS_NOT_STARTED;
+
+// Fires when a certificate enters its expiry warning period, or expires. The timer is limited to a
+// day, so that a change of the wall clock is picked up, and so that the warning is logged daily.
+#define CERT_EXPIRY_CHECK_MAX_SEC (24 * 60 * 60)
+static guint cert_expiry_timer_id = 0;
+
+// Polls dockerd from the time it is started until it answers on its IPC socket.
+#define READINESS_POLL_INTERVAL_MS 100
+#define READINESS_TIMEOUT_SEC      120
+static bool readiness_pending = false;  // Until dockerd is ready, or the timeout has passed
+static guint readiness_probe_id = 0;    // Between two pings
+static struct trace_span readiness_span;
+
+// The requests that the main loop makes to dockerd run on threads of GTask, see request_dockerd().
+// Cancelled when rootlesskit exits, so that a late answer from the previous dockerd is ignored.
+static GCancellable* dockerd_requests = NULL;
+
+// How long to wait for more changes in localdata before acting on the first one, so that files
+// written together, such as a key pair, lead to one restart of dockerd.
+#define LOCALDATA_SETTLE_MS 200
+
+// dockerd's defaults, used if a parameter is not a positive number
+#define DEFAULT_MAX_CONCURRENT_DOWNLOADS 3
+#define DEFAULT_MAX_DOWNLOAD_ATTEMPTS    5
+
+// Lower rates would stall the TLS handshakes with the registries.
+#define MIN_PULL_BANDWIDTH_KBPS 64
+
+// Fires a second after the first change of a parameter in params_that_reload_dockerd[]
+static guint registry_reload_timer_id = 0;
+
+// Fires when dockerd is to be started again, since a setting could not be read, see read_setting().
+#define SETTINGS_RETRY_SEC 2
+static guint settings_retry_timer_id = 0;
+
+// The values of the parameters that decide how dockerd is started, while it is being started, and
+// the latest read of them by read_settings_and_start_dockerd(). An earlier read is ignored.
+static GHashTable* setting_values = NULL;
+static guint settings_read_id = 0;
+
+// How long to wait for sd_card_callback() before starting dockerd without the SD card, and the
+// timer that starts it then.
+#define SD_CARD_WAIT_SEC 5
+static guint sd_card_wait_timer_id = 0;
+static bool sd_card_waited = false;
+
+// While dockerd is started on demand, the idle check runs, and the settings read when the sockets
+// were taken are used for each start.
+#define IDLE_CHECK_INTERVAL_SEC 30
+static guint idle_check_timer_id = 0;
+static bool idle_check_pending = false;  // Waiting for the containers of dockerd
+static struct settings on_demand_settings;
+
+// A rootlesskit that is told to stop without waiting for it, since dockerd is idle, or since it was
+// left running with other settings, is killed after the timeout.
+#define STOP_TIMEOUT_SEC 20
+static guint rootlesskit_kill_timer_id = 0;
+
+static const char* params_that_reload_dockerd[] = {PARAM_INSECURE_REGISTRIES,
+                                                   PARAM_MAX_CONCURRENT_DOWNLOADS,
+                                                   PARAM_MAX_DOWNLOAD_ATTEMPTS,
+                                                   PARAM_REGISTRY_CACHE_ADDRESS,
+                                                   PARAM_REGISTRY_MIRRORS,
+                                                   NULL};
 
 static const char* params_that_restart_dockerd[] = {PARAM_APPLICATION_LOG_LEVEL,
                                                     PARAM_DOCKERD_LOG_LEVEL,
                                                     PARAM_IPC_SOCKET,
+                                                    PARAM_ON_DEMAND_IDLE,
+                                                    PARAM_REGISTRY_CACHE,
+                                                    PARAM_REGISTRY_CACHE_SIZE,
                                                     PARAM_SD_CARD_SUPPORT,
                                                     PARAM_TCP_SOCKET,
+                                                    PARAM_TLS_PROXY,
                                                     PARAM_USE_TLS,
                                                     NULL};
 
@@ -138,24 +267,65 @@ static bool with_compose(void) {
     return strcmp(APP_NAME, "dockerdwrapperwithcompose") == 0;
 }
 
-static char* xdg_runtime_directory(void) {
-    return g_strdup_printf("/var/run/user/%d", getuid());
-}
-
-static char* xdg_runtime_file(const char* filename) {
-    g_autofree char* xdg_runtime_dir = xdg_runtime_directory();
-    return g_strdup_printf("%s/%s", xdg_runtime_dir, filename);
+// Paths in the XDG runtime directory, which depends on the uid only. They are formatted once by
+// init_xdg_runtime_paths(), so that restarting dockerd does not allocate.
+#define XDG_RUNTIME_DIR_MAX sizeof(XDG_RUNTIME_ROOT "/4294967295")
+static struct {
+    char directory[XDG_RUNTIME_DIR_MAX];
+    char daemon_json[XDG_RUNTIME_DIR_MAX + sizeof("/" DAEMON_JSON)];
+    char docker_pid[XDG_RUNTIME_DIR_MAX + sizeof("/docker.pid")];
+    char docker_sock[XDG_RUNTIME_DIR_MAX + sizeof("/docker.sock")];
+    char dockerd_sock[XDG_RUNTIME_DIR_MAX + sizeof("/dockerd.sock")];  // Behind docker_sock
+    char dockerd_stdout[XDG_RUNTIME_DIR_MAX + sizeof("/dockerd.stdout")];  // FIFO
+    char dockerd_stderr[XDG_RUNTIME_DIR_MAX + sizeof("/dockerd.stderr")];  // FIFO
+    char rootlesskit_record[XDG_RUNTIME_DIR_MAX + sizeof("/rootlesskit.record")];
+    char output_drain_record[XDG_RUNTIME_DIR_MAX + sizeof("/output_drain.record")];
+} xdg_runtime;
+
+static void init_xdg_runtime_paths(void) {
+    g_snprintf(
+        xdg_runtime.directory, sizeof(xdg_runtime.directory), XDG_RUNTIME_ROOT "/%u", getuid());
+    g_snprintf(xdg_runtime.daemon_json,
+               sizeof(xdg_runtime.daemon_json),
+               "%s/" DAEMON_JSON,
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.docker_pid,
+               sizeof(xdg_runtime.docker_pid),
+               "%s/docker.pid",
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.docker_sock,
+               sizeof(xdg_runtime.docker_sock),
+               "%s/docker.sock",
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.dockerd_sock,
+               sizeof(xdg_runtime.dockerd_sock),
+               "%s/dockerd.sock",
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.dockerd_stdout,
+               sizeof(xdg_runtime.dockerd_stdout),
+               "%s/dockerd.stdout",
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.dockerd_stderr,
+               sizeof(xdg_runtime.dockerd_stderr),
+               "%s/dockerd.stderr",
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.rootlesskit_record,
+               sizeof(xdg_runtime.rootlesskit_record),
+               "%s/rootlesskit.record",
+               xdg_runtime.directory);
+    g_snprintf(xdg_runtime.output_drain_record,
+               sizeof(xdg_runtime.output_drain_record),
+               "%s/output_drain.record",
+               xdg_runtime.directory);
 }
 
 static void remove_docker_pid_file(void) {
-    g_autofree char* pid_path = xdg_runtime_file("docker.pid");
-    unlink(pid_path);
+    unlink(xdg_runtime.docker_pid);
 }
 
 static bool set_xdg_directory_permisssions(mode_t mode) {
-    g_autofree char* xdg_runtime_dir = xdg_runtime_directory();
-    if (chmod(xdg_runtime_dir, mode) != 0) {
-        log_error("Failed to set permissions on %s: %s", xdg_runtime_dir, strerror(errno));
+    if (chmod(xdg_runtime.directory, mode) != 0) {
+        log_error("Failed to set permissions on %s: %s", xdg_runtime.directory, strerror(errno));
         return false;
     }
     return true;
@@ -206,6 +376,10 @@ static void init_signals(void) {
  * @return True if alive. False if dead or exited.
  */
 static bool is_process_alive(int pid) {
+    if (pid && pid == rootlesskit_pid && rootlesskit_pidfd >= 0)
+        // The pidfd becomes readable when the process exits.
+        return poll(&(struct pollfd){.fd = rootlesskit_pidfd, .events = POLLIN}, 1, 0) == 0;
+
     int status;
     pid_t return_pid = waitpid(pid, &status, WNOHANG);
     if (return_pid == -1) {
@@ -218,45 +392,56 @@ static bool is_process_alive(int pid) {
     return true;
 }
 
-static bool
-set_parameter_value(AXParameter* param_handle, const char* parameter_name, const char* value) {
-    log_debug("About to set %s to %s", parameter_name, value);
-    GError* error = NULL;
-    bool res = ax_parameter_set(param_handle, parameter_name, value, true, &error);
-    if (!res) {
-        log_error("Failed to write parameter value of %s to %s. Error: %s",
-                  parameter_name,
-                  value,
-                  error->message);
-    }
-    g_clear_error(&error);
-    return res;
-}
-
 static void set_status_parameter(AXParameter* param_handle, status_code_t status) {
-    set_parameter_value(param_handle, PARAM_STATUS, status_code_strs[status]);
+    const char* status_str = status_code_strs[status];
+    log_event_info(log_event_status_changed,
+                   LOG_FIELDS(LOG_INT("status", atoi(status_str)),
+                              LOG_STR("status_text", status_str)),
+                   "Status is %s",
+                   status_str);
+    param_io_set(param_handle, PARAM_STATUS, status_str);  // Without waiting for it
+    current_status = status;
 }
 
 /**
  * @brief Fetch the value of the parameter as a string
  *
- * @return The value of the parameter as string if successful, NULL otherwise
+ * @return The value of the parameter as string if successful, NULL otherwise. If the parameter
+ * service is slow to answer, the last known value is returned after PARAM_IO_TIMEOUT_MS, so this
+ * is only meant for log levels, which are harmless when stale. Use read_setting() for the others.
  */
 static char* get_parameter_value(AXParameter* param_handle, const char* parameter_name) {
-    GError* error = NULL;
-    char* parameter_value = NULL;
+    return param_io_get(param_handle, parameter_name, PARAM_IO_TIMEOUT_MS);
+}
 
-    if (!ax_parameter_get(param_handle, parameter_name, &parameter_value, &error)) {
-        log_error("Failed to fetch parameter value of %s. Error: %s",
-                  parameter_name,
-                  error->message);
+// Meant to be used as a one-shot call from g_timeout_add_seconds()
+static gboolean retry_settings(void*) {
+    settings_retry_timer_id = 0;
+    main_loop_quit();  // Trigger a start of dockerd from main()
+    return G_SOURCE_REMOVE;
+}
 
-        free(parameter_value);
-        parameter_value = NULL;
-    }
+static void retry_settings_later(void) {
+    if (!settings_retry_timer_id)
+        settings_retry_timer_id = g_timeout_add_seconds(SETTINGS_RETRY_SEC, retry_settings, NULL);
+}
 
-    g_clear_error(&error);
-    return parameter_value;
+// Set value to the value of a parameter that decides how dockerd is started, as read off the main
+// loop by read_settings_and_start_dockerd(), to be freed with g_free(). If it could not be read,
+// arrange for dockerd to be started again in SETTINGS_RETRY_SEC and return false. A stale or
+// missing value must not be used, since it could start dockerd with the TCP socket but without
+// TLS, or drop a change.
+static bool read_setting(const char* name, char** value) {
+    const char* read_value = setting_values ? g_hash_table_lookup(setting_values, name) : NULL;
+    if (read_value) {
+        *value = g_strdup(read_value);
+        return true;
+    }
+    log_warning("Could not read %s, will try to start dockerd again in %d s",
+                name,
+                SETTINGS_RETRY_SEC);
+    retry_settings_later();
+    return false;
 }
 
 /**
@@ -305,6 +490,7 @@ static char* get_filesystem_of_path(const char* path) {
 
 // Set up the SD card. Call set_status_parameter() and return false on error.
 static bool setup_sdcard(AXParameter* param_handle, const char* data_root) {
+    TRACE_FUNCTION();
     g_autofree char* sd_file_system = NULL;
     g_autofree char* create_droot_command = g_strdup_printf("mkdir -p %s", data_root);
 
@@ -355,21 +541,47 @@ is_parameter_equal_to(AXParameter* param_handle, const char* name, const char* v
 
 // A parameter of type "bool:no,yes" is guaranteed to contain one of those
 // strings, but user code is still needed to interpret it as a Boolean type.
-static bool is_parameter_yes(AXParameter* param_handle, const char* name) {
-    return is_parameter_equal_to(param_handle, name, "yes");
+// Leave yes unchanged and return false as read_setting() does.
+static bool read_setting_yes(const char* name, bool* yes) {
+    g_autofree char* value = NULL;
+    if (!read_setting(name, &value))
+        return false;
+    *yes = strcmp(value, "yes") == 0;
+    return true;
 }
 
 static bool is_app_log_level_debug(AXParameter* param_handle) {
     return is_parameter_equal_to(param_handle, PARAM_APPLICATION_LOG_LEVEL, "debug");
 }
 
+static void set_log_format(const char* value) {
+    enum log_format format;
+    if (log_format_from_string(value, &format))
+        log_format_set(format);
+    else
+        log_warning("Invalid %s \"%s\"", PARAM_LOG_FORMAT, value ? value : "");
+}
+
+static void read_app_log_levels(AXParameter* param_handle) {
+    g_autofree char* log_format = get_parameter_value(param_handle, PARAM_LOG_FORMAT);
+    set_log_format(log_format);
+    log_debug_set(is_app_log_level_debug(param_handle));
+    g_autofree char* module_levels =
+        get_parameter_value(param_handle, PARAM_APPLICATION_LOG_MODULES);
+    log_levels_parse(module_levels);
+}
+
 // Return data root matching the current SDCardSupport selection.
-// Call set_status_parameter() and return NULL on error.
+// Call set_status_parameter() and return NULL on error. Return NULL as read_setting() does if the
+// selection cannot be read.
 //
 // If SDCardSupport is "yes", data root will be located on the proved SD card
 // area. Passing NULL as SD card area signals that the SD card is not available.
 static char* prepare_data_root(AXParameter* param_handle, const char* sd_card_area) {
-    if (is_parameter_yes(param_handle, PARAM_SD_CARD_SUPPORT)) {
+    bool use_sd_card;
+    if (!read_setting_yes(PARAM_SD_CARD_SUPPORT, &use_sd_card))
+        return NULL;
+    if (use_sd_card) {
         if (!sd_card_area) {
             log_warning("SD card was requested, but no SD card is available at the moment.");
             set_status_parameter(param_handle, STATUS_NO_SD_CARD);
@@ -386,18 +598,45 @@ static char* prepare_data_root(AXParameter* param_handle, const char* sd_card_ar
     }
 }
 
-// Read UseTLS parameter and verify that TLS files are present. Call set_status_parameter() and
-// return false on error.
-static gboolean get_and_verify_tls_selection(AXParameter* param_handle, bool* use_tls_ret) {
-    const bool use_tls = is_parameter_yes(param_handle, PARAM_USE_TLS);
+// Return true if the TLS files in localdata can be used together, as parsed by tls_files_changed().
+// Certificates outside their validity period are reported by check_cert_expiry() instead. The CRL
+// is only used by the TLS proxy.
+static bool tls_files_consistent(bool use_tls_proxy) {
+    struct tls_status status;
+    tls_get_status(&status);
+    return status.key_matches_cert && status.cert_chains_to_ca &&
+           (!use_tls_proxy || tls_client_auth_crl_consistent());
+}
+
+// Read UseTLS and TLSProxy parameters and verify that TLS files are present and consistent. Call
+// set_status_parameter() and return false on error. Return false as read_setting() does if a
+// parameter cannot be read.
+static gboolean get_and_verify_tls_selection(AXParameter* param_handle,
+                                             bool* use_tls_ret,
+                                             bool* use_tls_proxy_ret) {
+    bool use_tls;
+    bool use_tls_proxy = false;
+    if (!read_setting_yes(PARAM_USE_TLS, &use_tls))
+        return false;
+    if (use_tls && !read_setting_yes(PARAM_TLS_PROXY, &use_tls_proxy))
+        return false;
 
     if (use_tls && tls_missing_certs()) {
         tls_log_missing_cert_warnings();
         set_status_parameter(param_handle, STATUS_TLS_CERT_MISSING);
         return false;
     }
+    // Uploads that do not match the other files are stored with 202 Accepted, e.g. the first half
+    // of a new key pair, and dockerd would fail to start with them.
+    if (use_tls && !tls_files_consistent(use_tls_proxy)) {
+        log_error("The TLS files in localdata do not match each other, see GET status. "
+                  "dockerd will not be started.");
+        set_status_parameter(param_handle, STATUS_TLS_FILES_INCONSISTENT);
+        return false;
+    }
 
     *use_tls_ret = use_tls;
+    *use_tls_proxy_ret = use_tls_proxy;
     return true;
 }
 
@@ -407,21 +646,72 @@ static gboolean quit_main_loop(void*) {
     return FALSE;
 }
 
+// The registry cache is optional, so dockerd is started without it if it cannot be hosted. Return
+// false as read_setting() does if the size cannot be read.
+static bool read_registry_cache_settings(struct settings* settings,
+                                         const struct app_state* app_state) {
+    if (!app_state->sd_card_area) {
+        log_warning("A registry cache was requested, but no SD card is available at the moment.");
+        return true;
+    }
+    if (!settings->use_ipc_socket && !settings->use_tls_proxy) {
+        log_warning("A registry cache was requested, but needs IPC socket to be set to \"yes\".");
+        return true;
+    }
+    g_autofree char* size_mb = NULL;
+    if (!read_setting(PARAM_REGISTRY_CACHE_SIZE, &size_mb))
+        return false;
+    settings->registry_cache_directory =
+        g_strdup_printf("%s/registry-cache", app_state->sd_card_area);
+    settings->registry_cache_max_size =
+        (guint64)MAX(g_ascii_strtoll(size_mb, NULL, 10), 1) * 1024 * 1024;
+    return true;
+}
+
+static void read_settings_and_start_dockerd(struct app_state* app_state);
+
+// Meant to be used with g_timeout_add_seconds() from wait_for_sd_card().
+static gboolean stop_waiting_for_sd_card(void* app_state_void_ptr) {
+    sd_card_wait_timer_id = 0;
+    read_settings_and_start_dockerd(app_state_void_ptr);
+    return G_SOURCE_REMOVE;
+}
+
+// It takes a few seconds from sd_disk_storage_init() until sd_card_callback(), which is when
+// app_state->sd_card_area is set. Return true if dockerd is to wait for it, which may avoid a
+// failure in prepare_data_root(), and a restart of dockerd to start the registry cache. dockerd is
+// then started by sd_card_callback(), or without the SD card after SD_CARD_WAIT_SEC.
+static bool wait_for_sd_card(struct app_state* app_state) {
+    if (sd_card_waited) {
+        sd_card_waited = false;
+        return false;
+    }
+    sd_card_waited = true;
+    sd_card_wait_timer_id =
+        g_timeout_add_seconds(SD_CARD_WAIT_SEC, stop_waiting_for_sd_card, app_state);
+    return true;
+}
+
 // Read and verify consistency of settings. Call set_status_parameter() or quit_program() and return
-// false on error.
-static bool read_settings(struct settings* settings, const struct app_state* app_state) {
+// false on error. Return false as read_setting() does if a parameter cannot be read, and while
+// waiting for the SD card.
+static bool read_settings(struct settings* settings, struct app_state* app_state) {
+    TRACE_FUNCTION();
     AXParameter* param_handle = app_state->param_handle;
-    settings->use_tcp_socket = is_parameter_yes(param_handle, PARAM_TCP_SOCKET);
+    if (!read_setting_yes(PARAM_TCP_SOCKET, &settings->use_tcp_socket))
+        return false;
 
     if (!settings->use_tcp_socket)
         // Even if the user has selected UseTLS we do not need to check the certs
         // when TCP won't be used. If the setting is changed we will loop through
         // this function again.
         settings->use_tls = false;
-    else if (!get_and_verify_tls_selection(param_handle, &settings->use_tls))
+    else if (!get_and_verify_tls_selection(
+                 param_handle, &settings->use_tls, &settings->use_tls_proxy))
         return false;
 
-    settings->use_ipc_socket = is_parameter_yes(param_handle, PARAM_IPC_SOCKET);
+    if (!read_setting_yes(PARAM_IPC_SOCKET, &settings->use_ipc_socket))
+        return false;
 
     if (!settings->use_ipc_socket && !settings->use_tcp_socket) {
         log_error(
@@ -431,24 +721,30 @@ static bool read_settings(struct settings* settings, const struct app_state* app
         return false;
     }
 
+    g_autofree char* idle_minutes = NULL;
+    if (!read_setting(PARAM_ON_DEMAND_IDLE, &idle_minutes))
+        return false;
+    settings->on_demand_idle_sec = g_ascii_strtoull(idle_minutes, NULL, 10) * 60;
+
     if (settings->use_ipc_socket && with_compose() && !let_other_apps_use_our_ipc_socket()) {
         quit_program(EX_SOFTWARE);
         return false;
     }
 
-    // It takes a few seconds from sd_disk_storage_init() until sd_card_callback(), which is when
-    // app_state->sd_card_area is set. Waiting here means we may avoid failure in the call to
-    // prepare_data_root() below.
-    if (is_parameter_yes(param_handle, PARAM_SD_CARD_SUPPORT) && !app_state->sd_card_area) {
-        int id = g_timeout_add_seconds(5, quit_main_loop, NULL);
-        g_main_loop_run(loop);  // Wait until the timer or sd_card_callback() calls main_loop_quit()
-        g_source_remove(id);    // If it was sd_card_callback(), the timer must not restart dockerd.
-    }
+    bool host_registry_cache;
+    bool sd_card_support;
+    if (!read_setting_yes(PARAM_REGISTRY_CACHE, &host_registry_cache) ||
+        !read_setting_yes(PARAM_SD_CARD_SUPPORT, &sd_card_support))
+        return false;
+    if ((sd_card_support || host_registry_cache) && !app_state->sd_card_area &&
+        wait_for_sd_card(app_state))
+        return false;
+    sd_card_waited = false;
 
     if (!(settings->data_root = prepare_data_root(param_handle, app_state->sd_card_area)))
         return false;
 
-    return true;
+    return !host_registry_cache || read_registry_cache_settings(settings, app_state);
 }
 
 static struct exit_cause child_process_exit_cause(int status, GError** error) {
@@ -467,6 +763,7 @@ static struct exit_cause child_process_exit_cause(int status, GError** error) {
 static void log_child_process_exit_cause(const char* name, GPid pid, int status) {
     GError* error = NULL;
     struct exit_cause exit_cause = child_process_exit_cause(status, &error);
+    const gint64 uptime_ms = (g_get_monotonic_time() - rootlesskit_start_time) / 1000;
 
     char msg[128];
     const char* end = msg + sizeof(msg);
@@ -478,7 +775,14 @@ static void log_child_process_exit_cause(const char* name, GPid pid, int status)
     else
         g_snprintf(ptr, end - ptr, " terminated in an unexpected way: %s", error->message);
     g_clear_error(&error);
-    log_debug("%s", msg);
+    log_event_info(log_event_dockerd_exited,
+                   LOG_FIELDS(LOG_STR("process", name),
+                              LOG_INT("pid", pid),
+                              LOG_INT("exit_code", exit_cause.code),
+                              LOG_INT("signal", exit_cause.signal),
+                              LOG_INT("uptime_ms", uptime_ms)),
+                   "%s",
+                   msg);
 }
 
 static bool child_process_exited_with_error(int status) {
@@ -488,50 +792,115 @@ static bool child_process_exited_with_error(int status) {
     return exit_cause.code > 0;
 }
 
-static void
-check_child_process_exit_code_and_clean_up(GPid pid, gint status, gpointer app_state_void_ptr) {
-    log_child_process_exit_cause("rootlesskit", pid, status);
-
-    struct app_state* app_state = app_state_void_ptr;
+static void finish_idle_stop(struct app_state* app_state);
+static void stop_output_drain(void);
 
-    bool runtime_error = child_process_exited_with_error(status);
+// Called when rootlesskit has exited.
+static void clean_up_after_rootlesskit(struct app_state* app_state, bool runtime_error) {
+    const bool idle_stop = app_state->idle_stopping && !runtime_error;
+    app_state->idle_stopping = false;
     allow_dockerd_to_start(app_state, !runtime_error);
-    status_code_t s = runtime_error ? STATUS_DOCKERD_RUNTIME_ERROR : STATUS_DOCKERD_STOPPED;
+    status_code_t s = runtime_error ? STATUS_DOCKERD_RUNTIME_ERROR
+                      : idle_stop   ? STATUS_DOCKERD_IDLE
+                                    : STATUS_DOCKERD_STOPPED;
     set_status_parameter(app_state->param_handle, s);
 
     rootlesskit_pid = 0;
-    g_spawn_close_pid(pid);
+    unlink(xdg_runtime.rootlesskit_record);
+    stop_output_drain();
+    if (rootlesskit_kill_timer_id)
+        g_source_remove(rootlesskit_kill_timer_id);
+    rootlesskit_kill_timer_id = 0;
+
+    if (dockerd_requests) {
+        g_cancellable_cancel(dockerd_requests);
+        g_clear_object(&dockerd_requests);
+    }
+    if (readiness_probe_id)
+        g_source_remove(readiness_probe_id);
+    readiness_probe_id = 0;
+    if (readiness_pending) {
+        readiness_pending = false;
+        readiness_span.name = NULL;  // Never became ready, so don't record the span.
+    }
+    idle_check_pending = false;
 
     remove_docker_pid_file();  // Might have been left behind if dockerd crashed.
 
+    if (idle_stop) {
+        finish_idle_stop(app_state);  // Keeps the sockets, for the next connection to start dockerd
+        return;
+    }
+
     prevent_others_from_using_our_ipc_socket();
 
     main_loop_quit();  // Trigger a restart of dockerd from main()
 }
 
-// Return a command line with space-delimited argument based on the current settings.
-static const char* build_daemon_args(const struct settings* settings, AXParameter* param_handle) {
+static void
+check_child_process_exit_code_and_clean_up(GPid pid, gint status, gpointer app_state_void_ptr) {
+    log_child_process_exit_cause("rootlesskit", pid, status);
+    g_spawn_close_pid(pid);
+    clean_up_after_rootlesskit(app_state_void_ptr, child_process_exited_with_error(status));
+}
+
+// Meant to be used with g_unix_fd_add() on the pidfd of a rootlesskit that was taken over. It is
+// not a child of this process, so its exit status is unknown.
+static gboolean taken_over_rootlesskit_exited(int fd, GIOCondition, void* app_state_void_ptr) {
+    const gint64 uptime_ms = (g_get_monotonic_time() - rootlesskit_start_time) / 1000;
+    log_event_info(log_event_dockerd_exited,
+                   LOG_FIELDS(LOG_STR("process", "rootlesskit"),
+                              LOG_INT("pid", rootlesskit_pid),
+                              LOG_INT("uptime_ms", uptime_ms)),
+                   "Process rootlesskit (%d) exited",
+                   rootlesskit_pid);
+    close(fd);
+    rootlesskit_pidfd = -1;
+    clean_up_after_rootlesskit(app_state_void_ptr, false);
+    return G_SOURCE_REMOVE;
+}
+
+// Return the IPv4 address of the device, which dockerd can reach from within rootlesskit, unlike
+// the loopback interface. The address is in a static buffer. Log and return NULL if the host name
+// does not resolve to an address.
+static const char* device_address(void) {
+    char host_buffer[256];
+    if (gethostname(host_buffer, sizeof(host_buffer)) != 0) {
+        log_error("Failed to get the host name: %s", strerror(errno));
+        return NULL;
+    }
+    const struct hostent* host_entry = gethostbyname(host_buffer);
+    if (!host_entry || !host_entry->h_addr_list[0]) {
+        log_error("Failed to get the address of %s: %s", host_buffer, hstrerror(h_errno));
+        return NULL;
+    }
+    return inet_ntoa(*((struct in_addr*)host_entry->h_addr_list[0]));
+}
+
+// Return a command line with space-delimited argument based on the current settings, and set
+// description to a message about the settings, in a static buffer. Return NULL if the port is to
+// be published on the address of the device, and that is not known.
+static const char* build_daemon_args(const struct settings* settings,
+                                     AXParameter* param_handle,
+                                     const char** description) {
+    TRACE_FUNCTION();
     static gchar args[1024];  // Pointer to args returned to caller on success.
     const char* args_end = args + sizeof(args);
     char* args_wr = args;  // Points to location of next write
 
     const char* data_root = settings->data_root;
     const bool use_tls = settings->use_tls;
+    const bool use_tls_proxy = settings->use_tls_proxy;
     const bool use_tcp_socket = settings->use_tcp_socket;
     const bool use_ipc_socket = settings->use_ipc_socket;
+    const bool on_demand = settings->on_demand_idle_sec > 0;
 
-    gsize msg_len = 128;
-    gchar msg[msg_len];
+    static gchar msg[256];  // Returned in description
+    const gsize msg_len = sizeof(msg);
 
     g_autofree char* log_level = get_parameter_value(param_handle, PARAM_DOCKERD_LOG_LEVEL);
-
-    // get host ip
-    char host_buffer[256];
-    char* IPbuffer;
-    struct hostent* host_entry;
-    gethostname(host_buffer, sizeof(host_buffer));
-    host_entry = gethostbyname(host_buffer);
-    IPbuffer = inet_ntoa(*((struct in_addr*)host_entry->h_addr_list[0]));
+    if (!log_level)
+        log_level = g_strdup("warn");
 
     // construct the rootlesskit command
     args_wr += g_snprintf(args_wr,
@@ -552,32 +921,50 @@ static const char* build_daemon_args(const struct settings* settings, AXParamete
         args_wr += g_snprintf(args_wr, args_end - args_wr, " %s", "--debug");
     }
 
+    // With the TLS proxy, the application listens on the port itself, outside rootlesskit. So does
+    // it when dockerd is started on demand, and forwards to the port published on loopback.
     const uint port = use_tls ? 2376 : 2375;
-    args_wr += g_snprintf(args_wr, args_end - args_wr, " -p %s:%d:%d/tcp", IPbuffer, port, port);
+    if (on_demand && !use_tls_proxy)
+        args_wr += g_snprintf(args_wr,
+                              args_end - args_wr,
+                              " -p 127.0.0.1:%d:%d/tcp",
+                              port + ON_DEMAND_TCP_BACKEND_OFFSET,
+                              port);
+    else if (!use_tls_proxy) {
+        const char* IPbuffer = device_address();
+        if (!IPbuffer)
+            return NULL;
+        args_wr +=
+            g_snprintf(args_wr, args_end - args_wr, " -p %s:%d:%d/tcp", IPbuffer, port, port);
+    }
 
-    // add dockerd command
-    args_wr += g_snprintf(args_wr,
-                          args_end - args_wr,
-                          " dockerd %s",
-                          "--config-file " APP_LOCALDATA "/" DAEMON_JSON);
+    // add dockerd command, with the configuration written by daemon_config_write()
+    args_wr += g_snprintf(
+        args_wr, args_end - args_wr, " dockerd --config-file %s", xdg_runtime.daemon_json);
 
     g_strlcpy(msg, "Starting dockerd", msg_len);
 
     args_wr += g_snprintf(args_wr, args_end - args_wr, " --log-level=%s", log_level);
 
-    if (use_ipc_socket) {
-        g_strlcat(msg, " with IPC socket and", msg_len);
+    g_strlcat(msg, use_ipc_socket ? " with IPC socket and" : " without IPC socket and", msg_len);
+
+    // The TLS proxy forwards to the IPC socket. If IPCSocket is not selected, the socket is still
+    // created, but other applications are not given access to it. When dockerd is started on
+    // demand, the application holds the IPC socket, and forwards to a socket of dockerd's own.
+    if (use_ipc_socket || use_tls_proxy || on_demand) {
         // The socket should reside in the user directory and have same group as user.
         // If omitted, dockerd will log a warning about the 'docker' group not being find.
         // However, rootlesskit maps the user's primary group to the root group, so "--group 0"
         // means the socket will belong to the user's primary group.
-        g_autofree char* ipc_socket = xdg_runtime_file("docker.sock");
-        args_wr += g_snprintf(args_wr, args_end - args_wr, " --group 0 -H unix://%s", ipc_socket);
-    } else {
-        g_strlcat(msg, " without IPC socket and", msg_len);
+        args_wr += g_snprintf(args_wr,
+                              args_end - args_wr,
+                              " --group 0 -H unix://%s",
+                              on_demand ? xdg_runtime.dockerd_sock : xdg_runtime.docker_sock);
     }
 
-    if (use_tcp_socket) {
+    if (use_tls_proxy) {
+        g_strlcat(msg, " with TCP socket in TLS mode through the TLS proxy", msg_len);
+    } else if (use_tcp_socket) {
         g_strlcat(msg, " with TCP socket", msg_len);
         g_strlcat(msg, use_tls ? " in TLS mode" : " in unsecured mode", msg_len);
         const uint port = use_tls ? 2376 : 2375;
@@ -594,64 +981,697 @@ static const char* build_daemon_args(const struct settings* settings, AXParamete
     g_strlcat(msg, data_root_msg, msg_len);
     args_wr += g_snprintf(args_wr, args_end - args_wr, " --data-root %s", data_root);
 
-    log_info("%s", msg);
+    *description = msg;
     return args;
 }
 
-// Start dockerd. On success, call set_status_parameter(STATUS_RUNNING) and on error,
-// call set_status_parameter(STATUS_NOT_STARTED).
-static bool start_dockerd(const struct settings* settings, struct app_state* app_state) {
-    AXParameter* param_handle = app_state->param_handle;
+// Return a hash of the command line and the configuration file of dockerd, which a rootlesskit left
+// running by an earlier instance of the application must have been started with to be taken over.
+static char* dockerd_settings_hash(const char* args) {
+    g_autofree char* config = NULL;
+    g_file_get_contents(xdg_runtime.daemon_json, &config, NULL, NULL);
+    g_autofree char* both = g_strconcat(args, "\n", config ? config : "", NULL);
+    return g_compute_checksum_for_string(G_CHECKSUM_SHA256, both, -1);
+}
+
+static bool send_signal(const char* name, GPid pid, int sig) {
+    log_debug("Sending SIG%s to %s (%d)", sigabbrev_np(sig), name, pid);
+    if (kill(pid, sig) != 0) {
+        log_error("Failed to send %s to %s (%d)", sigdescr_np(sig), name, pid);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Meant to be used with g_timeout_add_seconds().
+static gboolean kill_rootlesskit(void*) {
+    rootlesskit_kill_timer_id = 0;
+    if (rootlesskit_pid)
+        send_signal("rootlesskit", rootlesskit_pid, SIGKILL);
+    return G_SOURCE_REMOVE;
+}
+
+// Meant to be used with g_child_watch_add().
+static void reap_output_drain(GPid pid, gint, gpointer) {
+    g_spawn_close_pid(pid);
+}
+
+// Start drain_output for the FIFOs of dockerd, so that dockerd does not wait on a full FIFO while
+// no instance of the application reads it. Log if it cannot be started.
+static void start_output_drain(void) {
+    const char* argv[] = {
+        "drain_output", xdg_runtime.dockerd_stdout, xdg_runtime.dockerd_stderr, NULL};
+    GPid pid;
     GError* error = NULL;
-    bool result = false;
-    bool return_value = false;
+    if (!g_spawn_async_with_pipes(NULL,
+                                  (char**)argv,
+                                  NULL,
+                                  G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH |
+                                      G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                                  NULL,
+                                  NULL,
+                                  &pid,
+                                  &output_drain_fd,
+                                  NULL,
+                                  NULL,
+                                  &error)) {
+        log_warning("dockerd will wait on its output while the application is not running, since "
+                    "drain_output could not be started: %s",
+                    error->message);
+        g_clear_error(&error);
+        return;
+    }
+    g_child_watch_add(pid, reap_output_drain, NULL);
+    process_record_write(xdg_runtime.output_drain_record, pid, OUTPUT_DRAIN_HASH);
+}
+
+// Stop drain_output, whether started by this or by an earlier instance of the application, so
+// that it does not read output that this instance is to read.
+static void stop_output_drain(void) {
+    pid_t pid;
+    gint64 start_time;
+    bool same_settings;
+    const int pidfd = process_record_find(
+        xdg_runtime.output_drain_record, OUTPUT_DRAIN_HASH, &pid, &start_time, &same_settings);
+    if (pidfd >= 0) {
+        send_signal("drain_output", pid, SIGTERM);
+        close(pidfd);
+    }
+    unlink(xdg_runtime.output_drain_record);
+    if (output_drain_fd >= 0)
+        close(output_drain_fd);
+    output_drain_fd = -1;
+}
+
+// Tell rootlesskit to stop, and return without waiting for it, so that the main loop keeps
+// running. Kill it if it has not exited after STOP_TIMEOUT_SEC.
+static void stop_rootlesskit_later(void) {
+    send_signal("rootlesskit", rootlesskit_pid, SIGTERM);
+    rootlesskit_kill_timer_id = g_timeout_add_seconds(STOP_TIMEOUT_SEC, kill_rootlesskit, NULL);
+}
+
+// What start_dockerd() found of a rootlesskit left running by an earlier instance of the
+// application
+enum left_running {
+    left_running_none,
+    left_running_taken_over,  // Started with the same settings, and supervised from now on
+    left_running_stopping,    // Started with other settings, and told to stop
+};
 
-    const char* args = build_daemon_args(settings, param_handle);
+// Take over a rootlesskit left running with the same settings by an earlier instance of the
+// application, such as one that crashed, so that the containers keep running. A rootlesskit left
+// running with other settings is told to stop, and dockerd is started again when it has exited, by
+// main(), or by finish_idle_stop() if dockerd is started on demand.
+static enum left_running
+take_over_rootlesskit(const char* hash, bool on_demand, struct app_state* app_state) {
+    bool same_settings;
+    rootlesskit_pidfd = process_record_find(xdg_runtime.rootlesskit_record,
+                                            hash,
+                                            &rootlesskit_pid,
+                                            &rootlesskit_start_time,
+                                            &same_settings);
+    if (rootlesskit_pidfd < 0)
+        return left_running_none;
+
+    // The output written while no instance of the application was reading is still in the FIFOs.
+    // It is also read while a rootlesskit with other settings stops, so that it does not wait.
+    stop_output_drain();
+    const int stdout_fd = process_output_open_fifo(xdg_runtime.dockerd_stdout, NULL);
+    const int stderr_fd = process_output_open_fifo(xdg_runtime.dockerd_stderr, NULL);
+    if (stdout_fd >= 0 && stderr_fd >= 0)
+        process_output_watch("dockerd", stdout_fd, stderr_fd);
+    else if (stdout_fd >= 0 || stderr_fd >= 0)
+        close(MAX(stdout_fd, stderr_fd));
+
+    g_unix_fd_add(rootlesskit_pidfd, G_IO_IN, taken_over_rootlesskit_exited, app_state);
+    if (!same_settings) {
+        log_info("Stopping rootlesskit (%d), which was left running with other settings",
+                 rootlesskit_pid);
+        // Connections that wait for dockerd are kept, and dockerd is started for them.
+        app_state->idle_stopping = on_demand;
+        app_state->activation_pending = on_demand;
+        stop_rootlesskit_later();
+        return left_running_stopping;
+    }
 
+    start_output_drain();
+    log_event_info(log_event_dockerd_started,
+                   LOG_FIELDS(LOG_STR("process", "rootlesskit"), LOG_INT("pid", rootlesskit_pid)),
+                   "Took over rootlesskit (%d), which was left running.",
+                   rootlesskit_pid);
+    return left_running_taken_over;
+}
+
+// Start rootlesskit as a child process. Its output goes through FIFOs rather than pipes, so that it
+// can outlive the application, and be read by the next instance. Log and return false on error.
+static bool spawn_rootlesskit(const char* args, struct app_state* app_state) {
     log_debug("Sending daemon start command: %s", args);
+    stop_output_drain();  // Of an earlier rootlesskit, which is no longer running
+    int child_stdout_fd = -1;
+    int child_stderr_fd = -1;
+    const int stdout_fd = process_output_open_fifo(xdg_runtime.dockerd_stdout, &child_stdout_fd);
+    const int stderr_fd =
+        stdout_fd >= 0 ? process_output_open_fifo(xdg_runtime.dockerd_stderr, &child_stderr_fd)
+                       : -1;
     char** args_split = g_strsplit(args, " ", 0);
-    result = g_spawn_async(NULL,
-                           args_split,
-                           NULL,
-                           G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
-                           NULL,
-                           NULL,
-                           &rootlesskit_pid,
-                           &error);
+    GError* error = NULL;
+    const bool result = stderr_fd >= 0 &&
+                        g_spawn_async_with_pipes_and_fds(NULL,
+                                                         (const char* const*)args_split,
+                                                         NULL,
+                                                         G_SPAWN_DO_NOT_REAP_CHILD |
+                                                             G_SPAWN_SEARCH_PATH,
+                                                         NULL,
+                                                         NULL,
+                                                         -1,
+                                                         child_stdout_fd,
+                                                         child_stderr_fd,
+                                                         NULL,
+                                                         NULL,
+                                                         0,
+                                                         &rootlesskit_pid,
+                                                         NULL,
+                                                         NULL,
+                                                         NULL,
+                                                         &error);
+    g_strfreev(args_split);
+    if (child_stdout_fd >= 0)
+        close(child_stdout_fd);
+    if (child_stderr_fd >= 0)
+        close(child_stderr_fd);
     if (!result) {
-        log_error("Starting dockerd failed: execv returned: %d, error: %s", result, error->message);
-        set_status_parameter(param_handle, STATUS_NOT_STARTED);
-        goto end;
+        if (error)
+            log_error("Starting dockerd failed: %s", error->message);
+        g_clear_error(&error);
+        if (stdout_fd >= 0)
+            close(stdout_fd);
+        if (stderr_fd >= 0)
+            close(stderr_fd);
+        return false;
     }
-    log_debug("Child process rootlesskit (%d) was started.", rootlesskit_pid);
+
+    rootlesskit_start_time = g_get_monotonic_time();
+    log_event_info(log_event_dockerd_started,
+                   LOG_FIELDS(LOG_STR("process", "rootlesskit"), LOG_INT("pid", rootlesskit_pid)),
+                   "Child process rootlesskit (%d) was started.",
+                   rootlesskit_pid);
+
+    process_output_watch("dockerd", stdout_fd, stderr_fd);
+    start_output_drain();
 
     g_child_watch_add(rootlesskit_pid, check_child_process_exit_code_and_clean_up, app_state);
+    return true;
+}
 
-    set_status_parameter(param_handle, STATUS_RUNNING);
-    return_value = true;
+// Run func on a thread of GTask with the socket of dockerd as task data, and call callback on the
+// main loop with its result. func must return a boolean.
+static void request_dockerd(GTaskThreadFunc func,
+                            GAsyncReadyCallback callback,
+                            struct app_state* app_state) {
+    GTask* task = g_task_new(NULL, dockerd_requests, callback, app_state);
+    g_task_set_task_data(task, (void*)app_state->dockerd_socket, NULL);
+    g_task_run_in_thread(task, func);
+    g_object_unref(task);
+}
 
-end:
-    g_strfreev(args_split);
-    g_clear_error(&error);
-    return return_value;
+// Return false if rootlesskit has exited since the request of result was made.
+static bool dockerd_request_current(GAsyncResult* result) {
+    return !g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result)));
 }
 
-static void read_settings_and_start_dockerd(struct app_state* app_state) {
-    struct settings settings = {0};
+// Meant to be used with request_dockerd().
+static void ping_dockerd(GTask* task,
+                         __attribute__((unused)) void* source_object,
+                         void* ipc_socket_void_ptr,
+                         __attribute__((unused)) GCancellable* cancellable) {
+    g_task_return_boolean(task, docker_api_ping(ipc_socket_void_ptr, 1000));
+}
+
+static gboolean probe_dockerd_readiness(void* app_state_void_ptr);
+
+// Called on the main loop with the result of ping_dockerd(). Ping again after a while, until
+// dockerd answers or the timeout has passed.
+static void finish_readiness_probe(__attribute__((unused)) GObject* source_object,
+                                   GAsyncResult* result,
+                                   void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    const char* ipc_socket = app_state->dockerd_socket;
+    const gint64 elapsed_ms = (g_get_monotonic_time() - readiness_span.start) / 1000;
+    if (!dockerd_request_current(result))
+        return;
+
+    if (g_task_propagate_boolean(G_TASK(result), NULL)) {
+        log_event_info(log_event_dockerd_ready,
+                       LOG_FIELDS(LOG_INT("pid", rootlesskit_pid),
+                                  LOG_INT("duration_ms", elapsed_ms)),
+                       "dockerd is ready after %" G_GINT64_FORMAT " ms",
+                       elapsed_ms);
+        trace_end(&readiness_span);
+        on_demand_set_dockerd(on_demand_ready);
+        registry_cache_start(ipc_socket,
+                             app_state->registry_cache_directory,
+                             app_state->registry_cache_max_size);
+        image_pull_start(ipc_socket);
+        container_start_run(ipc_socket);
+    } else if (elapsed_ms > READINESS_TIMEOUT_SEC * 1000) {
+        log_event_warning(log_event_dockerd_not_ready,
+                          LOG_FIELDS(LOG_INT("pid", rootlesskit_pid),
+                                     LOG_INT("duration_ms", elapsed_ms)),
+                          "dockerd did not answer on %s within %d s",
+                          ipc_socket,
+                          READINESS_TIMEOUT_SEC);
+        readiness_span.name = NULL;
+    } else {
+        readiness_probe_id =
+            g_timeout_add(READINESS_POLL_INTERVAL_MS, probe_dockerd_readiness, app_state);
+        return;
+    }
+    readiness_pending = false;
+}
+
+// Meant to be used with g_timeout_add() from the time dockerd is started, until it answers. The
+// ping runs on another thread, since it can take up to a second while dockerd is starting.
+static gboolean probe_dockerd_readiness(void* app_state_void_ptr) {
+    readiness_probe_id = 0;
+    request_dockerd(ping_dockerd, finish_readiness_probe, app_state_void_ptr);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean check_cert_expiry(void* app_state_void_ptr);
+
+// Return the status of a running dockerd: STATUS_TLS_CERT_EXPIRING if it uses TLS and a
+// certificate is about to expire, or the TLS proxy uses a CRL that is about to expire, otherwise
+// STATUS_RUNNING. Schedule check_cert_expiry() for the next time that may change.
+static status_code_t running_status(struct app_state* app_state) {
+    const gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    gint64 next_change = 0;
+    bool expiring = app_state->tls_in_use && tls_certs_expiring(now, &next_change);
+
+    struct tls_proxy_stats proxy;
+    tls_proxy_get_stats(&proxy);
+    gint64 crl_change = 0;
+    if (app_state->tls_in_use && proxy.running)
+        expiring |= tls_client_auth_crl_expiring(now, &crl_change);
+    if (crl_change && (!next_change || crl_change < next_change))
+        next_change = crl_change;
+
+    if (cert_expiry_timer_id)
+        g_source_remove(cert_expiry_timer_id);
+    cert_expiry_timer_id = 0;
+    if (app_state->tls_in_use) {
+        const guint delay = next_change ? CLAMP(next_change - now, 1, CERT_EXPIRY_CHECK_MAX_SEC)
+                                        : CERT_EXPIRY_CHECK_MAX_SEC;
+        cert_expiry_timer_id = g_timeout_add_seconds(delay, check_cert_expiry, app_state);
+    }
+    return expiring ? STATUS_TLS_CERT_EXPIRING : STATUS_RUNNING;
+}
+
+// Meant to be used with g_timeout_add_seconds() and g_idle_add(). Updates the status while dockerd
+// is running. Otherwise the check is made when dockerd is started again.
+static gboolean check_cert_expiry(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    if (cert_expiry_timer_id)
+        g_source_remove(cert_expiry_timer_id);
+    cert_expiry_timer_id = 0;
+
+    if (current_status == STATUS_RUNNING || current_status == STATUS_TLS_CERT_EXPIRING) {
+        const status_code_t status = running_status(app_state);
+        if (status != current_status)
+            set_status_parameter(app_state->param_handle, status);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Let the pull throttle connect to the ports of the mirrors and insecure registries in registry.
+static void set_pull_throttle_registries(const struct registry_settings* registry) {
+    g_autofree char* registries =
+        g_strjoin(",", registry->mirrors, registry->insecure_registries, NULL);
+    pull_throttle_set_registries(registries);
+}
+
+// Start dockerd. On success, call set_status_parameter() with STATUS_RUNNING, or
+// STATUS_TLS_CERT_EXPIRING, and on error, call set_status_parameter(STATUS_NOT_STARTED).
+static bool start_dockerd(const struct settings* settings, struct app_state* app_state) {
+    TRACE_FUNCTION();
+    AXParameter* param_handle = app_state->param_handle;
+
+    // The pull throttle keeps its port until dockerd is stopped, so that the rate can be changed
+    // without restarting dockerd, which does not reload its proxy.
+    g_autofree char* pull_proxy = NULL;
+    if (app_state->pull_rate) {
+        set_pull_throttle_registries(&app_state->registry);
+        const char* address = device_address();
+        if (!address || !(pull_proxy = pull_throttle_start(address, app_state->pull_rate)))
+            log_warning(
+                "Image pulls are not limited, since the pull throttle could not be started");
+    }
+    g_strlcpy(app_state->registry.https_proxy,
+              pull_proxy ? pull_proxy : "",
+              sizeof(app_state->registry.https_proxy));
+
+    if (!daemon_config_write(xdg_runtime.daemon_json, &app_state->registry)) {
+        set_status_parameter(param_handle, STATUS_NOT_STARTED);
+        return false;
+    }
+    const char* description;
+    const char* args = build_daemon_args(settings, param_handle, &description);
+    if (!args) {
+        set_status_parameter(param_handle, STATUS_NOT_STARTED);
+        return false;
+    }
+    g_autofree char* hash = dockerd_settings_hash(args);
+    switch (take_over_rootlesskit(hash, settings->on_demand_idle_sec > 0, app_state)) {
+        case left_running_none:
+            log_info("%s", description);
+            if (!spawn_rootlesskit(args, app_state)) {
+                set_status_parameter(param_handle, STATUS_NOT_STARTED);
+                return false;
+            }
+            process_record_write(xdg_runtime.rootlesskit_record, rootlesskit_pid, hash);
+            break;
+        case left_running_taken_over:
+            break;
+        case left_running_stopping:
+            return true;  // Started again when the old rootlesskit has exited
+    }
+
+    // Without an IPC socket there is nothing the wrapper can probe.
+    app_state->dockerd_socket =
+        settings->on_demand_idle_sec ? xdg_runtime.dockerd_sock : xdg_runtime.docker_sock;
+    on_demand_set_dockerd(on_demand_starting);
+    g_clear_object(&dockerd_requests);
+    dockerd_requests = g_cancellable_new();
+    if (settings->use_ipc_socket || settings->use_tls_proxy || settings->on_demand_idle_sec) {
+        readiness_span = trace_begin("readiness");
+        readiness_pending = true;
+        readiness_probe_id =
+            g_timeout_add(READINESS_POLL_INTERVAL_MS, probe_dockerd_readiness, app_state);
+    }
+
+    app_state->tls_in_use = settings->use_tls;
+    g_free(app_state->registry_cache_directory);
+    app_state->registry_cache_directory = g_strdup(settings->registry_cache_directory);
+    app_state->registry_cache_max_size = settings->registry_cache_max_size;
+    set_status_parameter(param_handle, running_status(app_state));
+    return true;
+}
+
+static void warn_client_auth_not_enforced(void) {
+    if (localdata_index_exists(CLIENT_ALLOWLIST) || localdata_index_exists(CLIENT_CRL))
+        log_warning(
+            "%s and %s are only used with %s", CLIENT_ALLOWLIST, CLIENT_CRL, PARAM_TLS_PROXY);
+}
+
+// Start the TLS proxy if selected, before dockerd so that a port conflict is found before dockerd
+// is started. Call set_status_parameter() and return false on error.
+static bool start_tls_proxy(const struct settings* settings, AXParameter* param_handle) {
+    if (settings->use_tls && !settings->use_tls_proxy)
+        warn_client_auth_not_enforced();
+    if (!settings->use_tls_proxy || tls_proxy_start(2376, xdg_runtime.docker_sock))
+        return true;
+    set_status_parameter(param_handle, STATUS_NOT_STARTED);
+    return false;
+}
+
+static void free_settings(struct settings* settings) {
+    free(settings->data_root);
+    g_free(settings->registry_cache_directory);
+    *settings = (struct settings){0};
+}
+
+// Meant to be used with g_idle_add(), when a connection arrives while dockerd is stopped.
+static gboolean activate_dockerd(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    if (!idle_check_timer_id)
+        return G_SOURCE_REMOVE;  // The sockets have been released, which closed the connection.
+    if (app_state->idle_stopping)
+        app_state->activation_pending = true;  // Started by finish_idle_stop()
+    else if (!rootlesskit_pid && !start_dockerd(&on_demand_settings, app_state))
+        on_demand_set_dockerd(on_demand_stopped);  // Closes the waiting connections
+    return G_SOURCE_REMOVE;
+}
+
+// Called by on_demand on a connection thread.
+static void request_activation(void* app_state_void_ptr) {
+    g_idle_add(activate_dockerd, app_state_void_ptr);
+}
+
+// Meant to be used with request_dockerd(). Return true if no container is running, which includes
+// the registry cache.
+static void check_containers_unused(GTask* task,
+                                    __attribute__((unused)) void* source_object,
+                                    void* ipc_socket_void_ptr,
+                                    __attribute__((unused)) GCancellable* cancellable) {
+    g_autofree char* body = NULL;
+    const int code =
+        docker_api_request(ipc_socket_void_ptr, "GET", "/containers/json", NULL, &body, 2000);
+    g_task_return_boolean(task, code == 200 && strcmp(g_strstrip(body), "[]") == 0);
+}
+
+// Return true if dockerd has been ready without a connection for the idle time, and the labeled
+// containers are not being started.
+static bool dockerd_idle(const struct app_state* app_state) {
+    const guint idle_sec = on_demand_settings.on_demand_idle_sec;
+    if (!rootlesskit_pid || readiness_pending || app_state->idle_stopping ||
+        on_demand_idle_ms() < (gint64)idle_sec * 1000)
+        return false;
+
+    struct container_start_stats start;
+    container_start_get_stats(&start);
+    return start.done;
+}
+
+// Called on the main loop with the result of check_containers_unused(). Stop dockerd if it is still
+// idle. Only rootlesskit is stopped, not the main loop, so the sockets are kept for the next
+// connection.
+static void finish_idle_check(__attribute__((unused)) GObject* source_object,
+                              GAsyncResult* result,
+                              void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    if (!dockerd_request_current(result))
+        return;
+    idle_check_pending = false;
+    if (!g_task_propagate_boolean(G_TASK(result), NULL) || !idle_check_timer_id ||
+        !dockerd_idle(app_state))
+        return;
+
+    log_info("Stopping dockerd, since it has not been used for %u min",
+             on_demand_settings.on_demand_idle_sec / 60);
+    app_state->idle_stopping = true;
+    on_demand_set_dockerd(on_demand_stopped);
+    stop_rootlesskit_later();
+}
+
+// Meant to be used with g_timeout_add_seconds() while dockerd is started on demand. When dockerd is
+// idle, ask it on another thread whether a container is running, see finish_idle_check().
+static gboolean stop_dockerd_when_idle(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    if (idle_check_pending || !dockerd_idle(app_state))
+        return G_SOURCE_CONTINUE;
+
+    idle_check_pending = true;
+    request_dockerd(check_containers_unused, finish_idle_check, app_state);
+    return G_SOURCE_CONTINUE;
+}
+
+// Called when rootlesskit has exited after stop_dockerd_when_idle(), or after
+// take_over_rootlesskit() stopped one with other settings. Stop what depends on dockerd, as main()
+// does when it restarts dockerd, and start dockerd again if a connection is waiting.
+static void finish_idle_stop(struct app_state* app_state) {
+    registry_cache_stop();
+    image_pull_stop();
+    container_start_stop();
+    pull_throttle_stop();
+    if (app_state->activation_pending) {
+        app_state->activation_pending = false;
+        activate_dockerd(app_state);
+    }
+}
+
+// Take the sockets of dockerd if it is to be started on demand, so that the first connection starts
+// it. The TLS proxy forwards to the IPC socket, so TLS connections start it too. Call
+// set_status_parameter() and return false on error.
+static bool start_on_demand(const struct settings* settings, struct app_state* app_state) {
+    if (!settings->on_demand_idle_sec)
+        return true;
+    const bool ipc = settings->use_ipc_socket || settings->use_tls_proxy;
+    const bool tcp = settings->use_tcp_socket && !settings->use_tls_proxy;
+    const char* address = tcp ? device_address() : NULL;
+    if ((tcp && !address) ||
+        !on_demand_start(ipc ? xdg_runtime.docker_sock : NULL,
+                         xdg_runtime.dockerd_sock,
+                         address,
+                         settings->use_tls ? 2376 : 2375,
+                         request_activation,
+                         app_state)) {
+        set_status_parameter(app_state->param_handle, STATUS_NOT_STARTED);
+        return false;
+    }
+    idle_check_timer_id =
+        g_timeout_add_seconds(IDLE_CHECK_INTERVAL_SEC, stop_dockerd_when_idle, app_state);
+    return true;
+}
 
-    if (read_settings(&settings, app_state))
+// Release the sockets of dockerd, if it was started on demand.
+static void stop_on_demand(struct app_state* app_state) {
+    if (idle_check_timer_id)
+        g_source_remove(idle_check_timer_id);
+    idle_check_timer_id = 0;
+    idle_check_pending = false;
+    app_state->idle_stopping = false;
+    app_state->activation_pending = false;
+    on_demand_stop();
+    free_settings(&on_demand_settings);
+}
+
+// Set the registry setting of a parameter in params_that_reload_dockerd[].
+static void
+set_registry_setting(struct registry_settings* registry, const char* name, const char* value) {
+    if (!value)
+        value = "";
+    if (strcmp(name, PARAM_REGISTRY_MIRRORS) == 0) {
+        g_strlcpy(registry->mirrors, value, sizeof(registry->mirrors));
+    } else if (strcmp(name, PARAM_REGISTRY_CACHE_ADDRESS) == 0) {
+        g_strlcpy(registry->cache_address, value, sizeof(registry->cache_address));
+    } else if (strcmp(name, PARAM_INSECURE_REGISTRIES) == 0) {
+        g_strlcpy(registry->insecure_registries, value, sizeof(registry->insecure_registries));
+    } else if (strcmp(name, PARAM_MAX_CONCURRENT_DOWNLOADS) == 0) {
+        const int number = atoi(value);
+        registry->max_concurrent_downloads = number > 0 ? number : DEFAULT_MAX_CONCURRENT_DOWNLOADS;
+    } else if (strcmp(name, PARAM_MAX_DOWNLOAD_ATTEMPTS) == 0) {
+        const int number = atoi(value);
+        registry->max_download_attempts = number > 0 ? number : DEFAULT_MAX_DOWNLOAD_ATTEMPTS;
+    }
+}
+
+// Return false as read_setting() does if a parameter cannot be read.
+static bool read_registry_settings(struct app_state* app_state) {
+    for (const char** param = params_that_reload_dockerd; *param; param++) {
+        g_autofree char* value = NULL;
+        if (!read_setting(*param, &value))
+            return false;
+        set_registry_setting(&app_state->registry, *param, value);
+    }
+    return true;
+}
+
+// Return the rate in bytes per second for a value of PARAM_PULL_BANDWIDTH, or 0 for no limit.
+static guint64 pull_rate_from_kbps(const char* value) {
+    const guint64 kbps = value ? g_ascii_strtoull(value, NULL, 10) : 0;
+    return kbps ? MAX(kbps, MIN_PULL_BANDWIDTH_KBPS) * 1000 / 8 : 0;
+}
+
+// Return false as read_setting() does if a parameter cannot be read.
+static bool read_pull_settings(struct app_state* app_state) {
+    g_autofree char* bandwidth = NULL;
+    g_autofree char* window = NULL;
+    if (!read_setting(PARAM_PULL_BANDWIDTH, &bandwidth) ||
+        !read_setting(PARAM_PULL_WINDOW, &window))
+        return false;
+    app_state->pull_rate = pull_rate_from_kbps(bandwidth);
+    image_pull_set_window(window);
+    return true;
+}
+
+// The parameters read by read_setting(), besides params_that_reload_dockerd[]
+static const char* const params_that_start_dockerd[] = {PARAM_IPC_SOCKET,
+                                                        PARAM_ON_DEMAND_IDLE,
+                                                        PARAM_PULL_BANDWIDTH,
+                                                        PARAM_PULL_WINDOW,
+                                                        PARAM_REGISTRY_CACHE,
+                                                        PARAM_REGISTRY_CACHE_SIZE,
+                                                        PARAM_SD_CARD_SUPPORT,
+                                                        PARAM_TCP_SOCKET,
+                                                        PARAM_TLS_PROXY,
+                                                        PARAM_USE_TLS,
+                                                        NULL};
+
+struct settings_read {
+    struct app_state* app_state;
+    guint id;
+};
+
+// Called on the main loop with the parameters read by read_settings_and_start_dockerd(). Start
+// dockerd, or on-demand mode, unless it has been started, or the settings read again, meanwhile.
+static void start_dockerd_with_setting_values(GHashTable* values, void* read_void_ptr) {
+    struct settings_read* read = read_void_ptr;
+    struct app_state* app_state = read->app_state;
+    const bool current = read->id == settings_read_id;
+    g_free(read);
+    if (!current || rootlesskit_pid || !dockerd_allowed_to_start(app_state))
+        return;
+    if (!values) {
+        log_warning("Could not read the settings, will try to start dockerd again in %d s",
+                    SETTINGS_RETRY_SEC);
+        retry_settings_later();
+        return;
+    }
+
+    struct settings settings = {0};
+    setting_values = values;
+    if (!read_registry_settings(app_state) || !read_pull_settings(app_state) ||
+        !read_settings(&settings, app_state) ||
+        !start_tls_proxy(&settings, app_state->param_handle) ||
+        !start_on_demand(&settings, app_state)) {
+        free_settings(&settings);
+    } else if (settings.on_demand_idle_sec) {
+        on_demand_settings = settings;  // Freed by stop_on_demand()
+        set_status_parameter(app_state->param_handle, STATUS_DOCKERD_IDLE);
+        // Rather than wait for a connection, take over a dockerd that was left running.
+        if (access(xdg_runtime.rootlesskit_record, F_OK) == 0)
+            activate_dockerd(app_state);
+    } else {
         start_dockerd(&settings, app_state);
+        free_settings(&settings);
+    }
+    setting_values = NULL;
+}
 
-    free(settings.data_root);
+// Read the parameters that decide how dockerd is started on the parameter thread, and start it
+// from start_dockerd_with_setting_values(), so that a slow parameter service cannot stall the main
+// loop.
+static void read_settings_and_start_dockerd(struct app_state* app_state) {
+    if (settings_retry_timer_id) {  // Read now instead
+        g_source_remove(settings_retry_timer_id);
+        settings_retry_timer_id = 0;
+    }
+
+    GPtrArray* names = g_ptr_array_new();
+    for (const char* const* param = params_that_start_dockerd; *param; param++)
+        g_ptr_array_add(names, (void*)*param);
+    for (const char** param = params_that_reload_dockerd; *param; param++)
+        g_ptr_array_add(names, (void*)*param);
+    g_ptr_array_add(names, NULL);
+
+    struct settings_read* read = g_new0(struct settings_read, 1);
+    read->app_state = app_state;
+    read->id = ++settings_read_id;
+    param_io_get_current_async(app_state->param_handle,
+                               (const char* const*)names->pdata,
+                               start_dockerd_with_setting_values,
+                               read);
+    g_ptr_array_free(names, TRUE);
 }
 
-static bool send_signal(const char* name, GPid pid, int sig) {
-    log_debug("Sending SIG%s to %s (%d)", sigabbrev_np(sig), name, pid);
-    if (kill(pid, sig) != 0) {
-        log_error("Failed to send %s to %s (%d)", sigdescr_np(sig), name, pid);
-        return FALSE;
+// Forget a read by read_settings_and_start_dockerd() that has not completed, and stop waiting for
+// the SD card, as dockerd is stopped.
+static void cancel_settings_read(void) {
+    settings_read_id++;
+    if (sd_card_wait_timer_id)
+        g_source_remove(sd_card_wait_timer_id);
+    sd_card_wait_timer_id = 0;
+    sd_card_waited = false;
+}
+
+// Make dockerd read its configuration file again. Return false if it could not be told to.
+static bool reload_dockerd(void) {
+    g_autofree gchar* contents = NULL;
+    if (!g_file_get_contents(xdg_runtime.docker_pid, &contents, NULL, NULL)) {
+        log_warning("Failed to read the pid of dockerd from %s", xdg_runtime.docker_pid);
+        return false;
     }
-    return TRUE;
+    const pid_t pid = g_ascii_strtoll(contents, NULL, 10);
+    return pid > 0 && send_signal("dockerd", pid, SIGHUP);
 }
 
 // Check if dockerd is still running. Launch this function using g_timeout_add_seconds() and pass a
@@ -684,6 +1704,8 @@ static void stop_dockerd(void) {
     if (!is_process_alive(rootlesskit_pid))
         return;
 
+    TRACE_FUNCTION();
+    const gint64 start = g_get_monotonic_time();
     send_signal("rootlesskit", rootlesskit_pid, SIGTERM);
 
     int time_since_sigterm = 1;
@@ -691,7 +1713,17 @@ static void stop_dockerd(void) {
     while (time_since_sigterm != 0) {  // Loop until the timer callback has stopped running
         g_main_loop_run(loop);
     }
-    log_info("Stopped dockerd.");
+    log_event_info(log_event_dockerd_stopped,
+                   LOG_FIELDS(LOG_INT("duration_ms", (g_get_monotonic_time() - start) / 1000)),
+                   "Stopped dockerd.");
+}
+
+static void log_parameter_change(const char* name, const char* value) {
+    log_event_info(log_event_parameter_changed,
+                   LOG_FIELDS(LOG_STR("parameter", name), LOG_STR("value", value)),
+                   "%s changed to %s",
+                   name,
+                   value);
 }
 
 // Meant to be used as an AXParameter callback
@@ -700,7 +1732,7 @@ static void restart_dockerd_when_parameter_changed(const gchar* name,
                                                    gpointer app_state_void_ptr) {
     const gchar* parname = name += strlen("root." APP_NAME ".");
 
-    log_info("%s changed to %s", parname, value);
+    log_parameter_change(parname, value);
 
     struct app_state* app_state = app_state_void_ptr;
 
@@ -710,11 +1742,82 @@ static void restart_dockerd_when_parameter_changed(const gchar* name,
     // Trigger a restart of dockerd from main(), but delay it 1 second.
     // When there are multiple AXParameter callbacks in a queue, such as
     // during the first parameter change after installation, any parameter
-    // usage, even outside a callback, will cause a 20 second deadlock per
-    // queued callback.
+    // usage, even outside a callback, will be stalled per queued callback,
+    // which would make the parameter reads time out, see param_io.h.
     g_timeout_add_seconds(1, quit_main_loop, NULL);
 }
 
+// Meant to be used with g_timeout_add_seconds(). Write the new registry settings to the
+// configuration of dockerd, and make it read the configuration again, which neither restarts
+// dockerd nor the containers.
+static gboolean apply_registry_settings(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    registry_reload_timer_id = 0;
+    set_pull_throttle_registries(&app_state->registry);
+    if (rootlesskit_pid &&
+        (!daemon_config_write(xdg_runtime.daemon_json, &app_state->registry) || !reload_dockerd()))
+        main_loop_quit();  // Restart dockerd, which reports the problem in the status.
+    return G_SOURCE_REMOVE;
+}
+
+// Meant to be used as an AXParameter callback. The value is taken from the arguments, since
+// reading a parameter from within a callback can deadlock, see
+// restart_dockerd_when_parameter_changed().
+static void reload_dockerd_when_parameter_changed(const gchar* name,
+                                                  const gchar* value,
+                                                  gpointer app_state_void_ptr) {
+    const gchar* parname = name + strlen("root." APP_NAME ".");
+    log_parameter_change(parname, value);
+
+    struct app_state* app_state = app_state_void_ptr;
+    set_registry_setting(&app_state->registry, parname, value);
+
+    // Parameters changed together, such as from the settings page, lead to one reload.
+    if (!registry_reload_timer_id)
+        registry_reload_timer_id = g_timeout_add_seconds(1, apply_registry_settings, app_state);
+}
+
+// Meant to be used as an AXParameter callback. The window and a new rate take effect immediately,
+// but dockerd is restarted to start or stop pulling through the pull throttle.
+static void set_pull_limits_when_parameter_changed(const gchar* name,
+                                                   const gchar* value,
+                                                   gpointer app_state_void_ptr) {
+    const gchar* parname = name + strlen("root." APP_NAME ".");
+    log_parameter_change(parname, value);
+
+    struct app_state* app_state = app_state_void_ptr;
+    if (strcmp(parname, PARAM_PULL_WINDOW) == 0) {
+        image_pull_set_window(value);
+        return;
+    }
+    const guint64 rate = pull_rate_from_kbps(value);
+    const bool restart = (rate == 0) != (app_state->pull_rate == 0);
+    app_state->pull_rate = rate;
+    // The restart is delayed as in restart_dockerd_when_parameter_changed().
+    if (restart)
+        g_timeout_add_seconds(1, quit_main_loop, NULL);
+    else if (rate)
+        pull_throttle_set_rate(rate);
+}
+
+// Meant to be used as an AXParameter callback. Module log levels take effect immediately, without
+// restarting dockerd.
+static void set_log_levels_when_parameter_changed(const gchar* name,
+                                                  const gchar* value,
+                                                  __attribute__((unused)) gpointer data) {
+    log_parameter_change(name + strlen("root." APP_NAME "."), value);
+    log_levels_parse(value);
+}
+
+// Meant to be used as an AXParameter callback. The format takes effect immediately, without
+// restarting dockerd.
+static void set_log_format_when_parameter_changed(const gchar* name,
+                                                  const gchar* value,
+                                                  __attribute__((unused)) gpointer data) {
+    log_parameter_change(name + strlen("root." APP_NAME "."), value);
+    set_log_format(value);
+}
+
 static AXParameter* setup_axparameter(struct app_state* app_state) {
     bool success = false;
     GError* error = NULL;
@@ -735,6 +1838,49 @@ static AXParameter* setup_axparameter(struct app_state* app_state) {
         }
     }
 
+    for (const char** param = params_that_reload_dockerd; *param; param++) {
+        if (!ax_parameter_register_callback(ax_parameter,
+                                            *param,
+                                            reload_dockerd_when_parameter_changed,
+                                            app_state,
+                                            &error)) {
+            log_error("Could not register %s callback. Error: %s", *param, error->message);
+            goto end;
+        }
+    }
+
+    static const char* params_that_limit_pulls[] = {PARAM_PULL_BANDWIDTH, PARAM_PULL_WINDOW, NULL};
+    for (const char** param = params_that_limit_pulls; *param; param++) {
+        if (!ax_parameter_register_callback(ax_parameter,
+                                            *param,
+                                            set_pull_limits_when_parameter_changed,
+                                            app_state,
+                                            &error)) {
+            log_error("Could not register %s callback. Error: %s", *param, error->message);
+            goto end;
+        }
+    }
+
+    if (!ax_parameter_register_callback(ax_parameter,
+                                        PARAM_APPLICATION_LOG_MODULES,
+                                        set_log_levels_when_parameter_changed,
+                                        NULL,
+                                        &error)) {
+        log_error("Could not register %s callback. Error: %s",
+                  PARAM_APPLICATION_LOG_MODULES,
+                  error->message);
+        goto end;
+    }
+
+    if (!ax_parameter_register_callback(ax_parameter,
+                                        PARAM_LOG_FORMAT,
+                                        set_log_format_when_parameter_changed,
+                                        NULL,
+                                        &error)) {
+        log_error("Could not register %s callback. Error: %s", PARAM_LOG_FORMAT, error->message);
+        goto end;
+    }
+
     success = true;
 
 end:
@@ -746,23 +1892,128 @@ end:
     return ax_parameter;
 }
 
-static void sd_card_callback(const char* sd_card_area, void* app_state_void_ptr) {
-    struct app_state* app_state = app_state_void_ptr;
-    const bool using_sd_card = is_parameter_yes(app_state->param_handle, PARAM_SD_CARD_SUPPORT);
+struct sd_card_change {
+    struct app_state* app_state;
+    char* sd_card_area;
+};
+
+// Called on the main loop with the parameters read by sd_card_callback().
+static void apply_sd_card_change(GHashTable* values, void* change_void_ptr) {
+    struct sd_card_change* change = change_void_ptr;
+    struct app_state* app_state = change->app_state;
+    g_autofree char* sd_card_area = change->sd_card_area;
+    g_free(change);
+    // If the parameters cannot be read, assume that the SD card is used, so that dockerd is
+    // stopped before the SD card is removed.
+    const bool data_root_on_sd_card =
+        !values || g_strcmp0(g_hash_table_lookup(values, PARAM_SD_CARD_SUPPORT), "yes") == 0;
+    const bool registry_cache =
+        !values || g_strcmp0(g_hash_table_lookup(values, PARAM_REGISTRY_CACHE), "yes") == 0;
+    // dockerd is also restarted to start or stop hosting the registry cache.
+    const bool using_sd_card = data_root_on_sd_card || registry_cache;
     if (using_sd_card && !sd_card_area) {
         stop_dockerd();  // Block here until dockerd has stopped using the SD card.
-        set_status_parameter(app_state->param_handle, STATUS_NO_SD_CARD);
+        registry_cache_stop();
+        if (data_root_on_sd_card)
+            set_status_parameter(app_state->param_handle, STATUS_NO_SD_CARD);
     }
+    free(app_state->sd_card_area);
     app_state->sd_card_area = sd_card_area ? strdup(sd_card_area) : NULL;
     if (using_sd_card)
         main_loop_quit();  // Trigger a restart of dockerd from main()
 }
 
-static void restart_dockerd_after_file_upload(struct app_state* app_state) {
-    // If dockerd has failed before, this file upload may have resolved the problem.
-    allow_dockerd_to_start(app_state, true);
+// Meant to be used as an sd_disk_storage callback. The parameters are read off the main loop, and
+// the change applied by apply_sd_card_change(). Changes are applied in the order they come.
+static void sd_card_callback(const char* sd_card_area, void* app_state_void_ptr) {
+    static const char* const params[] = {PARAM_SD_CARD_SUPPORT, PARAM_REGISTRY_CACHE, NULL};
+    struct sd_card_change* change = g_new0(struct sd_card_change, 1);
+    change->app_state = app_state_void_ptr;
+    change->sd_card_area = g_strdup(sd_card_area);
+    param_io_get_current_async(change->app_state->param_handle,
+                               params,
+                               apply_sd_card_change,
+                               change);
+}
 
-    main_loop_quit();
+// Bits of enum localdata_file, for changes not yet handled by apply_localdata_changes()
+static volatile guint pending_localdata_changes;
+
+// Bits of enum localdata_file, for changes that need a restart of dockerd that waits for the TLS
+// files to match each other. Only used from the main loop.
+static guint deferred_localdata_changes;
+
+#define TLS_RELOADS ((1u << managed_file_reload_tls) | (1u << managed_file_reload_tls_proxy))
+
+// Put changed TLS files, or client certificate restrictions if tls_changed is false, to use.
+static void apply_tls_changes(struct app_state* app_state, bool tls_changed) {
+    struct tls_proxy_stats proxy;
+    tls_proxy_get_stats(&proxy);
+    if (tls_changed && !tls_files_consistent(proxy.running)) {
+        // Probably the first half of replacing a key pair, so wait for the other half before
+        // restarting dockerd with files that would make it fail.
+        log_warning("Not using the changed TLS files until they match each other");
+    } else if (proxy.running) {
+        // The TLS proxy switches to the new files without restarting dockerd or closing
+        // connections, but the new certificates may change the expiry status. If the files
+        // cannot be loaded, the proxy keeps using the previous ones, and so does the status.
+        if (tls_proxy_reload())
+            check_cert_expiry(app_state);
+    } else if (tls_changed) {
+        main_loop_quit();
+    } else {
+        warn_client_auth_not_enforced();
+    }
+}
+
+// Meant to be used with g_timeout_add(). Make the cheapest change that puts the files now in
+// localdata to use, as given by the managed file registry.
+static gboolean apply_localdata_changes(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    const guint changes =
+        g_atomic_int_and(&pending_localdata_changes, 0) | deferred_localdata_changes;
+    deferred_localdata_changes = 0;
+    guint reloads = 0;  // Bits of enum managed_file_reload
+    for (int i = 0; i < localdata_file_count; i++)
+        if (changes & (1u << i))
+            reloads |= 1u << managed_file_in_localdata(i)->reload;
+    const bool tls_changed = reloads & (1u << managed_file_reload_tls);
+    if (tls_changed)
+        tls_files_changed();
+
+    if (!rootlesskit_pid) {
+        // If dockerd has failed before, the changed file may have resolved the problem. Starting
+        // is refused by read_settings() if the TLS files do not match each other.
+        allow_dockerd_to_start(app_state, true);
+        main_loop_quit();
+        return G_SOURCE_REMOVE;
+    }
+
+    struct tls_proxy_stats proxy;
+    tls_proxy_get_stats(&proxy);
+    const bool restart = reloads & (1u << managed_file_reload_restart);
+    if (restart && app_state->tls_in_use && !tls_files_consistent(proxy.running)) {
+        // Restarting would stop dockerd, since read_settings() refuses to start it with these
+        // files, so keep the current one running until the TLS files are fixed.
+        log_warning("Not restarting dockerd to use the changed files until the TLS files in "
+                    "localdata match each other");
+        deferred_localdata_changes = changes;
+    } else if (restart) {
+        // Restarting dockerd also puts all the other changes to use.
+        log_info("Restarting dockerd to use the changed files");
+        main_loop_quit();
+    } else if ((reloads & TLS_RELOADS) && app_state->tls_in_use) {
+        apply_tls_changes(app_state, tls_changed);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Meant to be used as a localdata_index callback, from any thread. Changes reported within
+// LOCALDATA_SETTLE_MS, such as the files written by POST tls/generate, are handled together from
+// the main loop.
+static void localdata_changed(enum localdata_file file, void* app_state_void_ptr) {
+    if (g_atomic_int_or(&pending_localdata_changes, 1u << file) == 0)
+        g_timeout_add(LOCALDATA_SETTLE_MS, apply_localdata_changes, app_state_void_ptr);
 }
 
 // Stop the application and start it from an SSH prompt with
@@ -783,17 +2034,30 @@ static bool set_env_variable(const char* env_var, const char* value) {
 }
 
 static bool set_env_variables(void) {
-    uid_t uid = getuid();
     g_autofree char* path =
         g_strdup_printf("/bin:/usr/bin:%s:/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin",
                         APP_DIRECTORY);
-    g_autofree char* xdg_runtime_dir = xdg_runtime_directory();
 
     return set_env_variable("PATH", path) && set_env_variable("HOME", APP_DIRECTORY) &&
-           set_env_variable("XDG_RUNTIME_DIR", xdg_runtime_dir);
+           set_env_variable("XDG_RUNTIME_DIR", xdg_runtime.directory);
+}
+
+// Return true if rootlesskit is to be left running as the application exits, for the next instance
+// to take over, as asked for by POST detach.
+static bool leave_rootlesskit_running(const struct app_state* app_state) {
+    if (!rootlesskit_pid || !process_record_kept_on_stop())
+        return false;
+    if (app_state->pull_rate) {
+        log_warning("Stopping dockerd, since it cannot be taken over while pulls are limited");
+        return false;
+    }
+    log_info("Leaving rootlesskit (%d) running for the next instance of the application",
+             rootlesskit_pid);
+    return true;
 }
 
 int main(int argc, char** argv) {
+    struct trace_span main_span = trace_begin("main");
     struct app_state app_state = {0};
     struct log_settings log_settings = {0};
 
@@ -801,51 +2065,69 @@ int main(int argc, char** argv) {
 
     parse_command_line(argc, argv, &log_settings);
     log_init(&log_settings);
+    alloc_stats_init();
+    init_xdg_runtime_paths();
 
     allow_dockerd_to_start(&app_state, true);
 
+    param_io_start();
     app_state.param_handle = setup_axparameter(&app_state);
     if (!app_state.param_handle)
         return EX_SOFTWARE;
 
-    log_debug_set(is_app_log_level_debug(app_state.param_handle));
+    read_app_log_levels(app_state.param_handle);
 
     if (!set_env_variables())
         return EX_SOFTWARE;
 
+    localdata_index_init(localdata_changed, &app_state);
+    tls_files_changed();
+
     init_signals();
 
-    struct restart_dockerd_context restart_dockerd_context;
-    restart_dockerd_context.restart_dockerd = restart_dockerd_after_file_upload;
-    restart_dockerd_context.app_state = &app_state;
-    int fcgi_error = fcgi_start(http_request_callback, &restart_dockerd_context);
+    int fcgi_error = fcgi_start(http_request_callback, NULL);
     if (fcgi_error)
         return fcgi_error;
 
     struct sd_disk_storage* sd_disk_storage = sd_disk_storage_init(sd_card_callback, &app_state);
 
+    trace_end(&main_span);
+
     while (application_exit_code == EX_KEEP_RUNNING) {
         if (!rootlesskit_pid && dockerd_allowed_to_start(&app_state))
             read_settings_and_start_dockerd(&app_state);
 
         main_loop_run();
-
-        log_debug_set(is_app_log_level_debug(app_state.param_handle));
-
-        stop_dockerd();
+        cancel_settings_read();
+
+        read_app_log_levels(app_state.param_handle);
+
+        stop_on_demand(&app_state);
+        if (application_exit_code == EX_KEEP_RUNNING || !leave_rootlesskit_running(&app_state))
+            stop_dockerd();
+        registry_cache_stop();
+        image_pull_stop();
+        container_start_stop();
+        pull_throttle_stop();
+        tls_proxy_stop();
     }
 
     sd_disk_storage_free(sd_disk_storage);
 
     fcgi_stop();
+    localdata_index_free();
 
     set_status_parameter(app_state.param_handle, STATUS_NOT_STARTED);
+    param_io_stop();  // Waits for the status to be written
     ax_parameter_free(app_state.param_handle);
 
     free(app_state.sd_card_area);
+    g_free(app_state.registry_cache_directory);
 
     main_loop_unref();
 
+    alloc_stats_log();
+
     log_debug("Application exited with exit code %d", application_exit_code);
     return application_exit_code;
 }
@@ -0,0 +1,99 @@
+// Forward the output of dockerd from its FIFOs to syslog while no instance of the application reads
+// it, so that dockerd does not wait on a full FIFO. The application starts this with each
+// rootlesskit, with standard input from a pipe that the application holds. The FIFOs are only read
+// once the pipe is closed, which is when the application has ended, and until their writers have
+// closed them, or the next instance of the application sends SIGTERM.
+//
+// Usage: drain_output FIFO...
+// Exits with 0 when the writers have closed all FIFOs, 1 on error, and 2 on bad usage.
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define MAX_FIFOS 2
+#define LINE_SIZE 4096  // Longer lines are split
+
+struct fifo {
+    int fd;
+    size_t length;  // Of the incomplete line at the start of line
+    char line[LINE_SIZE];
+};
+
+static void log_line(const char* line, size_t length) {
+    syslog(LOG_INFO, "%.*s", (int)length, line);
+}
+
+// Read what is in fifo, and log each complete line. Return false when the FIFO has ended, which is
+// when it is empty and has no writer.
+static bool forward(struct fifo* fifo) {
+    const ssize_t count =
+        read(fifo->fd, fifo->line + fifo->length, sizeof(fifo->line) - fifo->length);
+    if (count < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (count == 0) {
+        if (fifo->length)
+            log_line(fifo->line, fifo->length);
+        return false;
+    }
+
+    const char* start = fifo->line;
+    const char* end = fifo->line + fifo->length + count;
+    for (const char* newline; (newline = memchr(start, '\n', end - start)); start = newline + 1)
+        log_line(start, newline - start);
+    fifo->length = end - start;
+    if (fifo->length == sizeof(fifo->line)) {
+        log_line(fifo->line, fifo->length);
+        fifo->length = 0;
+    } else {
+        memmove(fifo->line, start, fifo->length);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const int fifo_count = argc - 1;
+    if (fifo_count < 1 || fifo_count > MAX_FIFOS) {
+        fprintf(stderr, "Usage: %s FIFO...\n", argv[0]);
+        return 2;
+    }
+
+    // Wait until the application has ended, which closes the other end of standard input.
+    char byte;
+    ssize_t count;
+    while ((count = read(STDIN_FILENO, &byte, 1)) > 0 || (count < 0 && errno == EINTR)) continue;
+
+    openlog("dockerd", LOG_PID, LOG_DAEMON);
+    static struct fifo fifos[MAX_FIFOS];
+    struct pollfd polled[MAX_FIFOS];
+    for (int i = 0; i < fifo_count; i++) {
+        fifos[i].fd = open(argv[i + 1], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fifos[i].fd < 0) {
+            syslog(LOG_ERR, "Failed to open %s: %s", argv[i + 1], strerror(errno));
+            return 1;
+        }
+        // poll() does not report the end of a FIFO that had no writer when it was opened, so each
+        // FIFO is read once before the first poll().
+        polled[i] = (struct pollfd){.fd = fifos[i].fd, .events = POLLIN, .revents = POLLIN};
+    }
+
+    for (int open_count = fifo_count;;) {
+        for (int i = 0; i < fifo_count; i++) {
+            if (polled[i].fd < 0 || !polled[i].revents || forward(&fifos[i]))
+                continue;
+            close(fifos[i].fd);
+            polled[i].fd = -1;
+            open_count--;
+        }
+        if (!open_count)
+            return 0;
+        if (poll(polled, fifo_count, -1) < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to wait for output: %s", strerror(errno));
+            return 1;
+        }
+    }
+}
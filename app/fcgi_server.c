@@ -1,3 +1,4 @@
+#define LOG_MODULE log_module_fcgi
 #include "fcgi_server.h"
 #include "log.h"
 #include <fcgi_config.h>
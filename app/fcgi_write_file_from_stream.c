@@ -1,8 +1,11 @@
+#define LOG_MODULE log_module_upload
 #include "fcgi_write_file_from_stream.h"
 #include "fcgi_server.h"
 #include "log.h"
 #include <unistd.h>
 
+#define MAX_BOUNDARY_LEN 70  // RFC 2046
+
 static int request_content_length(const FCGX_Request* request) {
     const char* content_length_str = FCGX_GetParam("CONTENT_LENGTH", request->envp);
     if (!content_length_str)
@@ -33,6 +36,21 @@ char* fcgi_write_file_from_stream(FCGX_Request request) {
     }
     boundary_text += strlen(BOUNDARY_KEY);
     const int boundary_len = strlen(boundary_text);
+    if (boundary_len > MAX_BOUNDARY_LEN) {
+        log_error("The multipart boundary is longer than %d characters.", MAX_BOUNDARY_LEN);
+        return NULL;
+    }
+
+    // The part ends at CRLF, two dashes and the boundary. Searching for all of it, rather than
+    // for the boundary alone, accepts parts that contain the boundary text, and keeps the search
+    // within the buffer when the delimiter straddles two reads.
+    g_autofree char* delimiter = g_strdup_printf("\r\n--%s", boundary_text);
+    const int delimiter_len = strlen(delimiter);
+    const int bufferLen = 2048;
+    if (delimiter_len >= bufferLen) {
+        log_error("The multipart boundary does not fit the buffer.");
+        return NULL;
+    }
 
     temp_file = g_strdup_printf("/tmp/fcgi_upload.XXXXXX");
     int file_des = mkstemp(temp_file);
@@ -44,42 +62,42 @@ char* fcgi_write_file_from_stream(FCGX_Request request) {
 
     bool remove_temp_file = true;  // Clear this to return the filename to the caller.
 
-    const int bufferLen = 2048;
     char buffer[bufferLen + 1 /* Allow for NULL termination */];
 
     const char* data_start = "\r\n\r\n";
-    const char* data_end = "\r\n--";
 
     int total_bytes_processed = 0;
     bool pre_boundary_found = false;
     bool post_boundary_found = false;
 
     int loop_counter = 0;  // First iteration is special.
+    int carried = 0;       // Bytes at the start of buffer kept from the previous read
     char* p_payload = buffer;
     char* p_payload_end = NULL;
 
     while (total_bytes_processed < content_length) {
         loop_counter++;
-        const int available_len = bufferLen - (p_payload - buffer);
+        const int available_len = bufferLen - carried;
 
-        const int bytes_read = FCGX_GetStr(p_payload, available_len, request.in);
-        log_debug("FCGX_GetStr: bytes_read %d, p_payload %p(%d), available_len %d(%d)",
+        const int bytes_read = FCGX_GetStr(buffer + carried, available_len, request.in);
+        log_debug("FCGX_GetStr: bytes_read %d, carried %d, available_len %d",
                   bytes_read,
-                  p_payload,
-                  (int)(p_payload - buffer),
-                  available_len,
-                  available_len - bufferLen);
+                  carried,
+                  available_len);
         if (bytes_read < 0) {
             log_error("Failed to read from FCGI stream: %s", strerror(errno));
             break;
         }
+        char* const p_data_end = buffer + carried + bytes_read;
 
         /* Look for pre boundary */
         if (!pre_boundary_found) {
             buffer[bytes_read] = 0; /* NULL terminate */
-            p_payload = strstr(buffer + boundary_len + 1, data_start);
+            p_payload = bytes_read > boundary_len ? strstr(buffer + boundary_len + 1, data_start)
+                                                  : NULL;
             if (p_payload == NULL) {
                 log_error("Failed to find boundary in uploaded data.");
+                goto end;
             }
             pre_boundary_found = true;
             p_payload += strlen(data_start);
@@ -88,35 +106,23 @@ char* fcgi_write_file_from_stream(FCGX_Request request) {
             p_payload = buffer;
         }
 
-        /* Look for post boundary */
-        if (!post_boundary_found) {
-            char* pchar;
-            for (pchar = (loop_counter == 1) ? p_payload : buffer;
-                 pchar < buffer + bytes_read - ((loop_counter == 1) ? boundary_len : 0);
-                 pchar++) {
-                if (memcmp(pchar, boundary_text, boundary_len) == 0) {
-                    log_debug("Post boundary found for %.*s", boundary_len, pchar);
-                    pchar -= strlen(data_end);
-                    if (memcmp(pchar, data_end, strlen(data_end)) != 0) {
-                        log_error("Post boundary data end not found");
-                        log_debug("Found %02x%02x%02x%02x at post boundary",
-                                  pchar[0],
-                                  pchar[1],
-                                  pchar[2],
-                                  pchar[3]);
-                        goto end;
-                    }
-                    post_boundary_found = true;
-                    break;
-                }
+        /* Look for post boundary. Without it, everything but the last delimiter_len bytes, which
+         * may be the start of the delimiter, is payload. */
+        char* const p_last_start = p_data_end - delimiter_len;
+        p_payload_end = MAX(p_payload, p_last_start);
+        for (char* pchar = p_payload; pchar <= p_last_start; pchar++) {
+            if (memcmp(pchar, delimiter, delimiter_len) == 0) {
+                log_debug("Post boundary found for %.*s", boundary_len, pchar + 4);
+                post_boundary_found = true;
+                p_payload_end = pchar;
+                break;
             }
-            p_payload_end = pchar;
         }
 
         int to_write = p_payload_end - p_payload;
         int written = 0;
         while (to_write > 0) {
-            if ((written = write(file_des, p_payload + written, to_write)) < 0) {
+            if ((written = write(file_des, p_payload, to_write)) < 0) {
                 log_error("Failed to write %d bytes to %s: %s",
                           to_write,
                           temp_file,
@@ -124,9 +130,9 @@ char* fcgi_write_file_from_stream(FCGX_Request request) {
                 goto end;
             }
             total_bytes_processed += written;
+            p_payload += written;
             to_write -= written;
         }
-        log_debug("write: p_payload %p, %d bytes", p_payload, (int)(p_payload_end - p_payload));
         log_debug("loop %d, bytes_read %d, done %d",
                   loop_counter,
                   bytes_read,
@@ -145,9 +151,10 @@ char* fcgi_write_file_from_stream(FCGX_Request request) {
                 goto end;
             }
 
-            /* Post boundary may have been partial at payload end. Ensure possible rematch */
-            p_payload = buffer + boundary_len;
-            memcpy(buffer, p_payload_end, boundary_len);
+            /* Post boundary may have been partial at payload end. Keep the valid bytes after
+             * the payload written, at most delimiter_len, to ensure a possible rematch. */
+            carried = p_data_end - p_payload_end;
+            memmove(buffer, p_payload_end, carried);
         }
     }
 
@@ -0,0 +1,236 @@
+// Give every file under a directory the same owner, as 'chown -R -P uid:gid directory' would, for
+// the post-install script. Only files with another owner are changed, the tree is walked by several
+// threads, and when it is done, a marker with the owner is written to the directory, so that the
+// walk is skipped on the next install if the owner of the application has not changed since.
+//
+// Usage: fix_ownership UID GID DIRECTORY
+// Prints the number of files that were scanned and fixed. Exits with 0 if all files have the owner,
+// 1 if some could not be scanned or fixed, and 2 on bad usage.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MARKER_NAME    ".ownership"
+#define MAX_THREADS    8
+#define MARKER_SIZE    32
+#define MAX_ERRORS_LOG 10
+
+// Shared by the walking threads.
+static struct {
+    GMutex mutex;
+    GCond changed;   // Signaled when a directory is queued or done, and when the walk is done
+    GQueue pending;  // Paths relative to root_fd of directories to read. Guarded by mutex.
+    guint busy;      // Threads reading a directory. Guarded by mutex.
+    int root_fd;
+    uid_t uid;
+    gid_t gid;
+    gint scanned;  // Atomic
+    gint fixed;    // Atomic
+    gint errors;   // Atomic
+} walk = {.pending = G_QUEUE_INIT};
+
+static void report_error(const char* what, const char* path) {
+    if (g_atomic_int_add(&walk.errors, 1) < MAX_ERRORS_LOG)
+        fprintf(stderr, "Failed to %s %s: %s\n", what, path, strerror(errno));
+}
+
+static char* join(const char* directory, const char* name) {
+    return *directory ? g_strdup_printf("%s/%s", directory, name) : g_strdup(name);
+}
+
+// Fix the owner of name in dir_fd, whose path for messages is path. Symbolic links are changed
+// themselves, and not followed.
+static void fix(int dir_fd, const char* name, const char* path, const struct stat* st) {
+    g_atomic_int_inc(&walk.scanned);
+    if (st->st_uid == walk.uid && st->st_gid == walk.gid)
+        return;
+    if (fchownat(dir_fd, name, walk.uid, walk.gid, AT_SYMLINK_NOFOLLOW) != 0) {
+        report_error("change owner of", path);
+        return;
+    }
+    g_atomic_int_inc(&walk.fixed);
+}
+
+// Open directory, a path relative to walk.root_fd, one component at a time. O_NOFOLLOW only applies
+// to the last component of a path, and the application user, who owns the tree, could replace any
+// directory in it with a symbolic link after it was scanned, to have files outside the tree
+// changed. Return -1 on error.
+static int open_directory(const char* directory) {
+    char** names = g_strsplit(directory, "/", -1);
+    int fd = dup(walk.root_fd);
+    for (char** name = names; fd >= 0 && *name; name++) {
+        const int parent_fd = fd;
+        fd = openat(parent_fd, *name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        const int open_errno = errno;
+        close(parent_fd);
+        errno = open_errno;
+    }
+    g_strfreev(names);
+    return fd;
+}
+
+// Fix the owner of each entry in directory, and return its subdirectories, to be freed with
+// g_ptr_array_unref().
+static GPtrArray* fix_directory(const char* directory) {
+    GPtrArray* subdirectories = g_ptr_array_new_with_free_func(g_free);
+    const int fd = open_directory(directory);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        report_error("open", *directory ? directory : ".");
+        if (fd >= 0)
+            close(fd);
+        return subdirectories;
+    }
+
+    struct dirent* entry;
+    while ((errno = 0, entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        g_autofree char* path = join(directory, entry->d_name);
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            report_error("stat", path);
+            continue;
+        }
+        fix(dirfd(dir), entry->d_name, path, &st);
+        if (S_ISDIR(st.st_mode))
+            g_ptr_array_add(subdirectories, g_steal_pointer(&path));
+    }
+    if (errno != 0)
+        report_error("read", *directory ? directory : ".");
+    closedir(dir);
+    return subdirectories;
+}
+
+static void* walk_directories(void*) {
+    g_mutex_lock(&walk.mutex);
+    for (;;) {
+        char* directory = g_queue_pop_head(&walk.pending);
+        if (!directory && walk.busy == 0)
+            break;
+        if (!directory) {
+            g_cond_wait(&walk.changed, &walk.mutex);
+            continue;
+        }
+        walk.busy++;
+        g_mutex_unlock(&walk.mutex);
+
+        GPtrArray* subdirectories = fix_directory(directory);
+        g_free(directory);
+
+        g_mutex_lock(&walk.mutex);
+        for (guint i = 0; i < subdirectories->len; i++)
+            g_queue_push_tail(&walk.pending, g_strdup(subdirectories->pdata[i]));
+        g_ptr_array_unref(subdirectories);
+        walk.busy--;
+        g_cond_broadcast(&walk.changed);
+    }
+    g_mutex_unlock(&walk.mutex);
+    return NULL;
+}
+
+static guint thread_count(void) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // Most of the time is spent waiting for the storage, so use more threads than CPUs.
+    return CLAMP(cpus > 0 ? 2 * cpus : 2, 2, MAX_THREADS);
+}
+
+// Return true if the marker says that the tree was given the owner uid:gid by the last walk, and
+// the directory itself still has that owner.
+static bool marker_matches(const char* owner, const struct stat* root_st) {
+    if (root_st->st_uid != walk.uid || root_st->st_gid != walk.gid)
+        return false;
+    char marker[MARKER_SIZE] = {0};
+    const int fd = openat(walk.root_fd, MARKER_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    const ssize_t length = read(fd, marker, sizeof(marker) - 1);
+    close(fd);
+    return length > 0 && strcmp(g_strchomp(marker), owner) == 0;
+}
+
+// Write the marker so that it is replaced as a whole, or not at all.
+static bool write_marker(const char* owner) {
+    const char* temporary = MARKER_NAME ".tmp";
+    const int fd = openat(walk.root_fd,
+                          temporary,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                          0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", temporary, strerror(errno));
+        return false;
+    }
+    g_autofree char* contents = g_strdup_printf("%s\n", owner);
+    const size_t length = strlen(contents);
+    const bool written = write(fd, contents, length) == (ssize_t)length &&
+                         fchown(fd, walk.uid, walk.gid) == 0 && fsync(fd) == 0;
+    close(fd);
+    if (!written || renameat(walk.root_fd, temporary, walk.root_fd, MARKER_NAME) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", MARKER_NAME, strerror(errno));
+        unlinkat(walk.root_fd, temporary, 0);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_id(const char* text, guint* id) {
+    guint64 value;
+    if (!g_ascii_string_to_unsigned(text, 10, 0, G_MAXUINT32 - 1, &value, NULL))
+        return false;
+    *id = (guint)value;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    guint uid, gid;
+    if (argc != 4 || !parse_id(argv[1], &uid) || !parse_id(argv[2], &gid)) {
+        fprintf(stderr, "Usage: %s UID GID DIRECTORY\n", argv[0]);
+        return 2;
+    }
+    const char* root = argv[3];
+    walk.uid = uid;
+    walk.gid = gid;
+    g_autofree char* owner = g_strdup_printf("%u:%u", uid, gid);
+
+    walk.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat root_st;
+    if (walk.root_fd < 0 || fstat(walk.root_fd, &root_st) != 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+    if (marker_matches(owner, &root_st)) {
+        printf("Ownership of %s is already %s, skipped\n", root, owner);
+        return 0;
+    }
+
+    const gint64 started = g_get_monotonic_time();
+    fix(walk.root_fd, ".", root, &root_st);
+    g_queue_push_tail(&walk.pending, g_strdup(""));
+
+    const guint count = thread_count();
+    GThread* threads[MAX_THREADS];
+    for (guint i = 0; i < count; i++)
+        threads[i] = g_thread_new("fix_ownership", walk_directories, NULL);
+    for (guint i = 0; i < count; i++)
+        g_thread_join(threads[i]);
+
+    // Without the marker, the next install walks the tree again, and retries what failed.
+    const bool complete = walk.errors == 0 && write_marker(owner);
+    printf("Scanned %d files in %s and changed the owner of %d to %s in %" G_GINT64_FORMAT
+           " ms, %d errors\n",
+           walk.scanned,
+           root,
+           walk.fixed,
+           owner,
+           (g_get_monotonic_time() - started) / 1000,
+           walk.errors);
+    close(walk.root_fd);
+    return complete ? 0 : 1;
+}
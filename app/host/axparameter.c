@@ -0,0 +1,134 @@
+#include "host_control.h"
+#include <axsdk/axparameter.h>
+#include <stdio.h>
+#include <string.h>
+
+struct _AXParameter {
+    GMutex mutex;
+    char* app_name;
+    char* ini_path;
+    char* log_path;
+    GKeyFile* parameters;
+    GHashTable* callbacks;  // Parameter name -> struct callback
+};
+
+struct callback {
+    AXParameterCallback function;
+    gpointer user_data;
+};
+
+struct pending_callback {
+    struct callback callback;
+    char* name;
+    char* value;
+};
+
+static GQuark error_quark(void) {
+    return g_quark_from_static_string("axparameter-host");
+}
+
+static gboolean run_callback(gpointer pending_void_ptr) {
+    struct pending_callback* pending = pending_void_ptr;
+    pending->callback.function(pending->name, pending->value, pending->callback.user_data);
+    g_free(pending->name);
+    g_free(pending->value);
+    g_free(pending);
+    return G_SOURCE_REMOVE;
+}
+
+static void append_to_log(AXParameter* handle, const char* name, const char* value) {
+    FILE* fp = fopen(handle->log_path, "a");
+    if (!fp)
+        return;
+    fprintf(fp, "%" G_GINT64_FORMAT " %s %s\n", g_get_monotonic_time(), name, value);
+    fclose(fp);
+}
+
+// Like the real API, callbacks are called from the main loop, with the fully qualified name.
+static void set_value(AXParameter* handle, const char* name, const char* value) {
+    g_mutex_lock(&handle->mutex);
+    g_autofree char* old_value =
+        g_key_file_get_string(handle->parameters, handle->app_name, name, NULL);
+    g_key_file_set_string(handle->parameters, handle->app_name, name, value);
+    g_key_file_save_to_file(handle->parameters, handle->ini_path, NULL);
+    append_to_log(handle, name, value);
+    struct callback* callback = g_hash_table_lookup(handle->callbacks, name);
+    g_mutex_unlock(&handle->mutex);
+
+    if (callback && (!old_value || strcmp(old_value, value) != 0)) {
+        struct pending_callback* pending = g_malloc0(sizeof(struct pending_callback));
+        pending->callback = *callback;
+        pending->name = g_strdup_printf("root.%s.%s", handle->app_name, name);
+        pending->value = g_strdup(value);
+        g_idle_add(run_callback, pending);
+    }
+}
+
+static void param_command(const char* arguments, void* handle_void_ptr) {
+    gchar** words = g_strsplit(arguments, " ", 2);
+    if (g_strv_length(words) == 2)
+        set_value(handle_void_ptr, words[0], words[1]);
+    g_strfreev(words);
+}
+
+AXParameter* ax_parameter_new(const gchar* app_name, GError** error) {
+    AXParameter* handle = g_malloc0(sizeof(AXParameter));
+    g_mutex_init(&handle->mutex);
+    handle->app_name = g_strdup(app_name);
+    handle->ini_path = host_state_path("parameters.ini");
+    handle->log_path = host_state_path("parameters.log");
+    handle->parameters = g_key_file_new();
+    handle->callbacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    if (!g_key_file_load_from_file(
+            handle->parameters, handle->ini_path, G_KEY_FILE_NONE, error)) {
+        ax_parameter_free(handle);
+        return NULL;
+    }
+    host_control_register("param", param_command, handle);
+    return handle;
+}
+
+void ax_parameter_free(AXParameter* handle) {
+    if (!handle)
+        return;
+    g_key_file_free(handle->parameters);
+    g_hash_table_destroy(handle->callbacks);
+    g_free(handle->app_name);
+    g_free(handle->ini_path);
+    g_free(handle->log_path);
+    g_mutex_clear(&handle->mutex);
+    g_free(handle);
+}
+
+gboolean ax_parameter_get(AXParameter* handle, const gchar* name, gchar** value, GError** error) {
+    g_mutex_lock(&handle->mutex);
+    *value = g_key_file_get_string(handle->parameters, handle->app_name, name, NULL);
+    g_mutex_unlock(&handle->mutex);
+    if (!*value)
+        g_set_error(error, error_quark(), 0, "No parameter named %s", name);
+    return *value != NULL;
+}
+
+gboolean ax_parameter_set(AXParameter* handle,
+                          const gchar* name,
+                          const gchar* value,
+                          __attribute__((unused)) gboolean do_sync,
+                          __attribute__((unused)) GError** error) {
+    set_value(handle, name, value);
+    return TRUE;
+}
+
+gboolean ax_parameter_register_callback(AXParameter* handle,
+                                        const gchar* name,
+                                        AXParameterCallback function,
+                                        gpointer user_data,
+                                        __attribute__((unused)) GError** error) {
+    struct callback* callback = g_malloc0(sizeof(struct callback));
+    callback->function = function;
+    callback->user_data = user_data;
+    g_mutex_lock(&handle->mutex);
+    g_hash_table_insert(handle->callbacks, g_strdup(name), callback);
+    g_mutex_unlock(&handle->mutex);
+    return TRUE;
+}
@@ -0,0 +1,23 @@
+#pragma once
+// Host stand-in for the parts of the ACAP SDK AXParameter API used by the application. See
+// host_control.h for how parameters are stored and changed from the outside.
+#include <glib.h>
+
+typedef struct _AXParameter AXParameter;
+
+typedef void (*AXParameterCallback)(const gchar* name, const gchar* value, gpointer user_data);
+
+AXParameter* ax_parameter_new(const gchar* app_name, GError** error);
+void ax_parameter_free(AXParameter* handle);
+
+gboolean ax_parameter_get(AXParameter* handle, const gchar* name, gchar** value, GError** error);
+gboolean ax_parameter_set(AXParameter* handle,
+                          const gchar* name,
+                          const gchar* value,
+                          gboolean do_sync,
+                          GError** error);
+gboolean ax_parameter_register_callback(AXParameter* handle,
+                                        const gchar* name,
+                                        AXParameterCallback callback,
+                                        gpointer user_data,
+                                        GError** error);
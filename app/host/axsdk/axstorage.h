@@ -0,0 +1,34 @@
+#pragma once
+// Host stand-in for the parts of the ACAP SDK AXStorage API used by the application. A single
+// storage, SD_DISK, is inserted and ejected through the control socket, see host_control.h.
+#include <glib.h>
+
+typedef struct _AXStorage AXStorage;
+
+typedef enum {
+    AX_STORAGE_AVAILABLE_EVENT,
+    AX_STORAGE_EXITING_EVENT,
+    AX_STORAGE_WRITABLE_EVENT,
+    AX_STORAGE_FULL_EVENT,
+} AXStorageStatusEventId;
+
+typedef void (*AXStorageSubscriptionCallback)(gchar* storage_id, gpointer user_data, GError* error);
+typedef void (*AXStorageSetupCallback)(AXStorage* storage, gpointer user_data, GError* error);
+typedef void (*AXStorageReleaseCallback)(gpointer user_data, GError* error);
+
+GList* ax_storage_list(GError** error);
+guint ax_storage_subscribe(gchar* storage_id,
+                           AXStorageSubscriptionCallback callback,
+                           gpointer user_data,
+                           GError** error);
+gboolean ax_storage_unsubscribe(guint subscription_id, GError** error);
+gboolean ax_storage_get_status(gchar* storage_id, AXStorageStatusEventId event, GError** error);
+gboolean ax_storage_setup_async(gchar* storage_id,
+                                AXStorageSetupCallback callback,
+                                gpointer user_data,
+                                GError** error);
+gboolean ax_storage_release_async(AXStorage* storage,
+                                  AXStorageReleaseCallback callback,
+                                  gpointer user_data,
+                                  GError** error);
+gchar* ax_storage_get_path(AXStorage* storage, GError** error);
@@ -0,0 +1,132 @@
+#include "host_control.h"
+#include <axsdk/axstorage.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define STORAGE_ID "SD_DISK"
+
+struct _AXStorage {
+    char* path;
+};
+
+// There is only one storage, and all calls are made from the main loop.
+static struct {
+    char* path;  // NULL when ejected
+    bool exiting;
+    AXStorageSubscriptionCallback callback;
+    gpointer user_data;
+    bool control_registered;
+} sd_disk;
+
+static GQuark error_quark(void) {
+    return g_quark_from_static_string("axstorage-host");
+}
+
+static gboolean notify_subscriber(__attribute__((unused)) gpointer user_data) {
+    if (sd_disk.callback)
+        sd_disk.callback(STORAGE_ID, sd_disk.user_data, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+static void sd_command(const char* arguments, __attribute__((unused)) void* user_data) {
+    if (g_str_has_prefix(arguments, "insert ")) {
+        g_free(sd_disk.path);
+        sd_disk.path = g_strdup(arguments + strlen("insert "));
+        sd_disk.exiting = false;
+    } else if (strcmp(arguments, "eject") == 0) {
+        sd_disk.exiting = true;
+    } else {
+        return;
+    }
+    notify_subscriber(NULL);
+    if (sd_disk.exiting)
+        g_clear_pointer(&sd_disk.path, g_free);
+}
+
+GList* ax_storage_list(__attribute__((unused)) GError** error) {
+    return g_list_append(NULL, g_strdup(STORAGE_ID));
+}
+
+guint ax_storage_subscribe(gchar* storage_id,
+                           AXStorageSubscriptionCallback callback,
+                           gpointer user_data,
+                           GError** error) {
+    if (strcmp(storage_id, STORAGE_ID) != 0) {
+        g_set_error(error, error_quark(), 0, "No storage named %s", storage_id);
+        return 0;
+    }
+    if (!sd_disk.control_registered) {
+        host_control_register("sd", sd_command, NULL);
+        sd_disk.control_registered = true;
+    }
+    sd_disk.callback = callback;
+    sd_disk.user_data = user_data;
+    g_idle_add(notify_subscriber, NULL);  // Report the initial state, like the real API.
+    return 1;
+}
+
+gboolean ax_storage_unsubscribe(__attribute__((unused)) guint subscription_id,
+                                __attribute__((unused)) GError** error) {
+    sd_disk.callback = NULL;
+    return TRUE;
+}
+
+gboolean ax_storage_get_status(__attribute__((unused)) gchar* storage_id,
+                               AXStorageStatusEventId event,
+                               __attribute__((unused)) GError** error) {
+    switch (event) {
+        case AX_STORAGE_AVAILABLE_EVENT:
+        case AX_STORAGE_WRITABLE_EVENT:
+            return sd_disk.path && !sd_disk.exiting;
+        case AX_STORAGE_EXITING_EVENT:
+            return sd_disk.exiting;
+        default:
+            return FALSE;
+    }
+}
+
+struct pending_setup {
+    AXStorageSetupCallback callback;
+    gpointer user_data;
+};
+
+static gboolean finish_setup(gpointer pending_void_ptr) {
+    struct pending_setup* pending = pending_void_ptr;
+    AXStorage* storage = g_malloc0(sizeof(AXStorage));
+    storage->path = g_strdup(sd_disk.path);
+    pending->callback(storage, pending->user_data, NULL);
+    g_free(pending);
+    return G_SOURCE_REMOVE;
+}
+
+gboolean ax_storage_setup_async(__attribute__((unused)) gchar* storage_id,
+                                AXStorageSetupCallback callback,
+                                gpointer user_data,
+                                GError** error) {
+    if (!sd_disk.path) {
+        g_set_error(error, error_quark(), 0, "No storage inserted");
+        return FALSE;
+    }
+    struct pending_setup* pending = g_malloc0(sizeof(struct pending_setup));
+    pending->callback = callback;
+    pending->user_data = user_data;
+    g_idle_add(finish_setup, pending);
+    return TRUE;
+}
+
+gboolean ax_storage_release_async(AXStorage* storage,
+                                  AXStorageReleaseCallback callback,
+                                  gpointer user_data,
+                                  __attribute__((unused)) GError** error) {
+    g_free(storage->path);
+    g_free(storage);
+    if (callback)
+        callback(user_data, NULL);
+    return TRUE;
+}
+
+gchar* ax_storage_get_path(AXStorage* storage, GError** error) {
+    if (!storage->path)
+        g_set_error(error, error_quark(), 0, "Storage has no path");
+    return g_strdup(storage->path);
+}
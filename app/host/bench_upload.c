@@ -0,0 +1,420 @@
+// Feed synthetic multipart/form-data bodies through fcgi_write_file_from_stream(), using an
+// in-memory FCGX_Stream, to check that the stored file always equals the uploaded part and to
+// measure throughput and allocations.
+//
+// Usage: bench_upload [-s <MB>] [-n <repetitions>] [-c <corpus directory>]
+//
+// The correctness sweep varies the boundary length, the part size, the chunk size in which the
+// stream delivers data, including chunks that split the body across the parser's 2 KB buffer
+// edge, the length of the part's headers, through a long filename, so that they end just before
+// that edge, and where CRLF and near-boundary text appear in the part. Any mismatch makes the exit
+// status non-zero. The throughput run uploads a part of <MB> megabytes <repetitions> times.
+// With -c, the sweep cases are also written to a directory as seed corpus for the fuzz target.
+//
+// Built with -D FUZZING and -fsanitize=fuzzer ('make host-fuzz'), this file is instead a
+// libFuzzer target, taking its input in the same format as the seed corpus: two bytes of chunk
+// size, one byte of boundary length, the boundary and the body.
+#include "fcgi_write_file_from_stream.h"
+#include "log.h"
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PARSER_BUFFER_SIZE 2048  // Size of the buffer in fcgi_write_file_from_stream()
+#define MAX_BOUNDARY_LEN   70    // RFC 2046
+#define FAILURES_TO_LIST   10
+
+struct chunked_input {
+    const unsigned char* data;
+    size_t len;
+    size_t pos;
+    size_t chunk;
+};
+
+// Called by FCGX_GetStr() when it has consumed the current chunk.
+static void fill_buffer(FCGX_Stream* stream) {
+    struct chunked_input* input = stream->data;
+    const size_t len = MIN(input->chunk, input->len - input->pos);
+    if (len == 0) {
+        stream->isClosed = 1;
+        return;
+    }
+    stream->rdNext = (unsigned char*)input->data + input->pos;
+    stream->stop = stream->rdNext + len;
+    input->pos += len;
+}
+
+// Upload body with the given boundary, delivered in chunks of chunk bytes. Return the name of
+// the stored file, or NULL if the upload was rejected.
+static char* upload(const char* boundary, const unsigned char* body, size_t len, size_t chunk) {
+    struct chunked_input input = {body, len, 0, chunk};
+    FCGX_Stream stream = {.isReader = 1, .fillBuffProc = fill_buffer, .data = &input};
+    g_autofree char* content_type =
+        g_strdup_printf("CONTENT_TYPE=multipart/form-data; boundary=%s", boundary);
+    g_autofree char* content_length = g_strdup_printf("CONTENT_LENGTH=%zu", len);
+    char* envp[] = {content_type, content_length, NULL};
+    FCGX_Request request = {.in = &stream, .envp = envp};
+    return fcgi_write_file_from_stream(request);
+}
+
+static GString* build_body(const char* boundary,
+                           const char* filename,
+                           const char* part,
+                           size_t part_len) {
+    GString* body = g_string_new(NULL);
+    g_string_append_printf(body,
+                           "--%s\r\n"
+                           "Content-Disposition: form-data; name=\"file\"; filename=\"%s\"\r\n"
+                           "Content-Type: application/octet-stream\r\n\r\n",
+                           boundary,
+                           filename);
+    g_string_append_len(body, part, part_len);
+    g_string_append_printf(body, "\r\n--%s--\r\n", boundary);
+    return body;
+}
+
+#ifdef FUZZING
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static struct log_settings log_settings = {log_dest_stdout};
+    static bool initialized = false;
+    if (!initialized) {
+        log_init(&log_settings);
+        initialized = true;
+    }
+
+    if (size < 3)
+        return 0;
+    const size_t chunk = (data[0] | data[1] << 8) % 8192 + 1;
+    const size_t boundary_len = MIN((size_t)data[2] % MAX_BOUNDARY_LEN + 1, size - 3);
+    g_autofree char* boundary = g_strndup((const char*)data + 3, boundary_len);
+    g_strdelimit(boundary, "\r\n;", '-');  // Keep the CONTENT_TYPE parameter on one line.
+    if (strlen(boundary) == 0)
+        return 0;
+
+    const size_t header_len = 3 + boundary_len;
+    g_autofree char* temp_file = upload(boundary, data + header_len, size - header_len, chunk);
+    if (temp_file)
+        unlink(temp_file);
+    return 0;
+}
+
+#else
+
+struct alloc_counters {
+    size_t calls;
+    size_t bytes;
+};
+
+// Allocations made by the whole process, including by GLib, counted by the malloc wrappers
+// below. Only changed while an upload is measured.
+static struct alloc_counters allocs;
+static bool counting_allocs = false;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static void count_alloc(size_t size) {
+    if (__atomic_load_n(&counting_allocs, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&allocs.calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&allocs.bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+void* malloc(size_t size) {
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    count_alloc(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    count_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+enum pattern { pattern_random, pattern_crlf, pattern_leading_crlf, pattern_near_boundary };
+
+static const char* const pattern_names[] = {
+    "random", "CRLF only", "leading CRLF", "near boundary"};
+
+static const size_t chunk_sizes[] = {1, 3, 512, 2047, 2048, 2049, 65536};
+
+struct sweep {
+    size_t cases;
+    size_t failures;
+    const char* corpus_dir;
+};
+
+// Fill a part of len bytes with the given pattern. Near-boundary text is CRLF, dashes and the
+// boundary without its last character, which must not be taken for the closing delimiter.
+static char* make_part(enum pattern pattern, const char* boundary, size_t len, GRand* rand) {
+    char* part = g_malloc(len + 1);
+    g_autofree char* near_boundary =
+        g_strdup_printf("\r\n--%.*s", (int)strlen(boundary) - 1, boundary);
+    const size_t near_boundary_len = strlen(near_boundary);
+    for (size_t i = 0; i < len; i++) {
+        switch (pattern) {
+            case pattern_random:
+                part[i] = g_rand_int_range(rand, 0, 256);
+                break;
+            case pattern_crlf:
+                part[i] = i % 2 ? '\n' : '\r';
+                break;
+            case pattern_leading_crlf:
+                part[i] = i < 4 ? "\r\n\r\n"[i] : "abcdefghijklmnopqrstuvwxyz"[i % 26];
+                break;
+            case pattern_near_boundary:
+                part[i] = near_boundary[i % near_boundary_len];
+                break;
+        }
+    }
+    part[len] = '\0';
+    return part;
+}
+
+static void save_corpus_entry(const struct sweep* sweep,
+                              const char* boundary,
+                              const GString* body,
+                              size_t chunk) {
+    const size_t boundary_len = strlen(boundary);
+    GString* entry = g_string_new(NULL);
+    g_string_append_c(entry, (chunk - 1) & 0xff);
+    g_string_append_c(entry, ((chunk - 1) >> 8) & 0xff);
+    g_string_append_c(entry, boundary_len - 1);
+    g_string_append(entry, boundary);
+    g_string_append_len(entry, body->str, body->len);
+    g_autofree char* path = g_strdup_printf("%s/seed-%05zu", sweep->corpus_dir, sweep->cases);
+    if (!g_file_set_contents(path, entry->str, entry->len, NULL))
+        fprintf(stderr, "Failed to write %s\n", path);
+    g_string_free(entry, TRUE);
+}
+
+static void check_case(struct sweep* sweep,
+                       const char* boundary,
+                       const char* filename,
+                       enum pattern pattern,
+                       const char* part,
+                       size_t part_len,
+                       size_t chunk) {
+    GString* body = build_body(boundary, filename, part, part_len);
+    if (sweep->corpus_dir && chunk < 8192)
+        save_corpus_entry(sweep, boundary, body, chunk);
+    sweep->cases++;
+
+    g_autofree char* temp_file = upload(boundary, (unsigned char*)body->str, body->len, chunk);
+    g_autofree char* stored = NULL;
+    gsize stored_len = 0;
+    const char* error = NULL;
+    if (!temp_file)
+        error = "rejected";
+    else if (!g_file_get_contents(temp_file, &stored, &stored_len, NULL))
+        error = "stored file not readable";
+    else if (stored_len != part_len || memcmp(stored, part, part_len) != 0)
+        error = "stored file differs";
+    if (temp_file)
+        unlink(temp_file);
+
+    if (error && sweep->failures++ < FAILURES_TO_LIST)
+        printf("FAIL boundary %zu bytes, filename %zu bytes, part %zu bytes (%s), chunk %zu, "
+               "body %zu bytes: %s (stored %zu bytes)\n",
+               strlen(boundary),
+               strlen(filename),
+               part_len,
+               pattern_names[pattern],
+               chunk,
+               body->len,
+               error,
+               (size_t)stored_len);
+    g_string_free(body, TRUE);
+}
+
+// Part sizes around the parser's buffer size, chosen so that the closing delimiter starts at
+// every offset close to the buffer edge, plus some ordinary sizes.
+static GArray* part_sizes(const char* boundary) {
+    GString* empty_body = build_body(boundary, "ca.pem", "", 0);
+    const size_t overhead = empty_body->len;
+    g_string_free(empty_body, TRUE);
+
+    static const size_t ordinary_sizes[] = {0, 1, 5, 100, 1000, 4096, 10000, 100000};
+    GArray* sizes = g_array_new(FALSE, FALSE, sizeof(size_t));
+    g_array_append_vals(sizes, ordinary_sizes, G_N_ELEMENTS(ordinary_sizes));
+    for (size_t edge = PARSER_BUFFER_SIZE; edge <= 2 * PARSER_BUFFER_SIZE;
+         edge += PARSER_BUFFER_SIZE)
+        for (size_t delta = 0; delta <= overhead; delta++)
+            if (edge + delta >= overhead) {
+                const size_t size = edge + delta - overhead;
+                g_array_append_val(sizes, size);
+            }
+    return sizes;
+}
+
+static void run_sweep(struct sweep* sweep) {
+    GRand* rand = g_rand_new_with_seed(1);
+    for (size_t boundary_len = 1; boundary_len <= MAX_BOUNDARY_LEN;
+         boundary_len = boundary_len < 16 ? boundary_len * 4 : boundary_len + 27) {
+        // Browsers use boundaries like "----WebKitFormBoundary" followed by random characters.
+        g_autofree char* boundary = g_strnfill(boundary_len, '-');
+        for (size_t i = boundary_len / 2; i < boundary_len; i++)
+            boundary[i] = 'A' + g_rand_int_range(rand, 0, 26);
+
+        GArray* sizes = part_sizes(boundary);
+        for (enum pattern pattern = 0; pattern < G_N_ELEMENTS(pattern_names); pattern++)
+            for (guint i = 0; i < sizes->len; i++) {
+                const size_t part_len = g_array_index(sizes, size_t, i);
+                g_autofree char* part = make_part(pattern, boundary, part_len, rand);
+                for (size_t c = 0; c < G_N_ELEMENTS(chunk_sizes); c++)
+                    check_case(
+                        sweep, boundary, "ca.pem", pattern, part, part_len, chunk_sizes[c]);
+            }
+        g_array_free(sizes, TRUE);
+    }
+    g_rand_free(rand);
+}
+
+// Grow the filename so that the headers of the part end at every offset from a delimiter and more
+// before the parser's buffer edge up to the edge itself, where the payload starts with the second
+// read. The whole of the headers must be within the first read.
+static void run_header_sweep(struct sweep* sweep) {
+    static const size_t part_lens[] = {0, 1, 100, 5000};
+    GRand* rand = g_rand_new_with_seed(3);
+    for (size_t boundary_len = 1; boundary_len <= MAX_BOUNDARY_LEN; boundary_len += 23) {
+        g_autofree char* boundary = g_strnfill(boundary_len, 'B');
+        GString* empty_body = build_body(boundary, "", "", 0);
+        const size_t trailer_len = strlen(boundary) + 8;  // CRLF--boundary--CRLF
+        const size_t headers_len = empty_body->len - trailer_len;
+        g_string_free(empty_body, TRUE);
+
+        const size_t delimiter_len = boundary_len + 4;
+        for (size_t end = PARSER_BUFFER_SIZE - 2 * delimiter_len - 4; end <= PARSER_BUFFER_SIZE;
+             end++) {
+            g_autofree char* filename = g_strnfill(end - headers_len, 'f');
+            for (size_t p = 0; p < G_N_ELEMENTS(part_lens); p++) {
+                g_autofree char* part = make_part(pattern_random, boundary, part_lens[p], rand);
+                for (size_t c = 0; c < G_N_ELEMENTS(chunk_sizes); c++)
+                    check_case(sweep,
+                               boundary,
+                               filename,
+                               pattern_random,
+                               part,
+                               part_lens[p],
+                               chunk_sizes[c]);
+            }
+        }
+    }
+    g_rand_free(rand);
+}
+
+// A boundary longer than RFC 2046 allows must be rejected, not parsed.
+static void check_long_boundary(struct sweep* sweep) {
+    g_autofree char* boundary = g_strnfill(MAX_BOUNDARY_LEN + 1, 'B');
+    GString* body = build_body(boundary, "ca.pem", "data", 4);
+    g_autofree char* temp_file = upload(boundary, (unsigned char*)body->str, body->len, 8192);
+    sweep->cases++;
+    if (temp_file) {
+        unlink(temp_file);
+        sweep->failures++;
+        printf("FAIL boundary %zu bytes: accepted\n", strlen(boundary));
+    }
+    g_string_free(body, TRUE);
+}
+
+static int compare_doubles(gconstpointer a, gconstpointer b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Upload a part of megabytes MB repetitions times, delivered in the 8 KB chunks that libfcgi
+// typically hands over, and report the median throughput and the allocations per MB.
+static bool run_throughput(size_t megabytes, int repetitions) {
+    const char* boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+    const size_t part_len = megabytes << 20;
+    GRand* rand = g_rand_new_with_seed(2);
+    g_autofree char* part = make_part(pattern_random, boundary, part_len, rand);
+    g_rand_free(rand);
+    GString* body = build_body(boundary, "ca.pem", part, part_len);
+
+    GArray* throughputs = g_array_new(FALSE, FALSE, sizeof(double));
+    struct alloc_counters total = {0};
+    bool success = true;
+    for (int i = 0; i < repetitions && success; i++) {
+        allocs = (struct alloc_counters){0};
+        const gint64 start = g_get_monotonic_time();
+        __atomic_store_n(&counting_allocs, true, __ATOMIC_RELAXED);
+        g_autofree char* temp_file = upload(boundary, (unsigned char*)body->str, body->len, 8192);
+        __atomic_store_n(&counting_allocs, false, __ATOMIC_RELAXED);
+        const double seconds = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+        total.calls += allocs.calls;
+        total.bytes += allocs.bytes;
+
+        success = temp_file != NULL;
+        if (temp_file)
+            unlink(temp_file);
+        const double mb_per_second = megabytes / seconds;
+        g_array_append_val(throughputs, mb_per_second);
+    }
+
+    if (success) {
+        g_array_sort(throughputs, compare_doubles);
+        const double megabytes_total = (double)megabytes * repetitions;
+        printf("Throughput: %.1f MB/s median, %.1f MB/s best, over %d uploads of %zu MB\n",
+               g_array_index(throughputs, double, throughputs->len / 2),
+               g_array_index(throughputs, double, throughputs->len - 1),
+               repetitions,
+               megabytes);
+        printf("Allocations: %.1f per MB, %.0f bytes per MB\n",
+               total.calls / megabytes_total,
+               total.bytes / megabytes_total);
+    } else {
+        printf("FAIL throughput upload was rejected\n");
+    }
+    g_array_free(throughputs, TRUE);
+    g_string_free(body, TRUE);
+    return success;
+}
+
+int main(int argc, char** argv) {
+    size_t megabytes = 64;
+    int repetitions = 5;
+    struct sweep sweep = {0};
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:c:")) != -1) {
+        if (opt == 's')
+            megabytes = atoi(optarg);
+        else if (opt == 'n')
+            repetitions = atoi(optarg);
+        else if (opt == 'c')
+            sweep.corpus_dir = optarg;
+        else {
+            fprintf(stderr, "Usage: %s [-s <MB>] [-n <repetitions>] [-c <corpus dir>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    static struct log_settings log_settings = {log_dest_stdout};
+    log_init(&log_settings);
+    log_levels_parse("upload=error");
+
+    if (sweep.corpus_dir && g_mkdir_with_parents(sweep.corpus_dir, 0755) != 0) {
+        fprintf(stderr, "Failed to create %s\n", sweep.corpus_dir);
+        return EXIT_FAILURE;
+    }
+    run_sweep(&sweep);
+    run_header_sweep(&sweep);
+    check_long_boundary(&sweep);
+    printf("Sweep: %zu cases, %zu failures\n", sweep.cases, sweep.failures);
+
+    const bool throughput_ok = megabytes == 0 || repetitions <= 0 ||
+                               run_throughput(megabytes, repetitions);
+    return sweep.failures == 0 && throughput_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
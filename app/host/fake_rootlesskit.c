@@ -0,0 +1,205 @@
+// Stand-in for rootlesskit and dockerd in the host build, to exercise the application's
+// supervision of dockerd deterministically. It takes the same command line, creates the socket
+// given by '-H unix://<path>' and the pid file $XDG_RUNTIME_DIR/docker.pid, and answers
+// GET /_ping on the socket. Any other request gets 404.
+//
+// Its behavior is read at startup from the [fake_rootlesskit] group of
+// $HOST_STATE_DIR/fake_rootlesskit.ini, where all keys are optional:
+//   ready_delay_ms=<n>       Wait before creating the socket. Default 200.
+//   stop_delay_ms=<n>        Wait before exiting on SIGTERM. Default 100.
+//   ignore_sigterm=<bool>    Ignore SIGTERM, so that the application has to send SIGKILL.
+//   exit_after_ms=<n>        Exit with exit_code after this time. Default 0, meaning never.
+//   exit_code=<n>            Exit code used by exit_after_ms and SIGUSR1. Default 1.
+//   log_lines_per_sec=<n>    Write log lines like dockerd does at this rate. Default 0.
+//   log_level=<level>        Level of those log lines. Default info.
+// SIGUSR1 makes it exit immediately with exit_code, like a crash. SIGHUP is logged as a
+// configuration reload.
+#include "host_control.h"
+#include <errno.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CONFIG_GROUP    "fake_rootlesskit"
+#define LOG_INTERVAL_MS 10
+
+struct config {
+    gint ready_delay_ms;
+    gint stop_delay_ms;
+    gboolean ignore_sigterm;
+    gint exit_after_ms;
+    gint exit_code;
+    gint log_lines_per_sec;
+    char* log_level;
+};
+
+static struct config config = {
+    .ready_delay_ms = 200,
+    .stop_delay_ms = 100,
+    .exit_code = 1,
+    .log_level = "info",
+};
+static char* socket_path = NULL;
+static char* pid_path = NULL;
+static GMainLoop* loop = NULL;
+static guint64 log_line_count = 0;
+
+static void log_line(const char* level, const char* format, ...) G_GNUC_PRINTF(2, 3);
+static void log_line(const char* level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    g_autofree char* msg = g_strdup_vprintf(format, args);
+    va_end(args);
+    g_autoptr(GDateTime) now = g_date_time_new_now_utc();
+    g_autofree char* time = g_date_time_format_iso8601(now);
+    fprintf(stderr, "time=\"%s\" level=%s msg=\"%s\"\n", time, level, msg);
+}
+
+static int read_int(GKeyFile* key_file, const char* key, int default_value) {
+    GError* error = NULL;
+    const int value = g_key_file_get_integer(key_file, CONFIG_GROUP, key, &error);
+    if (error) {
+        g_error_free(error);
+        return default_value;
+    }
+    return value;
+}
+
+static void read_config(void) {
+    g_autofree char* path = host_state_path("fake_rootlesskit.ini");
+    GKeyFile* key_file = g_key_file_new();
+    if (g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL)) {
+        config.ready_delay_ms = read_int(key_file, "ready_delay_ms", config.ready_delay_ms);
+        config.stop_delay_ms = read_int(key_file, "stop_delay_ms", config.stop_delay_ms);
+        config.ignore_sigterm =
+            g_key_file_get_boolean(key_file, CONFIG_GROUP, "ignore_sigterm", NULL);
+        config.exit_after_ms = read_int(key_file, "exit_after_ms", config.exit_after_ms);
+        config.exit_code = read_int(key_file, "exit_code", config.exit_code);
+        config.log_lines_per_sec =
+            read_int(key_file, "log_lines_per_sec", config.log_lines_per_sec);
+        char* log_level = g_key_file_get_string(key_file, CONFIG_GROUP, "log_level", NULL);
+        if (log_level)
+            config.log_level = log_level;
+    }
+    g_key_file_free(key_file);
+}
+
+static void parse_command_line(int argc, char** argv) {
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-H") == 0 && g_str_has_prefix(argv[i + 1], "unix://"))
+            socket_path = g_strdup(argv[i + 1] + strlen("unix://"));
+        else if (strcmp(argv[i], "--data-root") == 0)
+            g_mkdir_with_parents(argv[i + 1], 0755);
+    }
+}
+
+static void remove_files(void) {
+    if (socket_path)
+        unlink(socket_path);
+    unlink(pid_path);
+}
+
+static gboolean answer_request(gint fd, GIOCondition, gpointer) {
+    char request[1024];
+    const ssize_t len = read(fd, request, sizeof(request) - 1);
+    if (len > 0) {
+        request[len] = '\0';
+        const char* response =
+            g_str_has_prefix(request, "GET /_ping ")
+                ? "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK"
+                : "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        if (write(fd, response, strlen(response)) < 0)
+            log_line("warning", "Failed to answer request: %s", strerror(errno));
+    }
+    close(fd);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean accept_connection(gint listen_fd, GIOCondition, gpointer) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0)
+        g_unix_fd_add(fd, G_IO_IN | G_IO_HUP, answer_request, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean become_ready(gpointer) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    g_strlcpy(address.sun_path, socket_path, sizeof(address.sun_path));
+    unlink(socket_path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(fd, 16) != 0) {
+        log_line("fatal", "Failed to listen on %s: %s", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_unix_fd_add(fd, G_IO_IN, accept_connection, NULL);
+    log_line("info", "API listen on %s", socket_path);
+    return G_SOURCE_REMOVE;
+}
+
+// Called every LOG_INTERVAL_MS, to reach rates above one line per millisecond.
+static gboolean write_log_lines(gpointer) {
+    static gint64 due = 0;  // In thousandths of a line
+    due += (gint64)config.log_lines_per_sec * LOG_INTERVAL_MS;
+    for (; due >= 1000; due -= 1000)
+        log_line(config.log_level, "Fake log line %" G_GUINT64_FORMAT, ++log_line_count);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean exit_with_code(gpointer) {
+    log_line("fatal", "Exiting with code %d", config.exit_code);
+    remove_files();
+    exit(config.exit_code);
+}
+
+static gboolean stop(gpointer) {
+    log_line("info", "Daemon shutdown complete");
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean handle_sigterm(gpointer) {
+    if (config.ignore_sigterm) {
+        log_line("warning", "Ignoring SIGTERM");
+        return G_SOURCE_CONTINUE;
+    }
+    log_line("info", "Processing signal 'terminated'");
+    g_timeout_add(config.stop_delay_ms, stop, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean handle_sighup(gpointer) {
+    log_line("info", "Got signal to reload configuration");
+    return G_SOURCE_CONTINUE;
+}
+
+int main(int argc, char** argv) {
+    read_config();
+    parse_command_line(argc, argv);
+    const char* xdg_runtime_dir = g_getenv("XDG_RUNTIME_DIR");
+    pid_path = g_build_filename(xdg_runtime_dir ? xdg_runtime_dir : "/tmp", "docker.pid", NULL);
+    g_autofree char* pid = g_strdup_printf("%d", getpid());
+    g_file_set_contents(pid_path, pid, -1, NULL);
+
+    loop = g_main_loop_new(NULL, FALSE);
+    g_unix_signal_add(SIGTERM, handle_sigterm, NULL);
+    g_unix_signal_add(SIGHUP, handle_sighup, NULL);
+    g_unix_signal_add(SIGUSR1, exit_with_code, NULL);
+    if (socket_path)
+        g_timeout_add(config.ready_delay_ms, become_ready, NULL);
+    if (config.exit_after_ms > 0)
+        g_timeout_add(config.exit_after_ms, exit_with_code, NULL);
+    if (config.log_lines_per_sec > 0)
+        g_timeout_add(LOG_INTERVAL_MS, write_log_lines, NULL);
+
+    log_line("info", "Starting up");
+    g_main_loop_run(loop);
+
+    remove_files();
+    return EXIT_SUCCESS;
+}
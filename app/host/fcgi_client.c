@@ -0,0 +1,123 @@
+#include "fcgi_client.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define FCGI_VERSION_1        1
+#define FCGI_BEGIN_REQUEST    1
+#define FCGI_END_REQUEST      3
+#define FCGI_PARAMS           4
+#define FCGI_STDIN            5
+#define FCGI_STDOUT           6
+#define FCGI_RESPONDER        1
+#define FCGI_MAX_CONTENT      65535
+#define FCGI_HEADER_LEN       8
+#define REQUEST_ID            1
+
+static bool write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        const ssize_t written = write(fd, p, len);
+        if (written < 0)
+            return false;
+        p += written;
+        len -= written;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t len) {
+    char* p = data;
+    while (len > 0) {
+        const ssize_t got = read(fd, p, len);
+        if (got <= 0)
+            return false;
+        p += got;
+        len -= got;
+    }
+    return true;
+}
+
+static bool write_record(int fd, int type, const void* content, size_t len) {
+    const unsigned char header[FCGI_HEADER_LEN] =
+        {FCGI_VERSION_1, type, 0, REQUEST_ID, (len >> 8) & 0xff, len & 0xff, 0, 0};
+    return write_all(fd, header, sizeof(header)) && write_all(fd, content, len);
+}
+
+static bool write_stream(int fd, int type, const char* data, size_t len) {
+    while (len > 0) {
+        const size_t chunk = MIN(len, FCGI_MAX_CONTENT);
+        if (!write_record(fd, type, data, chunk))
+            return false;
+        data += chunk;
+        len -= chunk;
+    }
+    return write_record(fd, type, NULL, 0);  // An empty record ends the stream.
+}
+
+static void append_length(GString* out, size_t len) {
+    if (len < 128) {
+        g_string_append_c(out, len);
+    } else {
+        g_string_append_c(out, ((len >> 24) & 0x7f) | 0x80);
+        g_string_append_c(out, (len >> 16) & 0xff);
+        g_string_append_c(out, (len >> 8) & 0xff);
+        g_string_append_c(out, len & 0xff);
+    }
+}
+
+static GString* encode_params(const char* const* params) {
+    GString* out = g_string_new(NULL);
+    for (; params[0] && params[1]; params += 2) {
+        append_length(out, strlen(params[0]));
+        append_length(out, strlen(params[1]));
+        g_string_append(out, params[0]);
+        g_string_append(out, params[1]);
+    }
+    return out;
+}
+
+static bool read_response(int fd, GString* response) {
+    while (true) {
+        unsigned char header[FCGI_HEADER_LEN];
+        if (!read_all(fd, header, sizeof(header)))
+            return false;
+        const size_t len = (header[4] << 8) | header[5];
+        char content[FCGI_MAX_CONTENT + 255];
+        if (!read_all(fd, content, len + header[6]))
+            return false;
+        if (header[1] == FCGI_STDOUT)
+            g_string_append_len(response, content, len);
+        else if (header[1] == FCGI_END_REQUEST)
+            return true;
+    }
+}
+
+bool fcgi_client_request(const char* socket_path,
+                         const char* const* params,
+                         const char* body,
+                         size_t body_len,
+                         GString* response) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    g_strlcpy(address.sun_path, socket_path, sizeof(address.sun_path));
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    const unsigned char begin_request[8] = {0, FCGI_RESPONDER, 0, 0, 0, 0, 0, 0};
+    GString* encoded_params = encode_params(params);
+    const bool success = write_record(fd, FCGI_BEGIN_REQUEST, begin_request, 8) &&
+                         write_stream(fd, FCGI_PARAMS, encoded_params->str, encoded_params->len) &&
+                         write_stream(fd, FCGI_STDIN, body, body_len) &&
+                         read_response(fd, response);
+    g_string_free(encoded_params, TRUE);
+    close(fd);
+    return success;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// Minimal FastCGI responder client, enough to drive the application's HTTP handlers without a
+// web server in front. params is a NULL-terminated list of alternating names and values.
+// The CGI-style response (headers and body) is appended to response.
+// Return false if the request could not be sent or the response could not be read.
+bool fcgi_client_request(const char* socket_path,
+                         const char* const* params,
+                         const char* body,
+                         size_t body_len,
+                         GString* response);
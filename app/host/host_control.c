@@ -0,0 +1,72 @@
+#include "host_control.h"
+#include <errno.h>
+#include <glib-unix.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct command {
+    char* name;
+    host_control_handler handler;
+    void* user_data;
+};
+
+static GList* commands = NULL;
+static int control_socket = -1;
+
+char* host_state_path(const char* filename) {
+    const char* state_dir = g_getenv("HOST_STATE_DIR");
+    return g_build_filename(state_dir ? state_dir : "/tmp/dockerdwrapper-host", filename, NULL);
+}
+
+static gboolean read_command(gint fd,
+                             __attribute__((unused)) GIOCondition condition,
+                             __attribute__((unused)) gpointer user_data) {
+    char buffer[1024];
+    const ssize_t len = recv(fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0)
+        return G_SOURCE_CONTINUE;
+    buffer[len] = '\0';
+    g_strchomp(buffer);
+
+    char* arguments = strchr(buffer, ' ');
+    if (arguments)
+        *arguments++ = '\0';
+    for (GList* node = commands; node; node = node->next) {
+        struct command* command = node->data;
+        if (strcmp(command->name, buffer) == 0) {
+            command->handler(arguments ? arguments : "", command->user_data);
+            return G_SOURCE_CONTINUE;
+        }
+    }
+    fprintf(stderr, "host_control: unknown command '%s'\n", buffer);
+    return G_SOURCE_CONTINUE;
+}
+
+static void open_control_socket(void) {
+    g_autofree char* path = host_state_path("control.sock");
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+
+    unlink(path);
+    control_socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (control_socket < 0 ||
+        bind(control_socket, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "host_control: cannot bind %s: %s\n", path, strerror(errno));
+        return;
+    }
+    g_unix_fd_add(control_socket, G_IO_IN, read_command, NULL);
+}
+
+void host_control_register(const char* name, host_control_handler handler, void* user_data) {
+    if (control_socket < 0)
+        open_control_socket();
+
+    struct command* command = g_malloc0(sizeof(struct command));
+    command->name = g_strdup(name);
+    command->handler = handler;
+    command->user_data = user_data;
+    commands = g_list_append(commands, command);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <glib.h>
+
+// Shared state of the host stand-ins for the ACAP SDK APIs.
+//
+// Everything lives in the directory named by the HOST_STATE_DIR environment variable:
+//   parameters.ini  Current parameter values, in the [<app name>] group.
+//   parameters.log  One "<CLOCK_MONOTONIC us> <name> <value>" line per parameter write.
+//   control.sock    Unix datagram socket accepting one command per datagram:
+//                     param <name> <value>   Change a parameter and run its callback.
+//                     sd insert <path>       Make SD_DISK available with its area at <path>.
+//                     sd eject               Make SD_DISK unavailable.
+
+typedef void (*host_control_handler)(const char* arguments, void* user_data);
+
+// Call handler, from the default main context, for each command starting with the given word.
+void host_control_register(const char* command, host_control_handler handler, void* user_data);
+
+// Return the path of a file in HOST_STATE_DIR. Free with g_free().
+char* host_state_path(const char* filename);
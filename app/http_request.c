@@ -1,34 +1,61 @@
+#define LOG_MODULE log_module_fcgi
 #include "http_request.h"
-#include "app_paths.h"
+#include "container_start.h"
 #include "fcgi_write_file_from_stream.h"
+#include "image_pull.h"
+#include "json.h"
+#include "localdata_index.h"
 #include "log.h"
+#include "log_store.h"
+#include "managed_file.h"
+#include "on_demand.h"
+#include "param_io.h"
+#include "process_record.h"
+#include "registry_cache.h"
 #include "tls.h"
+#include "tls_client_auth.h"
+#include "tls_generate.h"
+#include "tls_proxy.h"
+#include "trace.h"
 #include <gio/gio.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #define HTTP_200_OK                    "200 OK"
+#define HTTP_202_ACCEPTED              "202 Accepted"
 #define HTTP_204_NO_CONTENT            "204 No Content"
 #define HTTP_400_BAD_REQUEST           "400 Bad Request"
 #define HTTP_404_NOT_FOUND             "404 Not Found"
 #define HTTP_405_METHOD_NOT_ALLOWED    "405 Method Not Allowed"
+#define HTTP_409_CONFLICT              "409 Conflict"
+#define HTTP_413_CONTENT_TOO_LARGE     "413 Content Too Large"
 #define HTTP_422_UNPROCESSABLE_CONTENT "422 Unprocessable Content"
 #define HTTP_500_INTERNAL_SERVER_ERROR "500 Internal Server Error"
 
-static char* localdata_full_path(const char* filename) {
-    return g_strdup_printf("%s/%s", APP_LOCALDATA, filename);
-}
+// Room for the multipart boundaries and part headers around an uploaded file, so that an upload
+// that is too large can be refused before it is written to /tmp.
+#define MULTIPART_OVERHEAD_MAX 4096
+
+// How long after POST detach a stop of the application leaves dockerd running
+#define DETACH_TIMEOUT_SEC (10 * 60)
 
-static bool copy_to_localdata(const char* source_path, const char* destination_filename) {
-    g_autofree char* full_path = localdata_full_path(destination_filename);
-    log_debug("Copying %s to %s.", source_path, full_path);
+static bool install_file(const char* source_path, const char* destination_path) {
+    log_debug("Copying %s to %s.", source_path, destination_path);
+
+    // Not every managed file is in localdata, which always exists.
+    g_autofree char* directory = g_path_get_dirname(destination_path);
+    if (g_mkdir_with_parents(directory, 0700) != 0) {
+        log_error("Failed to create %s: %s.", directory, strerror(errno));
+        return false;
+    }
 
     GFile* source = g_file_new_for_path(source_path);
-    GFile* destination = g_file_new_for_path(full_path);
+    GFile* destination = g_file_new_for_path(destination_path);
     GError* error = NULL;
     bool success =
         g_file_copy(source, destination, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error);
     if (!success)
-        log_error("Failed to copy %s to %s: %s.", source_path, full_path, error->message);
+        log_error("Failed to copy %s to %s: %s.", source_path, destination_path, error->message);
     g_object_unref(source);
     g_object_unref(destination);
     g_clear_error(&error);
@@ -36,22 +63,6 @@ static bool copy_to_localdata(const char* source_path, const char* destination_f
     return success;
 }
 
-static bool exists_in_localdata(const char* filename) {
-    g_autofree char* full_path = localdata_full_path(filename);
-    struct stat sb;
-    return stat(full_path, &sb) == 0;
-}
-
-static bool remove_from_localdata(const char* filename) {
-    g_autofree char* full_path = localdata_full_path(filename);
-    log_debug("Removing %s.", full_path);
-    bool success = !unlink(full_path);
-    if (!success)
-        // Log as warning rather than error, since 'No such file' is also treated as a failure.
-        log_warning("Failed to remove %s: %s.", filename, strerror(errno));
-    return success;
-}
-
 static void
 response(FCGX_Request* request, const char* status, const char* content_type, const char* body) {
     FCGX_FPrintF(request->out,
@@ -63,6 +74,11 @@ response(FCGX_Request* request, const char* status, const char* content_type, co
                  body);
 }
 
+static void response_json(FCGX_Request* request, const char* body) {
+    log_debug("Send response %s with %zu bytes of JSON", HTTP_200_OK, strlen(body));
+    response(request, HTTP_200_OK, "application/json", body);
+}
+
 static void response_204_no_content(FCGX_Request* request) {
     const char* status = HTTP_204_NO_CONTENT;
     log_debug("Send response %s", status);
@@ -75,38 +91,649 @@ static void response_msg(FCGX_Request* request, const char* status, const char*
     response(request, status, "text/plain", body);
 }
 
-static void post_request(FCGX_Request* request,
-                         const char* filename,
-                         struct restart_dockerd_context* restart_dockerd_context) {
+static gint64 file_size(const char* path) {
+    struct stat sb;
+    return stat(path, &sb) == 0 ? sb.st_size : -1;
+}
+
+static void response_too_large(FCGX_Request* request, const struct managed_file* file) {
+    g_autofree char* msg = g_strdup_printf("The %s must not be larger than %" G_GSIZE_FORMAT
+                                           " bytes.",
+                                           file->description,
+                                           file->max_size);
+    response_msg(request, HTTP_413_CONTENT_TOO_LARGE, msg);
+}
+
+// Files in localdata are reported to the supervisor by the localdata index, which makes the
+// cheapest change that puts them to use.
+static void post_request(FCGX_Request* request, const struct managed_file* file) {
+    const char* content_length = FCGX_GetParam("CONTENT_LENGTH", request->envp);
+    if (content_length &&
+        g_ascii_strtoull(content_length, NULL, 10) > file->max_size + MULTIPART_OVERHEAD_MAX) {
+        response_too_large(request, file);
+        return;
+    }
     g_autofree char* temp_file = fcgi_write_file_from_stream(*request);
     if (!temp_file) {
         response_msg(request, HTTP_422_UNPROCESSABLE_CONTENT, "Upload to temporary file failed.");
         return;
     }
-    if (!tls_file_has_correct_format(filename, temp_file)) {
-        g_autofree char* msg =
-            g_strdup_printf("File is not a valid %s.", tls_file_description(filename));
+    const bool too_large = file_size(temp_file) > (gint64)file->max_size;
+    char reason[256];
+    const enum file_validation validation =
+        too_large ? file_validation_invalid
+                  : file->validate(file->name, temp_file, reason, sizeof(reason));
+    if (too_large) {
+        response_too_large(request, file);
+    } else if (validation == file_validation_invalid) {
+        g_autofree char* msg = g_strdup_printf("File is not valid: %s.", reason);
         response_msg(request, HTTP_400_BAD_REQUEST, msg);
-    } else if (!copy_to_localdata(temp_file, filename))
-        response_msg(request, HTTP_500_INTERNAL_SERVER_ERROR, "Failed to copy file to localdata");
-    else {
+    } else if (!install_file(temp_file, file->path)) {
+        response_msg(request, HTTP_500_INTERNAL_SERVER_ERROR, "Failed to install the file");
+    } else if (validation == file_validation_inconsistent) {
+        // Probably the first half of replacing a key pair, or a CA and its CRL. The files are used
+        // once the other half has been uploaded.
+        localdata_index_refresh(file->name);
+        g_autofree char* msg =
+            g_strdup_printf("File was stored, but is not used yet since the %s.", reason);
+        response_msg(request, HTTP_202_ACCEPTED, msg);
+    } else {
+        localdata_index_refresh(file->name);
         response_204_no_content(request);
-        restart_dockerd_context->restart_dockerd(restart_dockerd_context->app_state);
     }
 
     if (unlink(temp_file) != 0)
         log_error("Failed to remove %s: %s", temp_file, strerror(errno));
 }
 
-static void delete_request(FCGX_Request* request, const char* filename) {
-    if (!exists_in_localdata(filename))
-        response_msg(request, HTTP_404_NOT_FOUND, "File not found in localdata");
-    else if (!remove_from_localdata(filename))
+static void delete_request(FCGX_Request* request, const struct managed_file* file) {
+    log_debug("Removing %s.", file->path);
+    if (unlink(file->path) != 0) {
+        const int error = errno;
+        // Log as warning rather than error, since 'No such file' is also treated as a failure.
+        log_warning("Failed to remove %s: %s.", file->name, strerror(error));
+        if (error == ENOENT)
+            response_msg(request, HTTP_404_NOT_FOUND, "File not found");
+        else
+            response_msg(request, HTTP_500_INTERNAL_SERVER_ERROR, "Failed to remove the file");
+        return;
+    }
+    localdata_index_refresh(file->name);
+    response_204_no_content(request);
+}
+
+// Return the value of an unsigned integer query parameter, or default_value if it is missing.
+static guint64
+query_parameter(const char* query_string, const char* name, guint64 default_value) {
+    const size_t name_len = strlen(name);
+    for (const char* p = query_string; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL)
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=')
+            return g_ascii_strtoull(p + name_len + 1, NULL, 10);
+    return default_value;
+}
+
+// Return the unescaped value of a query parameter, which must be freed with g_free(), or NULL if
+// it is missing.
+static char* query_string_parameter(const char* query_string, const char* name) {
+    const size_t name_len = strlen(name);
+    for (const char* p = query_string; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL)
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            g_autofree char* value = g_strndup(p + name_len + 1, strcspn(p + name_len + 1, "&"));
+            return g_uri_unescape_string(value, NULL);
+        }
+    return NULL;
+}
+
+struct logs_response {
+    GString* json;
+    guint64 last_sequence;
+};
+
+static void append_log_line(const struct log_store_line* line, void* logs_response_void_ptr) {
+    struct logs_response* logs_response = logs_response_void_ptr;
+    GString* json = logs_response->json;
+    if (logs_response->last_sequence)
+        g_string_append_c(json, ',');
+    g_string_append_printf(json,
+                           "{\"seq\":%" G_GUINT64_FORMAT ",\"time\":%" G_GINT64_FORMAT
+                           ",\"level\":\"%s\",\"module\":\"%s\",\"message\":",
+                           line->sequence,
+                           line->timestamp,
+                           log_level_to_string(line->level),
+                           log_module_name(line->module));
+    json_append_string(json, line->message);
+    g_string_append_c(json, '}');
+    logs_response->last_sequence = line->sequence;
+}
+
+// GET logs?epoch=<epoch>&after=<seq>&limit=<n> returns at most n lines with a sequence number
+// greater than seq. The 'next' member is the value to pass as 'after' in the next request, and
+// 'first' is the oldest line still available. The 'epoch' member changes when the application
+// restarts, and an epoch from an earlier process makes the lines be returned from the start.
+static void logs_request(FCGX_Request* request) {
+    const char* query_string = FCGX_GetParam("QUERY_STRING", request->envp);
+    const guint64 epoch = query_parameter(query_string, "epoch", 0);
+    const guint64 after = query_parameter(query_string, "after", 0);
+    const guint limit = MIN(query_parameter(query_string, "limit", 100), 1000);
+
+    struct logs_response logs_response = {g_string_new("{\"lines\":["), 0};
+    guint64 next;
+    const guint64 first =
+        log_store_read(epoch, after, limit, append_log_line, &logs_response, &next);
+    g_string_append_printf(logs_response.json,
+                           "],\"epoch\":%" G_GUINT64_FORMAT ",\"first\":%" G_GUINT64_FORMAT
+                           ",\"next\":%" G_GUINT64_FORMAT "}",
+                           log_store_epoch(),
+                           first,
+                           next);
+
+    g_autofree char* body = g_string_free(logs_response.json, FALSE);
+    response_json(request, body);
+}
+
+// GET trace?limit=<n> returns the last n spans in the Chrome trace event format.
+static void trace_request(FCGX_Request* request) {
+    const char* query_string = FCGX_GetParam("QUERY_STRING", request->envp);
+    g_autofree char* body = trace_to_json(query_parameter(query_string, "limit", G_MAXUINT));
+    response_json(request, body);
+}
+
+static void append_json_time(GString* json, gint64 time) {
+    char text[32];
+    const time_t seconds = time;
+    struct tm tm;
+    strftime(text, sizeof(text), "\"%Y-%m-%dT%H:%M:%SZ\"", gmtime_r(&seconds, &tm));
+    g_string_append(json, text);
+}
+
+static void append_tls_file_info(GString* json, const struct tls_file_info* info, gint64 now) {
+    g_string_append(json, "{\"file\":");
+    json_append_string(json, info->filename);
+    g_string_append_printf(json,
+                           ",\"present\":%s,\"valid\":%s",
+                           info->present ? "true" : "false",
+                           info->valid ? "true" : "false");
+    if (info->present && !info->valid) {
+        g_string_append(json, ",\"error\":");
+        json_append_string(json, info->error);
+    }
+    if (*info->public_key) {
+        g_string_append(json, ",\"public_key\":");
+        json_append_string(json, info->public_key);
+    }
+    // Also for certificates that have expired or are not yet valid
+    if (*info->sha256) {
+        g_string_append(json, ",\"subject\":");
+        json_append_string(json, info->subject);
+        g_string_append(json, ",\"issuer\":");
+        json_append_string(json, info->issuer);
+        g_string_append(json, ",\"not_before\":");
+        append_json_time(json, info->not_before);
+        g_string_append(json, ",\"not_after\":");
+        append_json_time(json, info->not_after);
+        g_string_append_printf(
+            json, ",\"days_to_expiry\":%" G_GINT64_FORMAT, tls_days_to_expiry(info, now));
+        g_string_append(json, ",\"sha256\":");
+        json_append_string(json, info->sha256);
+    }
+    g_string_append_c(json, '}');
+}
+
+// GET status returns what is known about the TLS files in localdata, as parsed when they were
+// last uploaded or removed, and the counters of the TLS proxy.
+static void status_request(FCGX_Request* request) {
+    struct tls_status tls_status;
+    tls_get_status(&tls_status);
+    const gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    GString* json = g_string_new("{\"tls\":{\"files\":[");
+    for (size_t i = 0; i < TLS_FILE_COUNT; i++) {
+        if (i)
+            g_string_append_c(json, ',');
+        append_tls_file_info(json, &tls_status.files[i], now);
+    }
+    g_string_append_printf(json,
+                           "],\"key_matches_cert\":%s,\"cert_chains_to_ca\":%s}",
+                           tls_status.key_matches_cert ? "true" : "false",
+                           tls_status.cert_chains_to_ca ? "true" : "false");
+
+    struct tls_proxy_stats proxy;
+    tls_proxy_get_stats(&proxy);
+    g_string_append_printf(json,
+                           ",\"tls_proxy\":{\"running\":%s,\"connections\":%u,"
+                           "\"handshakes\":%" G_GUINT64_FORMAT
+                           ",\"resumed_handshakes\":%" G_GUINT64_FORMAT
+                           ",\"failed_handshakes\":%" G_GUINT64_FORMAT
+                           ",\"rejected_connections\":%" G_GUINT64_FORMAT "}}",
+                           proxy.running ? "true" : "false",
+                           proxy.connections,
+                           proxy.handshakes,
+                           proxy.resumed_handshakes,
+                           proxy.failed_handshakes,
+                           proxy.rejected_connections);
+
+    g_autofree char* body = g_string_free(json, FALSE);
+    response_json(request, body);
+}
+
+static void
+append_metric_help(GString* text, const char* name, const char* type, const char* help) {
+    g_string_append_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void append_registry_cache_metrics(GString* text, const struct registry_cache_stats* cache) {
+    append_metric_help(
+        text, "registry_cache_size_bytes", "gauge", "Size of the blobs in the registry cache.");
+    g_string_append_printf(
+        text, "registry_cache_size_bytes %" G_GUINT64_FORMAT "\n", cache->size_bytes);
+    append_metric_help(text,
+                       "registry_cache_max_size_bytes",
+                       "gauge",
+                       "Size above which the least recently used blobs are evicted.");
+    g_string_append_printf(
+        text, "registry_cache_max_size_bytes %" G_GUINT64_FORMAT "\n", cache->max_size_bytes);
+    append_metric_help(
+        text, "registry_cache_evicted_blobs_total", "counter", "Blobs evicted from the cache.");
+    g_string_append_printf(
+        text, "registry_cache_evicted_blobs_total %" G_GUINT64_FORMAT "\n", cache->evicted_blobs);
+    append_metric_help(text,
+                       "registry_cache_evicted_bytes_total",
+                       "counter",
+                       "Size of the blobs evicted from the cache.");
+    g_string_append_printf(
+        text, "registry_cache_evicted_bytes_total %" G_GUINT64_FORMAT "\n", cache->evicted_bytes);
+    if (!cache->have_requests)
+        return;
+
+    const struct {
+        const char* kind;
+        const struct registry_cache_requests* requests;
+    } kinds[] = {{"blob", &cache->blobs}, {"manifest", &cache->manifests}};
+    const struct {
+        const char* name;
+        size_t offset;
+        const char* help;
+    } counters[] = {
+        {"registry_cache_requests_total",
+         G_STRUCT_OFFSET(struct registry_cache_requests, requests),
+         "Requests to the registry cache, since its container was started."},
+        {"registry_cache_hits_total",
+         G_STRUCT_OFFSET(struct registry_cache_requests, hits),
+         "Requests served from the cache."},
+        {"registry_cache_misses_total",
+         G_STRUCT_OFFSET(struct registry_cache_requests, misses),
+         "Requests that were fetched from Docker Hub."},
+        {"registry_cache_pulled_bytes_total",
+         G_STRUCT_OFFSET(struct registry_cache_requests, bytes_pulled),
+         "Bytes fetched from Docker Hub."},
+    };
+    for (size_t i = 0; i < G_N_ELEMENTS(counters); i++) {
+        append_metric_help(text, counters[i].name, "counter", counters[i].help);
+        for (size_t k = 0; k < G_N_ELEMENTS(kinds); k++)
+            g_string_append_printf(text,
+                                   "%s{kind=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                   counters[i].name,
+                                   kinds[k].kind,
+                                   G_STRUCT_MEMBER(guint64, kinds[k].requests, counters[i].offset));
+    }
+    append_metric_help(text,
+                       "registry_cache_hit_ratio",
+                       "gauge",
+                       "Hits divided by requests, since the cache container was started.");
+    for (size_t k = 0; k < G_N_ELEMENTS(kinds); k++)
+        if (kinds[k].requests->requests)
+            g_string_append_printf(text,
+                                   "registry_cache_hit_ratio{kind=\"%s\"} %.3f\n",
+                                   kinds[k].kind,
+                                   (double)kinds[k].requests->hits / kinds[k].requests->requests);
+}
+
+static void append_param_io_metrics(GString* text) {
+    struct param_io_stats stats;
+    param_io_get_stats(&stats);
+    static const char* const op_names[PARAM_IO_OP_COUNT] = {
+        [param_io_get_op] = "get",
+        [param_io_set_op] = "set",
+    };
+
+    append_metric_help(text,
+                       "param_io_latency_seconds",
+                       "histogram",
+                       "Time from an AXParameter call being queued until it completed.");
+    for (int op = 0; op < PARAM_IO_OP_COUNT; op++) {
+        const struct param_io_latency* latency = &stats.ops[op];
+        for (int i = 0; i < PARAM_IO_BUCKET_COUNT; i++)
+            g_string_append_printf(text,
+                                   "param_io_latency_seconds_bucket{op=\"%s\",le=\"%g\"} "
+                                   "%" G_GUINT64_FORMAT "\n",
+                                   op_names[op],
+                                   param_io_bucket_ms[i] / 1000.0,
+                                   latency->buckets[i]);
+        g_string_append_printf(text,
+                               "param_io_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} "
+                               "%" G_GUINT64_FORMAT "\n"
+                               "param_io_latency_seconds_sum{op=\"%s\"} %.6f\n"
+                               "param_io_latency_seconds_count{op=\"%s\"} %" G_GUINT64_FORMAT
+                               "\n",
+                               op_names[op],
+                               latency->count,
+                               op_names[op],
+                               latency->sum_us / 1e6,
+                               op_names[op],
+                               latency->count);
+    }
+    append_metric_help(text, "param_io_errors_total", "counter", "Failed AXParameter calls.");
+    for (int op = 0; op < PARAM_IO_OP_COUNT; op++)
+        g_string_append_printf(text,
+                               "param_io_errors_total{op=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                               op_names[op],
+                               stats.ops[op].errors);
+    append_metric_help(text,
+                       "param_io_timeouts_total",
+                       "counter",
+                       "Parameter reads that gave up waiting, and used the last known value.");
+    g_string_append_printf(text, "param_io_timeouts_total %" G_GUINT64_FORMAT "\n", stats.timeouts);
+    append_metric_help(text,
+                       "param_io_replaced_sets_total",
+                       "counter",
+                       "Queued parameter writes replaced by a later write of the same parameter.");
+    g_string_append_printf(
+        text, "param_io_replaced_sets_total %" G_GUINT64_FORMAT "\n", stats.replaced_sets);
+    append_metric_help(
+        text, "param_io_queued_calls", "gauge", "AXParameter calls queued or in progress.");
+    g_string_append_printf(text, "param_io_queued_calls %u\n", stats.queued);
+}
+
+// Container names are [a-zA-Z0-9][a-zA-Z0-9_.-]*, so they need no escaping as label values.
+static void append_container_start_metrics(GString* text) {
+    struct container_start_stats stats;
+    container_start_get_stats(&stats);
+
+    append_metric_help(text,
+                       "container_start_time_to_running_seconds",
+                       "gauge",
+                       "Time from dockerd being ready until a container with a start priority "
+                       "label was running, and healthy if it has a health check.");
+    for (guint i = 0; i < stats.count; i++)
+        if (stats.results[i].state == container_start_running)
+            g_string_append_printf(text,
+                                   "container_start_time_to_running_seconds{container=\"%s\","
+                                   "priority=\"%d\"} %.3f\n",
+                                   stats.results[i].name,
+                                   stats.results[i].priority,
+                                   stats.results[i].time_to_running_ms / 1000.0);
+
+    guint counts[CONTAINER_START_STATE_COUNT] = {0};
+    for (guint i = 0; i < stats.count; i++)
+        counts[stats.results[i].state]++;
+    append_metric_help(text,
+                       "container_start_containers",
+                       "gauge",
+                       "Containers with a start priority label, by how far they got since dockerd "
+                       "was started.");
+    for (int state = 0; state < CONTAINER_START_STATE_COUNT; state++)
+        g_string_append_printf(text,
+                               "container_start_containers{state=\"%s\"} %u\n",
+                               container_start_state_names[state],
+                               counts[state]);
+}
+
+static void append_on_demand_metrics(GString* text, const struct on_demand_stats* stats) {
+    append_metric_help(text,
+                       "on_demand_connections",
+                       "gauge",
+                       "Open connections to dockerd, including those waiting for it to start.");
+    g_string_append_printf(text, "on_demand_connections %u\n", stats->connections);
+    append_metric_help(text,
+                       "on_demand_first_connection_latency_seconds",
+                       "summary",
+                       "Time from a connection arriving while dockerd was stopped, until dockerd "
+                       "was ready.");
+    g_string_append_printf(text,
+                           "on_demand_first_connection_latency_seconds_sum %.3f\n"
+                           "on_demand_first_connection_latency_seconds_count %" G_GUINT64_FORMAT
+                           "\n",
+                           stats->activation_ms_total / 1000.0,
+                           stats->activations);
+    if (stats->last_activation_ms >= 0) {
+        append_metric_help(text,
+                           "on_demand_last_first_connection_latency_seconds",
+                           "gauge",
+                           "The latest time from a connection arriving while dockerd was stopped, "
+                           "until dockerd was ready.");
+        g_string_append_printf(text,
+                               "on_demand_last_first_connection_latency_seconds %.3f\n",
+                               stats->last_activation_ms / 1000.0);
+    }
+    append_metric_help(text,
+                       "on_demand_idle_stopped_seconds_total",
+                       "counter",
+                       "Time that dockerd has been stopped, waiting for a connection.");
+    g_string_append_printf(text,
+                           "on_demand_idle_stopped_seconds_total %.3f\n",
+                           stats->stopped_ms_total / 1000.0);
+    append_metric_help(
+        text, "on_demand_idle_stops_total", "counter", "Stops of dockerd for being idle.");
+    g_string_append_printf(
+        text, "on_demand_idle_stops_total %" G_GUINT64_FORMAT "\n", stats->idle_stops);
+}
+
+// GET metrics returns the expiry of the certificates in localdata and of the CRL in use, the
+// counters of the TLS proxy, the latency of the parameter calls, the start of the containers with
+// a start priority, the counters of the registry cache if it is hosted, and the start and stop of
+// dockerd if it is started on demand, in the Prometheus text format.
+static void metrics_request(FCGX_Request* request) {
+    struct tls_status tls_status;
+    tls_get_status(&tls_status);
+    struct tls_proxy_stats proxy;
+    tls_proxy_get_stats(&proxy);
+    const gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    GString* text = g_string_new(NULL);
+    append_metric_help(text,
+                       "tls_cert_days_to_expiry",
+                       "gauge",
+                       "Whole days until the certificate in localdata expires, negative once "
+                       "expired.");
+    for (size_t i = 0; i < TLS_FILE_COUNT; i++)
+        if (tls_status.files[i].not_after)
+            g_string_append_printf(text,
+                                   "tls_cert_days_to_expiry{file=\"%s\"} %" G_GINT64_FORMAT "\n",
+                                   tls_status.files[i].filename,
+                                   tls_days_to_expiry(&tls_status.files[i], now));
+    append_metric_help(text,
+                       "tls_cert_not_after_seconds",
+                       "gauge",
+                       "Expiry time of the certificate in localdata, in seconds since the epoch.");
+    for (size_t i = 0; i < TLS_FILE_COUNT; i++)
+        if (tls_status.files[i].not_after)
+            g_string_append_printf(text,
+                                   "tls_cert_not_after_seconds{file=\"%s\"} %" G_GINT64_FORMAT
+                                   "\n",
+                                   tls_status.files[i].filename,
+                                   tls_status.files[i].not_after);
+
+    const gint64 crl_next_update = proxy.running ? tls_client_auth_crl_next_update() : 0;
+    append_metric_help(text,
+                       "tls_crl_next_update_seconds",
+                       "gauge",
+                       "Next update time of the CRL used by the TLS proxy, in seconds since the "
+                       "epoch. Every client certificate is rejected after it.");
+    if (crl_next_update)
+        g_string_append_printf(
+            text, "tls_crl_next_update_seconds %" G_GINT64_FORMAT "\n", crl_next_update);
+
+    append_metric_help(text, "tls_proxy_connections", "gauge", "Open TLS proxy connections.");
+    g_string_append_printf(text, "tls_proxy_connections %u\n", proxy.connections);
+    const struct {
+        const char* name;
+        guint64 value;
+        const char* help;
+    } counters[] = {
+        {"tls_proxy_handshakes_total", proxy.handshakes, "Completed TLS handshakes."},
+        {"tls_proxy_resumed_handshakes_total",
+         proxy.resumed_handshakes,
+         "Completed TLS handshakes that resumed a session."},
+        {"tls_proxy_failed_handshakes_total", proxy.failed_handshakes, "Failed TLS handshakes."},
+        {"tls_proxy_rejected_connections_total",
+         proxy.rejected_connections,
+         "Connections closed since too many were open."},
+    };
+    for (size_t i = 0; i < G_N_ELEMENTS(counters); i++) {
+        append_metric_help(text, counters[i].name, "counter", counters[i].help);
+        g_string_append_printf(
+            text, "%s %" G_GUINT64_FORMAT "\n", counters[i].name, counters[i].value);
+    }
+
+    append_param_io_metrics(text);
+    append_container_start_metrics(text);
+
+    struct registry_cache_stats cache;
+    registry_cache_get_stats(&cache);
+    if (cache.running)
+        append_registry_cache_metrics(text, &cache);
+
+    struct on_demand_stats on_demand;
+    on_demand_get_stats(&on_demand);
+    if (on_demand.running)
+        append_on_demand_metrics(text, &on_demand);
+
+    g_autofree char* body = g_string_free(text, FALSE);
+    log_debug("Send response %s with %zu bytes of metrics", HTTP_200_OK, strlen(body));
+    response(request, HTTP_200_OK, "text/plain; version=0.0.4", body);
+}
+
+// POST tls/generate creates the TLS files on the device, and returns the CA certificate for clients
+// to trust. An optional upload holds a CA key to sign with, and/or a client certificate request.
+static void generate_request(FCGX_Request* request) {
+    const char* content_length = FCGX_GetParam("CONTENT_LENGTH", request->envp);
+    g_autofree char* temp_file = NULL;
+    if (content_length && g_ascii_strtoull(content_length, NULL, 10) > 0 &&
+        !(temp_file = fcgi_write_file_from_stream(*request))) {
+        response_msg(request, HTTP_422_UNPROCESSABLE_CONTENT, "Upload to temporary file failed.");
+        return;
+    }
+
+    struct tls_generate_result result;
+    char reason[256];
+    const enum tls_generate_status status =
+        tls_generate(temp_file, &result, reason, sizeof(reason));
+    if (temp_file && unlink(temp_file) != 0)
+        log_error("Failed to remove %s: %s", temp_file, strerror(errno));
+
+    if (status != tls_generate_ok) {
+        g_autofree char* msg = g_strdup_printf("TLS files were not generated: %s.", reason);
         response_msg(request,
-                     HTTP_500_INTERNAL_SERVER_ERROR,
-                     "Failed to remove file from localdata");
-    else
+                     status == tls_generate_bad_upload ? HTTP_400_BAD_REQUEST
+                     : status == tls_generate_conflict ? HTTP_409_CONFLICT
+                                                       : HTTP_500_INTERNAL_SERVER_ERROR,
+                     msg);
+        return;
+    }
+
+    static const char* const ca_names[] = {
+        [tls_generate_ca_created] = "created",
+        [tls_generate_ca_device] = "device",
+        [tls_generate_ca_uploaded] = "uploaded",
+    };
+    GString* json = g_string_new("{\"ca\":");
+    json_append_string(json, ca_names[result.ca]);
+    g_string_append(json, ",\"ca_cert\":");
+    json_append_string(json, result.ca_cert_pem);
+    g_string_append(json, ",\"server_cert\":{\"subject\":");
+    json_append_string(json, result.subject);
+    g_string_append(json, ",\"sans\":[");
+    for (int i = 0; i < result.san_count; i++) {
+        if (i)
+            g_string_append_c(json, ',');
+        json_append_string(json, result.sans[i]);
+    }
+    g_string_append(json, "],\"not_after\":");
+    append_json_time(json, result.not_after);
+    g_string_append_c(json, '}');
+    if (result.client_cert_pem) {
+        g_string_append(json, ",\"client_cert\":");
+        json_append_string(json, result.client_cert_pem);
+    }
+    g_string_append_c(json, '}');
+    tls_generate_result_clear(&result);
+
+    g_autofree char* body = g_string_free(json, FALSE);
+    response_json(request, body);
+}
+
+// GET pulls returns the pull window and the state of each pull, with the progress of each layer.
+// POST pulls?image=<reference> queues a pull, and DELETE pulls?image=<reference> cancels one.
+static void pulls_request(FCGX_Request* request, const char* method) {
+    if (strcmp(method, "GET") == 0) {
+        g_autofree char* body = image_pull_status_json();
+        response_json(request, body);
+        return;
+    }
+
+    const char* query_string = FCGX_GetParam("QUERY_STRING", request->envp);
+    g_autofree char* image = query_string_parameter(query_string, "image");
+    if (strcmp(method, "DELETE") == 0) {
+        if (image_pull_cancel(image))
+            response_204_no_content(request);
+        else
+            response_msg(request, HTTP_404_NOT_FOUND, "The image is not being pulled.");
+        return;
+    }
+    switch (image_pull_request(image)) {
+        case image_pull_queued:
+            response_msg(request, HTTP_202_ACCEPTED, "The pull is queued.");
+            break;
+        case image_pull_already_queued:
+            response_msg(request, HTTP_409_CONFLICT, "The image is already being pulled.");
+            break;
+        case image_pull_too_many:
+            response_msg(request, HTTP_409_CONFLICT, "Too many pulls are queued.");
+            break;
+        case image_pull_invalid:
+            response_msg(request, HTTP_400_BAD_REQUEST, "The image is not a valid reference.");
+            break;
+    }
+}
+
+// POST detach leaves dockerd running if the application is stopped within DETACH_TIMEOUT_SEC, such
+// as for an upgrade, for the next instance to take over. DELETE detach cancels that.
+static void detach_request(FCGX_Request* request, const char* method) {
+    if (strcmp(method, "DELETE") == 0) {
+        process_record_keep_on_stop(0);
         response_204_no_content(request);
+        return;
+    }
+    process_record_keep_on_stop(DETACH_TIMEOUT_SEC);
+    g_autofree char* msg =
+        g_strdup_printf("dockerd is left running if the application is stopped within %d min.",
+                        DETACH_TIMEOUT_SEC / 60);
+    response_msg(request, HTTP_202_ACCEPTED, msg);
+}
+
+static void get_request(FCGX_Request* request, const char* name) {
+    if (strcmp(name, "logs") == 0)
+        logs_request(request);
+    else if (strcmp(name, "metrics") == 0)
+        metrics_request(request);
+    else if (strcmp(name, "pulls") == 0)
+        pulls_request(request, "GET");
+    else if (strcmp(name, "status") == 0)
+        status_request(request);
+    else if (strcmp(name, "trace") == 0)
+        trace_request(request);
+    else
+        response_msg(request, HTTP_404_NOT_FOUND, "Not found");
+}
+
+static void file_request(FCGX_Request* request, const char* method, const char* filename) {
+    const struct managed_file* file = managed_file_find(filename);
+    if (!file)
+        response_msg(request, HTTP_404_NOT_FOUND, "Not a file that can be uploaded");
+    else if (strcmp(method, "POST") == 0)
+        post_request(request, file);
+    else
+        delete_request(request, file);
 }
 
 static void unsupported_request(FCGX_Request* request, const char* method, const char* filename) {
@@ -119,22 +746,40 @@ static void malformed_request(FCGX_Request* request, const char* method, const c
     response_msg(request, HTTP_400_BAD_REQUEST, "Malformed request");
 }
 
-void http_request_callback(FCGX_Request* request, void* restart_dockerd_context_void_ptr) {
+void http_request_callback(FCGX_Request* request, void*) {
     const char* method = FCGX_GetParam("REQUEST_METHOD", request->envp);
     const char* uri = FCGX_GetParam("REQUEST_URI", request->envp);
 
-    log_info("Processing HTTP request %s %s", method, uri);
+    log_event_info(log_event_http_request,
+                   LOG_FIELDS(LOG_STR("method", method), LOG_STR("uri", uri)),
+                   "Processing HTTP request %s %s",
+                   method,
+                   uri);
+
+    char span_name[48];
+    g_snprintf(span_name, sizeof(span_name), "%s %s", method, uri);
+    TRACE_SCOPE(span_name);
 
-    const char* filename = strrchr(uri, '/');
-    if (!filename) {
+    // The query string may hold an image reference, with slashes of its own.
+    g_autofree char* uri_path = g_strndup(uri, strcspn(uri, "?"));
+    const char* last_segment = strrchr(uri_path, '/');
+    if (!last_segment) {
         malformed_request(request, method, uri);
     } else {
-        filename++;  // Strip leading '/'
+        const char* filename = last_segment + 1;  // Strip leading '/'
 
-        if (strcmp(method, "POST") == 0)
-            post_request(request, filename, restart_dockerd_context_void_ptr);
-        else if (strcmp(method, "DELETE") == 0)
-            delete_request(request, filename);
+        if (strcmp(method, "GET") == 0)
+            get_request(request, filename);
+        else if (strcmp(method, "POST") == 0 && g_str_has_suffix(uri_path, "/tls/generate"))
+            generate_request(request);
+        else if ((strcmp(method, "POST") == 0 || strcmp(method, "DELETE") == 0) &&
+                 strcmp(filename, "pulls") == 0)
+            pulls_request(request, method);
+        else if ((strcmp(method, "POST") == 0 || strcmp(method, "DELETE") == 0) &&
+                 strcmp(filename, "detach") == 0)
+            detach_request(request, method);
+        else if (strcmp(method, "POST") == 0 || strcmp(method, "DELETE") == 0)
+            file_request(request, method, filename);
         else
             unsupported_request(request, method, filename);
     }
@@ -0,0 +1,632 @@
+#define LOG_MODULE log_module_storage
+#include "image_pull.h"
+#include "app_paths.h"
+#include "docker_api.h"
+#include "json.h"
+#include "log.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define PULL_TIMEOUT_MS 120000  // Between two progress messages
+
+#define MAX_PULLS  32   // Finished pulls are forgotten, oldest first, to make room for new ones
+#define MAX_LAYERS 128  // Per pull, for the progress report
+
+// A failed pull is retried after BACKOFF_MIN_SEC, doubling up to BACKOFF_MAX_SEC, and given up
+// after MAX_ATTEMPTS. Interruptions by the window or a stop do not count.
+#define MAX_ATTEMPTS     8
+#define BACKOFF_MIN_SEC  30
+#define BACKOFF_MAX_SEC  3600
+#define IDLE_CHECK_SEC   60  // The window is checked this often while nothing is pulled
+#define WINDOW_CHECK_SEC 1   // and at most this often while a pull is in progress
+
+enum pull_state { pull_queued, pull_pulling, pull_done, pull_failed };
+
+static const char* const state_names[] = {
+    [pull_queued] = "queued",
+    [pull_pulling] = "pulling",
+    [pull_done] = "done",
+    [pull_failed] = "failed",
+};
+
+struct layer {
+    char id[72];
+    char status[48];  // As reported by dockerd, e.g. "Downloading" or "Pull complete"
+    gint64 current;
+    gint64 total;
+};
+
+struct pull {
+    char image[IMAGE_PULL_REFERENCE_SIZE];  // With a tag or digest
+    enum pull_state state;
+    int attempts;         // That failed
+    gint64 next_attempt;  // From g_get_monotonic_time()
+    bool cancelled;       // While pulling. The thread forgets the pull when it has stopped.
+    char error[256];      // Of the last failed attempt
+    GArray* layers;       // Of struct layer
+};
+
+// Shared by the thread that starts and stops the pulls, the pull thread, and the FCGI thread.
+static struct {
+    GMutex mutex;
+    GCond wakeup;      // Signaled on a new pull, a new window, and when stopping
+    bool running;      // Between image_pull_start() and image_pull_stop(). Guarded by mutex.
+    bool stopping;     // Guarded by mutex
+    GPtrArray* pulls;  // Of struct pull, oldest first. Guarded by mutex.
+    char window[16];   // As given to image_pull_set_window(). Guarded by mutex.
+    int window_start;  // Minutes after midnight, or -1 if pulls are allowed at any time
+    int window_end;    // Guarded by mutex, as is window_start
+    GThread* thread;
+    char* docker_socket;
+} puller = {.window_start = -1, .window_end = -1};
+
+// Progress of the pull in progress, for handle_progress_line()
+struct progress {
+    struct pull* pull;
+    gint64 next_window_check;
+    bool interrupted;  // By a stop, a cancel, or the window
+    char error[256];
+};
+
+static void free_pull(void* pull_void_ptr) {
+    struct pull* pull = pull_void_ptr;
+    g_array_free(pull->layers, TRUE);
+    g_free(pull);
+}
+
+static GPtrArray* pulls(void) {
+    if (!puller.pulls)
+        puller.pulls = g_ptr_array_new_with_free_func(free_pull);
+    return puller.pulls;
+}
+
+// Return true if pulls are allowed now. The mutex must be held.
+static bool in_window(void) {
+    if (puller.window_start < 0)
+        return true;
+    const time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    const int minute = tm.tm_hour * 60 + tm.tm_min;
+    return puller.window_start < puller.window_end
+               ? minute >= puller.window_start && minute < puller.window_end
+               : minute >= puller.window_start || minute < puller.window_end;
+}
+
+// One progress message from dockerd, e.g.
+// {"status":"Downloading","progressDetail":{"current":1024,"total":4096},"id":"a2abf6c4d29d"}
+struct message {
+    char id[72];
+    char status[48];
+    char error[256];  // From "error", or "message" if the pull could not start
+    gint64 current;
+    gint64 total;
+    bool have_detail;
+};
+
+static void parse_detail(const char* key,
+                         gsize key_length,
+                         const char* value,
+                         gsize,
+                         void* message_void_ptr) {
+    struct message* message = message_void_ptr;
+    if (json_is_key(key, key_length, "current"))
+        message->current = g_ascii_strtoll(value, NULL, 10);
+    else if (json_is_key(key, key_length, "total"))
+        message->total = g_ascii_strtoll(value, NULL, 10);
+}
+
+static void parse_message(const char* key,
+                          gsize key_length,
+                          const char* value,
+                          gsize value_length,
+                          void* message_void_ptr) {
+    struct message* message = message_void_ptr;
+    char reason[64];
+    if (json_is_key(key, key_length, "id"))
+        json_copy_string(value, value_length, message->id, sizeof(message->id));
+    else if (json_is_key(key, key_length, "status"))
+        json_copy_string(value, value_length, message->status, sizeof(message->status));
+    else if (json_is_key(key, key_length, "error") || json_is_key(key, key_length, "message"))
+        json_copy_string(value, value_length, message->error, sizeof(message->error));
+    else if (json_is_key(key, key_length, "progressDetail"))
+        message->have_detail = json_foreach_member(
+            value, value_length, parse_detail, message, reason, sizeof(reason));
+}
+
+// Record the progress of a layer. The mutex must be held.
+static void update_layer(struct pull* pull, const struct message* message) {
+    struct layer* layer = NULL;
+    for (guint i = 0; i < pull->layers->len && !layer; i++)
+        if (strcmp(g_array_index(pull->layers, struct layer, i).id, message->id) == 0)
+            layer = &g_array_index(pull->layers, struct layer, i);
+    if (!layer) {
+        if (pull->layers->len == MAX_LAYERS)
+            return;
+        g_array_set_size(pull->layers, pull->layers->len + 1);
+        layer = &g_array_index(pull->layers, struct layer, pull->layers->len - 1);
+        g_strlcpy(layer->id, message->id, sizeof(layer->id));
+    }
+    g_strlcpy(layer->status, message->status, sizeof(layer->status));
+    if (message->have_detail && message->total > 0) {
+        layer->current = message->current;
+        layer->total = message->total;
+    } else if (strcmp(message->status, "Pull complete") == 0 ||
+               strcmp(message->status, "Already exists") == 0) {
+        layer->current = layer->total;
+    }
+}
+
+// Meant to be used as a docker_api_line_callback. Return false to interrupt the pull.
+static bool handle_progress_line(const char* line, void* progress_void_ptr) {
+    struct progress* progress = progress_void_ptr;
+    struct message message = {0};
+    char reason[64];
+    if (!json_foreach_member(
+            line, strlen(line), parse_message, &message, reason, sizeof(reason))) {
+        log_debug("Ignoring pull progress %s: %s", line, reason);
+        return true;
+    }
+
+    g_mutex_lock(&puller.mutex);
+    if (*message.error)
+        g_strlcpy(progress->error, message.error, sizeof(progress->error));
+    // The first message has the tag as id, and the last ones have no id.
+    else if (*message.id && !g_str_has_prefix(message.status, "Pulling from"))
+        update_layer(progress->pull, &message);
+
+    const gint64 now = g_get_monotonic_time();
+    if (now >= progress->next_window_check) {
+        progress->interrupted = !in_window();
+        progress->next_window_check = now + WINDOW_CHECK_SEC * G_USEC_PER_SEC;
+    }
+    progress->interrupted |= puller.stopping || progress->pull->cancelled;
+    const bool keep_going = !progress->interrupted;
+    g_mutex_unlock(&puller.mutex);
+    return keep_going;
+}
+
+#define DOCKER_HUB         "docker.io"
+#define DOCKER_HUB_ADDRESS "https://index.docker.io/v1/"  // Its key in a Docker config.json
+#define CREDENTIAL_SIZE    4096
+
+// Return the registry of image, as docker pull resolves it: the first component of the name if it
+// looks like a host name, otherwise Docker Hub.
+static char* registry_of(const char* image) {
+    const char* slash = strchr(image, '/');
+    if (!slash)
+        return g_strdup(DOCKER_HUB);
+    g_autofree char* first = g_strndup(image, slash - image);
+    if (!strchr(first, '.') && !strchr(first, ':') && strcmp(first, "localhost") != 0)
+        return g_strdup(DOCKER_HUB);
+    return g_steal_pointer(&first);
+}
+
+// Return true if key, an address in the auths of a Docker config.json with or without a scheme
+// and path, is that of registry.
+static bool is_address_of(const char* key, gsize key_length, const char* registry) {
+    g_autofree char* address = g_strndup(key, key_length);
+    const char* host = strstr(address, "://") ? strstr(address, "://") + strlen("://") : address;
+    const size_t host_length = strcspn(host, "/");
+    if (strcmp(registry, DOCKER_HUB) == 0)
+        return (host_length == strlen("index.docker.io") &&
+                strncmp(host, "index.docker.io", host_length) == 0) ||
+               (host_length == strlen("registry-1.docker.io") &&
+                strncmp(host, "registry-1.docker.io", host_length) == 0) ||
+               (host_length == strlen(DOCKER_HUB) && strncmp(host, DOCKER_HUB, host_length) == 0);
+    return host_length == strlen(registry) && strncmp(host, registry, host_length) == 0;
+}
+
+struct credentials {
+    const char* registry;
+    bool found;
+    char auth[CREDENTIAL_SIZE];  // base64 of "<username>:<password>"
+    char username[CREDENTIAL_SIZE];
+    char password[CREDENTIAL_SIZE];
+    char identity_token[CREDENTIAL_SIZE];
+};
+
+// Meant to be used with json_foreach_member() on the entry of a registry in auths.
+static void parse_credential(const char* key,
+                             gsize key_length,
+                             const char* value,
+                             gsize value_length,
+                             void* credentials_void_ptr) {
+    struct credentials* credentials = credentials_void_ptr;
+    if (json_is_key(key, key_length, "auth"))
+        json_copy_string(value, value_length, credentials->auth, sizeof(credentials->auth));
+    else if (json_is_key(key, key_length, "username"))
+        json_copy_string(
+            value, value_length, credentials->username, sizeof(credentials->username));
+    else if (json_is_key(key, key_length, "password"))
+        json_copy_string(
+            value, value_length, credentials->password, sizeof(credentials->password));
+    else if (json_is_key(key, key_length, "identitytoken"))
+        json_copy_string(
+            value, value_length, credentials->identity_token, sizeof(credentials->identity_token));
+}
+
+// Meant to be used with json_foreach_member() on auths.
+static void parse_registry_entry(const char* key,
+                                 gsize key_length,
+                                 const char* value,
+                                 gsize value_length,
+                                 void* credentials_void_ptr) {
+    struct credentials* credentials = credentials_void_ptr;
+    if (credentials->found || !is_address_of(key, key_length, credentials->registry))
+        return;
+    char reason[64];
+    credentials->found = json_foreach_member(
+        value, value_length, parse_credential, credentials, reason, sizeof(reason));
+}
+
+// Meant to be used with json_foreach_member() on a Docker config.json.
+static void parse_auths(const char* key,
+                        gsize key_length,
+                        const char* value,
+                        gsize value_length,
+                        void* credentials_void_ptr) {
+    char reason[64];
+    if (json_is_key(key, key_length, "auths"))
+        json_foreach_member(value,
+                            value_length,
+                            parse_registry_entry,
+                            credentials_void_ptr,
+                            reason,
+                            sizeof(reason));
+}
+
+// Return an X-Registry-Auth header line with the credentials for the registry of image in the
+// uploaded REGISTRY_AUTH, as the Docker CLI sends them, or NULL if there are none. dockerd does
+// not read any config.json itself.
+static char* registry_auth_header(const char* image) {
+    g_autofree char* contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(REGISTRY_AUTH_PATH, &contents, &length, NULL))
+        return NULL;
+
+    g_autofree char* registry = registry_of(image);
+    struct credentials* credentials = g_new0(struct credentials, 1);
+    credentials->registry = registry;
+    char reason[64];
+    json_foreach_member(contents, length, parse_auths, credentials, reason, sizeof(reason));
+    if (credentials->found && *credentials->auth) {
+        gsize decoded_length = 0;
+        g_autofree guchar* decoded = g_base64_decode(credentials->auth, &decoded_length);
+        g_autofree char* user_password = g_strndup((const char*)decoded, decoded_length);
+        char* colon = strchr(user_password, ':');
+        if (colon) {
+            *colon = '\0';
+            g_strlcpy(credentials->username, user_password, sizeof(credentials->username));
+            g_strlcpy(credentials->password, colon + 1, sizeof(credentials->password));
+        }
+    }
+
+    char* header = NULL;
+    if (credentials->found && (*credentials->username || *credentials->identity_token)) {
+        GString* json = g_string_new("{");
+        if (*credentials->identity_token) {
+            g_string_append(json, "\"identitytoken\":");
+            json_append_string(json, credentials->identity_token);
+        } else {
+            g_string_append(json, "\"username\":");
+            json_append_string(json, credentials->username);
+            g_string_append(json, ",\"password\":");
+            json_append_string(json, credentials->password);
+        }
+        g_string_append(json, ",\"serveraddress\":");
+        json_append_string(json,
+                           strcmp(registry, DOCKER_HUB) == 0 ? DOCKER_HUB_ADDRESS : registry);
+        g_string_append_c(json, '}');
+
+        // dockerd expects the URL-safe alphabet.
+        g_autofree char* encoded = g_base64_encode((const guchar*)json->str, json->len);
+        g_strdelimit(encoded, "+", '-');
+        g_strdelimit(encoded, "/", '_');
+        header = g_strdup_printf("X-Registry-Auth: %s\r\n", encoded);
+        g_string_free(json, TRUE);
+    }
+    g_free(credentials);
+    return header;
+}
+
+// Pull image through dockerd, with the credentials for its registry in REGISTRY_AUTH, if any.
+// dockerd keeps the layers that were completed, also if the pull is interrupted. Return the HTTP
+// status, or -1 if the response was interrupted or incomplete.
+static int pull_image(const char* image, struct progress* progress) {
+    // A reference without a digest must be given a tag, or dockerd pulls every tag.
+    g_autofree char* path = NULL;
+    const char* name_end = strrchr(image, '/') ? strrchr(image, '/') : image;
+    const char* tag = strchr(image, '@') ? NULL : strrchr(name_end, ':');
+    if (tag)
+        path = g_strdup_printf(
+            "/images/create?fromImage=%.*s&tag=%s", (int)(tag - image), image, tag + 1);
+    else
+        path = g_strdup_printf("/images/create?fromImage=%s", image);
+
+    g_autofree char* auth_header = registry_auth_header(image);
+    return docker_api_stream(puller.docker_socket,
+                             "POST",
+                             path,
+                             auth_header,
+                             NULL,
+                             handle_progress_line,
+                             progress,
+                             PULL_TIMEOUT_MS);
+}
+
+// Return the queued pull that is due first, or NULL if there is none. Set next_attempt to when it
+// is due. The mutex must be held.
+static struct pull* next_pull(gint64* next_attempt) {
+    struct pull* next = NULL;
+    for (guint i = 0; i < pulls()->len; i++) {
+        struct pull* pull = g_ptr_array_index(pulls(), i);
+        if (pull->state == pull_queued && (!next || pull->next_attempt < next->next_attempt))
+            next = pull;
+    }
+    if (next)
+        *next_attempt = next->next_attempt;
+    return next;
+}
+
+// Set the state of pull after an attempt. The mutex must be held.
+static void finish_attempt(struct pull* pull, int status, const struct progress* progress) {
+    if (pull->cancelled) {
+        log_info("Cancelled the pull of %s", pull->image);
+        g_ptr_array_remove(pulls(), pull);
+    } else if (progress->interrupted) {
+        log_info("Interrupted the pull of %s, to be resumed later", pull->image);
+        pull->state = pull_queued;
+    } else if (status == 200 && !*progress->error) {
+        log_info("Pulled %s", pull->image);
+        pull->state = pull_done;
+        *pull->error = '\0';
+    } else {
+        pull->attempts++;
+        if (*progress->error)
+            g_strlcpy(pull->error, progress->error, sizeof(pull->error));
+        else
+            g_snprintf(pull->error, sizeof(pull->error), "dockerd answered with status %d", status);
+
+        // A reference that dockerd refuses or cannot find will not improve with retries.
+        if ((status >= 400 && status < 500) || pull->attempts >= MAX_ATTEMPTS) {
+            log_error("Failed to pull %s after %d attempts: %s",
+                      pull->image,
+                      pull->attempts,
+                      pull->error);
+            pull->state = pull_failed;
+            return;
+        }
+        const int delay = MIN(BACKOFF_MIN_SEC << (pull->attempts - 1), BACKOFF_MAX_SEC);
+        log_warning("Failed to pull %s, retrying in %d s: %s", pull->image, delay, pull->error);
+        pull->state = pull_queued;
+        pull->next_attempt = g_get_monotonic_time() + (gint64)delay * G_USEC_PER_SEC;
+    }
+}
+
+static void* run_pulls(void*) {
+    g_mutex_lock(&puller.mutex);
+    while (!puller.stopping) {
+        const gint64 now = g_get_monotonic_time();
+        gint64 next_attempt = G_MAXINT64;
+        struct pull* pull = in_window() ? next_pull(&next_attempt) : NULL;
+        if (!pull || next_attempt > now) {
+            g_cond_wait_until(&puller.wakeup,
+                              &puller.mutex,
+                              MIN(next_attempt, now + IDLE_CHECK_SEC * G_USEC_PER_SEC));
+            continue;
+        }
+
+        // The pull is not freed while pulling, since image_pull_cancel() leaves that to us.
+        pull->state = pull_pulling;
+        char image[IMAGE_PULL_REFERENCE_SIZE];
+        g_strlcpy(image, pull->image, sizeof(image));
+        struct progress progress = {.pull = pull};
+        g_mutex_unlock(&puller.mutex);
+
+        log_info("Pulling %s", image);
+        const int status = pull_image(image, &progress);
+
+        g_mutex_lock(&puller.mutex);
+        finish_attempt(pull, status, &progress);
+    }
+    g_mutex_unlock(&puller.mutex);
+    return NULL;
+}
+
+void image_pull_start(const char* docker_socket) {
+    if (puller.thread)
+        return;
+    puller.docker_socket = g_strdup(docker_socket);
+    g_mutex_lock(&puller.mutex);
+    puller.running = true;
+    puller.stopping = false;
+    g_mutex_unlock(&puller.mutex);
+    puller.thread = g_thread_new("image_pull", run_pulls, NULL);
+}
+
+void image_pull_stop(void) {
+    if (!puller.thread)
+        return;
+
+    g_mutex_lock(&puller.mutex);
+    puller.running = false;
+    puller.stopping = true;
+    g_cond_signal(&puller.wakeup);
+    g_mutex_unlock(&puller.mutex);
+
+    g_thread_join(puller.thread);
+    puller.thread = NULL;
+    g_clear_pointer(&puller.docker_socket, g_free);
+}
+
+// Parse "HH:MM" into minutes after midnight, or return -1.
+static int parse_time_of_day(const char* text) {
+    int hours;
+    int minutes;
+    char end;
+    if (sscanf(text, "%2d:%2d%c", &hours, &minutes, &end) != 2 || hours < 0 || hours > 23 ||
+        minutes < 0 || minutes > 59)
+        return -1;
+    return hours * 60 + minutes;
+}
+
+bool image_pull_set_window(const char* window) {
+    g_autofree char* text = g_strstrip(g_strdup(window ? window : ""));
+    int start = -1;
+    int end = -1;
+    bool valid = true;
+    if (*text) {
+        gchar** times = g_strsplit(text, "-", 0);
+        valid = g_strv_length(times) == 2 && (start = parse_time_of_day(times[0])) >= 0 &&
+                (end = parse_time_of_day(times[1])) >= 0 && start != end;
+        g_strfreev(times);
+    }
+    if (!valid) {
+        log_warning("Pulling at any time, since the window %s is not HH:MM-HH:MM", text);
+        start = end = -1;
+    }
+
+    g_mutex_lock(&puller.mutex);
+    g_strlcpy(puller.window, valid ? text : "", sizeof(puller.window));
+    puller.window_start = start;
+    puller.window_end = end;
+    g_cond_signal(&puller.wakeup);
+    g_mutex_unlock(&puller.mutex);
+    return valid;
+}
+
+// Return true if image is a reference that can be passed to dockerd as it is.
+static bool is_valid_reference(const char* image) {
+    const size_t length = strlen(image);
+    return length > 0 && length < IMAGE_PULL_REFERENCE_SIZE - strlen(":latest") &&
+           strspn(image,
+                  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._/:@-") ==
+               length &&
+           g_ascii_isalnum(*image);
+}
+
+// Return image with the tag "latest" if it has neither a tag nor a digest, like docker pull does,
+// so that the same image is not queued twice under different names.
+static char* normalize_reference(const char* image) {
+    const char* name = strrchr(image, '/') ? strrchr(image, '/') : image;
+    return strchr(image, '@') || strchr(name, ':') ? g_strdup(image)
+                                                   : g_strdup_printf("%s:latest", image);
+}
+
+// Return the pull of image, or NULL. The mutex must be held.
+static struct pull* find_pull(const char* image) {
+    for (guint i = 0; i < pulls()->len; i++) {
+        struct pull* pull = g_ptr_array_index(pulls(), i);
+        if (strcmp(pull->image, image) == 0)
+            return pull;
+    }
+    return NULL;
+}
+
+// Forget the oldest finished pulls until there is room for one more. The mutex must be held.
+// Return false if all pulls are unfinished.
+static bool make_room(void) {
+    for (guint i = 0; i < pulls()->len && pulls()->len >= MAX_PULLS;) {
+        const struct pull* pull = g_ptr_array_index(pulls(), i);
+        if (pull->state == pull_done || pull->state == pull_failed)
+            g_ptr_array_remove_index(pulls(), i);
+        else
+            i++;
+    }
+    return pulls()->len < MAX_PULLS;
+}
+
+enum image_pull_request_result image_pull_request(const char* image) {
+    if (!image || !is_valid_reference(image))
+        return image_pull_invalid;
+    g_autofree char* reference = normalize_reference(image);
+
+    enum image_pull_request_result result = image_pull_queued;
+    g_mutex_lock(&puller.mutex);
+    struct pull* pull = find_pull(reference);
+    if (pull && (pull->state == pull_queued || pull->state == pull_pulling)) {
+        result = image_pull_already_queued;
+    } else if (!pull && !make_room()) {
+        log_warning("Not pulling %s, since %d pulls are already queued", reference, MAX_PULLS);
+        result = image_pull_too_many;
+    } else {
+        // A finished pull is started over, which also checks for a newer image.
+        if (pull)
+            g_ptr_array_remove(pulls(), pull);
+        pull = g_new0(struct pull, 1);
+        g_strlcpy(pull->image, reference, sizeof(pull->image));
+        pull->layers = g_array_new(FALSE, TRUE, sizeof(struct layer));
+        g_ptr_array_add(pulls(), pull);
+        g_cond_signal(&puller.wakeup);
+        log_info("Queued a pull of %s", reference);
+    }
+    g_mutex_unlock(&puller.mutex);
+    return result;
+}
+
+bool image_pull_cancel(const char* image) {
+    if (!image || !is_valid_reference(image))
+        return false;
+    g_autofree char* reference = normalize_reference(image);
+
+    g_mutex_lock(&puller.mutex);
+    struct pull* pull = find_pull(reference);
+    if (pull && pull->state == pull_pulling)
+        pull->cancelled = true;  // Forgotten by the pull thread when it has stopped
+    else if (pull)
+        g_ptr_array_remove(pulls(), pull);
+    g_mutex_unlock(&puller.mutex);
+    return pull;
+}
+
+static void append_pull(GString* json, const struct pull* pull, gint64 now) {
+    g_string_append(json, "{\"image\":");
+    json_append_string(json, pull->image);
+    g_string_append_printf(
+        json, ",\"state\":\"%s\",\"attempts\":%d", state_names[pull->state], pull->attempts);
+    if (pull->state == pull_queued && pull->next_attempt > now)
+        g_string_append_printf(json,
+                               ",\"retry_in_s\":%" G_GINT64_FORMAT,
+                               (pull->next_attempt - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC);
+    if (*pull->error) {
+        g_string_append(json, ",\"error\":");
+        json_append_string(json, pull->error);
+    }
+    g_string_append(json, ",\"layers\":[");
+    for (guint i = 0; i < pull->layers->len; i++) {
+        const struct layer* layer = &g_array_index(pull->layers, struct layer, i);
+        g_string_append(json, i ? ",{\"id\":" : "{\"id\":");
+        json_append_string(json, layer->id);
+        g_string_append(json, ",\"status\":");
+        json_append_string(json, layer->status);
+        g_string_append_printf(json,
+                               ",\"current\":%" G_GINT64_FORMAT ",\"total\":%" G_GINT64_FORMAT "}",
+                               layer->current,
+                               layer->total);
+    }
+    g_string_append(json, "]}");
+}
+
+char* image_pull_status_json(void) {
+    GString* json = g_string_new("{\"window\":");
+    const gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&puller.mutex);
+    json_append_string(json, puller.window);
+    g_string_append_printf(json,
+                           ",\"in_window\":%s,\"running\":%s,\"pulls\":[",
+                           in_window() ? "true" : "false",
+                           puller.running ? "true" : "false");
+    for (guint i = 0; i < pulls()->len; i++) {
+        if (i)
+            g_string_append_c(json, ',');
+        append_pull(json, g_ptr_array_index(pulls(), i), now);
+    }
+    g_mutex_unlock(&puller.mutex);
+
+    g_string_append(json, "]}");
+    return g_string_free(json, FALSE);
+}
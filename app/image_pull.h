@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+
+// A queue of image pulls that the application drives through dockerd, one at a time, so that a
+// pull that fails on a flaky link is retried with backoff instead of being given up by the client.
+// Layers that were completed are kept by dockerd, so a retry only downloads what is missing.
+
+#define IMAGE_PULL_REFERENCE_SIZE 256
+
+enum image_pull_request_result {
+    image_pull_queued,
+    image_pull_already_queued,  // The image is already waiting or being pulled
+    image_pull_too_many,        // No finished pull can be forgotten to make room
+    image_pull_invalid,
+};
+
+// Start pulling the queued images, through dockerd on docker_socket. Pulls requested while
+// dockerd is not running wait until this is called.
+void image_pull_start(const char* docker_socket);
+
+// Stop the thread, which interrupts any pull in progress. The pull is resumed on the next start.
+// Return when the thread has ended.
+void image_pull_stop(void);
+
+// Only pull between two times of day, given as "HH:MM-HH:MM" in local time. The end may be before
+// the start, for a window across midnight. An empty window allows pulls at any time. A pull in
+// progress when the window closes is interrupted, and resumed when it opens again. Return false,
+// and allow pulls at any time, if window is not valid. Can be called from any thread.
+bool image_pull_set_window(const char* window);
+
+// Queue a pull of image, e.g. "nginx", "nginx:1.27" or "registry.example.com/team/app@sha256:...".
+// Can be called from any thread.
+enum image_pull_request_result image_pull_request(const char* image);
+
+// Stop pulling image, and forget it. Return false if it was not in the list. Can be called from
+// any thread.
+bool image_pull_cancel(const char* image);
+
+// Return the window and the state of each pull, with the progress of each layer, as a JSON object
+// that must be freed with g_free(). Can be called from any thread.
+char* image_pull_status_json(void);
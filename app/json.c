@@ -0,0 +1,259 @@
+#include "json.h"
+#include <string.h>
+
+// Deeper nesting than this is rejected, so that the recursion is bounded.
+#define JSON_MAX_DEPTH 32
+
+struct parser {
+    const char* pos;
+    const char* end;
+    const char* start;
+    char* reason;
+    size_t reason_size;
+    json_member_callback callback;           // For the members of the outermost object, or NULL
+    json_element_callback element_callback;  // For the elements of the outermost array, or NULL
+    void* user_data;
+};
+
+static int line_of(const struct parser* parser) {
+    int line = 1;
+    for (const char* c = parser->start; c < parser->pos; c++)
+        if (*c == '\n')
+            line++;
+    return line;
+}
+
+static bool fail(struct parser* parser, const char* expected) {
+    if (parser->pos >= parser->end)
+        g_snprintf(parser->reason, parser->reason_size, "expected %s at the end", expected);
+    else
+        g_snprintf(parser->reason,
+                   parser->reason_size,
+                   "expected %s at line %d",
+                   expected,
+                   line_of(parser));
+    return false;
+}
+
+static void skip_whitespace(struct parser* parser) {
+    while (parser->pos < parser->end && (*parser->pos == ' ' || *parser->pos == '\t' ||
+                                         *parser->pos == '\r' || *parser->pos == '\n'))
+        parser->pos++;
+}
+
+// Consume c, after any whitespace, and return true if it is next.
+static bool accept(struct parser* parser, char c) {
+    skip_whitespace(parser);
+    if (parser->pos < parser->end && *parser->pos == c) {
+        parser->pos++;
+        return true;
+    }
+    return false;
+}
+
+static bool accept_literal(struct parser* parser, const char* literal) {
+    const size_t length = strlen(literal);
+    if ((size_t)(parser->end - parser->pos) < length || strncmp(parser->pos, literal, length) != 0)
+        return false;
+    parser->pos += length;
+    return true;
+}
+
+static bool parse_string(struct parser* parser) {
+    if (!accept(parser, '"'))
+        return fail(parser, "a string");
+    while (parser->pos < parser->end && *parser->pos != '"') {
+        if ((unsigned char)*parser->pos < 0x20)
+            return fail(parser, "no control character in a string");
+        if (*parser->pos++ != '\\')
+            continue;
+        if (parser->pos >= parser->end)
+            break;
+        const char escaped = *parser->pos++;
+        if (escaped == 'u') {
+            for (int i = 0; i < 4; i++, parser->pos++)
+                if (parser->pos >= parser->end || !g_ascii_isxdigit(*parser->pos))
+                    return fail(parser, "four hex digits after \\u");
+        } else if (!escaped || !strchr("\"\\/bfnrt", escaped)) {
+            parser->pos--;
+            return fail(parser, "a valid escape sequence");
+        }
+    }
+    if (parser->pos >= parser->end)
+        return fail(parser, "'\"'");
+    parser->pos++;
+    return true;
+}
+
+static bool accept_digits(struct parser* parser) {
+    const char* first = parser->pos;
+    while (parser->pos < parser->end && g_ascii_isdigit(*parser->pos))
+        parser->pos++;
+    return parser->pos > first;
+}
+
+static bool parse_number(struct parser* parser) {
+    accept_literal(parser, "-");
+    if (!accept_literal(parser, "0") && !accept_digits(parser))
+        return fail(parser, "a value");
+    if (accept_literal(parser, ".") && !accept_digits(parser))
+        return fail(parser, "a digit");
+    if (accept_literal(parser, "e") || accept_literal(parser, "E")) {
+        if (!accept_literal(parser, "+"))
+            accept_literal(parser, "-");
+        if (!accept_digits(parser))
+            return fail(parser, "a digit");
+    }
+    return true;
+}
+
+static bool parse_value(struct parser* parser, int depth);
+
+static bool parse_object(struct parser* parser, int depth) {
+    if (!accept(parser, '{'))
+        return fail(parser, "'{'");
+    if (accept(parser, '}'))
+        return true;
+    do {
+        skip_whitespace(parser);
+        const char* key = parser->pos + 1;
+        if (!parse_string(parser))
+            return false;
+        const gsize key_length = parser->pos - 1 - key;
+        if (!accept(parser, ':'))
+            return fail(parser, "':'");
+        skip_whitespace(parser);
+        const char* value = parser->pos;
+        if (!parse_value(parser, depth + 1))
+            return false;
+        if (depth == 0 && parser->callback)
+            parser->callback(key, key_length, value, parser->pos - value, parser->user_data);
+    } while (accept(parser, ','));
+    return accept(parser, '}') || fail(parser, "',' or '}'");
+}
+
+static bool parse_array(struct parser* parser, int depth) {
+    parser->pos++;  // '['
+    if (accept(parser, ']'))
+        return true;
+    do {
+        skip_whitespace(parser);
+        const char* value = parser->pos;
+        if (!parse_value(parser, depth + 1))
+            return false;
+        if (depth == 0 && parser->element_callback)
+            parser->element_callback(value, parser->pos - value, parser->user_data);
+    } while (accept(parser, ','));
+    return accept(parser, ']') || fail(parser, "',' or ']'");
+}
+
+static bool parse_value(struct parser* parser, int depth) {
+    if (depth > JSON_MAX_DEPTH)
+        return fail(parser, "less nesting");
+    skip_whitespace(parser);
+    if (parser->pos >= parser->end)
+        return fail(parser, "a value");
+    switch (*parser->pos) {
+        case '{':
+            return parse_object(parser, depth);
+        case '[':
+            return parse_array(parser, depth);
+        case '"':
+            return parse_string(parser);
+        default:
+            return accept_literal(parser, "true") || accept_literal(parser, "false") ||
+                   accept_literal(parser, "null") || parse_number(parser);
+    }
+}
+
+static bool parse(struct parser* parser) {
+    if (!parse_object(parser, 0))
+        return false;
+    skip_whitespace(parser);
+    return parser->pos == parser->end || fail(parser, "nothing after the object");
+}
+
+static bool parse_outermost_array(struct parser* parser) {
+    skip_whitespace(parser);
+    if (parser->pos >= parser->end || *parser->pos != '[')
+        return fail(parser, "'['");
+    if (!parse_array(parser, 0))
+        return false;
+    skip_whitespace(parser);
+    return parser->pos == parser->end || fail(parser, "nothing after the array");
+}
+
+bool json_validate_object(const char* text, gsize length, char* reason, size_t reason_size) {
+    struct parser parser = {text, text + length, text, reason, reason_size, NULL, NULL, NULL};
+    return parse(&parser);
+}
+
+bool json_foreach_member(const char* text,
+                         gsize length,
+                         json_member_callback callback,
+                         void* user_data,
+                         char* reason,
+                         size_t reason_size) {
+    if (!json_validate_object(text, length, reason, reason_size))
+        return false;
+    struct parser parser = {
+        text, text + length, text, reason, reason_size, callback, NULL, user_data};
+    return parse(&parser);
+}
+
+bool json_is_key(const char* key, gsize key_length, const char* name) {
+    return key_length == strlen(name) && strncmp(key, name, key_length) == 0;
+}
+
+void json_copy_string(const char* value, gsize value_length, char* dest, size_t dest_size) {
+    size_t length = 0;
+    const char* end = value + value_length - 1;  // The closing quote
+    if (value_length >= 2 && *value == '"') {
+        for (const char* c = value + 1; c < end && length < dest_size - 1; c++) {
+            if (*c == '\\' && c + 1 < end)
+                c++;
+            dest[length++] = *c;
+        }
+    }
+    dest[length] = '\0';
+}
+
+bool json_foreach_element(const char* text,
+                          gsize length,
+                          json_element_callback callback,
+                          void* user_data,
+                          char* reason,
+                          size_t reason_size) {
+    struct parser validator = {text, text + length, text, reason, reason_size, NULL, NULL, NULL};
+    if (!parse_outermost_array(&validator))
+        return false;
+    struct parser parser = {
+        text, text + length, text, reason, reason_size, NULL, callback, user_data};
+    return parse_outermost_array(&parser);
+}
+
+void json_append_string(GString* json, const char* text) {
+    g_string_append_c(json, '"');
+    for (const char* c = text; *c; c++) {
+        switch (*c) {
+            case '"':
+                g_string_append(json, "\\\"");
+                break;
+            case '\\':
+                g_string_append(json, "\\\\");
+                break;
+            case '\n':
+                g_string_append(json, "\\n");
+                break;
+            case '\t':
+                g_string_append(json, "\\t");
+                break;
+            default:
+                if ((unsigned char)*c < 0x20)
+                    g_string_append_printf(json, "\\u%04x", *c);
+                else
+                    g_string_append_c(json, *c);
+        }
+    }
+    g_string_append_c(json, '"');
+}
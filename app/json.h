@@ -0,0 +1,51 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// Minimal JSON support for the configuration files that the application is given, which are too
+// small and too few to motivate a JSON library.
+
+// Return true if text is a JSON object, optionally surrounded by whitespace. Otherwise write the
+// reason, e.g. "expected ':' at line 3", to reason.
+bool json_validate_object(const char* text, gsize length, char* reason, size_t reason_size);
+
+// Called for each member of an object, with the key as written between its quotes, and the value
+// as written, both pointing into the text and not terminated.
+typedef void (*json_member_callback)(const char* key,
+                                     gsize key_length,
+                                     const char* value,
+                                     gsize value_length,
+                                     void* user_data);
+
+// Like json_validate_object(), but also call callback for each member of the object, but not for
+// those of objects within it. Nothing is called if text turns out not to be valid.
+bool json_foreach_member(const char* text,
+                         gsize length,
+                         json_member_callback callback,
+                         void* user_data,
+                         char* reason,
+                         size_t reason_size);
+
+// Return true if key, as passed to a json_member_callback, is name.
+bool json_is_key(const char* key, gsize key_length, const char* name);
+
+// Copy a string value, as passed to a json_member_callback, without its quotes, truncated to fit
+// dest. Escape sequences are reduced to the escaped character, which is enough for names, labels
+// and messages. dest is empty if the value is not a string.
+void json_copy_string(const char* value, gsize value_length, char* dest, size_t dest_size);
+
+// Called for each element of an array, with the value as written, pointing into the text and not
+// terminated.
+typedef void (*json_element_callback)(const char* value, gsize value_length, void* user_data);
+
+// Like json_foreach_member(), but for text that is a JSON array, such as a list from the Docker
+// Engine API. Call callback for each element of the array, but not for those of arrays within it.
+bool json_foreach_element(const char* text,
+                          gsize length,
+                          json_element_callback callback,
+                          void* user_data,
+                          char* reason,
+                          size_t reason_size);
+
+// Append text as a JSON string, including the quotes.
+void json_append_string(GString* json, const char* text);
@@ -0,0 +1,179 @@
+#define LOG_MODULE log_module_localdata
+#include "localdata_index.h"
+#include "app_paths.h"
+#include "log.h"
+#include "managed_file.h"
+#include <errno.h>
+#include <glib-unix.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files are written in place by scp and by uploads, and replaced by a rename by editors and
+// GIO, so both kinds of events are watched.
+#define LOCALDATA_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+#define ALL_FILES ((1u << localdata_file_count) - 1)
+
+// Serializes refreshes, so that a file read before a change cannot overwrite the entry of the
+// same file read after it.
+static GMutex refresh_mutex;
+
+static GMutex index_mutex;
+static struct localdata_entry entries[localdata_file_count];  // Guarded by index_mutex
+
+static localdata_changed_callback changed_callback = NULL;
+static void* changed_user_data = NULL;
+static int inotify_fd = -1;
+static guint inotify_source_id = 0;
+
+static int find_file(const char* filename) {
+    const struct managed_file* file = managed_file_find(filename);
+    return file ? file->localdata_file : -1;
+}
+
+// Hash the contents of path into entry. Return false if the file could not be read.
+static bool hash_file(const char* path, struct localdata_entry* entry) {
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    guchar buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        g_checksum_update(checksum, buffer, count);
+    const bool success = !ferror(fp);
+    if (success)
+        g_strlcpy(entry->sha256, g_checksum_get_string(checksum), sizeof(entry->sha256));
+    g_checksum_free(checksum);
+    fclose(fp);
+    return success;
+}
+
+static void read_entry(enum localdata_file file, struct localdata_entry* entry) {
+    const struct managed_file* managed_file = managed_file_in_localdata(file);
+    const char* path = managed_file->path;
+    *entry = (struct localdata_entry){.filename = managed_file->name};
+
+    struct stat sb;
+    if (stat(path, &sb) != 0) {
+        if (errno != ENOENT)
+            log_warning("Failed to stat %s: %s", path, strerror(errno));
+        return;
+    }
+    entry->present = true;
+    entry->size = sb.st_size;
+    entry->mtime = sb.st_mtime;
+    if (!hash_file(path, entry))
+        log_warning("Failed to read %s: %s", path, strerror(errno));
+}
+
+static void refresh(enum localdata_file file) {
+    g_mutex_lock(&refresh_mutex);
+    struct localdata_entry entry;
+    read_entry(file, &entry);
+
+    g_mutex_lock(&index_mutex);
+    const struct localdata_entry previous = entries[file];
+    entries[file] = entry;
+    g_mutex_unlock(&index_mutex);
+    g_mutex_unlock(&refresh_mutex);
+
+    if (entry.present == previous.present && strcmp(entry.sha256, previous.sha256) == 0)
+        return;
+    log_info("%s in localdata was %s",
+             entry.filename,
+             !entry.present ? "removed" : previous.present ? "changed" : "created");
+    if (changed_callback)
+        changed_callback(file, changed_user_data);
+}
+
+static gboolean read_inotify_events(gint fd, GIOCondition, gpointer) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    guint files_to_refresh = 0;  // Bits of enum localdata_file
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        const struct inotify_event* event;
+        for (char* ptr = buffer; ptr < buffer + length; ptr += sizeof(*event) + event->len) {
+            event = (const struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                files_to_refresh = ALL_FILES;
+            } else if (event->mask & IN_IGNORED) {
+                log_warning("%s is no longer watched", APP_LOCALDATA);
+            } else if (event->len) {
+                const int file = find_file(event->name);
+                if (file >= 0)
+                    files_to_refresh |= 1u << file;
+            }
+        }
+    }
+
+    // Several events for the same file, such as those of a rename over it, lead to one refresh.
+    for (int i = 0; i < localdata_file_count; i++)
+        if (files_to_refresh & (1u << i))
+            refresh(i);
+    return G_SOURCE_CONTINUE;
+}
+
+bool localdata_index_init(localdata_changed_callback callback, void* user_data) {
+    changed_callback = callback;
+    changed_user_data = user_data;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, APP_LOCALDATA, LOCALDATA_EVENTS) < 0) {
+        log_warning("Failed to watch %s, so files changed over SSH take effect after a restart: %s",
+                    APP_LOCALDATA,
+                    strerror(errno));
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        inotify_fd = -1;
+    } else {
+        inotify_source_id = g_unix_fd_add(inotify_fd, G_IO_IN, read_inotify_events, NULL);
+    }
+
+    // Read the files after the watch has been added, so that no change in between is missed.
+    g_mutex_lock(&refresh_mutex);
+    for (int i = 0; i < localdata_file_count; i++) {
+        struct localdata_entry entry;
+        read_entry(i, &entry);
+        g_mutex_lock(&index_mutex);
+        entries[i] = entry;
+        g_mutex_unlock(&index_mutex);
+    }
+    g_mutex_unlock(&refresh_mutex);
+    return inotify_fd >= 0;
+}
+
+void localdata_index_free(void) {
+    if (inotify_source_id)
+        g_source_remove(inotify_source_id);
+    inotify_source_id = 0;
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    inotify_fd = -1;
+    changed_callback = NULL;
+}
+
+void localdata_index_refresh(const char* filename) {
+    const int file = find_file(filename);
+    if (file >= 0)
+        refresh(file);
+}
+
+bool localdata_index_exists(const char* filename) {
+    const int file = find_file(filename);
+    if (file < 0)
+        return false;
+    g_mutex_lock(&index_mutex);
+    const bool present = entries[file].present;
+    g_mutex_unlock(&index_mutex);
+    return present;
+}
+
+void localdata_index_get(struct localdata_entry entries_ret[localdata_file_count]) {
+    g_mutex_lock(&index_mutex);
+    memcpy(entries_ret, entries, sizeof(entries));
+    g_mutex_unlock(&index_mutex);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// The files in localdata that the application reacts to, in the order of the managed file
+// registry. See managed_file.h.
+enum localdata_file {
+    localdata_ca_cert,
+    localdata_server_cert,
+    localdata_server_key,
+    localdata_daemon_json,
+    localdata_client_allowlist,
+    localdata_client_crl,
+    localdata_file_count,
+};
+
+struct localdata_entry {
+    const char* filename;
+    bool present;
+    gint64 size;
+    gint64 mtime;     // Seconds since the epoch
+    char sha256[65];  // Of the contents, as hex. Empty if not present.
+};
+
+// Called when the contents of a file have changed, or the file was created or removed, from the
+// thread that noticed the change: the main loop for changes seen through inotify, or the thread
+// calling localdata_index_refresh(). A change is only reported once, whichever comes first.
+typedef void (*localdata_changed_callback)(enum localdata_file file, void* user_data);
+
+// Read all files into the index and watch localdata with inotify from the default main context.
+// Without a watch, e.g. if inotify is not available, the index is only updated by
+// localdata_index_refresh(). Return false on error.
+bool localdata_index_init(localdata_changed_callback callback, void* user_data);
+
+// Stop watching localdata.
+void localdata_index_free(void);
+
+// Read filename into the index again, e.g. after writing it, so that the change is reported
+// without waiting for the inotify event. Names of other files are ignored.
+void localdata_index_refresh(const char* filename);
+
+// Return true if filename is one of the indexed files and present, without touching the file
+// system. Can be called from any thread.
+bool localdata_index_exists(const char* filename);
+
+// Copy the index, in the order of enum localdata_file. Can be called from any thread.
+void localdata_index_get(struct localdata_entry entries[localdata_file_count]);
@@ -1,8 +1,91 @@
 #include "log.h"
+#include "log_store.h"
+#include <poll.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
-static volatile int debug_log_enabled;  // Accessed using g_atomic_int_get/set only
+// Producers (any thread calling g_log) push messages into a bounded lock-free MPSC ring buffer,
+// based on Dmitry Vyukov's bounded queue. Each slot carries a sequence number that tells whether
+// it is free for the producer claiming position 'pos' (sequence == pos) or holds a message ready
+// for the consumer (sequence == pos + 1). A single background thread drains the ring, formats the
+// messages and writes them in batches. When the ring is full the message is dropped and counted,
+// so logging never blocks the caller. Only errors are written synchronously in that case.
+
+#define LOG_RING_SLOTS     128  // Must be a power of two
+#define LOG_MESSAGE_SIZE   1024
+#define LOG_BATCH_SIZE     32
+#define LOG_IDLE_WAIT_MS   100
+#define LOG_TIMESTAMP_SIZE 48
+#define LOG_FIELDS_SIZE    256
+
+// Large enough for a JSON line where every byte of the message is escaped as \u00XX.
+#define LOG_LINE_SIZE (6 * LOG_MESSAGE_SIZE + LOG_FIELDS_SIZE + 256)
+
+struct log_slot {
+    guint sequence;
+    enum log_module module;
+    GLogLevelFlags level;
+    enum log_event event;
+    enum log_format format;        // The output format when the message was logged
+    gint64 timestamp;              // Microseconds since the epoch, from g_get_real_time()
+    char fields[LOG_FIELDS_SIZE];  // JSON members, each preceded by a comma, or empty
+    char message[LOG_MESSAGE_SIZE];
+};
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static guint enqueue_pos;  // Shared by all producers, accessed using __atomic builtins only
+static guint dequeue_pos;  // Owned by the consumer thread
+
+static guint dropped_messages;   // Accessed using __atomic builtins only
+static guint reported_messages;  // Owned by the consumer thread
+static int consumer_waiting;     // Accessed using __atomic builtins only
+static int consumer_stop;        // Accessed using __atomic builtins only
+static int wakeup_fd = -1;
+static GThread* consumer_thread = NULL;
+
+static enum log_destination destination;
+static int output_format = log_format_text;  // Accessed using g_atomic_int_get/set only
+
+volatile int log_module_levels[log_module_count];
+
+// Level of modules without a level of their own, and each module's own level or -1. Only
+// changed by the thread calling log_debug_set() and log_levels_parse().
+static int default_level = LOG_LEVEL_INFO;
+static int module_level_overrides[log_module_count];
+
+static const char* const module_names[log_module_count] = {"supervisor",
+                                                           "fcgi",
+                                                           "upload",
+                                                           "storage",
+                                                           "tls",
+                                                           "localdata",
+                                                           "dockerd"};
+
+// Output captured from dockerd has already been filtered by DockerdLogLevel, so it is passed on
+// at any level unless the dockerd module has been given a level of its own.
+static int module_default_level(int module) {
+    return module == log_module_dockerd ? LOG_LEVEL_DEBUG : default_level;
+}
+
+static void update_module_levels(void) {
+    for (int i = 0; i < log_module_count; i++)
+        g_atomic_int_set(&log_module_levels[i],
+                         module_level_overrides[i] >= 0 ? module_level_overrides[i]
+                                                        : module_default_level(i));
+}
+
+static const char* const event_names[log_event_count] = {"message",
+                                                         "dockerd_started",
+                                                         "dockerd_exited",
+                                                         "dockerd_ready",
+                                                         "dockerd_not_ready",
+                                                         "dockerd_stopped",
+                                                         "status_changed",
+                                                         "parameter_changed",
+                                                         "http_request"};
 
 static int log_level_to_syslog_priority(GLogLevelFlags log_level) {
     if (log_level == G_LOG_LEVEL_NON_FATAL_ERROR)
@@ -25,7 +108,7 @@ static int log_level_to_syslog_priority(GLogLevelFlags log_level) {
 }
 
 // String representation has been chosen to match that of dockerd
-static const char* log_level_to_string(GLogLevelFlags log_level) {
+const char* log_level_to_string(GLogLevelFlags log_level) {
     if (log_level == G_LOG_LEVEL_NON_FATAL_ERROR)
         log_level = G_LOG_LEVEL_ERROR;
 
@@ -45,41 +128,532 @@ static const char* log_level_to_string(GLogLevelFlags log_level) {
     }
 }
 
-static bool log_threshold_met(GLogLevelFlags log_level) {
-    return g_atomic_int_get(&debug_log_enabled) || (log_level & ~G_LOG_LEVEL_DEBUG);
+static int log_level_to_level(GLogLevelFlags log_level) {
+    if (log_level & G_LOG_LEVEL_DEBUG)
+        return LOG_LEVEL_DEBUG;
+    if (log_level & (G_LOG_LEVEL_INFO | G_LOG_LEVEL_MESSAGE))
+        return LOG_LEVEL_INFO;
+    if (log_level & G_LOG_LEVEL_WARNING)
+        return LOG_LEVEL_WARNING;
+    return LOG_LEVEL_ERROR;
+}
+
+// Timestamp format has been chosen to match that of dockerd, i.e. "%Y-%m-%dT%T.%f000%:z". The
+// part up to and including the seconds is cached, since consecutive messages usually share it.
+static const char* format_timestamp(gint64 timestamp, char* buffer, size_t size) {
+    static __thread time_t cached_seconds = -1;
+    static __thread char cached_prefix[32];
+    static __thread char cached_offset[8];
+
+    const time_t seconds = timestamp / G_USEC_PER_SEC;
+    if (seconds != cached_seconds) {
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        strftime(cached_prefix, sizeof(cached_prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        const long offset_minutes = labs(tm.tm_gmtoff) / 60;
+        g_snprintf(cached_offset,
+                   sizeof(cached_offset),
+                   "%c%02ld:%02ld",
+                   tm.tm_gmtoff < 0 ? '-' : '+',
+                   offset_minutes / 60,
+                   offset_minutes % 60);
+        cached_seconds = seconds;
+    }
+    g_snprintf(buffer,
+               size,
+               "%s.%06d000%s",
+               cached_prefix,
+               (int)(timestamp % G_USEC_PER_SEC),
+               cached_offset);
+    return buffer;
+}
+
+// A string being built in a fixed-size buffer. Appending stops at the end of the buffer, and
+// sets 'overflow' instead, so that the caller can take back what did not fit.
+struct line_buffer {
+    char* data;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+static void append_bytes(struct line_buffer* line, const char* bytes, size_t count) {
+    if (line->len + count >= line->size) {
+        count = line->size - 1 - line->len;
+        line->overflow = true;
+    }
+    memcpy(line->data + line->len, bytes, count);
+    line->len += count;
+    line->data[line->len] = '\0';
+}
+
+static void append_text(struct line_buffer* line, const char* text) {
+    append_bytes(line, text, strlen(text));
+}
+
+// Append text as a JSON string, including the quotes.
+static void append_json_string(struct line_buffer* line, const char* text) {
+    append_bytes(line, "\"", 1);
+    const char* plain = text;  // Start of the characters that need no escaping
+    for (const char* c = text;; c++) {
+        const unsigned char ch = *c;
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+        append_bytes(line, plain, c - plain);
+        if (!ch)
+            break;
+        char escaped[8];
+        if (ch == '"' || ch == '\\')
+            g_snprintf(escaped, sizeof(escaped), "\\%c", ch);
+        else if (ch == '\n')
+            g_strlcpy(escaped, "\\n", sizeof(escaped));
+        else if (ch == '\t')
+            g_strlcpy(escaped, "\\t", sizeof(escaped));
+        else
+            g_snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+        append_text(line, escaped);
+        plain = c + 1;
+    }
+    append_bytes(line, "\"", 1);
+}
+
+// Format fields as JSON members into the fields of a slot. A field that does not fit is dropped,
+// along with all fields after it.
+static void format_fields(struct log_slot* slot, const struct log_field* fields, size_t count) {
+    struct line_buffer line = {slot->fields, sizeof(slot->fields), 0, false};
+    slot->fields[0] = '\0';
+    for (size_t i = 0; i < count && !line.overflow; i++) {
+        const size_t len_before = line.len;
+        append_text(&line, ",");
+        append_json_string(&line, fields[i].key);
+        append_text(&line, ":");
+        if (fields[i].type == log_field_int) {
+            char number[24];
+            g_snprintf(number, sizeof(number), "%" G_GINT64_FORMAT, fields[i].int_value);
+            append_text(&line, number);
+        } else {
+            append_json_string(&line, fields[i].string_value ? fields[i].string_value : "");
+        }
+        if (line.overflow)
+            slot->fields[line.len = len_before] = '\0';
+    }
+}
+
+static const char* log_level_to_json_name(GLogLevelFlags log_level) {
+    if (log_level == G_LOG_LEVEL_NON_FATAL_ERROR)
+        log_level = G_LOG_LEVEL_ERROR;
+
+    switch (log_level) {
+        case G_LOG_LEVEL_DEBUG:
+            return "debug";
+        case G_LOG_LEVEL_INFO:
+            return "info";
+        case G_LOG_LEVEL_WARNING:
+            return "warning";
+        case G_LOG_LEVEL_ERROR:
+            return "error";
+        case G_LOG_LEVEL_CRITICAL:
+            return "critical";
+        default:
+            return "unknown";
+    }
+}
+
+// Format a message as one JSON object, without a trailing newline.
+static void append_json_line(struct line_buffer* line, const struct log_slot* slot) {
+    char timestamp_text[LOG_TIMESTAMP_SIZE];
+    append_text(line, "{\"time\":\"");
+    append_text(line, format_timestamp(slot->timestamp, timestamp_text, sizeof(timestamp_text)));
+    append_text(line, "\",\"level\":\"");
+    append_text(line, log_level_to_json_name(slot->level));
+    append_text(line, "\",\"module\":\"");
+    append_text(line, module_names[slot->module]);
+    append_text(line, "\",\"event\":\"");
+    append_text(line, event_names[slot->event]);
+    append_text(line, "\",\"msg\":");
+    append_json_string(line, slot->message);
+    append_text(line, slot->fields);
+    append_text(line, "}");
 }
 
-static void log_to_syslog(__attribute__((unused)) const char* log_domain,
-                          GLogLevelFlags log_level,
-                          const char* message,
-                          __attribute__((unused)) gpointer settings_void_ptr) {
-    if (log_threshold_met(log_level))
-        syslog(log_level_to_syslog_priority(log_level), "%s", message);
+static void write_to_syslog(const struct log_slot* slot) {
+    const int priority = log_level_to_syslog_priority(slot->level);
+    if (slot->format == log_format_json) {
+        char text[LOG_LINE_SIZE];
+        struct line_buffer line = {text, sizeof(text), 0, false};
+        append_json_line(&line, slot);
+        syslog(priority, "%s", text);
+    } else {
+        syslog(priority, "%s", slot->message);
+    }
 }
 
-// Timestamp format and log level have been chosen to match that of dockerd
-static void log_to_stdout(__attribute__((unused)) const char* log_domain,
-                          GLogLevelFlags log_level,
-                          const char* message,
-                          __attribute__((unused)) gpointer settings_void_ptr) {
-    if (log_threshold_met(log_level)) {
-        GDateTime* now = g_date_time_new_now_local();
-        g_autofree char* now_text = g_date_time_format(now, "%Y-%m-%dT%T.%f000%:z");
-        g_date_time_unref(now);
-        printf("%s[%s] %s\n", log_level_to_string(log_level), now_text, message);
+// Format one line for stdout, including the newline, and return its length.
+static size_t format_stdout_line(char* buffer, size_t size, const struct log_slot* slot) {
+    struct line_buffer line = {buffer, size, 0, false};
+    if (slot->format == log_format_json) {
+        append_json_line(&line, slot);
+    } else {
+        char timestamp_text[LOG_TIMESTAMP_SIZE];
+        append_text(&line, log_level_to_string(slot->level));
+        append_text(&line, "[");
+        append_text(&line,
+                    format_timestamp(slot->timestamp, timestamp_text, sizeof(timestamp_text)));
+        append_text(&line, "] ");
+        append_text(&line, slot->message);
     }
+    if (line.overflow)
+        line.len--;  // Make room for the newline
+    line.data[line.len++] = '\n';
+    return line.len;
+}
+
+static void write_to_stdout(const struct log_slot* slot) {
+    char line[LOG_LINE_SIZE];
+    const size_t len = format_stdout_line(line, sizeof(line), slot);
+    fwrite(line, 1, len, stdout);
+    fflush(stdout);
+}
+
+// Write a message in the calling thread. Used for fatal messages and when no consumer is running.
+static void write_synchronously(const struct log_slot* slot) {
+    log_store_append(slot->module, slot->level, slot->timestamp, slot->message);
+    if (destination == log_dest_syslog)
+        write_to_syslog(slot);
+    else
+        write_to_stdout(slot);
+}
+
+static void wake_consumer(void) {
+    const uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        // Nothing sensible to do here; the consumer will wake up by its timeout anyway.
+    }
+}
+
+// Claim the next free slot, or return NULL if the ring is full. The slot must be handed back to
+// the consumer using publish().
+static struct log_slot* claim(guint* pos_ret) {
+    guint pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        struct log_slot* slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        const int diff = (int)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(
+                    &enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos_ret = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void publish(struct log_slot* slot, guint pos) {
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&consumer_waiting, __ATOMIC_SEQ_CST))
+        wake_consumer();
+}
+
+static struct log_slot* peek(void) {
+    struct log_slot* slot = &ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+    const guint sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    return sequence == dequeue_pos + 1 ? slot : NULL;
+}
+
+static void release(struct log_slot* slot) {
+    __atomic_store_n(&slot->sequence, dequeue_pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+}
+
+// Set everything but the sequence and the message, which are set by the caller.
+static void init_slot(struct log_slot* slot,
+                      enum log_module module,
+                      GLogLevelFlags log_level,
+                      enum log_event event) {
+    slot->module = module;
+    slot->level = log_level;
+    slot->event = event;
+    slot->format = g_atomic_int_get(&output_format);
+    slot->timestamp = g_get_real_time();
+    slot->fields[0] = '\0';
+}
+
+static void report_dropped_messages(void) {
+    const guint dropped = __atomic_load_n(&dropped_messages, __ATOMIC_RELAXED);
+    if (dropped != reported_messages) {
+        struct log_slot slot;
+        init_slot(&slot, log_module_supervisor, G_LOG_LEVEL_WARNING, log_event_message);
+        g_snprintf(slot.message,
+                   sizeof(slot.message),
+                   "Dropped %u log messages",
+                   dropped - reported_messages);
+        write_synchronously(&slot);
+        reported_messages = dropped;
+    }
+}
+
+// Drain up to LOG_BATCH_SIZE messages. Return the number of messages written.
+static int write_batch(void) {
+    static char batch[LOG_BATCH_SIZE * (LOG_MESSAGE_SIZE + LOG_TIMESTAMP_SIZE + 8)];
+    static char line[LOG_LINE_SIZE];
+    size_t batch_len = 0;
+    int count = 0;
+
+    struct log_slot* slot;
+    while (count < LOG_BATCH_SIZE && (slot = peek())) {
+        log_store_append(slot->module, slot->level, slot->timestamp, slot->message);
+        if (destination == log_dest_syslog) {
+            write_to_syslog(slot);
+        } else {
+            const size_t len = format_stdout_line(line, sizeof(line), slot);
+            if (batch_len + len > sizeof(batch)) {
+                fwrite(batch, 1, batch_len, stdout);
+                batch_len = 0;
+            }
+            memcpy(batch + batch_len, line, len);  // A line always fits in an empty batch.
+            batch_len += len;
+        }
+        release(slot);
+        count++;
+    }
+
+    if (batch_len) {
+        fwrite(batch, 1, batch_len, stdout);
+        fflush(stdout);
+    }
+    report_dropped_messages();
+    return count;
+}
+
+static void wait_for_messages(void) {
+    __atomic_store_n(&consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!peek() && !__atomic_load_n(&consumer_stop, __ATOMIC_SEQ_CST)) {
+        struct pollfd pfd = {.fd = wakeup_fd, .events = POLLIN};
+        poll(&pfd, 1, LOG_IDLE_WAIT_MS);
+    }
+    __atomic_store_n(&consumer_waiting, 0, __ATOMIC_SEQ_CST);
+
+    uint64_t counter;
+    if (read(wakeup_fd, &counter, sizeof(counter)) < 0) {
+        // EAGAIN just means that no producer has written to the eventfd.
+    }
+}
+
+static void* consume(void*) {
+    while (!__atomic_load_n(&consumer_stop, __ATOMIC_SEQ_CST)) {
+        if (!write_batch())
+            wait_for_messages();
+    }
+    while (write_batch())
+        ;  // Drain what is left before exiting.
+    return NULL;
+}
+
+// Called when a message could not be queued. Return true if the caller should write it
+// synchronously instead of dropping it.
+static bool must_write_synchronously(GLogLevelFlags log_level) {
+    // A fatal message will abort the process as soon as the handler returns, and errors are rare
+    // and too valuable to lose, so only less severe messages are dropped.
+    if (log_level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_NON_FATAL_ERROR | G_LOG_LEVEL_CRITICAL |
+                     G_LOG_LEVEL_ERROR))
+        return true;
+    __atomic_add_fetch(&dropped_messages, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+static void write_event(enum log_module module,
+                        GLogLevelFlags log_level,
+                        enum log_event event,
+                        const struct log_field* fields,
+                        size_t field_count,
+                        const char* format,
+                        va_list args) {
+    guint pos;
+    struct log_slot* slot = g_atomic_pointer_get(&consumer_thread) ? claim(&pos) : NULL;
+    struct log_slot unqueued_slot;
+    if (!slot) {
+        if (g_atomic_pointer_get(&consumer_thread) && !must_write_synchronously(log_level))
+            return;
+        slot = &unqueued_slot;
+    }
+
+    init_slot(slot, module, log_level, event);
+    if (field_count && slot->format == log_format_json)
+        format_fields(slot, fields, field_count);
+    g_vsnprintf(slot->message, sizeof(slot->message), format, args);
+
+    if (slot == &unqueued_slot)
+        write_synchronously(slot);
+    else
+        publish(slot, pos);
+}
+
+void log_write(enum log_module module, GLogLevelFlags log_level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    write_event(module, log_level, log_event_message, NULL, 0, format, args);
+    va_end(args);
+}
+
+void log_write_event(enum log_module module,
+                     GLogLevelFlags log_level,
+                     enum log_event event,
+                     const struct log_field* fields,
+                     size_t field_count,
+                     const char* format,
+                     ...) {
+    va_list args;
+    va_start(args, format);
+    write_event(module, log_level, event, fields, field_count, format, args);
+    va_end(args);
+}
+
+// Handler for messages logged through g_log(), e.g. by GLib itself. These are attributed to the
+// supervisor module.
+static void log_handler(__attribute__((unused)) const char* log_domain,
+                        GLogLevelFlags log_level,
+                        const char* message,
+                        __attribute__((unused)) gpointer settings_void_ptr) {
+    const GLogLevelFlags level = log_level & G_LOG_LEVEL_MASK;
+    if (!log_enabled(log_module_supervisor, log_level_to_level(level)))
+        return;
+
+    guint pos;
+    struct log_slot* slot = (log_level & G_LOG_FLAG_FATAL) ||
+                                    !g_atomic_pointer_get(&consumer_thread)
+                                ? NULL
+                                : claim(&pos);
+    struct log_slot unqueued_slot;
+    if (!slot) {
+        if (g_atomic_pointer_get(&consumer_thread) && !must_write_synchronously(log_level))
+            return;
+        slot = &unqueued_slot;
+    }
+
+    init_slot(slot, log_module_supervisor, level, log_event_message);
+    g_strlcpy(slot->message, message, sizeof(slot->message));
+
+    if (slot == &unqueued_slot)
+        write_synchronously(slot);
+    else
+        publish(slot, pos);
 }
 
 void log_init(struct log_settings* settings) {
-    if (settings->destination == log_dest_syslog)
+    destination = settings->destination;
+    if (destination == log_dest_syslog)
         openlog(NULL, LOG_PID, LOG_USER);
 
+    for (guint i = 0; i < LOG_RING_SLOTS; i++) ring[i].sequence = i;
+    for (int i = 0; i < log_module_count; i++) module_level_overrides[i] = -1;
+    update_module_levels();
+
     g_log_set_handler(NULL,
                       G_LOG_FLAG_FATAL | G_LOG_FLAG_RECURSION | G_LOG_LEVEL_MASK,
-                      settings->destination == log_dest_syslog ? log_to_syslog : log_to_stdout,
+                      log_handler,
                       settings);
+
+    // Without the consumer thread, messages are written synchronously by log_handler().
+    if ((wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return;
+    g_atomic_pointer_set(&consumer_thread, g_thread_new("log", consume, NULL));
+    atexit(log_cleanup);
+}
+
+void log_cleanup(void) {
+    GThread* thread = g_atomic_pointer_get(&consumer_thread);
+    if (!thread)
+        return;
+
+    __atomic_store_n(&consumer_stop, 1, __ATOMIC_SEQ_CST);
+    wake_consumer();
+    g_thread_join(thread);
+    g_atomic_pointer_set(&consumer_thread, NULL);
+    close(wakeup_fd);
+    wakeup_fd = -1;
+}
+
+guint log_dropped_messages(void) {
+    return __atomic_load_n(&dropped_messages, __ATOMIC_RELAXED);
 }
 
 void log_debug_set(bool enabled) {
-    g_atomic_int_set(&debug_log_enabled, enabled);
+    default_level = enabled ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO;
+    update_module_levels();
+}
+
+const char* log_module_name(enum log_module module) {
+    return module_names[module];
+}
+
+void log_format_set(enum log_format format) {
+    g_atomic_int_set(&output_format, format);
+}
+
+bool log_format_from_string(const char* name, enum log_format* format) {
+    if (g_strcmp0(name, "text") == 0)
+        *format = log_format_text;
+    else if (g_strcmp0(name, "json") == 0)
+        *format = log_format_json;
+    else
+        return false;
+    return true;
+}
+
+static int level_from_string(const char* name) {
+    if (strcmp(name, "debug") == 0)
+        return LOG_LEVEL_DEBUG;
+    if (strcmp(name, "info") == 0)
+        return LOG_LEVEL_INFO;
+    if (strcmp(name, "warn") == 0 || strcmp(name, "warning") == 0)
+        return LOG_LEVEL_WARNING;
+    if (strcmp(name, "error") == 0)
+        return LOG_LEVEL_ERROR;
+    return -1;
+}
+
+static int module_from_string(const char* name) {
+    for (int i = 0; i < log_module_count; i++)
+        if (strcmp(name, module_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+bool log_levels_parse(const char* module_levels) {
+    int overrides[log_module_count];
+    bool success = true;
+
+    for (int i = 0; i < log_module_count; i++) overrides[i] = -1;
+
+    char** items = g_strsplit(module_levels ? module_levels : "", ",", 0);
+    for (char** item = items; *item && success; item++) {
+        g_strstrip(*item);
+        if (!**item)
+            continue;
+        char* level = strchr(*item, '=');
+        if (level)
+            *level++ = '\0';
+        const int module = module_from_string(g_strstrip(*item));
+        const int value = level ? level_from_string(g_strstrip(level)) : -1;
+        if (module < 0 || value < 0) {
+            log_warning("Invalid module log level \"%s\"", *item);
+            success = false;
+        } else {
+            overrides[module] = value;
+        }
+    }
+    g_strfreev(items);
+
+    if (success) {
+        memcpy(module_level_overrides, overrides, sizeof(overrides));
+        update_module_levels();
+    }
+    return success;
 }
@@ -8,21 +8,163 @@ struct log_settings {
     enum log_destination destination;
 };
 
+// Text is the "INFO[<time>] <message>" format of dockerd. In JSON format each message is written
+// as one JSON object per line, with the members time, level, module, event and msg, followed by
+// the fields of the event, if any.
+enum log_format { log_format_text, log_format_json };
+
+// Modules with individually adjustable log levels. A source file selects its
+// module by defining LOG_MODULE before including this header.
+enum log_module {
+    log_module_supervisor,
+    log_module_fcgi,
+    log_module_upload,
+    log_module_storage,
+    log_module_tls,
+    log_module_localdata,
+    log_module_dockerd,  // Output captured from dockerd and rootlesskit
+    log_module_count,
+};
+
+#define LOG_LEVEL_DEBUG   0
+#define LOG_LEVEL_INFO    1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR   3
+
+// Log calls below this level are removed at compile time, e.g. build with
+// LOG_MIN_LEVEL=1 to strip all debug logging from a production build.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#ifndef LOG_MODULE
+#define LOG_MODULE log_module_supervisor
+#endif
+
 // Set up g_log to log to either stdout or syslog.
-// The log destination cannot be changed after this call, but the debug level
-// can be adjusted at any time by changing the 'debug' member of the struct. A
+// The log destination cannot be changed after this call, but the log levels
+// can be adjusted at any time using log_debug_set() and log_levels_parse(). A
 // pointer to the log_settings struct will be passed to g_log_set_handler(), so
 // the struct must live until the process exits.
+//
+// Messages are handed over to a background thread through a fixed-size ring
+// buffer, so logging never blocks the caller. If the ring buffer is full, the
+// message is dropped and counted instead.
 void log_init(struct log_settings* settings);
 
+// Write all queued messages and stop the background thread. Messages logged
+// after this call are written synchronously. Registered with atexit() by
+// log_init(), so queued messages are not lost when main() returns early.
+void log_cleanup(void);
+
+// Total number of messages dropped because the ring buffer was full.
+guint log_dropped_messages(void);
+
+// Set the level of all modules that have no level of their own to debug or info.
 void log_debug_set(bool enabled);
 
+// Set the level of individual modules from a comma-separated list such as
+// "upload=debug,tls=warning". Modules not in the list follow log_debug_set().
+// Return false, and leave all levels untouched, if the list is malformed.
+bool log_levels_parse(const char* module_levels);
+
+// Select the output format of messages written after this call. Text is the default.
+void log_format_set(enum log_format format);
+
+// Return false if name is neither "text" nor "json".
+bool log_format_from_string(const char* name, enum log_format* format);
+
+// Names used in log output, e.g. "INFO" and "fcgi".
+const char* log_level_to_string(GLogLevelFlags log_level);
+const char* log_module_name(enum log_module module);
+
+// Current level of each module. Accessed using g_atomic_int_get/set only.
+extern volatile int log_module_levels[log_module_count];
+
+static inline bool log_enabled(enum log_module module, int level) {
+    return level >= g_atomic_int_get(&log_module_levels[module]);
+}
+
+// Format a message straight into the ring buffer. Use the macros below, which
+// check the level before any of the arguments are evaluated.
+void log_write(enum log_module module, GLogLevelFlags log_level, const char* format, ...)
+    G_GNUC_PRINTF(3, 4);
+
+// Events that log ingestion can select on, written as the 'event' member in JSON format. Messages
+// logged with the plain macros below are of the event log_event_message.
+enum log_event {
+    log_event_message,
+    log_event_dockerd_started,
+    log_event_dockerd_exited,
+    log_event_dockerd_ready,
+    log_event_dockerd_not_ready,
+    log_event_dockerd_stopped,
+    log_event_status_changed,
+    log_event_parameter_changed,
+    log_event_http_request,
+    log_event_count,
+};
+
+enum log_field_type { log_field_int, log_field_string };
+
+// A typed value attached to an event. In JSON format, each field becomes a member of the object,
+// while the text format only writes the message. Durations are integers named with a unit
+// suffix, e.g. "duration_ms".
+struct log_field {
+    const char* key;
+    enum log_field_type type;
+    union {
+        gint64 int_value;
+        const char* string_value;
+    };
+};
+
+#define LOG_INT(key_, value) {.key = (key_), .type = log_field_int, .int_value = (value)}
+#define LOG_STR(key_, value) {.key = (key_), .type = log_field_string, .string_value = (value)}
+
+// An array of fields for the log_event_*() macros, e.g. LOG_FIELDS(LOG_INT("pid", pid)).
+#define LOG_FIELDS(...) ((const struct log_field[]){__VA_ARGS__})
+
+// Like log_write(), with an event code and fields. The fields are only formatted if the output
+// format is JSON, and are dropped one by one from the end if they do not fit in the message slot.
+void log_write_event(enum log_module module,
+                     GLogLevelFlags log_level,
+                     enum log_event event,
+                     const struct log_field* fields,
+                     size_t field_count,
+                     const char* format,
+                     ...) G_GNUC_PRINTF(6, 7);
+
 // Replacement for G_LOG_LEVEL_ERROR, which is fatal.
 #define G_LOG_LEVEL_NON_FATAL_ERROR (1 << G_LOG_LEVEL_USER_SHIFT)
 
-#define log_debug(format, ...)   g_debug(format, ##__VA_ARGS__)
-#define log_info(format, ...)    g_info(format, ##__VA_ARGS__)
-#define log_warning(format, ...) g_warning(format, ##__VA_ARGS__)
+#define log_at(level, log_level, format, ...)                             \
+    do {                                                                  \
+        if ((level) >= LOG_MIN_LEVEL && log_enabled(LOG_MODULE, (level))) \
+            log_write(LOG_MODULE, (log_level), format, ##__VA_ARGS__);    \
+    } while (0)
+
+#define log_debug(format, ...)   log_at(LOG_LEVEL_DEBUG, G_LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define log_info(format, ...)    log_at(LOG_LEVEL_INFO, G_LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define log_warning(format, ...) \
+    log_at(LOG_LEVEL_WARNING, G_LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
 
 #define log_error(format, ...) \
-    g_log(G_LOG_DOMAIN, G_LOG_LEVEL_NON_FATAL_ERROR, format, ##__VA_ARGS__)
+    log_at(LOG_LEVEL_ERROR, G_LOG_LEVEL_NON_FATAL_ERROR, format, ##__VA_ARGS__)
+
+#define log_event_at(level, log_level, event, fields, format, ...)        \
+    do {                                                                  \
+        if ((level) >= LOG_MIN_LEVEL && log_enabled(LOG_MODULE, (level))) \
+            log_write_event(LOG_MODULE,                                   \
+                            (log_level),                                  \
+                            (event),                                      \
+                            fields,                                       \
+                            G_N_ELEMENTS(fields),                         \
+                            format,                                       \
+                            ##__VA_ARGS__);                               \
+    } while (0)
+
+#define log_event_info(event, fields, format, ...) \
+    log_event_at(LOG_LEVEL_INFO, G_LOG_LEVEL_INFO, event, fields, format, ##__VA_ARGS__)
+#define log_event_warning(event, fields, format, ...) \
+    log_event_at(LOG_LEVEL_WARNING, G_LOG_LEVEL_WARNING, event, fields, format, ##__VA_ARGS__)
@@ -0,0 +1,71 @@
+#include "log_store.h"
+
+#define LOG_STORE_LINES        512
+#define LOG_STORE_MESSAGE_SIZE 256
+
+struct stored_line {
+    gint64 timestamp;
+    enum log_module module;
+    GLogLevelFlags level;
+    char message[LOG_STORE_MESSAGE_SIZE];
+};
+
+static GMutex mutex;
+static struct stored_line lines[LOG_STORE_LINES];
+static guint64 next_sequence = 1;  // Line n is stored at index n % LOG_STORE_LINES.
+static guint64 store_epoch;        // Set on first use. The mutex must be held.
+
+static void init_epoch(void) {
+    if (!store_epoch)
+        store_epoch = g_get_real_time();
+}
+
+void log_store_append(enum log_module module,
+                      GLogLevelFlags level,
+                      gint64 timestamp,
+                      const char* message) {
+    g_mutex_lock(&mutex);
+    init_epoch();
+    struct stored_line* line = &lines[next_sequence % LOG_STORE_LINES];
+    line->timestamp = timestamp;
+    line->module = module;
+    line->level = level;
+    g_strlcpy(line->message, message, sizeof(line->message));
+    next_sequence++;
+    g_mutex_unlock(&mutex);
+}
+
+guint64 log_store_epoch(void) {
+    g_mutex_lock(&mutex);
+    init_epoch();
+    const guint64 epoch = store_epoch;
+    g_mutex_unlock(&mutex);
+    return epoch;
+}
+
+guint64 log_store_read(guint64 epoch,
+                       guint64 after,
+                       guint limit,
+                       log_store_line_func func,
+                       void* user_data,
+                       guint64* next) {
+    g_mutex_lock(&mutex);
+    init_epoch();
+    const guint64 oldest = next_sequence > LOG_STORE_LINES ? next_sequence - LOG_STORE_LINES : 1;
+    if ((epoch && epoch != store_epoch) || after >= next_sequence)
+        after = 0;
+    const guint64 start = MAX(after + 1, oldest);
+    guint64 sequence = start;
+    for (; sequence < next_sequence && limit > 0; sequence++, limit--) {
+        const struct stored_line* stored = &lines[sequence % LOG_STORE_LINES];
+        const struct log_store_line line = {.sequence = sequence,
+                                            .timestamp = stored->timestamp,
+                                            .module = stored->module,
+                                            .level = stored->level,
+                                            .message = stored->message};
+        func(&line, user_data);
+    }
+    *next = sequence > start ? sequence - 1 : after;
+    g_mutex_unlock(&mutex);
+    return oldest;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "log.h"
+
+// Fixed-size in-memory store of the most recent log lines, both from the application and
+// captured from dockerd. Each line gets a sequence number, starting at 1 and increasing by one per
+// line, so that a reader can fetch only the lines it has not seen yet. Sequence numbers start over
+// when the application restarts, so they are only meaningful together with the epoch of the store,
+// which differs between processes.
+
+struct log_store_line {
+    guint64 sequence;
+    gint64 timestamp;  // Microseconds since the epoch
+    enum log_module module;
+    GLogLevelFlags level;
+    const char* message;
+};
+
+typedef void (*log_store_line_func)(const struct log_store_line* line, void* user_data);
+
+// Thread safe. Long messages are truncated.
+void log_store_append(enum log_module module,
+                      GLogLevelFlags level,
+                      gint64 timestamp,
+                      const char* message);
+
+// Return the epoch of this process' store: the time it was first used, in microseconds since the
+// epoch.
+guint64 log_store_epoch(void);
+
+// Call func for at most limit lines with a sequence number greater than after, oldest first. The
+// store is locked during the calls, so func must not log. Return the sequence number of the
+// oldest line still in the store, or the next sequence number to be used if the store is empty. A
+// reader whose 'after' is less than this value minus one has missed lines. A reader whose epoch is
+// not that of the store, or whose 'after' is ahead of the newest line, has seen the lines of an
+// earlier process, and reads from the start. An epoch of 0 is taken as that of the store. Set next
+// to the value to pass as after in the next call.
+guint64 log_store_read(guint64 epoch,
+                       guint64 after,
+                       guint limit,
+                       log_store_line_func func,
+                       void* user_data,
+                       guint64* next);
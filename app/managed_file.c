@@ -0,0 +1,102 @@
+#define LOG_MODULE log_module_localdata
+#include "managed_file.h"
+#include "app_paths.h"
+#include "json.h"
+#include "localdata_index.h"
+#include "log.h"
+#include "tls.h"
+#include "tls_client_auth.h"
+
+#define KiB 1024
+#define MiB (1024 * KiB)
+
+static enum file_validation
+validate_json_object(const char* name, const char* path_to_file, char* reason, size_t reason_size) {
+    g_autofree gchar* contents = NULL;
+    gsize length = 0;
+    char parse_reason[128];
+    if (!g_file_get_contents(path_to_file, &contents, &length, NULL))
+        g_snprintf(parse_reason, sizeof(parse_reason), "could not be read");
+    else if (json_validate_object(contents, length, parse_reason, sizeof(parse_reason)))
+        return file_validation_ok;
+    g_snprintf(reason, reason_size, "%s is not a JSON object: %s", name, parse_reason);
+    log_warning("Uploaded %s is not valid: %s", name, parse_reason);
+    return file_validation_invalid;
+}
+
+#define LOCALDATA_FILE(file, name, description, max_size, validate, reload)                        \
+    [file] = {name, APP_LOCALDATA "/" name, description, max_size, validate, reload, file}
+
+// Files in localdata come first, in the order of enum localdata_file.
+static const struct managed_file managed_files[] = {
+    LOCALDATA_FILE(localdata_ca_cert,
+                   "ca.pem",
+                   "CA certificate",
+                   256 * KiB,
+                   tls_file_validate,
+                   managed_file_reload_tls),
+    LOCALDATA_FILE(localdata_server_cert,
+                   "server-cert.pem",
+                   "server certificate",
+                   64 * KiB,
+                   tls_file_validate,
+                   managed_file_reload_tls),
+    LOCALDATA_FILE(localdata_server_key,
+                   "server-key.pem",
+                   "server key",
+                   64 * KiB,
+                   tls_file_validate,
+                   managed_file_reload_tls),
+    // dockerd reloads only some of its options on SIGHUP, and not e.g. proxies.
+    LOCALDATA_FILE(localdata_daemon_json,
+                   DAEMON_JSON,
+                   "dockerd configuration",
+                   64 * KiB,
+                   validate_json_object,
+                   managed_file_reload_restart),
+    LOCALDATA_FILE(localdata_client_allowlist,
+                   CLIENT_ALLOWLIST,
+                   "client certificate allowlist",
+                   64 * KiB,
+                   tls_client_auth_validate,
+                   managed_file_reload_tls_proxy),
+    LOCALDATA_FILE(localdata_client_crl,
+                   CLIENT_CRL,
+                   "certificate revocation list",
+                   MiB,
+                   tls_client_auth_validate,
+                   managed_file_reload_tls_proxy),
+    // Read by the Docker CLI on the device, whose home is the application directory, on each pull.
+    {REGISTRY_AUTH,
+     REGISTRY_AUTH_PATH,
+     "registry credentials",
+     64 * KiB,
+     validate_json_object,
+     managed_file_reload_none,
+     -1},
+};
+
+_Static_assert(G_N_ELEMENTS(managed_files) >= localdata_file_count,
+               "Each file in enum localdata_file must be in managed_files[]");
+
+// Maps each name to its entry in managed_files[]. Built on first use and never changed.
+static GHashTable* lookup_table(void) {
+    static gsize initialized = 0;
+    static GHashTable* table = NULL;
+    if (g_once_init_enter(&initialized)) {
+        table = g_hash_table_new(g_str_hash, g_str_equal);
+        for (size_t i = 0; i < G_N_ELEMENTS(managed_files); i++)
+            g_hash_table_insert(
+                table, (gpointer)managed_files[i].name, (gpointer)&managed_files[i]);
+        g_once_init_leave(&initialized, 1);
+    }
+    return table;
+}
+
+const struct managed_file* managed_file_find(const char* name) {
+    return g_hash_table_lookup(lookup_table(), name);
+}
+
+const struct managed_file* managed_file_in_localdata(int localdata_file) {
+    return &managed_files[localdata_file];
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// The files that can be uploaded to the application, and what it takes to put a new one to use.
+
+enum file_validation {
+    file_validation_ok,
+    file_validation_invalid,       // The file cannot be used and must be rejected
+    file_validation_inconsistent,  // Usable, but does not match the other files in localdata
+};
+
+// Check an uploaded file before it is installed. The reason for any other result than
+// file_validation_ok is written to reason.
+typedef enum file_validation (*managed_file_validator)(const char* name,
+                                                       const char* path_to_file,
+                                                       char* reason,
+                                                       size_t reason_size);
+
+// What a changed file needs to take effect, from the cheapest to the most expensive.
+enum managed_file_reload {
+    managed_file_reload_none,       // The file is read each time it is used
+    managed_file_reload_tls_proxy,  // Reload the TLS proxy. dockerd does not use the file.
+    managed_file_reload_tls,        // Reload the TLS proxy, or restart dockerd if it terminates TLS
+    managed_file_reload_restart,    // Restart dockerd
+    managed_file_reload_count,
+};
+
+struct managed_file {
+    const char* name;  // The last segment of the upload URL
+    const char* path;  // Where the file is installed
+    const char* description;
+    gsize max_size;
+    managed_file_validator validate;
+    enum managed_file_reload reload;
+    int localdata_file;  // enum localdata_file if the file is in the localdata index, otherwise -1
+};
+
+// Return the file uploaded as name, or NULL if name is not a managed file. Can be called from any
+// thread.
+const struct managed_file* managed_file_find(const char* name);
+
+// Return the managed file with an index of type enum localdata_file.
+const struct managed_file* managed_file_in_localdata(int localdata_file);
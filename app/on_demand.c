@@ -0,0 +1,427 @@
+#define _GNU_SOURCE  // For accept4() and pipe2()
+#define LOG_MODULE log_module_supervisor
+#include "on_demand.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define ON_DEMAND_MAX_CONNECTIONS 64
+#define ON_DEMAND_LISTEN_BACKLOG  16
+#define ON_DEMAND_BUFFER_SIZE     16384
+
+// Shared by the thread that starts and stops the listener, the main loop through
+// on_demand_set_dockerd(), the listener thread, the connection threads, and the FCGI thread.
+static struct {
+    GMutex mutex;
+    GCond changed;                   // Broadcast when dockerd changes state, and when stopping
+    GCond all_closed;                // Signaled when stats.connections drops to zero
+    enum on_demand_dockerd dockerd;  // Guarded by mutex
+    bool stopping;                   // Guarded by mutex
+    gint64 activation_start;         // First connection while stopped, or 0. Guarded by mutex.
+    gint64 stopped_since;            // While dockerd is stopped. Guarded by mutex.
+    gint64 last_activity;            // Ready, or a connection closed. Guarded by mutex.
+    struct on_demand_stats stats;    // Guarded by mutex
+    int unix_fd;
+    int tcp_fd;
+    int stop_pipe[2];  // Closing the write end wakes up and stops all threads
+    GThread* listener;
+    struct sockaddr_un backend;
+    struct sockaddr_in tcp_backend;
+    char* socket_path;
+    on_demand_activate_callback activate;
+    void* user_data;
+} on_demand = {.unix_fd = -1,
+               .tcp_fd = -1,
+               .stop_pipe = {-1, -1},
+               .stats.last_activation_ms = -1};
+
+// Bytes read from one side of a connection, not yet written to the other side.
+struct stream_buffer {
+    char data[ON_DEMAND_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+    bool eof;  // The side it is read from has closed
+};
+
+struct connection {
+    int client_fd;
+    int backend_fd;
+    bool tcp;                         // Accepted on the TCP port, so forwarded to the TCP backend
+    struct stream_buffer upstream;    // From the client to dockerd
+    struct stream_buffer downstream;  // From dockerd to the client
+};
+
+static bool is_empty(const struct stream_buffer* buffer) {
+    return buffer->start == buffer->end;
+}
+
+// Wait for events on fds[0..count-2]. The last entry is filled in with the stop pipe. Return false
+// if stopping.
+static bool wait_for(struct pollfd* fds, nfds_t count) {
+    fds[count - 1] = (struct pollfd){.fd = on_demand.stop_pipe[0], .events = POLLIN};
+    while (poll(fds, count, -1) < 0)
+        if (errno != EINTR)
+            return false;
+    return !fds[count - 1].revents;
+}
+
+// The time in on_demand_stopped so far. The mutex must be held.
+static void add_stopped_time(gint64 now) {
+    if (on_demand.dockerd == on_demand_stopped && on_demand.stopped_since)
+        on_demand.stats.stopped_ms_total += (now - on_demand.stopped_since) / 1000;
+    on_demand.stopped_since = now;
+}
+
+// Set the state of dockerd. The mutex must be held.
+static void set_state(enum on_demand_dockerd state) {
+    const gint64 now = g_get_monotonic_time();
+    add_stopped_time(now);
+    if (state == on_demand_ready && on_demand.dockerd != on_demand_ready) {
+        on_demand.last_activity = now;
+        if (on_demand.activation_start) {
+            const gint64 elapsed_ms = (now - on_demand.activation_start) / 1000;
+            on_demand.stats.activations++;
+            on_demand.stats.activation_ms_total += elapsed_ms;
+            on_demand.stats.last_activation_ms = elapsed_ms;
+            log_info("dockerd was ready %" G_GINT64_FORMAT " ms after the first connection",
+                     elapsed_ms);
+        }
+    }
+    if (state != on_demand_starting)
+        on_demand.activation_start = 0;
+    on_demand.dockerd = state;
+    g_cond_broadcast(&on_demand.changed);
+}
+
+// Ask for dockerd to be started if it is stopped, and wait until it is ready. Return false if it
+// is stopped again, on timeout, or if stopping.
+static bool wait_for_dockerd(void) {
+    bool activate = false;
+    g_mutex_lock(&on_demand.mutex);
+    if (on_demand.dockerd == on_demand_stopped) {
+        set_state(on_demand_starting);
+        on_demand.activation_start = g_get_monotonic_time();
+        activate = true;
+    }
+    g_mutex_unlock(&on_demand.mutex);
+
+    if (activate) {
+        log_info("Starting dockerd for a connection");
+        on_demand.activate(on_demand.user_data);
+    }
+
+    g_mutex_lock(&on_demand.mutex);
+    const gint64 deadline =
+        g_get_monotonic_time() + ON_DEMAND_ACTIVATION_TIMEOUT_SEC * G_USEC_PER_SEC;
+    while (!on_demand.stopping && on_demand.dockerd == on_demand_starting &&
+           g_cond_wait_until(&on_demand.changed, &on_demand.mutex, deadline))
+        continue;
+    const bool ready = !on_demand.stopping && on_demand.dockerd == on_demand_ready;
+    g_mutex_unlock(&on_demand.mutex);
+    if (!ready)
+        log_warning("Closed a connection, since dockerd did not become ready");
+    return ready;
+}
+
+static bool connect_to_backend(struct connection* c) {
+    const struct sockaddr* address = c->tcp ? (const struct sockaddr*)&on_demand.tcp_backend
+                                            : (const struct sockaddr*)&on_demand.backend;
+    const socklen_t length = c->tcp ? sizeof(on_demand.tcp_backend) : sizeof(on_demand.backend);
+    c->backend_fd = socket(address->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->backend_fd < 0 || connect(c->backend_fd, address, length) != 0 ||
+        fcntl(c->backend_fd, F_SETFL, O_NONBLOCK) != 0) {
+        log_warning("Failed to connect to dockerd: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Move what can be moved from the socket from to the socket to through buffer, without blocking,
+// and add the poll events that it is blocked on. A closed side is passed on as a half close, which
+// clients such as 'docker attach' depend on. Return false on error.
+static bool transfer(int from,
+                     int to,
+                     struct stream_buffer* buffer,
+                     short* from_events,
+                     short* to_events,
+                     bool* progress) {
+    if (is_empty(buffer) && !buffer->eof) {
+        const ssize_t n = recv(from, buffer->data, sizeof(buffer->data), 0);
+        buffer->start = 0;
+        buffer->end = n > 0 ? n : 0;
+        if (n >= 0) {
+            buffer->eof = n == 0;
+            if (buffer->eof)
+                shutdown(to, SHUT_WR);
+            *progress = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            *from_events |= POLLIN;
+        } else {
+            return false;
+        }
+    }
+    if (!is_empty(buffer)) {
+        const ssize_t n =
+            send(to, buffer->data + buffer->start, buffer->end - buffer->start, MSG_NOSIGNAL);
+        if (n > 0) {
+            buffer->start += n;
+            *progress = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            *to_events |= POLLOUT;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Move data both ways until both sides have closed, either side fails, or stopping.
+static void forward(struct connection* c) {
+    struct pollfd fds[3];
+    while (true) {
+        short client_events;
+        short backend_events;
+        bool progress;
+        do {
+            client_events = 0;
+            backend_events = 0;
+            progress = false;
+            if (!transfer(c->client_fd,
+                          c->backend_fd,
+                          &c->upstream,
+                          &client_events,
+                          &backend_events,
+                          &progress) ||
+                !transfer(c->backend_fd,
+                          c->client_fd,
+                          &c->downstream,
+                          &backend_events,
+                          &client_events,
+                          &progress))
+                return;
+            if (c->upstream.eof && c->downstream.eof && is_empty(&c->downstream))
+                return;
+        } while (progress);
+
+        fds[0] = (struct pollfd){.fd = client_events ? c->client_fd : -1, .events = client_events};
+        fds[1] =
+            (struct pollfd){.fd = backend_events ? c->backend_fd : -1, .events = backend_events};
+        if (!wait_for(fds, G_N_ELEMENTS(fds)))
+            return;
+    }
+}
+
+static void close_connection(struct connection* c) {
+    close(c->client_fd);
+    if (c->backend_fd >= 0)
+        close(c->backend_fd);
+    g_free(c);
+
+    g_mutex_lock(&on_demand.mutex);
+    on_demand.last_activity = g_get_monotonic_time();
+    if (--on_demand.stats.connections == 0)
+        g_cond_broadcast(&on_demand.all_closed);
+    g_mutex_unlock(&on_demand.mutex);
+}
+
+static void* serve_connection(void* connection_void_ptr) {
+    struct connection* c = connection_void_ptr;
+    if (wait_for_dockerd() && connect_to_backend(c))
+        forward(c);
+    close_connection(c);
+    return NULL;
+}
+
+static void accept_connection(int listen_fd) {
+    const int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        log_debug("accept4() failed: %s", strerror(errno));
+        return;
+    }
+
+    g_mutex_lock(&on_demand.mutex);
+    const bool full = on_demand.stats.connections >= ON_DEMAND_MAX_CONNECTIONS;
+    if (!full)
+        on_demand.stats.connections++;
+    g_mutex_unlock(&on_demand.mutex);
+    if (full) {
+        log_warning("Closed connection, since %d are already open", ON_DEMAND_MAX_CONNECTIONS);
+        close(fd);
+        return;
+    }
+
+    struct connection* c = g_new(struct connection, 1);
+    c->client_fd = fd;
+    c->backend_fd = -1;
+    c->tcp = listen_fd == on_demand.tcp_fd;
+    c->upstream.start = c->upstream.end = 0;
+    c->upstream.eof = false;
+    c->downstream.start = c->downstream.end = 0;
+    c->downstream.eof = false;
+
+    GError* error = NULL;
+    GThread* thread = g_thread_try_new("on_demand_connection", serve_connection, c, &error);
+    if (!thread) {
+        log_error("Failed to start connection thread: %s", error->message);
+        g_clear_error(&error);
+        close_connection(c);
+        return;
+    }
+    g_thread_unref(thread);  // The thread cleans up after itself
+}
+
+static void* accept_connections(void*) {
+    struct pollfd fds[3] = {{.fd = on_demand.unix_fd, .events = POLLIN},
+                            {.fd = on_demand.tcp_fd, .events = POLLIN}};
+    while (wait_for(fds, G_N_ELEMENTS(fds))) {
+        if (fds[0].revents)
+            accept_connection(on_demand.unix_fd);
+        if (fds[1].revents)
+            accept_connection(on_demand.tcp_fd);
+    }
+    return NULL;
+}
+
+static void close_fd(int* fd) {
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+// Replace any socket left at path by dockerd, and let the group of the user connect, like the
+// socket of dockerd.
+static int listen_on_unix_socket(const char* path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+    unlink(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (const struct sockaddr*)&address, sizeof(address)) != 0 ||
+        chmod(path, 0660) != 0 || listen(fd, ON_DEMAND_LISTEN_BACKLOG) != 0) {
+        log_error("Failed to listen on %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_on_tcp_port(const char* address, guint16 port) {
+    struct sockaddr_in in = {.sin_family = AF_INET, .sin_port = htons(port)};
+    const int reuse = 1;
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || inet_pton(AF_INET, address, &in.sin_addr) != 1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(fd, (const struct sockaddr*)&in, sizeof(in)) != 0 ||
+        listen(fd, ON_DEMAND_LISTEN_BACKLOG) != 0) {
+        log_error("Failed to listen on %s:%u: %s", address, port, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool on_demand_start(const char* socket_path,
+                     const char* backend_path,
+                     const char* tcp_address,
+                     guint16 tcp_port,
+                     on_demand_activate_callback activate,
+                     void* user_data) {
+    on_demand.backend.sun_family = AF_UNIX;
+    g_strlcpy(on_demand.backend.sun_path, backend_path, sizeof(on_demand.backend.sun_path));
+    on_demand.tcp_backend = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(tcp_port + ON_DEMAND_TCP_BACKEND_OFFSET),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    on_demand.activate = activate;
+    on_demand.user_data = user_data;
+
+    if (socket_path && (on_demand.unix_fd = listen_on_unix_socket(socket_path)) < 0)
+        goto error;
+    if (tcp_address && (on_demand.tcp_fd = listen_on_tcp_port(tcp_address, tcp_port)) < 0)
+        goto error;
+    if (pipe2(on_demand.stop_pipe, O_CLOEXEC) != 0) {
+        log_error("Failed to create pipe: %s", strerror(errno));
+        goto error;
+    }
+    on_demand.socket_path = g_strdup(socket_path);
+
+    g_mutex_lock(&on_demand.mutex);
+    on_demand.stopping = false;
+    on_demand.dockerd = on_demand_stopped;
+    on_demand.stopped_since = g_get_monotonic_time();
+    on_demand.stats.running = true;
+    g_mutex_unlock(&on_demand.mutex);
+    on_demand.listener = g_thread_new("on_demand", accept_connections, NULL);
+    log_info("Holding the sockets of dockerd, to start it on demand");
+    return true;
+
+error:
+    close_fd(&on_demand.unix_fd);
+    close_fd(&on_demand.tcp_fd);
+    return false;
+}
+
+void on_demand_set_dockerd(enum on_demand_dockerd state) {
+    g_mutex_lock(&on_demand.mutex);
+    if (on_demand.stats.running) {
+        if (state == on_demand_stopped && on_demand.dockerd == on_demand_ready)
+            on_demand.stats.idle_stops++;
+        set_state(state);
+    }
+    g_mutex_unlock(&on_demand.mutex);
+}
+
+gint64 on_demand_idle_ms(void) {
+    g_mutex_lock(&on_demand.mutex);
+    const gint64 idle_ms = on_demand.stats.connections || on_demand.dockerd != on_demand_ready
+                               ? 0
+                               : (g_get_monotonic_time() - on_demand.last_activity) / 1000;
+    g_mutex_unlock(&on_demand.mutex);
+    return idle_ms;
+}
+
+void on_demand_stop(void) {
+    if (!on_demand.listener)
+        return;
+
+    g_mutex_lock(&on_demand.mutex);
+    on_demand.stopping = true;
+    g_cond_broadcast(&on_demand.changed);
+    g_mutex_unlock(&on_demand.mutex);
+
+    close_fd(&on_demand.stop_pipe[1]);
+    g_thread_join(on_demand.listener);
+    on_demand.listener = NULL;
+
+    g_mutex_lock(&on_demand.mutex);
+    while (on_demand.stats.connections) g_cond_wait(&on_demand.all_closed, &on_demand.mutex);
+    add_stopped_time(g_get_monotonic_time());
+    on_demand.stopped_since = 0;
+    on_demand.stats.running = false;
+    g_mutex_unlock(&on_demand.mutex);
+
+    close_fd(&on_demand.stop_pipe[0]);
+    close_fd(&on_demand.unix_fd);
+    close_fd(&on_demand.tcp_fd);
+    if (on_demand.socket_path)
+        unlink(on_demand.socket_path);
+    g_clear_pointer(&on_demand.socket_path, g_free);
+    log_info("Released the sockets of dockerd");
+}
+
+void on_demand_get_stats(struct on_demand_stats* stats) {
+    g_mutex_lock(&on_demand.mutex);
+    *stats = on_demand.stats;
+    if (stats->running && on_demand.dockerd == on_demand_stopped && on_demand.stopped_since)
+        stats->stopped_ms_total += (g_get_monotonic_time() - on_demand.stopped_since) / 1000;
+    g_mutex_unlock(&on_demand.mutex);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// Holds the sockets that clients use to reach dockerd, so that dockerd, and the rest of the
+// rootless stack, only has to run while it is used. A connection that arrives while dockerd is
+// stopped asks for it to be started, and every connection waits until dockerd is ready before it
+// is forwarded.
+
+// How long a connection waits for dockerd to become ready before it is closed
+#define ON_DEMAND_ACTIVATION_TIMEOUT_SEC 120
+
+// dockerd's TCP port is published by rootlesskit on the loopback interface, at the public port
+// plus this, for the application to forward to.
+#define ON_DEMAND_TCP_BACKEND_OFFSET 10000
+
+enum on_demand_dockerd {
+    on_demand_stopped,   // A connection will ask for dockerd to be started
+    on_demand_starting,  // Connections wait
+    on_demand_ready,     // Connections are forwarded
+};
+
+// Counters since the application started.
+struct on_demand_stats {
+    bool running;
+    guint connections;            // Open, whether forwarded or waiting for dockerd
+    guint64 activations;          // Starts of dockerd for a connection, that became ready
+    guint64 activation_ms_total;  // From the first connection until dockerd was ready, summed
+    gint64 last_activation_ms;    // Of the last activation, or -1 if there has been none
+    guint64 idle_stops;           // Times a ready dockerd was stopped
+    guint64 stopped_ms_total;     // In on_demand_stopped, including the time so far
+};
+
+// Called on a connection thread, when dockerd must be started.
+typedef void (*on_demand_activate_callback)(void* user_data);
+
+// Listen on the Unix socket at socket_path, unless it is NULL, and forward to the Unix socket at
+// backend_path. Listen on tcp_address:tcp_port, unless tcp_address is NULL, and forward to
+// 127.0.0.1:tcp_port + ON_DEMAND_TCP_BACKEND_OFFSET. dockerd is taken to be stopped. Log and
+// return false on error.
+bool on_demand_start(const char* socket_path,
+                     const char* backend_path,
+                     const char* tcp_address,
+                     guint16 tcp_port,
+                     on_demand_activate_callback activate,
+                     void* user_data);
+
+// Tell the state of dockerd. Waiting connections are forwarded when it becomes ready, and closed
+// if it is stopped. Does nothing if not running.
+void on_demand_set_dockerd(enum on_demand_dockerd state);
+
+// Return the milliseconds since dockerd became ready, or since the last connection was closed,
+// whichever is later. Return 0 if a connection is open, or dockerd is not ready.
+gint64 on_demand_idle_ms(void);
+
+// Close the sockets and all connections. Return when all threads have ended.
+void on_demand_stop(void);
+
+// Can be called from any thread.
+void on_demand_get_stats(struct on_demand_stats* stats);
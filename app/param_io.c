@@ -0,0 +1,252 @@
+#define LOG_MODULE log_module_supervisor
+#include "param_io.h"
+#include "log.h"
+#include <string.h>
+
+const guint param_io_bucket_ms[PARAM_IO_BUCKET_COUNT] = {1, 5, 10, 50, 100, 500, 1000, 5000};
+
+// Reads queued together by param_io_get_current_async()
+struct batch {
+    guint remaining;     // Reads not completed yet. Guarded by mutex.
+    bool failed;         // Guarded by mutex
+    GHashTable* values;  // Guarded by mutex until remaining is zero
+    param_io_values_callback callback;
+    void* user_data;
+};
+
+struct call {
+    enum param_io_op op;
+    AXParameter* handle;
+    char* name;
+    char* value;  // To write, or the value read
+    bool done;
+    guint refs;           // The queue or the thread, and a reader that waits. Guarded by mutex.
+    gint64 queued_at;     // From g_get_monotonic_time()
+    struct batch* batch;  // For a read of param_io_get_current_async(), otherwise NULL
+};
+
+// Shared by the threads that make calls, and the parameter thread.
+static struct {
+    GMutex mutex;
+    GCond queued;                 // Signaled when a call is queued, and when stopping
+    GCond done;                   // Broadcast when a call has completed
+    bool stopping;                // Guarded by mutex
+    GQueue calls;                 // Of struct call, not yet started. Guarded by mutex.
+    GHashTable* values;           // Last value read or written, by name. Guarded by mutex.
+    struct param_io_stats stats;  // Guarded by mutex
+    GThread* thread;
+} io = {.calls = G_QUEUE_INIT};
+
+// The mutex must be held.
+static void unref_call(struct call* call) {
+    if (--call->refs)
+        return;
+    g_free(call->name);
+    g_free(call->value);
+    g_free(call);
+}
+
+// The mutex must be held.
+static void record_latency(const struct call* call, bool success) {
+    struct param_io_latency* latency = &io.stats.ops[call->op];
+    const gint64 elapsed_us = g_get_monotonic_time() - call->queued_at;
+    for (int i = 0; i < PARAM_IO_BUCKET_COUNT; i++)
+        if (elapsed_us <= (gint64)param_io_bucket_ms[i] * 1000)
+            latency->buckets[i]++;
+    latency->count++;
+    latency->sum_us += elapsed_us;
+    latency->errors += !success;
+}
+
+// Make the call, without the mutex held. Return false on error.
+static bool perform(struct call* call) {
+    GError* error = NULL;
+    bool success;
+    if (call->op == param_io_get_op) {
+        success = ax_parameter_get(call->handle, call->name, &call->value, &error);
+        if (!success)
+            log_error("Failed to fetch parameter value of %s. Error: %s",
+                      call->name,
+                      error->message);
+    } else {
+        log_debug("About to set %s to %s", call->name, call->value);
+        success = ax_parameter_set(call->handle, call->name, call->value, true, &error);
+        if (!success)
+            log_error("Failed to write parameter value of %s to %s. Error: %s",
+                      call->name,
+                      call->value,
+                      error->message);
+    }
+    g_clear_error(&error);
+    if (!success)
+        g_clear_pointer(&call->value, g_free);
+    return success;
+}
+
+// Meant to be used with g_idle_add() once all reads of batch have completed.
+static gboolean deliver_batch(void* batch_void_ptr) {
+    struct batch* batch = batch_void_ptr;
+    batch->callback(batch->failed ? NULL : batch->values, batch->user_data);
+    g_hash_table_unref(batch->values);
+    g_free(batch);
+    return G_SOURCE_REMOVE;
+}
+
+// The mutex must be held.
+static void complete_batch_read(const struct call* call, bool success) {
+    struct batch* batch = call->batch;
+    if (success)
+        g_hash_table_insert(batch->values, g_strdup(call->name), g_strdup(call->value));
+    batch->failed |= !success;
+    if (--batch->remaining == 0)
+        g_idle_add(deliver_batch, batch);
+}
+
+static void* run_calls(void*) {
+    g_mutex_lock(&io.mutex);
+    for (;;) {
+        struct call* call = g_queue_pop_head(&io.calls);
+        if (!call && io.stopping)
+            break;
+        if (!call) {
+            g_cond_wait(&io.queued, &io.mutex);
+            continue;
+        }
+        g_mutex_unlock(&io.mutex);
+
+        const bool success = perform(call);
+
+        g_mutex_lock(&io.mutex);
+        record_latency(call, success);
+        if (success)
+            g_hash_table_insert(io.values, g_strdup(call->name), g_strdup(call->value));
+        io.stats.queued--;
+        if (call->batch)
+            complete_batch_read(call, success);
+        call->done = true;
+        g_cond_broadcast(&io.done);
+        unref_call(call);
+    }
+    g_mutex_unlock(&io.mutex);
+    return NULL;
+}
+
+void param_io_start(void) {
+    if (io.thread)
+        return;
+    io.values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    io.stopping = false;
+    io.thread = g_thread_new("param_io", run_calls, NULL);
+}
+
+void param_io_stop(void) {
+    if (!io.thread)
+        return;
+
+    g_mutex_lock(&io.mutex);
+    io.stopping = true;
+    g_cond_signal(&io.queued);
+    g_mutex_unlock(&io.mutex);
+
+    g_thread_join(io.thread);
+    io.thread = NULL;
+    g_clear_pointer(&io.values, g_hash_table_unref);
+}
+
+// Queue call. The mutex must be held.
+static void queue_call(struct call* call) {
+    call->queued_at = g_get_monotonic_time();
+    g_queue_push_tail(&io.calls, call);
+    io.stats.queued++;
+    g_cond_signal(&io.queued);
+}
+
+// Queue a read of parameter name, and wait at most timeout_ms for it. Return with the mutex held,
+// and the call referenced, to be released with unref_call().
+static struct call* wait_for_get(AXParameter* handle, const char* name, int timeout_ms) {
+    struct call* call = g_new0(struct call, 1);
+    call->op = param_io_get_op;
+    call->handle = handle;
+    call->name = g_strdup(name);
+    call->refs = 2;
+
+    g_mutex_lock(&io.mutex);
+    queue_call(call);
+    const gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+    while (!call->done && g_cond_wait_until(&io.done, &io.mutex, deadline)) continue;
+    if (!call->done)
+        io.stats.timeouts++;
+    return call;
+}
+
+char* param_io_get(AXParameter* handle, const char* name, int timeout_ms) {
+    struct call* call = wait_for_get(handle, name, timeout_ms);
+    char* value;
+    if (call->done) {
+        value = g_strdup(call->value);
+    } else {
+        value = g_strdup(g_hash_table_lookup(io.values, name));
+        log_warning("Reading parameter %s took more than %d ms, using %s",
+                    name,
+                    timeout_ms,
+                    value ? "the last known value" : "no value");
+    }
+    unref_call(call);
+    g_mutex_unlock(&io.mutex);
+    return value;
+}
+
+void param_io_get_current_async(AXParameter* handle,
+                                const char* const* names,
+                                param_io_values_callback callback,
+                                void* user_data) {
+    struct batch* batch = g_new0(struct batch, 1);
+    batch->values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    batch->callback = callback;
+    batch->user_data = user_data;
+
+    g_mutex_lock(&io.mutex);
+    for (const char* const* name = names; *name; name++) {
+        struct call* call = g_new0(struct call, 1);
+        call->op = param_io_get_op;
+        call->handle = handle;
+        call->name = g_strdup(*name);
+        call->refs = 1;
+        call->batch = batch;
+        batch->remaining++;
+        queue_call(call);
+    }
+    if (!batch->remaining)
+        g_idle_add(deliver_batch, batch);
+    g_mutex_unlock(&io.mutex);
+}
+
+void param_io_set(AXParameter* handle, const char* name, const char* value) {
+    g_mutex_lock(&io.mutex);
+    for (GList* item = io.calls.head; item; item = item->next) {
+        struct call* queued = item->data;
+        if (queued->op == param_io_set_op && queued->handle == handle &&
+            strcmp(queued->name, name) == 0) {
+            g_free(queued->value);
+            queued->value = g_strdup(value);
+            io.stats.replaced_sets++;
+            g_mutex_unlock(&io.mutex);
+            return;
+        }
+    }
+
+    struct call* call = g_new0(struct call, 1);
+    call->op = param_io_set_op;
+    call->handle = handle;
+    call->name = g_strdup(name);
+    call->value = g_strdup(value);
+    call->refs = 1;
+    queue_call(call);
+    g_mutex_unlock(&io.mutex);
+}
+
+void param_io_get_stats(struct param_io_stats* stats) {
+    g_mutex_lock(&io.mutex);
+    *stats = io.stats;
+    g_mutex_unlock(&io.mutex);
+}
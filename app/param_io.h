@@ -0,0 +1,64 @@
+#pragma once
+#include <axsdk/axparameter.h>
+#include <glib.h>
+#include <stdbool.h>
+
+// Runs all AXParameter reads and writes of the application on a thread of its own. Writes are
+// queued without waiting, and reads either wait at most PARAM_IO_TIMEOUT_MS, or complete with a
+// callback, so that a slow parameter service, or a read while AXParameter callbacks are queued,
+// cannot stall the main loop, which supervises dockerd. A read that times out falls back to the
+// last known value.
+
+#define PARAM_IO_TIMEOUT_MS 2000
+
+// Upper bounds of the latency histogram buckets, in milliseconds. Slower calls are only counted in
+// the total.
+#define PARAM_IO_BUCKET_COUNT 8
+extern const guint param_io_bucket_ms[PARAM_IO_BUCKET_COUNT];
+
+enum param_io_op { param_io_get_op, param_io_set_op, PARAM_IO_OP_COUNT };
+
+// Time from a call being queued until it has completed, whether the caller waited for it or not.
+struct param_io_latency {
+    guint64 buckets[PARAM_IO_BUCKET_COUNT];  // Calls at most as slow as each bound, cumulative
+    guint64 count;
+    guint64 sum_us;
+    guint64 errors;  // Included in count
+};
+
+struct param_io_stats {
+    struct param_io_latency ops[PARAM_IO_OP_COUNT];
+    guint64 timeouts;       // Reads that returned before the call completed
+    guint64 replaced_sets;  // Queued writes replaced by a later write of the same parameter
+    guint queued;           // Calls waiting for the thread, or in progress
+};
+
+void param_io_start(void);
+
+// Wait for the queued writes, and end the thread. Must be called before the handle is freed.
+void param_io_stop(void);
+
+// Return the value of parameter name, to be freed with g_free(). If the call does not complete
+// within timeout_ms, return the last value that was read or written instead, or NULL if there is
+// none. Also return NULL on error.
+char* param_io_get(AXParameter* handle, const char* name, int timeout_ms);
+
+// Called from the main loop with the values read by param_io_get_current_async(), by name, or with
+// NULL if a read failed. The values are freed when the callback returns.
+typedef void (*param_io_values_callback)(GHashTable* values, void* user_data);
+
+// Queue reads of the parameters in names, a NULL terminated array, and return at once. callback is
+// called from the main loop once they have all completed, however long that takes. Unlike
+// param_io_get(), never use an earlier value. Meant for settings that must not be acted on when
+// stale.
+void param_io_get_current_async(AXParameter* handle,
+                                const char* const* names,
+                                param_io_values_callback callback,
+                                void* user_data);
+
+// Queue a write of value to parameter name, and return at once. A queued write of the same
+// parameter that has not started yet is replaced, since only the last value matters.
+void param_io_set(AXParameter* handle, const char* name, const char* value);
+
+// Can be called from any thread.
+void param_io_get_stats(struct param_io_stats* stats);
@@ -5,7 +5,9 @@ if [ ! -e /usr/bin/containerd ]; then
 	exit 77 # EX_NOPERM
 fi
 
-UID_DOT_GID="$(stat -c %u.%g localdata)"
+APP_UID="$(stat -c %u localdata)"
+APP_GID="$(stat -c %g localdata)"
+UID_DOT_GID="$APP_UID.$APP_GID"
 IS_ROOT=$([ "$(id -u)" -eq 0 ] && echo true || echo false)
 
 # Create empty daemon.json
@@ -17,9 +19,14 @@ if [ ! -e "$DAEMON_JSON" ]; then
 fi
 
 # ACAP framework does not handle ownership on SD card, which causes problem when
-# the app user ID changes. If run as root, this script will repair the ownership.
+# the app user ID changes. If run as root, this script will repair the ownership. The walk is
+# skipped when the last repair was for the same user, since it can take long on a full SD card.
 APP_NAME="$(basename "$(pwd)")"
 SD_CARD_AREA=/var/spool/storage/SD_DISK/areas/"$APP_NAME"
 if $IS_ROOT && [ -d "$SD_CARD_AREA" ]; then
-	chown -R "$UID_DOT_GID" "$SD_CARD_AREA"
+	if RESULT="$(./fix_ownership "$APP_UID" "$APP_GID" "$SD_CARD_AREA" 2>&1)"; then
+		logger -p user.info "$0: $RESULT"
+	else
+		logger -p user.warn "$0: Failed to repair ownership on the SD card. $RESULT"
+	fi
 fi
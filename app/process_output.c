@@ -0,0 +1,227 @@
+#define _GNU_SOURCE  // For F_SETPIPE_SZ
+#define LOG_MODULE log_module_dockerd
+#include "process_output.h"
+#include "log.h"
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LINE_BUFFER_SIZE     1024
+#define READS_PER_WAKEUP     16  // Give other main loop sources a chance during a flood.
+#define LINES_PER_SECOND     50
+#define LINE_BURST           200
+#define SUMMARY_INTERVAL_SEC 10
+#define FIFO_SIZE            (1024 * 1024)  // Output kept while no one reads it
+
+// Token bucket shared by the streams of one process.
+struct rate_limit {
+    int refs;
+    char* name;
+    double tokens;
+    gint64 last_refill;  // g_get_monotonic_time()
+    guint suppressed;
+    guint suppressed_errors;
+    gint64 suppressed_since;
+};
+
+struct stream {
+    struct rate_limit* rate_limit;
+    int fd;
+    size_t len;
+    char line[LINE_BUFFER_SIZE];
+};
+
+static GLogLevelFlags level_of_line(const char* line) {
+    const char* level = strstr(line, "level=");
+    if (!level)
+        return G_LOG_LEVEL_INFO;
+    level += strlen("level=");
+
+    if (g_str_has_prefix(level, "debug") || g_str_has_prefix(level, "trace"))
+        return G_LOG_LEVEL_DEBUG;
+    if (g_str_has_prefix(level, "warn"))
+        return G_LOG_LEVEL_WARNING;
+    if (g_str_has_prefix(level, "error"))
+        return G_LOG_LEVEL_NON_FATAL_ERROR;
+    if (g_str_has_prefix(level, "fatal") || g_str_has_prefix(level, "panic"))
+        return G_LOG_LEVEL_CRITICAL;
+    return G_LOG_LEVEL_INFO;
+}
+
+static int to_level(GLogLevelFlags log_level) {
+    switch (log_level) {
+        case G_LOG_LEVEL_DEBUG:
+            return LOG_LEVEL_DEBUG;
+        case G_LOG_LEVEL_INFO:
+            return LOG_LEVEL_INFO;
+        case G_LOG_LEVEL_WARNING:
+            return LOG_LEVEL_WARNING;
+        default:
+            return LOG_LEVEL_ERROR;
+    }
+}
+
+static void refill(struct rate_limit* rate_limit) {
+    const gint64 now = g_get_monotonic_time();
+    rate_limit->tokens +=
+        (double)(now - rate_limit->last_refill) * LINES_PER_SECOND / G_USEC_PER_SEC;
+    if (rate_limit->tokens > LINE_BURST)
+        rate_limit->tokens = LINE_BURST;
+    rate_limit->last_refill = now;
+}
+
+static void log_suppression_summary(struct rate_limit* rate_limit) {
+    if (!rate_limit->suppressed)
+        return;
+    log_write(LOG_MODULE,
+              G_LOG_LEVEL_WARNING,
+              "Suppressed %u lines (%u warnings or errors) from %s during the last "
+              "%" G_GINT64_FORMAT " s",
+              rate_limit->suppressed,
+              rate_limit->suppressed_errors,
+              rate_limit->name,
+              (g_get_monotonic_time() - rate_limit->suppressed_since) / G_USEC_PER_SEC);
+    rate_limit->suppressed = 0;
+    rate_limit->suppressed_errors = 0;
+}
+
+static void forward_line(struct rate_limit* rate_limit, const char* line) {
+    if (!*line)
+        return;
+
+    const GLogLevelFlags log_level = level_of_line(line);
+    const int level = to_level(log_level);
+    if (!log_enabled(LOG_MODULE, level))
+        return;
+
+    refill(rate_limit);
+    if (rate_limit->tokens < 1) {
+        if (!rate_limit->suppressed)
+            rate_limit->suppressed_since = g_get_monotonic_time();
+        rate_limit->suppressed++;
+        if (level >= LOG_LEVEL_WARNING)
+            rate_limit->suppressed_errors++;
+        if (g_get_monotonic_time() - rate_limit->suppressed_since >=
+            SUMMARY_INTERVAL_SEC * G_USEC_PER_SEC)
+            log_suppression_summary(rate_limit);
+        return;
+    }
+    rate_limit->tokens--;
+
+    log_suppression_summary(rate_limit);
+    log_write(LOG_MODULE, log_level, "%s", line);
+}
+
+static void rate_limit_unref(struct rate_limit* rate_limit) {
+    if (--rate_limit->refs)
+        return;
+    log_suppression_summary(rate_limit);
+    g_free(rate_limit->name);
+    g_free(rate_limit);
+}
+
+// Forward all complete lines in the buffer and keep a partial last line. A line that does not fit
+// in the buffer is forwarded in pieces.
+static void forward_lines(struct stream* stream) {
+    char* start = stream->line;
+    char* end = stream->line + stream->len;
+    char* newline;
+    while ((newline = memchr(start, '\n', end - start))) {
+        *newline = '\0';
+        forward_line(stream->rate_limit, start);
+        start = newline + 1;
+    }
+    stream->len = end - start;
+    if (stream->len == sizeof(stream->line) - 1) {
+        stream->line[stream->len] = '\0';
+        forward_line(stream->rate_limit, stream->line);
+        stream->len = 0;
+    } else {
+        memmove(stream->line, start, stream->len);
+    }
+}
+
+static void close_stream(struct stream* stream) {
+    stream->line[stream->len] = '\0';
+    forward_line(stream->rate_limit, stream->line);
+    close(stream->fd);
+    rate_limit_unref(stream->rate_limit);
+    g_free(stream);
+}
+
+static gboolean read_stream(gint fd, GIOCondition condition, gpointer stream_void_ptr) {
+    struct stream* stream = stream_void_ptr;
+
+    for (int i = 0; i < READS_PER_WAKEUP; i++) {
+        const size_t space = sizeof(stream->line) - 1 - stream->len;
+        const ssize_t bytes_read = read(fd, stream->line + stream->len, space);
+        if (bytes_read > 0) {
+            stream->len += bytes_read;
+            forward_lines(stream);
+        } else if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return G_SOURCE_CONTINUE;
+        } else {
+            if (bytes_read < 0)
+                log_warning("Failed to read output from %s: %s",
+                            stream->rate_limit->name,
+                            strerror(errno));
+            close_stream(stream);
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    if (condition & (G_IO_ERR | G_IO_NVAL)) {
+        close_stream(stream);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void watch_stream(struct rate_limit* rate_limit, int fd) {
+    GError* error = NULL;
+    if (!g_unix_set_fd_nonblocking(fd, TRUE, &error)) {
+        log_warning("Failed to make output from %s non-blocking: %s",
+                    rate_limit->name,
+                    error->message);
+        g_clear_error(&error);
+    }
+
+    struct stream* stream = g_malloc0(sizeof(struct stream));
+    stream->rate_limit = rate_limit;
+    stream->fd = fd;
+    rate_limit->refs++;
+    g_unix_fd_add(fd, G_IO_IN | G_IO_HUP | G_IO_ERR, read_stream, stream);
+}
+
+void process_output_watch(const char* name, int stdout_fd, int stderr_fd) {
+    struct rate_limit* rate_limit = g_malloc0(sizeof(struct rate_limit));
+    rate_limit->name = g_strdup(name);
+    rate_limit->tokens = LINE_BURST;
+    rate_limit->last_refill = g_get_monotonic_time();
+
+    rate_limit->refs = 1;  // Keep it alive until both streams have been set up.
+    watch_stream(rate_limit, stdout_fd);
+    watch_stream(rate_limit, stderr_fd);
+    rate_limit_unref(rate_limit);
+}
+
+int process_output_open_fifo(const char* path, int* child_fd) {
+    struct stat st;
+    if (mkfifo(path, 0600) != 0 &&
+        (errno != EEXIST || stat(path, &st) != 0 || !S_ISFIFO(st.st_mode))) {
+        log_error("Failed to create FIFO %s: %s", path, strerror(errno));
+        return -1;
+    }
+    // Not blocking, since opening a FIFO without writers to read would block.
+    const int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 || (child_fd && (*child_fd = open(path, O_RDWR | O_CLOEXEC)) < 0)) {
+        log_error("Failed to open FIFO %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (child_fd && fcntl(*child_fd, F_SETPIPE_SZ, FIFO_SIZE) < 0)
+        log_debug("Failed to resize FIFO %s: %s", path, strerror(errno));
+    return fd;
+}
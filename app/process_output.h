@@ -0,0 +1,16 @@
+#pragma once
+
+// Forward the output of a child process to the log, line by line, from the main loop. The
+// level of each line is taken from its logrus style "level=" field, and lines beyond a fixed rate
+// are suppressed and summarized instead. Both file descriptors are made non-blocking and are
+// closed when the child process closes its end of the pipes.
+void process_output_watch(const char* name, int stdout_fd, int stderr_fd);
+
+// Open the FIFO at path, creating it if needed, for output of a child process that may outlive
+// the application. Return the end to pass to process_output_watch(), and set child_fd to the end to
+// give the child, which the caller closes once the child has been started. The end of the child is
+// also open for reading, so that the child is not killed by SIGPIPE while the application is not
+// running, but the child blocks once the FIFO is full, unless something else, such as
+// drain_output, reads it. If child_fd is NULL, only open the end to read, for a child that is
+// already running. Log and return -1 on error.
+int process_output_open_fifo(const char* path, int* child_fd);
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE  // For syscall()
+#define LOG_MODULE log_module_supervisor
+#include "process_record.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define HASH_SIZE 64  // Hexadecimal SHA-256
+
+// Until when the recorded processes are to be left running, from g_get_monotonic_time(), or 0
+static gint64 keep_until;
+static GMutex keep_mutex;
+
+// Without a wrapper in glibc before 2.36.
+static int open_pidfd(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Return the start time of pid in clock ticks since boot, field 22 of /proc/<pid>/stat, or 0 if it
+// is not running.
+static guint64 process_start_ticks(pid_t pid) {
+    char path[32];
+    g_snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    g_autofree char* stat = NULL;
+    if (!g_file_get_contents(path, &stat, NULL, NULL))
+        return 0;
+    // The name in field 2 may contain spaces and parentheses, so count from the last ')'.
+    const char* field = strrchr(stat, ')');
+    for (int i = 2; field && i < 22; i++)
+        field = strchr(field + 1, ' ');
+    return field ? g_ascii_strtoull(field + 1, NULL, 10) : 0;
+}
+
+bool process_record_write(const char* path, pid_t pid, const char* hash) {
+    g_autofree char* record =
+        g_strdup_printf("%d %" G_GUINT64_FORMAT " %s\n", pid, process_start_ticks(pid), hash);
+    GError* error = NULL;
+    if (!g_file_set_contents(path, record, -1, &error)) {
+        log_warning("Failed to write %s: %s", path, error->message);
+        g_clear_error(&error);
+        return false;
+    }
+    return true;
+}
+
+int process_record_find(const char* path,
+                        const char* hash,
+                        pid_t* pid,
+                        gint64* start_time,
+                        bool* same_settings) {
+    g_autofree char* record = NULL;
+    if (!g_file_get_contents(path, &record, NULL, NULL))
+        return -1;
+
+    int recorded_pid = 0;
+    guint64 recorded_ticks = 0;
+    char recorded_hash[HASH_SIZE + 1] = "";
+    const bool parsed = sscanf(record,
+                               "%d %" G_GUINT64_FORMAT " %" G_STRINGIFY(HASH_SIZE) "s",
+                               &recorded_pid,
+                               &recorded_ticks,
+                               recorded_hash) == 3;
+    int pidfd = -1;
+    if (parsed && recorded_pid > 0 && recorded_ticks &&
+        (pidfd = open_pidfd(recorded_pid)) < 0 && errno == ENOSYS)
+        log_warning("Processes cannot be taken over, since pidfds are not supported");
+    // Checked after the pidfd is opened, which then refers to the recorded process or to none.
+    if (pidfd >= 0 && process_start_ticks(recorded_pid) != recorded_ticks) {
+        close(pidfd);
+        pidfd = -1;
+    }
+    if (pidfd < 0) {
+        unlink(path);
+        return -1;
+    }
+
+    *pid = recorded_pid;
+    // Ticks since boot, which the monotonic clock also counts from, as long as the device is not
+    // suspended.
+    *start_time = recorded_ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+    *same_settings = strcmp(recorded_hash, hash) == 0;
+    return pidfd;
+}
+
+void process_record_keep_on_stop(guint timeout_sec) {
+    g_mutex_lock(&keep_mutex);
+    keep_until = timeout_sec ? g_get_monotonic_time() + (gint64)timeout_sec * G_USEC_PER_SEC : 0;
+    g_mutex_unlock(&keep_mutex);
+}
+
+bool process_record_kept_on_stop(void) {
+    g_mutex_lock(&keep_mutex);
+    const bool kept = g_get_monotonic_time() < keep_until;
+    g_mutex_unlock(&keep_mutex);
+    return kept;
+}
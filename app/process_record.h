@@ -0,0 +1,32 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A record in a file of a child process that may outlive the application, such as when the
+// application crashes or is replaced by a new version, so that the next instance can take over the
+// supervision of the process instead of starting another. The process is identified by its pid and
+// its start time, so that a reused pid is not mistaken for it, and the record holds a hash of the
+// settings it was started with.
+
+// Record that pid was started with the settings that hash identifies. Log and return false on
+// error.
+bool process_record_write(const char* path, pid_t pid, const char* hash);
+
+// If the recorded process is running, return a pidfd for it, which becomes readable when the
+// process exits, and set pid, start_time as from g_get_monotonic_time(), and same_settings to
+// whether it was started with hash. A process with other settings is left for the caller to stop,
+// without blocking. Return -1 if the recorded process is not running, and then remove the record.
+int process_record_find(const char* path,
+                        const char* hash,
+                        pid_t* pid,
+                        gint64* start_time,
+                        bool* same_settings);
+
+// Ask for the recorded processes to be left running if the application stops within timeout_sec,
+// such as for an upgrade, for the next instance to take over. Cancel that if timeout_sec is 0. Can
+// be called from any thread.
+void process_record_keep_on_stop(guint timeout_sec);
+
+// Return true if the recorded processes are to be left running as the application stops now.
+bool process_record_kept_on_stop(void);
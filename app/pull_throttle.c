@@ -0,0 +1,419 @@
+#define _GNU_SOURCE  // For accept4() and pipe2()
+#define LOG_MODULE log_module_supervisor
+#include "pull_throttle.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PULL_THROTTLE_MAX_CONNECTIONS 32
+#define PULL_THROTTLE_BUFFER_SIZE     16384
+#define PULL_THROTTLE_HEAD_MAX        4096
+#define PULL_THROTTLE_TIMEOUT_MS      10000  // For the CONNECT request and the upstream connect
+#define PULL_THROTTLE_HTTPS_PORT      443
+#define PULL_THROTTLE_MAX_PORTS       16  // Of registries, besides the HTTPS port
+// Data received after an idle period may be sent at once, up to this many microseconds worth.
+#define PULL_THROTTLE_BURST_US 200000
+
+// Shared by the thread that starts and stops the proxy, the listener thread, the connection
+// threads, and the FCGI thread through pull_throttle_set_rate().
+static struct {
+    GMutex mutex;
+    GCond all_closed;   // Signaled when connections drops to zero
+    guint connections;  // Guarded by mutex
+    guint64 rate;       // Bytes per second. Guarded by mutex.
+    gint64 next_send;   // When the data let through so far is sent at rate. Guarded by mutex.
+    guint16 ports[PULL_THROTTLE_MAX_PORTS];  // Of registries. Guarded by mutex.
+    guint port_count;                        // Guarded by mutex
+    int listen_fd;
+    int stop_pipe[2];  // Closing the write end wakes up and stops all threads
+    struct in_addr address;
+    GThread* listener;
+} throttle = {.listen_fd = -1, .stop_pipe = {-1, -1}};
+
+// Wait until bytes may be let through at the current rate. Return false if the proxy is stopping.
+static bool wait_for_rate(size_t bytes) {
+    g_mutex_lock(&throttle.mutex);
+    const gint64 now = g_get_monotonic_time();
+    throttle.next_send = MAX(throttle.next_send, now - PULL_THROTTLE_BURST_US);
+    throttle.next_send += bytes * G_USEC_PER_SEC / MAX(throttle.rate, 1);
+    const gint64 delay_ms = (throttle.next_send - now) / 1000;
+    g_mutex_unlock(&throttle.mutex);
+
+    struct pollfd stop = {.fd = throttle.stop_pipe[0], .events = POLLIN};
+    return delay_ms <= 0 || poll(&stop, 1, delay_ms) == 0;
+}
+
+// Wait for events on fds[0..count-2]. The last entry is filled in with the stop pipe. Return false
+// if the proxy is stopping, or on timeout.
+static bool wait_for(struct pollfd* fds, nfds_t count, int timeout_ms) {
+    fds[count - 1] = (struct pollfd){.fd = throttle.stop_pipe[0], .events = POLLIN};
+    int ready;
+    while ((ready = poll(fds, count, timeout_ms)) < 0 && errno == EINTR) continue;
+    return ready > 0 && !fds[count - 1].revents;
+}
+
+static bool write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        const ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// Read the request head, and return the host and port of a CONNECT request in target, e.g.
+// "registry-1.docker.io:443".
+static bool read_connect_request(int fd, char* target, size_t target_size) {
+    char head[PULL_THROTTLE_HEAD_MAX + 1];
+    size_t length = 0;
+    while (!g_strstr_len(head, length, "\r\n\r\n")) {
+        struct pollfd fds[2] = {{.fd = fd, .events = POLLIN}};
+        if (length == PULL_THROTTLE_HEAD_MAX ||
+            !wait_for(fds, G_N_ELEMENTS(fds), PULL_THROTTLE_TIMEOUT_MS))
+            return false;
+        const ssize_t n = recv(fd, head + length, PULL_THROTTLE_HEAD_MAX - length, 0);
+        if (n <= 0)
+            return false;
+        length += n;
+    }
+    head[length] = '\0';
+
+    if (!g_str_has_prefix(head, "CONNECT "))
+        return false;
+    const char* start = head + strlen("CONNECT ");
+    const char* end = strchr(start, ' ');
+    if (!end || end == start || (size_t)(end - start) >= target_size)
+        return false;
+    g_strlcpy(target, start, end - start + 1);
+    return true;
+}
+
+// Return the port of a registry, as given in the settings, e.g. "https://mirror.example.com:5000",
+// "registry.example.com:5000" or "[2001:db8::1]:5000", or 0 if it has none.
+static guint16 registry_port(const char* registry) {
+    const char* host = strstr(registry, "://");
+    host = host ? host + strlen("://") : registry;
+    g_autofree char* authority = g_strndup(host, strcspn(host, "/"));
+    // An IPv6 address is written within brackets, and a bare one has no port.
+    const char* bracket = strrchr(authority, ']');
+    const char* colon = strrchr(bracket ? bracket : authority, ':');
+    if (!colon || (!bracket && strchr(authority, ':') != colon))
+        return 0;
+    guint64 port;
+    return g_ascii_string_to_unsigned(colon + 1, 10, 1, G_MAXUINT16, &port, NULL) ? port : 0;
+}
+
+static bool port_allowed(guint16 port) {
+    if (port == PULL_THROTTLE_HTTPS_PORT)
+        return true;
+    g_mutex_lock(&throttle.mutex);
+    bool allowed = false;
+    for (guint i = 0; i < throttle.port_count && !allowed; i++)
+        allowed = throttle.ports[i] == port;
+    g_mutex_unlock(&throttle.mutex);
+    return allowed;
+}
+
+static bool ipv4_forbidden(const struct in_addr* address) {
+    const in_addr_t a = ntohl(address->s_addr);
+    return a == INADDR_ANY || a == INADDR_BROADCAST || (a >> 24) == 127 ||
+           (a >> 16) == 0xa9fe /* 169.254.0.0/16 */ || IN_MULTICAST(a);
+}
+
+// Return true if address reaches the device itself, or does not leave its link. Containers reach
+// the proxy through slirp, so forwarding there would give them the services of the device that
+// rootlesskit keeps from them with --disable-host-loopback.
+static bool address_forbidden(const struct sockaddr* address, const struct ifaddrs* own) {
+    if (address->sa_family == AF_INET) {
+        const struct in_addr* a = &((const struct sockaddr_in*)address)->sin_addr;
+        if (ipv4_forbidden(a))
+            return true;
+        for (; own; own = own->ifa_next)
+            if (own->ifa_addr && own->ifa_addr->sa_family == AF_INET &&
+                ((const struct sockaddr_in*)own->ifa_addr)->sin_addr.s_addr == a->s_addr)
+                return true;
+        return false;
+    }
+    if (address->sa_family == AF_INET6) {
+        const struct in6_addr* a = &((const struct sockaddr_in6*)address)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a) || IN6_IS_ADDR_V4COMPAT(a)) {
+            struct in_addr v4;
+            memcpy(&v4, &a->s6_addr[12], sizeof(v4));
+            const struct sockaddr_in mapped = {.sin_family = AF_INET, .sin_addr = v4};
+            return address_forbidden((const struct sockaddr*)&mapped, own);
+        }
+        if (IN6_IS_ADDR_UNSPECIFIED(a) || IN6_IS_ADDR_LOOPBACK(a) || IN6_IS_ADDR_LINKLOCAL(a) ||
+            IN6_IS_ADDR_MULTICAST(a))
+            return true;
+        for (; own; own = own->ifa_next)
+            if (own->ifa_addr && own->ifa_addr->sa_family == AF_INET6 &&
+                IN6_ARE_ADDR_EQUAL(&((const struct sockaddr_in6*)own->ifa_addr)->sin6_addr, a))
+                return true;
+        return false;
+    }
+    return true;
+}
+
+// Split target, e.g. "registry-1.docker.io:443" or "[2001:db8::1]:443", into host and port.
+// Return false if it has no valid port.
+static bool split_target(const char* target, char* host, size_t host_size, guint16* port) {
+    const char* colon = strrchr(target, ':');
+    guint64 number;
+    if (!colon || !g_ascii_string_to_unsigned(colon + 1, 10, 1, G_MAXUINT16, &number, NULL))
+        return false;
+    *port = number;
+    // An IPv6 address is written within brackets.
+    const bool bracketed = *target == '[' && colon > target && colon[-1] == ']';
+    const char* start = bracketed ? target + 1 : target;
+    const size_t length = colon - start - (bracketed ? 1 : 0);
+    if (length == 0 || length >= host_size)
+        return false;
+    g_strlcpy(host, start, length + 1);
+    return true;
+}
+
+// Connect to host and port. Return the socket, or -1 with forbidden set if each address of host
+// is forbidden, see address_forbidden(), or clear if the connection failed.
+static int connect_upstream(const char* host, guint16 port, bool* forbidden) {
+    char port_text[8];
+    g_snprintf(port_text, sizeof(port_text), "%u", port);
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* addresses;
+    *forbidden = false;
+    if (getaddrinfo(host, port_text, &hints, &addresses) != 0)
+        return -1;
+    struct ifaddrs* own = NULL;
+    if (getifaddrs(&own) != 0)
+        log_warning("Failed to get the addresses of the device: %s", strerror(errno));
+
+    int fd = -1;
+    bool any_allowed = false;
+    for (struct addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+        if (address_forbidden(a->ai_addr, own))
+            continue;
+        any_allowed = true;
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        const struct timeval timeout = {PULL_THROTTLE_TIMEOUT_MS / 1000, 0};
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+                        connect(fd, a->ai_addr, a->ai_addrlen) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeifaddrs(own);
+    freeaddrinfo(addresses);
+    *forbidden = !any_allowed;
+    return fd;
+}
+
+// Forward data both ways until either side closes, or the proxy is stopped. Data from the registry
+// is let through at the current rate.
+static void forward(int client_fd, int upstream_fd) {
+    char buffer[PULL_THROTTLE_BUFFER_SIZE];
+    struct pollfd fds[3] = {{.fd = client_fd, .events = POLLIN},
+                            {.fd = upstream_fd, .events = POLLIN}};
+    while (wait_for(fds, G_N_ELEMENTS(fds), -1)) {
+        for (int i = 0; i < 2; i++) {
+            if (!fds[i].revents)
+                continue;
+            const ssize_t n = recv(fds[i].fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                return;
+            if ((fds[i].fd == upstream_fd && !wait_for_rate(n)) ||
+                !write_all(fds[1 - i].fd, buffer, n))
+                return;
+        }
+    }
+}
+
+static void* serve_connection(void* fd_ptr) {
+    const int client_fd = GPOINTER_TO_INT(fd_ptr);
+    char target[256];
+    char host[256];
+    guint16 port;
+    bool forbidden = false;
+    int upstream_fd = -1;
+    static const char refused[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
+    if (!read_connect_request(client_fd, target, sizeof(target))) {
+        static const char bad_request[] = "HTTP/1.1 405 Method Not Allowed\r\n\r\n";
+        write_all(client_fd, bad_request, strlen(bad_request));
+    } else if (!split_target(target, host, sizeof(host), &port) || !port_allowed(port)) {
+        log_warning("Refused to forward to %s, which is not on the port of a registry", target);
+        write_all(client_fd, refused, strlen(refused));
+    } else if ((upstream_fd = connect_upstream(host, port, &forbidden)) < 0 && forbidden) {
+        log_warning("Refused to forward to %s, which is on the device or its link", target);
+        write_all(client_fd, refused, strlen(refused));
+    } else if (upstream_fd < 0) {
+        log_warning("Failed to connect to %s for dockerd", target);
+        static const char bad_gateway[] = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
+        write_all(client_fd, bad_gateway, strlen(bad_gateway));
+    } else {
+        log_debug("Forwarding a connection to %s at the pull rate", target);
+        static const char established[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+        if (write_all(client_fd, established, strlen(established)))
+            forward(client_fd, upstream_fd);
+        close(upstream_fd);
+    }
+    close(client_fd);
+
+    g_mutex_lock(&throttle.mutex);
+    if (--throttle.connections == 0)
+        g_cond_broadcast(&throttle.all_closed);
+    g_mutex_unlock(&throttle.mutex);
+    return NULL;
+}
+
+static void accept_connection(int fd, const struct sockaddr_in* peer) {
+    if (peer->sin_addr.s_addr != throttle.address.s_addr) {
+        log_warning("Refused a pull proxy connection from %s", inet_ntoa(peer->sin_addr));
+        close(fd);
+        return;
+    }
+
+    g_mutex_lock(&throttle.mutex);
+    const bool full = throttle.connections >= PULL_THROTTLE_MAX_CONNECTIONS;
+    if (!full)
+        throttle.connections++;
+    g_mutex_unlock(&throttle.mutex);
+    if (full) {
+        log_warning("Closed pull proxy connection, since %d are already open",
+                    PULL_THROTTLE_MAX_CONNECTIONS);
+        close(fd);
+        return;
+    }
+
+    GError* error = NULL;
+    GThread* thread =
+        g_thread_try_new("pull_connection", serve_connection, GINT_TO_POINTER(fd), &error);
+    if (!thread) {
+        log_error("Failed to start pull proxy connection thread: %s", error->message);
+        g_clear_error(&error);
+        close(fd);
+        g_mutex_lock(&throttle.mutex);
+        if (--throttle.connections == 0)
+            g_cond_broadcast(&throttle.all_closed);
+        g_mutex_unlock(&throttle.mutex);
+        return;
+    }
+    g_thread_unref(thread);  // The thread cleans up after itself
+}
+
+static void* accept_connections(void*) {
+    // Make writes to a closed connection fail with EPIPE rather than kill the application. The
+    // connection threads inherit the signal mask.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    struct pollfd fds[2] = {{.fd = throttle.listen_fd, .events = POLLIN}};
+    while (wait_for(fds, G_N_ELEMENTS(fds), -1)) {
+        struct sockaddr_in peer;
+        socklen_t peer_size = sizeof(peer);
+        const int fd =
+            accept4(throttle.listen_fd, (struct sockaddr*)&peer, &peer_size, SOCK_CLOEXEC);
+        if (fd >= 0)
+            accept_connection(fd, &peer);
+        else
+            log_debug("accept4() failed: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+static void close_fd(int* fd) {
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+char* pull_throttle_start(const char* address, guint64 bytes_per_second) {
+    struct sockaddr_in listen_address = {.sin_family = AF_INET};
+    socklen_t address_size = sizeof(listen_address);
+    if (inet_pton(AF_INET, address, &listen_address.sin_addr) != 1) {
+        log_error("Invalid address %s for the pull proxy", address);
+        return NULL;
+    }
+    if ((throttle.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(throttle.listen_fd, (struct sockaddr*)&listen_address, address_size) != 0 ||
+        getsockname(throttle.listen_fd, (struct sockaddr*)&listen_address, &address_size) != 0 ||
+        listen(throttle.listen_fd, PULL_THROTTLE_MAX_CONNECTIONS) != 0) {
+        log_error("Failed to listen on %s for the pull proxy: %s", address, strerror(errno));
+        close_fd(&throttle.listen_fd);
+        return NULL;
+    }
+    if (pipe2(throttle.stop_pipe, O_CLOEXEC) != 0) {
+        log_error("Failed to create pipe: %s", strerror(errno));
+        close_fd(&throttle.listen_fd);
+        return NULL;
+    }
+
+    throttle.address = listen_address.sin_addr;
+    pull_throttle_set_rate(bytes_per_second);
+    throttle.listener = g_thread_new("pull_throttle", accept_connections, NULL);
+    const guint16 port = ntohs(listen_address.sin_port);
+    log_info("Limiting image pulls to %" G_GUINT64_FORMAT " bytes/s through port %u",
+             bytes_per_second,
+             port);
+    return g_strdup_printf("http://%s:%u", address, port);
+}
+
+void pull_throttle_set_rate(guint64 bytes_per_second) {
+    g_mutex_lock(&throttle.mutex);
+    throttle.rate = bytes_per_second;
+    g_mutex_unlock(&throttle.mutex);
+}
+
+void pull_throttle_set_registries(const char* registries) {
+    gchar** entries = g_strsplit(registries, ",", -1);
+    g_mutex_lock(&throttle.mutex);
+    throttle.port_count = 0;
+    for (gchar** entry = entries; *entry; entry++) {
+        const guint16 port = registry_port(g_strstrip(*entry));
+        if (!port || port == PULL_THROTTLE_HTTPS_PORT)
+            continue;
+        if (throttle.port_count == PULL_THROTTLE_MAX_PORTS) {
+            log_warning("Pulls through the pull throttle are limited to %d registry ports",
+                        PULL_THROTTLE_MAX_PORTS);
+            break;
+        }
+        throttle.ports[throttle.port_count++] = port;
+    }
+    g_mutex_unlock(&throttle.mutex);
+    g_strfreev(entries);
+}
+
+void pull_throttle_stop(void) {
+    if (!throttle.listener)
+        return;
+
+    close_fd(&throttle.stop_pipe[1]);
+    g_thread_join(throttle.listener);
+    throttle.listener = NULL;
+
+    g_mutex_lock(&throttle.mutex);
+    while (throttle.connections) g_cond_wait(&throttle.all_closed, &throttle.mutex);
+    g_mutex_unlock(&throttle.mutex);
+
+    close_fd(&throttle.stop_pipe[0]);
+    close_fd(&throttle.listen_fd);
+    log_info("Stopped limiting image pulls");
+}
+
+bool pull_throttle_running(void) {
+    return throttle.listener;
+}
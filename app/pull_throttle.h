@@ -0,0 +1,26 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// A forward proxy for the HTTPS connections that dockerd makes to registries, which limits the rate
+// at which image layers are received, so that pulls leave room for the video streams on the link.
+
+// Listen for HTTP CONNECT requests on address, which must be an IPv4 address of the device that
+// dockerd can reach, on a port chosen by the system. Only connections from the device itself are
+// served, and since containers connect from that address too, only to port 443 or the port of a
+// registry, see pull_throttle_set_registries(), and never to the device itself, loopback or
+// link-local addresses. Return a proxy URL for dockerd to use, which must be freed with g_free(),
+// or NULL on error.
+char* pull_throttle_start(const char* address, guint64 bytes_per_second);
+
+// Also allow connections to the ports of registries, given as comma-separated URLs or host[:port],
+// as in the registry settings. Can be called from any thread, also before the proxy is started.
+void pull_throttle_set_registries(const char* registries);
+
+// Change the rate, which applies to all connections together. Can be called from any thread.
+void pull_throttle_set_rate(guint64 bytes_per_second);
+
+// Close the listening socket and all connections. Return when all threads have ended.
+void pull_throttle_stop(void);
+
+bool pull_throttle_running(void);
@@ -0,0 +1,338 @@
+#define LOG_MODULE log_module_storage
+#include "registry_cache.h"
+#include "docker_api.h"
+#include "json.h"
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONTAINER_NAME "acap-registry-cache"
+#define IMAGE          "registry:2"
+#define REMOTE_URL     "https://registry-1.docker.io"
+#define DEBUG_PORT     5001  // Serves the request counters, on the loopback interface only
+
+#define API_TIMEOUT_MS   10000
+#define PULL_TIMEOUT_MS  120000  // Between two progress messages
+#define STATS_TIMEOUT_MS 1000
+
+#define SCAN_INTERVAL_SEC 600
+// Eviction makes room for this much more than what it has to, so that it does not run on every
+// scan once the cache is full.
+#define EVICT_TO_PERCENT 90
+
+// Shared by the thread that starts and stops the cache, the cache thread, and the FCGI thread
+// through registry_cache_get_stats().
+static struct {
+    GMutex mutex;
+    GCond wakeup;                       // Signaled when stopping
+    bool stopping;                      // Guarded by mutex
+    struct registry_cache_stats stats;  // Guarded by mutex
+    GThread* thread;
+    char* docker_socket;
+    char* storage_directory;
+} cache;
+
+struct blob {
+    char* directory;
+    guint64 size;
+    gint64 last_used;
+};
+
+static int request(const char* method, const char* path, const char* json_body, int timeout_ms) {
+    return docker_api_request(cache.docker_socket, method, path, json_body, NULL, timeout_ms);
+}
+
+static void remove_container(void) {
+    const int status =
+        request("DELETE", "/containers/" CONTAINER_NAME "?force=true", NULL, API_TIMEOUT_MS);
+    if (status == 204)
+        log_info("Removed the registry cache container");
+    else if (status != 404)
+        log_warning("Failed to remove the registry cache container, status %d", status);
+}
+
+// A pull that fails after it has started still gets status 200, with the error in the progress
+// messages, so the image is looked up again afterwards.
+static bool pull_image(void) {
+    if (request("GET", "/images/" IMAGE "/json", NULL, API_TIMEOUT_MS) == 200)
+        return true;
+    log_info("Pulling %s for the registry cache", IMAGE);
+    request("POST", "/images/create?fromImage=" IMAGE, NULL, PULL_TIMEOUT_MS);
+    if (request("GET", "/images/" IMAGE "/json", NULL, API_TIMEOUT_MS) == 200)
+        return true;
+    log_error("Failed to pull %s for the registry cache", IMAGE);
+    return false;
+}
+
+static bool create_and_start_container(void) {
+    GString* body = g_string_new(NULL);
+    g_string_append_printf(body,
+                           "{\"Image\":\"%s\","
+                           "\"Env\":[\"REGISTRY_PROXY_REMOTEURL=%s\","
+                           "\"REGISTRY_HTTP_DEBUG_ADDR=:%d\"],"
+                           "\"ExposedPorts\":{\"%d/tcp\":{},\"%d/tcp\":{}},"
+                           "\"HostConfig\":{\"Binds\":[",
+                           IMAGE,
+                           REMOTE_URL,
+                           DEBUG_PORT,
+                           REGISTRY_CACHE_PORT,
+                           DEBUG_PORT);
+    g_autofree char* bind = g_strdup_printf("%s:/var/lib/registry", cache.storage_directory);
+    json_append_string(body, bind);
+    g_string_append_printf(body,
+                           "],\"PortBindings\":{\"%d/tcp\":[{\"HostPort\":\"%d\"}],"
+                           "\"%d/tcp\":[{\"HostIp\":\"127.0.0.1\",\"HostPort\":\"%d\"}]},"
+                           "\"RestartPolicy\":{\"Name\":\"on-failure\"}}}",
+                           REGISTRY_CACHE_PORT,
+                           REGISTRY_CACHE_PORT,
+                           DEBUG_PORT,
+                           DEBUG_PORT);
+    const int created = request(
+        "POST", "/containers/create?name=" CONTAINER_NAME, body->str, API_TIMEOUT_MS);
+    g_string_free(body, TRUE);
+    if (created != 201) {
+        log_error("Failed to create the registry cache container, status %d", created);
+        return false;
+    }
+    const int started =
+        request("POST", "/containers/" CONTAINER_NAME "/start", NULL, API_TIMEOUT_MS);
+    if (started != 204) {
+        log_error("Failed to start the registry cache container, status %d", started);
+        return false;
+    }
+    return true;
+}
+
+static void clear_blob(void* blob_void_ptr) {
+    g_free(((struct blob*)blob_void_ptr)->directory);
+}
+
+static int compare_last_used(const void* a_void_ptr, const void* b_void_ptr) {
+    const struct blob* a = a_void_ptr;
+    const struct blob* b = b_void_ptr;
+    return (a->last_used > b->last_used) - (a->last_used < b->last_used);
+}
+
+// Add each blob that the registry has stored, in blobs/sha256/<2 hex digits>/<digest>/data, to
+// blobs, and return their total size.
+static guint64 scan_blobs(GArray* blobs) {
+    g_autofree char* root = g_build_filename(
+        cache.storage_directory, "docker", "registry", "v2", "blobs", "sha256", NULL);
+    GDir* prefixes = g_dir_open(root, 0, NULL);
+    if (!prefixes)
+        return 0;  // Nothing has been cached yet
+
+    guint64 total = 0;
+    const char* prefix;
+    while ((prefix = g_dir_read_name(prefixes))) {
+        g_autofree char* prefix_path = g_build_filename(root, prefix, NULL);
+        GDir* digests = g_dir_open(prefix_path, 0, NULL);
+        if (!digests)
+            continue;
+        const char* digest;
+        while ((digest = g_dir_read_name(digests))) {
+            g_autofree char* directory = g_build_filename(prefix_path, digest, NULL);
+            g_autofree char* data = g_build_filename(directory, "data", NULL);
+            struct stat st;
+            if (stat(data, &st) != 0)
+                continue;
+            // The access time is only updated once a day with relatime, but it is recent enough
+            // to tell the layers of the images in use from those of replaced images.
+            struct blob blob = {g_steal_pointer(&directory),
+                                st.st_size,
+                                MAX(st.st_atime, st.st_mtime)};
+            g_array_append_val(blobs, blob);
+            total += blob.size;
+        }
+        g_dir_close(digests);
+    }
+    g_dir_close(prefixes);
+    return total;
+}
+
+static bool remove_blob(const char* directory) {
+    g_autofree char* data = g_build_filename(directory, "data", NULL);
+    if (unlink(data) != 0 || rmdir(directory) != 0) {
+        log_warning("Failed to evict %s from the registry cache: %s", directory, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Remove the least recently used blobs if the cache has grown above its maximum size. The registry
+// fetches a removed blob from Docker Hub again the next time it is asked for.
+static void evict_least_recently_used(void) {
+    GArray* blobs = g_array_new(FALSE, FALSE, sizeof(struct blob));
+    g_array_set_clear_func(blobs, clear_blob);
+    guint64 size = scan_blobs(blobs);
+
+    const guint64 max_size = cache.stats.max_size_bytes;
+    guint64 evicted_blobs = 0;
+    guint64 evicted_bytes = 0;
+    if (size > max_size) {
+        g_array_sort(blobs, compare_last_used);
+        const guint64 target_size = max_size / 100 * EVICT_TO_PERCENT;
+        for (guint i = 0; i < blobs->len && size > target_size; i++) {
+            const struct blob* blob = &g_array_index(blobs, struct blob, i);
+            if (!remove_blob(blob->directory))
+                continue;
+            size -= blob->size;
+            evicted_blobs++;
+            evicted_bytes += blob->size;
+        }
+        log_info("Evicted %" G_GUINT64_FORMAT " blobs, %" G_GUINT64_FORMAT
+                 " bytes, from the registry cache",
+                 evicted_blobs,
+                 evicted_bytes);
+        // The registry remembers the blobs it has served, and must forget the evicted ones.
+        const char* restart = "/containers/" CONTAINER_NAME "/restart?t=5";
+        if (evicted_blobs && request("POST", restart, NULL, API_TIMEOUT_MS) != 204)
+            log_warning("Failed to restart the registry cache container after eviction");
+    }
+    g_array_free(blobs, TRUE);
+
+    g_mutex_lock(&cache.mutex);
+    cache.stats.size_bytes = size;
+    cache.stats.evicted_blobs += evicted_blobs;
+    cache.stats.evicted_bytes += evicted_bytes;
+    g_mutex_unlock(&cache.mutex);
+}
+
+static void* run_cache(void*) {
+    remove_container();
+    if (!cache.storage_directory)
+        return NULL;
+
+    if (g_mkdir_with_parents(cache.storage_directory, 0755) != 0) {
+        log_error("Failed to create %s: %s", cache.storage_directory, strerror(errno));
+        return NULL;
+    }
+    if (!pull_image() || !create_and_start_container())
+        return NULL;
+    log_info("Hosting a registry cache on port %d, with its storage in %s",
+             REGISTRY_CACHE_PORT,
+             cache.storage_directory);
+
+    g_mutex_lock(&cache.mutex);
+    cache.stats.running = true;
+    while (!cache.stopping) {
+        g_mutex_unlock(&cache.mutex);
+        evict_least_recently_used();
+        g_mutex_lock(&cache.mutex);
+        const gint64 next_scan = g_get_monotonic_time() + SCAN_INTERVAL_SEC * G_TIME_SPAN_SECOND;
+        while (!cache.stopping && g_cond_wait_until(&cache.wakeup, &cache.mutex, next_scan))
+            ;
+    }
+    g_mutex_unlock(&cache.mutex);
+    return NULL;
+}
+
+void registry_cache_start(const char* docker_socket,
+                          const char* storage_directory,
+                          guint64 max_size_bytes) {
+    registry_cache_stop();
+
+    cache.docker_socket = g_strdup(docker_socket);
+    cache.storage_directory = g_strdup(storage_directory);
+    g_mutex_lock(&cache.mutex);
+    cache.stopping = false;
+    cache.stats.max_size_bytes = max_size_bytes;
+    g_mutex_unlock(&cache.mutex);
+    cache.thread = g_thread_new("registry_cache", run_cache, NULL);
+}
+
+void registry_cache_stop(void) {
+    if (!cache.thread)
+        return;
+
+    g_mutex_lock(&cache.mutex);
+    cache.stopping = true;
+    g_cond_signal(&cache.wakeup);
+    g_mutex_unlock(&cache.mutex);
+    g_thread_join(cache.thread);
+    cache.thread = NULL;
+
+    g_mutex_lock(&cache.mutex);
+    cache.stats.running = false;
+    g_mutex_unlock(&cache.mutex);
+    g_clear_pointer(&cache.docker_socket, g_free);
+    g_clear_pointer(&cache.storage_directory, g_free);
+}
+
+// The value is followed by more JSON, which ends the number.
+static void read_counter(const char* key,
+                         gsize key_length,
+                         const char* value,
+                         gsize,
+                         void* requests_void_ptr) {
+    struct registry_cache_requests* requests = requests_void_ptr;
+    const guint64 number = g_ascii_strtoull(value, NULL, 10);
+    if (json_is_key(key, key_length, "Requests"))
+        requests->requests = number;
+    else if (json_is_key(key, key_length, "Hits"))
+        requests->hits = number;
+    else if (json_is_key(key, key_length, "Misses"))
+        requests->misses = number;
+    else if (json_is_key(key, key_length, "BytesPulled"))
+        requests->bytes_pulled = number;
+}
+
+static void read_proxy_member(const char* key,
+                              gsize key_length,
+                              const char* value,
+                              gsize value_length,
+                              void* stats_void_ptr) {
+    struct registry_cache_stats* stats = stats_void_ptr;
+    struct registry_cache_requests* requests = NULL;
+    if (json_is_key(key, key_length, "blobs"))
+        requests = &stats->blobs;
+    else if (json_is_key(key, key_length, "manifests"))
+        requests = &stats->manifests;
+    char reason[64];
+    if (requests &&
+        json_foreach_member(value, value_length, read_counter, requests, reason, sizeof(reason)))
+        stats->have_requests = true;
+}
+
+static void read_registry_member(const char* key,
+                                 gsize key_length,
+                                 const char* value,
+                                 gsize value_length,
+                                 void* stats_void_ptr) {
+    char reason[64];
+    if (json_is_key(key, key_length, "proxy"))
+        json_foreach_member(
+            value, value_length, read_proxy_member, stats_void_ptr, reason, sizeof(reason));
+}
+
+static void read_debug_var(const char* key,
+                           gsize key_length,
+                           const char* value,
+                           gsize value_length,
+                           void* stats_void_ptr) {
+    char reason[64];
+    if (json_is_key(key, key_length, "registry"))
+        json_foreach_member(
+            value, value_length, read_registry_member, stats_void_ptr, reason, sizeof(reason));
+}
+
+void registry_cache_get_stats(struct registry_cache_stats* stats) {
+    g_mutex_lock(&cache.mutex);
+    *stats = cache.stats;
+    g_mutex_unlock(&cache.mutex);
+    if (!stats->running)
+        return;
+
+    // The registry publishes its counters as Go expvars.
+    g_autofree char* vars = NULL;
+    char reason[64];
+    if (docker_api_request("tcp://127.0.0.1:" G_STRINGIFY(DEBUG_PORT),
+                           "GET",
+                           "/debug/vars",
+                           NULL,
+                           &vars,
+                           STATS_TIMEOUT_MS) == 200)
+        json_foreach_member(vars, strlen(vars), read_debug_var, stats, reason, sizeof(reason));
+}
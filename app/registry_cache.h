@@ -0,0 +1,44 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// A pull-through cache of Docker Hub, hosted as a registry container with its storage on the SD
+// card, for the other devices on a site to use as a registry mirror.
+
+#define REGISTRY_CACHE_PORT 5000
+
+// Requests that the registry has served from the cache, or fetched from Docker Hub, since its
+// container was last started. Eviction restarts it.
+struct registry_cache_requests {
+    guint64 requests;
+    guint64 hits;
+    guint64 misses;
+    guint64 bytes_pulled;  // From Docker Hub
+};
+
+struct registry_cache_stats {
+    bool running;
+    guint64 size_bytes;      // Of the cached blobs, as of the last scan
+    guint64 max_size_bytes;  // Least recently used blobs are evicted above this
+    guint64 evicted_blobs;   // Since the application started
+    guint64 evicted_bytes;
+    bool have_requests;  // false if the registry did not report the counters below
+    struct registry_cache_requests blobs;
+    struct registry_cache_requests manifests;
+};
+
+// Start the cache container from a thread, through dockerd on docker_socket, and keep the blobs in
+// storage_directory below max_size_bytes. Any container left from a previous start is
+// replaced, so that it has the current settings. If storage_directory is NULL, only remove any
+// such container.
+void registry_cache_start(const char* docker_socket,
+                          const char* storage_directory,
+                          guint64 max_size_bytes);
+
+// Stop the thread. dockerd stops the container along with itself, and should be stopped first, so
+// that any pull in progress is interrupted. Return when the thread has ended.
+void registry_cache_stop(void);
+
+// Can be called from any thread. Asks the registry for its request counters, which may take up
+// to a second.
+void registry_cache_get_stats(struct registry_cache_stats* stats);
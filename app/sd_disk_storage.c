@@ -1,3 +1,4 @@
+#define LOG_MODULE log_module_storage
 #include "sd_disk_storage.h"
 #include "log.h"
 #include <axsdk/axstorage.h>
@@ -1,38 +1,68 @@
+#define LOG_MODULE log_module_tls
 #include "tls.h"
-#include "app_paths.h"
+#include "localdata_index.h"
 #include "log.h"
+#include "tls_client_auth.h"
+#include <errno.h>
 #include <glib.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <string.h>
+#include <time.h>
 
-#define TLS_CERT_PATH APP_LOCALDATA
+// Sessions resumed from the server cache or from a ticket skip the certificate exchange and the
+// signatures of a full handshake, which dominate the handshake cost on the device.
+#define TLS_SESSION_CACHE_SIZE  256
+#define TLS_SESSION_TIMEOUT_SEC (2 * 60 * 60)
+#define TLS_GROUPS              "X25519:P-256:P-384"
 
+#define SECONDS_PER_DAY (24 * 60 * 60)
+
+// The TLS files in the managed file registry, with the dockerd options that name them.
 struct cert {
     const char* dockerd_option;
-    const char* filename;
-    const char* description;
+    enum localdata_file file;
 };
 
-static struct cert tls_certs[] = {{"--tlscacert", "ca.pem", "CA certificate"},
-                                  {"--tlscert", "server-cert.pem", "server certificate"},
-                                  {"--tlskey", "server-key.pem", "server key"}};
+static const struct cert tls_certs[] = {{"--tlscacert", localdata_ca_cert},
+                                        {"--tlscert", localdata_server_cert},
+                                        {"--tlskey", localdata_server_key}};
 
 #define NUM_TLS_CERTS (sizeof(tls_certs) / sizeof(tls_certs[0]))
 
-#define BEGIN(x)        "-----BEGIN " x "-----\n"
-#define END(x)          "-----END " x "-----\n"
-#define CERTIFICATE     "CERTIFICATE"
-#define PRIVATE_KEY     "PRIVATE KEY"
-#define RSA_PRIVATE_KEY "RSA PRIVATE KEY"
+_Static_assert(NUM_TLS_CERTS == TLS_FILE_COUNT, "TLS_FILE_COUNT must match tls_certs[]");
+
+enum { CA_CERT, SERVER_CERT, SERVER_KEY };  // Index in tls_certs[]
+
+// Metadata of the files in localdata, updated by tls_files_changed() and read by tls_get_status()
+// from any thread.
+static GMutex status_mutex;
+static struct tls_status status;
+
+// The contents of a TLS file: one or more certificates, or a private key.
+struct parsed_file {
+    STACK_OF(X509) * certs;
+    EVP_PKEY* key;
+};
+
+static const struct managed_file* managed(const struct cert* tls_cert) {
+    return managed_file_in_localdata(tls_cert->file);
+}
+
+static const char* path_of(size_t index) {
+    return managed(&tls_certs[index])->path;
+}
 
-// Filename is assumed to be one of those listed in tls_certs[].
-static bool is_key_file(const char* filename) {
-    return strstr(filename, "key");
+static const char* description_of(size_t index) {
+    return managed(&tls_certs[index])->description;
 }
 
 static bool cert_file_exists(const struct cert* tls_cert) {
-    g_autofree char* full_path = g_strdup_printf("%s/%s", TLS_CERT_PATH, tls_cert->filename);
-    return access(full_path, F_OK) == 0;
+    return localdata_index_exists(managed(tls_cert)->name);
 }
 
 bool tls_missing_certs(void) {
@@ -45,16 +75,13 @@ bool tls_missing_certs(void) {
 void tls_log_missing_cert_warnings(void) {
     for (size_t i = 0; i < NUM_TLS_CERTS; ++i)
         if (!cert_file_exists(&tls_certs[i]))
-            log_warning("No %s found at %s/%s",
-                        tls_certs[i].description,
-                        TLS_CERT_PATH,
-                        tls_certs[i].filename);
+            log_warning("No %s found at %s", description_of(i), path_of(i));
 }
 
-const char* tls_file_description(const char* filename) {
+static const struct cert* find_cert(const char* filename) {
     for (size_t i = 0; i < NUM_TLS_CERTS; ++i)
-        if (strcmp(filename, tls_certs[i].filename) == 0)
-            return tls_certs[i].description;
+        if (strcmp(filename, managed(&tls_certs[i])->name) == 0)
+            return &tls_certs[i];
     return NULL;
 }
 
@@ -64,61 +91,336 @@ const char* tls_file_dockerd_args(void) {
     char* ptr = args;
 
     for (size_t i = 0; i < NUM_TLS_CERTS; ++i)
-        ptr += g_snprintf(ptr,
-                          end - ptr,
-                          "%s %s/%s ",
-                          tls_certs[i].dockerd_option,
-                          TLS_CERT_PATH,
-                          tls_certs[i].filename);
+        ptr += g_snprintf(ptr, end - ptr, "%s %s ", tls_certs[i].dockerd_option, path_of(i));
     ptr[-1] = '\0';  // Remove space after last item.
     return args;
 }
 
-static bool read_bytes_from(FILE* fp, int whence, char* buffer, int num_bytes) {
-    const long offset = whence == SEEK_SET ? 0 : -num_bytes;
-    if (fseek(fp, offset, whence) != 0) {
-        log_error("Could not reposition stream to %s%ld: %s",
-                  whence == SEEK_SET ? "SEEK_SET+" : "SEEK_END",
-                  offset,
-                  strerror(errno));
+// Encrypted keys are not supported, since dockerd would have no way to get the passphrase.
+static int no_passphrase(char*, int, int, void*) {
+    return -1;
+}
+
+static gint64 asn1_time_to_unix(const ASN1_TIME* time) {
+    struct tm tm;
+    return ASN1_TIME_to_tm(time, &tm) == 1 ? (gint64)timegm(&tm) : 0;
+}
+
+static void format_unix_time(gint64 time, char* buffer, size_t size) {
+    const time_t seconds = time;
+    struct tm tm;
+    strftime(buffer, size, "%Y-%m-%d %H:%M:%S UTC", gmtime_r(&seconds, &tm));
+}
+
+// Return false and set reason if a certificate is outside its validity period.
+static bool within_validity_period(X509* cert, char* reason, size_t reason_size) {
+    char date[32];
+    if (X509_cmp_current_time(X509_get0_notBefore(cert)) > 0) {
+        format_unix_time(asn1_time_to_unix(X509_get0_notBefore(cert)), date, sizeof(date));
+        g_snprintf(reason, reason_size, "not valid before %s", date);
         return false;
     }
-    if (fread(buffer, num_bytes, 1, fp) != 1) {
-        log_error("Could not read %d bytes: %s", num_bytes, strerror(errno));
+    if (X509_cmp_current_time(X509_get0_notAfter(cert)) < 0) {
+        format_unix_time(asn1_time_to_unix(X509_get0_notAfter(cert)), date, sizeof(date));
+        g_snprintf(reason, reason_size, "expired on %s", date);
         return false;
     }
     return true;
 }
 
-static bool is_file_section_equal_to(FILE* fp, int whence, const char* section) {
-    char buffer[128];
-    int to_read = strlen(section);
-    if (!read_bytes_from(fp, whence, buffer, to_read))
-        return false;
-    buffer[to_read] = '\0';
-    return strncmp(buffer, section, to_read) == 0;
-}
-
-static bool has_header_and_footer(FILE* fp, const char* header, const char* footer) {
-    return is_file_section_equal_to(fp, SEEK_SET, header) &&
-           is_file_section_equal_to(fp, SEEK_END, footer);
+static void free_parsed_file(struct parsed_file* parsed) {
+    if (parsed->certs)
+        sk_X509_pop_free(parsed->certs, X509_free);
+    EVP_PKEY_free(parsed->key);
+    parsed->certs = NULL;
+    parsed->key = NULL;
 }
 
-bool tls_file_has_correct_format(const char* filename, const char* path_to_file) {
-    FILE* fp = fopen(path_to_file, "r");
+// Parse a file in the role of tls_cert. Return false and set reason if it cannot be parsed.
+static bool parse_file(const struct cert* tls_cert,
+                       const char* path,
+                       struct parsed_file* parsed,
+                       char* reason,
+                       size_t reason_size) {
+    parsed->certs = NULL;
+    parsed->key = NULL;
+    FILE* fp = fopen(path, "r");
     if (!fp) {
-        log_error("Could not read %s", path_to_file);
+        g_snprintf(reason, reason_size, "could not be read: %s", strerror(errno));
         return false;
     }
 
-    bool correct = is_key_file(filename)
-                       ? (has_header_and_footer(fp, BEGIN(PRIVATE_KEY), END(PRIVATE_KEY)) ||
-                          has_header_and_footer(fp, BEGIN(RSA_PRIVATE_KEY), END(RSA_PRIVATE_KEY)))
-                       : has_header_and_footer(fp, BEGIN(CERTIFICATE), END(CERTIFICATE));
-    if (!correct)
-        log_error("%s does not contain the headers and footers for a %s.",
-                  path_to_file,
-                  tls_file_description(filename));
+    bool success = false;
+    if (tls_cert->file == localdata_server_key) {
+        if (!(parsed->key = PEM_read_PrivateKey(fp, NULL, no_passphrase, NULL)))
+            g_snprintf(reason, reason_size, "no unencrypted PEM private key found");
+        else
+            success = true;
+    } else {
+        parsed->certs = sk_X509_new_null();
+        X509* cert;
+        while ((cert = PEM_read_X509(fp, NULL, NULL, NULL)))
+            sk_X509_push(parsed->certs, cert);
+        if (sk_X509_num(parsed->certs) == 0)
+            g_snprintf(reason, reason_size, "no PEM certificate found");
+        else
+            success = true;
+    }
     fclose(fp);
-    return correct;
+    ERR_clear_error();  // Reading until the end of the file leaves an error behind.
+    if (!success)
+        free_parsed_file(parsed);
+    return success;
+}
+
+// Return false and set reason if a certificate in the file is outside its validity period.
+static bool
+certs_within_validity_period(const struct parsed_file* parsed, char* reason, size_t reason_size) {
+    for (int i = 0; parsed->certs && i < sk_X509_num(parsed->certs); i++)
+        if (!within_validity_period(sk_X509_value(parsed->certs, i), reason, reason_size))
+            return false;
+    return true;
+}
+
+static bool key_matches_cert(EVP_PKEY* key, X509* cert) {
+    const bool matches = X509_check_private_key(cert, key) == 1;
+    ERR_clear_error();
+    return matches;
+}
+
+// Return true if cert is signed by one of the certificates in ca_certs, or one of their
+// descendants in ca_certs. Like dockerd, any certificate in ca.pem is trusted, not only roots.
+static bool
+cert_chains_to_ca(X509* cert, STACK_OF(X509) * ca_certs, char* reason, size_t reason_size) {
+    X509_STORE* store = X509_STORE_new();
+    X509_STORE_CTX* ctx = X509_STORE_CTX_new();
+    for (int i = 0; i < sk_X509_num(ca_certs); i++)
+        X509_STORE_add_cert(store, sk_X509_value(ca_certs, i));
+    // Expiry is reported on its own, see tls_certs_expiring(), so it does not break the chain.
+    X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN | X509_V_FLAG_NO_CHECK_TIME);
+
+    const bool chains = X509_STORE_CTX_init(ctx, store, cert, NULL) == 1 &&
+                        X509_verify_cert(ctx) == 1;
+    if (!chains)
+        g_snprintf(reason,
+                   reason_size,
+                   "%s",
+                   X509_verify_cert_error_string(X509_STORE_CTX_get_error(ctx)));
+    X509_STORE_CTX_free(ctx);
+    X509_STORE_free(store);
+    ERR_clear_error();
+    return chains;
+}
+
+static X509* first_cert(const struct parsed_file* parsed) {
+    return parsed->certs ? sk_X509_value(parsed->certs, 0) : NULL;
+}
+
+enum file_validation tls_file_validate(const char* filename,
+                                       const char* path_to_file,
+                                       char* reason,
+                                       size_t reason_size) {
+    const struct cert* tls_cert = find_cert(filename);
+    if (!tls_cert) {
+        g_snprintf(reason, reason_size, "%s is not a TLS file", filename);
+        return file_validation_invalid;
+    }
+
+    struct parsed_file files[NUM_TLS_CERTS] = {0};
+    const size_t uploaded = tls_cert - tls_certs;
+    char parse_reason[128];
+    if (!parse_file(tls_cert, path_to_file, &files[uploaded], parse_reason, sizeof(parse_reason)) ||
+        !certs_within_validity_period(&files[uploaded], parse_reason, sizeof(parse_reason))) {
+        free_parsed_file(&files[uploaded]);
+        g_snprintf(reason, reason_size, "%s: %s", description_of(uploaded), parse_reason);
+        log_warning("Uploaded %s is not valid: %s", description_of(uploaded), parse_reason);
+        return file_validation_invalid;
+    }
+
+    // The other files are those in localdata. A file that is missing or invalid there is not
+    // checked against, since it will be replaced anyway.
+    for (size_t i = 0; i < NUM_TLS_CERTS; i++)
+        if (i != uploaded && cert_file_exists(&tls_certs[i]) &&
+            (!parse_file(&tls_certs[i], path_of(i), &files[i], parse_reason, 0) ||
+             !certs_within_validity_period(&files[i], parse_reason, 0)))
+            free_parsed_file(&files[i]);
+
+    enum file_validation result = file_validation_ok;
+    X509* server_cert = first_cert(&files[SERVER_CERT]);
+    if (uploaded != CA_CERT && server_cert && files[SERVER_KEY].key &&
+        !key_matches_cert(files[SERVER_KEY].key, server_cert)) {
+        g_snprintf(reason,
+                   reason_size,
+                   "%s does not match the %s in localdata",
+                   description_of(uploaded),
+                   description_of(uploaded == SERVER_KEY ? SERVER_CERT : SERVER_KEY));
+        result = file_validation_inconsistent;
+    } else if (uploaded != SERVER_KEY && server_cert && files[CA_CERT].certs &&
+               !cert_chains_to_ca(
+                   server_cert, files[CA_CERT].certs, parse_reason, sizeof(parse_reason))) {
+        g_snprintf(reason,
+                   reason_size,
+                   "server certificate is not signed by the CA certificate: %s",
+                   parse_reason);
+        result = file_validation_inconsistent;
+    }
+    if (result == file_validation_inconsistent)
+        log_warning("Uploaded %s is inconsistent: %s", description_of(uploaded), reason);
+
+    for (size_t i = 0; i < NUM_TLS_CERTS; i++) free_parsed_file(&files[i]);
+    return result;
+}
+
+static void describe_public_key(EVP_PKEY* key, char* buffer, size_t size) {
+    const int type = EVP_PKEY_base_id(key);
+    const char* name = type == EVP_PKEY_RSA       ? "RSA"
+                       : type == EVP_PKEY_EC      ? "EC"
+                       : type == EVP_PKEY_ED25519 ? "Ed25519"
+                                                  : OBJ_nid2sn(type);
+    g_snprintf(buffer, size, "%s %d", name, EVP_PKEY_bits(key));
+}
+
+static void describe_cert(X509* cert, struct tls_file_info* info) {
+    X509_NAME_oneline(X509_get_subject_name(cert), info->subject, sizeof(info->subject));
+    X509_NAME_oneline(X509_get_issuer_name(cert), info->issuer, sizeof(info->issuer));
+    info->not_before = asn1_time_to_unix(X509_get0_notBefore(cert));
+    info->not_after = asn1_time_to_unix(X509_get0_notAfter(cert));
+    describe_public_key(X509_get0_pubkey(cert), info->public_key, sizeof(info->public_key));
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    X509_digest(cert, EVP_sha256(), digest, &digest_len);
+    char* hex = info->sha256;
+    for (unsigned int i = 0; i < digest_len && hex + 3 < info->sha256 + sizeof(info->sha256); i++)
+        hex += g_snprintf(hex, 4, i ? ":%02X" : "%02X", digest[i]);
+}
+
+void tls_files_changed(void) {
+    struct tls_status new_status = {0};
+    struct parsed_file files[NUM_TLS_CERTS] = {0};
+    for (size_t i = 0; i < NUM_TLS_CERTS; i++) {
+        struct tls_file_info* info = &new_status.files[i];
+        info->filename = managed(&tls_certs[i])->name;
+        info->present = cert_file_exists(&tls_certs[i]);
+        if (!info->present)
+            continue;
+        // Certificates outside their validity period are still described, so that the expiry
+        // date of an expired certificate is known.
+        if (!parse_file(&tls_certs[i], path_of(i), &files[i], info->error, sizeof(info->error)))
+            info->valid = false;
+        else if (files[i].key)
+            describe_public_key(files[i].key, info->public_key, sizeof(info->public_key));
+        else
+            describe_cert(first_cert(&files[i]), info);
+        if (files[i].key || files[i].certs)
+            info->valid = certs_within_validity_period(&files[i], info->error, sizeof(info->error));
+        if (!info->valid)
+            log_warning("The %s in localdata is not valid: %s", description_of(i), info->error);
+    }
+
+    X509* server_cert = first_cert(&files[SERVER_CERT]);
+    char reason[128];
+    new_status.key_matches_cert = server_cert && files[SERVER_KEY].key &&
+                                  key_matches_cert(files[SERVER_KEY].key, server_cert);
+    new_status.cert_chains_to_ca =
+        server_cert && files[CA_CERT].certs &&
+        cert_chains_to_ca(server_cert, files[CA_CERT].certs, reason, sizeof(reason));
+    for (size_t i = 0; i < NUM_TLS_CERTS; i++) free_parsed_file(&files[i]);
+
+    g_mutex_lock(&status_mutex);
+    status = new_status;
+    g_mutex_unlock(&status_mutex);
+}
+
+void tls_get_status(struct tls_status* status_ret) {
+    g_mutex_lock(&status_mutex);
+    *status_ret = status;
+    g_mutex_unlock(&status_mutex);
+}
+
+gint64 tls_days_to_expiry(const struct tls_file_info* info, gint64 now) {
+    const gint64 seconds = info->not_after - now;
+    return seconds >= 0 ? seconds / SECONDS_PER_DAY : -((-seconds - 1) / SECONDS_PER_DAY) - 1;
+}
+
+bool tls_certs_expiring(gint64 now, gint64* next_change) {
+    struct tls_status current;
+    tls_get_status(&current);
+
+    bool expiring = false;
+    *next_change = 0;
+    for (size_t i = 0; i < NUM_TLS_CERTS; i++) {
+        const struct tls_file_info* info = &current.files[i];
+        if (!info->not_after)
+            continue;  // Missing, not parsed, or a key
+        const gint64 warn_from = info->not_after - TLS_EXPIRY_WARNING_DAYS * SECONDS_PER_DAY;
+        const gint64 days = tls_days_to_expiry(info, now);
+        char date[32];
+        format_unix_time(info->not_after, date, sizeof(date));
+        if (now >= info->not_after)
+            log_warning("The %s in localdata expired on %s", description_of(i), date);
+        else if (now >= warn_from)
+            log_warning("The %s in localdata expires in %" G_GINT64_FORMAT " days, on %s",
+                        description_of(i),
+                        days,
+                        date);
+        expiring |= now >= warn_from;
+
+        const gint64 change = now < warn_from ? warn_from : info->not_after;
+        if (change > now && (!*next_change || change < *next_change))
+            *next_change = change;
+    }
+    return expiring;
+}
+
+static void log_openssl_error(const char* what) {
+    char error[256];
+    ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+    log_error("%s: %s", what, error);
+    ERR_clear_error();
+}
+
+SSL_CTX* tls_server_context_new(void) {
+    static const unsigned char session_id_context[] = APP_NAME;
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log_openssl_error("Failed to create TLS context");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set1_groups_list(ctx, TLS_GROUPS);
+    SSL_CTX_set_default_passwd_cb(ctx, no_passphrase);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, path_of(SERVER_CERT)) != 1) {
+        log_openssl_error("Failed to load the server certificate");
+        goto error;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, path_of(SERVER_KEY), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        log_openssl_error("Failed to load the server key");
+        goto error;
+    }
+    if (SSL_CTX_load_verify_locations(ctx, path_of(CA_CERT), NULL) != 1) {
+        log_openssl_error("Failed to load the CA certificate");
+        goto error;
+    }
+
+    // Require a client certificate signed by ca.pem, like dockerd --tlsverify does.
+    X509_STORE_set_flags(SSL_CTX_get_cert_store(ctx), X509_V_FLAG_PARTIAL_CHAIN);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    if (!tls_client_auth_configure(ctx))
+        goto error;
+
+    // Resumption is refused when client certificates are verified, unless a session id context is
+    // set. Ticket keys are generated per context, so sessions do not survive a reload.
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT_SEC);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    return ctx;
+
+error:
+    SSL_CTX_free(ctx);
+    return NULL;
 }
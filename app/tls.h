@@ -1,8 +1,69 @@
 #pragma once
+#include "managed_file.h"
+#include <glib.h>
+#include <openssl/ssl.h>
 #include <stdbool.h>
 
+#define TLS_FILE_COUNT 3
+
+// Metadata of a TLS file in localdata, as parsed by tls_files_changed().
+struct tls_file_info {
+    const char* filename;
+    bool present;
+    bool valid;           // Parsed, and for certificates, within the validity period
+    char error[128];      // Why a present file is not valid
+    char subject[256];    // Of the first certificate in the file. Empty for the key.
+    char issuer[256];     // Of the first certificate in the file
+    gint64 not_before;    // Of the first certificate, in seconds since the epoch
+    gint64 not_after;     // Of the first certificate, in seconds since the epoch
+    char public_key[32];  // Type and size, e.g. "EC 256" or "RSA 2048"
+    char sha256[96];      // Fingerprint of the first certificate, as colon-separated hex
+};
+
+// Files are in the order ca.pem, server-cert.pem, server-key.pem.
+struct tls_status {
+    struct tls_file_info files[TLS_FILE_COUNT];
+    bool key_matches_cert;   // server-key.pem is the private key of server-cert.pem
+    bool cert_chains_to_ca;  // server-cert.pem is signed by a certificate in ca.pem, even if a
+                             // certificate is outside its validity period
+};
+
 bool tls_missing_certs(void);
 void tls_log_missing_cert_warnings(void);
-const char* tls_file_description(const char* filename);
 const char* tls_file_dockerd_args(void);
-bool tls_file_has_correct_format(const char* filename, const char* path_to_file);
+
+// Check an uploaded file with OpenSSL before it is copied to localdata: that it parses, that its
+// certificates are within their validity period, that a key matches server-cert.pem and that
+// server-cert.pem is signed by ca.pem. The last two checks are made against the files already in
+// localdata, and fail with file_validation_inconsistent, since replacing a key pair takes two
+// uploads. The reason for any other result than file_validation_ok is written to reason.
+enum file_validation tls_file_validate(const char* filename,
+                                       const char* path_to_file,
+                                       char* reason,
+                                       size_t reason_size);
+
+// Parse the TLS files in localdata again. Call at startup, after localdata_index_init(), and when
+// the index reports that a TLS file has changed. Whether a file exists is taken from the index.
+void tls_files_changed(void);
+
+// Get the metadata from the last call to tls_files_changed(). Can be called from any thread.
+void tls_get_status(struct tls_status* status);
+
+// Certificates expiring within this many days make the application report TLS CERT EXPIRING.
+#define TLS_EXPIRY_WARNING_DAYS 30
+
+// Whole days from now until the certificate described by info expires, negative once it has
+// expired. Times are in seconds since the epoch.
+gint64 tls_days_to_expiry(const struct tls_file_info* info, gint64 now);
+
+// Return true, and log a warning per certificate, if a certificate in localdata expires within
+// TLS_EXPIRY_WARNING_DAYS of now, or has expired. Uses the dates parsed by tls_files_changed(),
+// so no file is read. Set next_change to the next time the result or the warnings change, or to
+// zero if they never will.
+bool tls_certs_expiring(gint64 now, gint64* next_change);
+
+// Create a server context from the files in localdata, for terminating TLS in the application
+// instead of in dockerd. Clients must present a certificate signed by ca.pem, and allowed by
+// tls_client_auth_configure(). Session tickets and a session cache are enabled, and both RSA and
+// EC keys work. Log and return NULL on error.
+SSL_CTX* tls_server_context_new(void);
@@ -0,0 +1,308 @@
+#define LOG_MODULE log_module_tls
+#include "tls_client_auth.h"
+#include "app_paths.h"
+#include "localdata_index.h"
+#include "log.h"
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509_vfy.h>
+#include <string.h>
+#include <time.h>
+
+#define FINGERPRINT_LENGTH 64  // SHA-256 as hex
+
+// Index of the allowlist in the ex data of an SSL_CTX
+static int allowlist_index = -1;
+
+static GMutex crl_mutex;
+static gint64 crl_next_update;  // Of the CRLs loaded by load_crls(), guarded by crl_mutex
+
+static void free_allowlist(void*, void* allowlist, CRYPTO_EX_DATA*, int, long, void*) {
+    if (allowlist)
+        g_hash_table_unref(allowlist);
+}
+
+// Read fingerprints, one per line, as hex with or without colons. Text up to a '=' is skipped,
+// so that the output of 'openssl x509 -noout -fingerprint -sha256' can be used as is, and text
+// after a '#' is a comment. Return a set of upper case hex strings without colons, or NULL and
+// set reason if a line is not a fingerprint or there are none.
+static GHashTable* read_allowlist(const char* path, char* reason, size_t reason_size) {
+    g_autofree gchar* contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_snprintf(reason, reason_size, "could not be read");
+        return NULL;
+    }
+    GHashTable* allowlist = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gchar** lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i] && allowlist; i++) {
+        char* comment = strchr(lines[i], '#');
+        if (comment)
+            *comment = '\0';
+        const char* value = strchr(lines[i], '=') ? strchr(lines[i], '=') + 1 : lines[i];
+
+        char fingerprint[FINGERPRINT_LENGTH + 1];
+        size_t length = 0;
+        bool valid = true;
+        for (const char* c = value; *c && valid; c++) {
+            if (*c == ':' || g_ascii_isspace(*c))
+                continue;
+            valid = g_ascii_isxdigit(*c) && length < FINGERPRINT_LENGTH;
+            if (valid)
+                fingerprint[length++] = g_ascii_toupper(*c);
+        }
+        fingerprint[length] = '\0';
+
+        if (valid && length == FINGERPRINT_LENGTH) {
+            g_hash_table_add(allowlist, g_strdup(fingerprint));
+        } else if (!valid || length) {
+            g_snprintf(reason, reason_size, "line %d is not a SHA-256 fingerprint", i + 1);
+            g_clear_pointer(&allowlist, g_hash_table_unref);
+        }
+    }
+    g_strfreev(lines);
+    if (allowlist && g_hash_table_size(allowlist) == 0) {
+        g_snprintf(reason, reason_size, "no fingerprints found");
+        g_clear_pointer(&allowlist, g_hash_table_unref);
+    }
+    return allowlist;
+}
+
+// Return the CRLs in the file, or NULL and set reason if there are none, or one has expired.
+static STACK_OF(X509_CRL) * read_crls(const char* path, char* reason, size_t reason_size) {
+    *reason = '\0';
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        g_snprintf(reason, reason_size, "could not be read");
+        return NULL;
+    }
+    STACK_OF(X509_CRL)* crls = sk_X509_CRL_new_null();
+    X509_CRL* crl;
+    while ((crl = PEM_read_X509_CRL(fp, NULL, NULL, NULL)))
+        sk_X509_CRL_push(crls, crl);
+    fclose(fp);
+    ERR_clear_error();  // Reading until the end of the file leaves an error behind.
+
+    if (sk_X509_CRL_num(crls) == 0)
+        g_snprintf(reason, reason_size, "no PEM certificate revocation list found");
+    for (int i = 0; i < sk_X509_CRL_num(crls) && !*reason; i++) {
+        const ASN1_TIME* next_update = X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, i));
+        if (next_update && X509_cmp_current_time(next_update) < 0)
+            g_snprintf(reason,
+                       reason_size,
+                       "expired, so it would make all client certificates be rejected");
+    }
+    if (*reason) {
+        sk_X509_CRL_pop_free(crls, X509_CRL_free);
+        return NULL;
+    }
+    return crls;
+}
+
+// Return true if each CRL is signed by a certificate in ca.pem, or if there is no ca.pem.
+static bool crls_signed_by_ca(STACK_OF(X509_CRL) * crls) {
+    FILE* fp = fopen(APP_LOCALDATA "/ca.pem", "r");
+    if (!fp)
+        return true;
+    STACK_OF(X509)* ca_certs = sk_X509_new_null();
+    X509* cert;
+    while ((cert = PEM_read_X509(fp, NULL, NULL, NULL)))
+        sk_X509_push(ca_certs, cert);
+    fclose(fp);
+
+    bool all_signed = true;
+    for (int i = 0; i < sk_X509_CRL_num(crls) && all_signed; i++) {
+        bool is_signed = false;
+        for (int j = 0; j < sk_X509_num(ca_certs) && !is_signed; j++)
+            is_signed = X509_CRL_verify(sk_X509_CRL_value(crls, i),
+                                        X509_get0_pubkey(sk_X509_value(ca_certs, j))) == 1;
+        all_signed = is_signed;
+    }
+    sk_X509_pop_free(ca_certs, X509_free);
+    ERR_clear_error();
+    return all_signed;
+}
+
+enum file_validation tls_client_auth_validate(const char* filename,
+                                              const char* path_to_file,
+                                              char* reason,
+                                              size_t reason_size) {
+    char parse_reason[128];
+    enum file_validation result = file_validation_ok;
+    if (strcmp(filename, CLIENT_ALLOWLIST) == 0) {
+        GHashTable* allowlist = read_allowlist(path_to_file, parse_reason, sizeof(parse_reason));
+        if (!allowlist)
+            result = file_validation_invalid;
+        else
+            g_hash_table_unref(allowlist);
+    } else {
+        STACK_OF(X509_CRL)* crls = read_crls(path_to_file, parse_reason, sizeof(parse_reason));
+        if (!crls) {
+            result = file_validation_invalid;
+        } else if (!crls_signed_by_ca(crls)) {
+            result = file_validation_inconsistent;
+        }
+        if (crls)
+            sk_X509_CRL_pop_free(crls, X509_CRL_free);
+    }
+    if (result == file_validation_invalid) {
+        g_snprintf(reason, reason_size, "%s: %s", filename, parse_reason);
+        log_warning("Uploaded %s is not valid: %s", filename, parse_reason);
+    } else if (result == file_validation_inconsistent) {
+        g_snprintf(reason, reason_size, "%s is not signed by the CA certificate", filename);
+        log_warning("Uploaded %s is inconsistent: %s", filename, reason);
+    }
+    return result;
+}
+
+bool tls_client_auth_crl_consistent(void) {
+    if (!localdata_index_exists(CLIENT_CRL))
+        return true;
+    char reason[128];
+    STACK_OF(X509_CRL)* crls = read_crls(APP_LOCALDATA "/" CLIENT_CRL, reason, sizeof(reason));
+    if (!crls)
+        return true;  // Not a matter of consistency, and reported by tls_client_auth_configure().
+    const bool consistent = crls_signed_by_ca(crls);
+    sk_X509_CRL_pop_free(crls, X509_CRL_free);
+    return consistent;
+}
+
+// Called by OpenSSL for each certificate in the chain of a client during a full handshake.
+static int verify_client(int preverify_ok, X509_STORE_CTX* store_ctx) {
+    if (!preverify_ok || X509_STORE_CTX_get_error_depth(store_ctx) != 0)
+        return preverify_ok;
+    const SSL* ssl = X509_STORE_CTX_get_ex_data(store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    GHashTable* allowlist = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), allowlist_index);
+    if (!allowlist)
+        return 1;
+
+    X509* cert = X509_STORE_CTX_get_current_cert(store_ctx);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    char fingerprint[FINGERPRINT_LENGTH + 1] = "";
+    if (X509_digest(cert, EVP_sha256(), digest, &digest_length))
+        for (unsigned int i = 0; i < digest_length && i < FINGERPRINT_LENGTH / 2; i++)
+            g_snprintf(fingerprint + 2 * i, 3, "%02X", digest[i]);
+    if (g_hash_table_contains(allowlist, fingerprint))
+        return 1;
+
+    char subject[256];
+    X509_NAME_oneline(X509_get_subject_name(cert), subject, sizeof(subject));
+    log_warning("Rejected client certificate %s with SHA-256 fingerprint %s, which is not in %s",
+                subject,
+                fingerprint,
+                CLIENT_ALLOWLIST);
+    X509_STORE_CTX_set_error(store_ctx, X509_V_ERR_APPLICATION_VERIFICATION);
+    return 0;
+}
+
+static bool load_allowlist(SSL_CTX* ctx) {
+    if (!localdata_index_exists(CLIENT_ALLOWLIST))
+        return true;
+    char reason[128];
+    GHashTable* allowlist =
+        read_allowlist(APP_LOCALDATA "/" CLIENT_ALLOWLIST, reason, sizeof(reason));
+    if (!allowlist) {
+        log_error("Failed to load %s: %s", CLIENT_ALLOWLIST, reason);
+        return false;
+    }
+    if (allowlist_index < 0)
+        allowlist_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, free_allowlist);
+    SSL_CTX_set_ex_data(ctx, allowlist_index, allowlist);
+    SSL_CTX_set_verify(ctx, SSL_CTX_get_verify_mode(ctx), verify_client);
+    log_info("Only accepting client certificates with the %u fingerprints in %s",
+             g_hash_table_size(allowlist),
+             CLIENT_ALLOWLIST);
+    return true;
+}
+
+// Return the earliest nextUpdate of the CRLs in seconds since the epoch, or 0 if none has one.
+static gint64 earliest_next_update(STACK_OF(X509_CRL) * crls) {
+    const gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    gint64 earliest = 0;
+    for (int i = 0; i < sk_X509_CRL_num(crls); i++) {
+        const ASN1_TIME* next_update = X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, i));
+        int days = 0;
+        int seconds = 0;
+        if (!next_update || !ASN1_TIME_diff(&days, &seconds, NULL, next_update))
+            continue;
+        const gint64 time = now + (gint64)days * 24 * 60 * 60 + seconds;
+        if (!earliest || time < earliest)
+            earliest = time;
+    }
+    return earliest;
+}
+
+static void set_crl_next_update(gint64 next_update) {
+    g_mutex_lock(&crl_mutex);
+    crl_next_update = next_update;
+    g_mutex_unlock(&crl_mutex);
+}
+
+// Called last by tls_client_auth_configure(), so ctx is put to use if this succeeds.
+static bool load_crls(SSL_CTX* ctx) {
+    if (!localdata_index_exists(CLIENT_CRL)) {
+        set_crl_next_update(0);
+        return true;
+    }
+    char reason[128];
+    STACK_OF(X509_CRL)* crls = read_crls(APP_LOCALDATA "/" CLIENT_CRL, reason, sizeof(reason));
+    if (!crls) {
+        log_error("Failed to load %s: %s", CLIENT_CRL, reason);
+        return false;
+    }
+    // A CRL from another CA would make all client certificates be rejected.
+    if (!crls_signed_by_ca(crls)) {
+        log_error("Failed to load %s: not signed by the CA certificate", CLIENT_CRL);
+        sk_X509_CRL_pop_free(crls, X509_CRL_free);
+        return false;
+    }
+    set_crl_next_update(earliest_next_update(crls));
+    X509_STORE* store = SSL_CTX_get_cert_store(ctx);
+    for (int i = 0; i < sk_X509_CRL_num(crls); i++)
+        X509_STORE_add_crl(store, sk_X509_CRL_value(crls, i));
+    sk_X509_CRL_pop_free(crls, X509_CRL_free);
+    // Only the client certificate is checked, since the CA does not revoke itself.
+    X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
+    log_info("Rejecting client certificates revoked in %s", CLIENT_CRL);
+    return true;
+}
+
+bool tls_client_auth_configure(SSL_CTX* ctx) {
+    return load_allowlist(ctx) && load_crls(ctx);
+}
+
+gint64 tls_client_auth_crl_next_update(void) {
+    g_mutex_lock(&crl_mutex);
+    const gint64 next_update = crl_next_update;
+    g_mutex_unlock(&crl_mutex);
+    return next_update;
+}
+
+bool tls_client_auth_crl_expiring(gint64 now, gint64* next_change) {
+    const gint64 next_update = tls_client_auth_crl_next_update();
+    *next_change = 0;
+    if (!next_update)
+        return false;
+
+    const gint64 warn_from = next_update - TLS_CRL_UPDATE_WARNING_HOURS * 60 * 60;
+    const time_t seconds = next_update;
+    struct tm tm;
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S UTC", gmtime_r(&seconds, &tm));
+    if (now >= next_update)
+        log_error("The %s in use expired on %s, so every client certificate is rejected. "
+                  "Upload a new %s.",
+                  CLIENT_CRL,
+                  date,
+                  CLIENT_CRL);
+    else if (now >= warn_from)
+        log_warning("The %s in use must be updated by %s, or every client certificate will be "
+                    "rejected",
+                    CLIENT_CRL,
+                    date);
+    if (now < warn_from)
+        *next_change = warn_from;
+    else if (now < next_update)
+        *next_change = next_update;
+    return now >= warn_from;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "tls.h"
+#include <openssl/ssl.h>
+#include <stdbool.h>
+
+// Restrictions on client certificates beyond being signed by ca.pem, from files in localdata:
+// CLIENT_ALLOWLIST lists the SHA-256 fingerprints of the certificates that are accepted, and
+// CLIENT_CRL holds certificate revocation lists from the CA. Either file may be missing. They can
+// only be enforced where the application terminates TLS, i.e. in the TLS proxy.
+
+// Check an uploaded CLIENT_ALLOWLIST or CLIENT_CRL, as a managed_file_validator. A CRL that is not
+// signed by a certificate in ca.pem is file_validation_inconsistent.
+enum file_validation tls_client_auth_validate(const char* filename,
+                                              const char* path_to_file,
+                                              char* reason,
+                                              size_t reason_size);
+
+// Return true if CLIENT_CRL is missing or signed by a certificate in ca.pem. An inconsistent
+// CLIENT_CRL can be stored after ca.pem is replaced, or before ca.pem is uploaded.
+bool tls_client_auth_crl_consistent(void);
+
+// Make ctx, which already verifies clients against ca.pem, also check the files in localdata.
+// The result of the check is kept in each session, so resumed handshakes are not checked again.
+// Log and return false if a file is present but cannot be used.
+bool tls_client_auth_configure(SSL_CTX* ctx);
+
+// A CRL due for an update within this many hours makes the application report TLS CERT EXPIRING.
+#define TLS_CRL_UPDATE_WARNING_HOURS 24
+
+// The earliest nextUpdate of the CRLs in the context last configured by
+// tls_client_auth_configure(), in seconds since the epoch, or 0 if there are none. Can be called
+// from any thread.
+gint64 tls_client_auth_crl_next_update(void);
+
+// Like tls_certs_expiring(), for the CRLs in use: return true if one is due for an update within
+// TLS_CRL_UPDATE_WARNING_HOURS of now, and log an error once it is overdue, since every client
+// certificate is then rejected.
+bool tls_client_auth_crl_expiring(gint64 now, gint64* next_change);
@@ -0,0 +1,529 @@
+#define LOG_MODULE log_module_tls
+#include "tls_generate.h"
+#include "app_paths.h"
+#include "localdata_index.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <net/if.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The key of a CA created on the device. Unlike the other files in localdata, it is never served
+// or accepted over HTTP.
+#define CA_KEY_FILENAME "ca-key.pem"
+
+#define CA_VALIDITY_DAYS   3650
+#define CERT_VALIDITY_DAYS 365
+#define CLOCK_SKEW_SEC     (5 * 60)  // Certificates are valid from a bit before they are issued.
+
+// Serializes generation, since it replaces several files that must match each other.
+static GMutex generate_mutex;
+
+struct extension {
+    int nid;
+    const char* value;  // In the openssl.cnf syntax
+};
+
+struct upload {
+    EVP_PKEY* ca_key;
+    STACK_OF(X509) * ca_certs;
+    X509_REQ* client_request;
+};
+
+struct ca {
+    EVP_PKEY* key;
+    STACK_OF(X509) * certs;  // All of ca.pem
+    X509* cert;              // The certificate in certs of key
+    bool certs_changed;      // ca.pem must be written
+};
+
+// Encrypted keys are not supported, since there is no way to enter a passphrase.
+static int no_passphrase(char*, int, int, void*) {
+    return -1;
+}
+
+static void free_upload(struct upload* upload) {
+    EVP_PKEY_free(upload->ca_key);
+    if (upload->ca_certs)
+        sk_X509_pop_free(upload->ca_certs, X509_free);
+    X509_REQ_free(upload->client_request);
+}
+
+static void free_ca(struct ca* ca) {
+    EVP_PKEY_free(ca->key);
+    if (ca->certs)
+        sk_X509_pop_free(ca->certs, X509_free);
+}
+
+static STACK_OF(X509) * read_certs(BIO* bio) {
+    STACK_OF(X509)* certs = sk_X509_new_null();
+    X509* cert;
+    while ((cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)))
+        sk_X509_push(certs, cert);
+    ERR_clear_error();  // Reading until the end of the file leaves an error behind.
+    return certs;
+}
+
+// Each PEM_read_bio function skips the blocks of other types, so the file is read once per type.
+static bool
+read_upload(const char* path, struct upload* upload, char* reason, size_t reason_size) {
+    g_autofree gchar* contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, NULL)) {
+        g_snprintf(reason, reason_size, "the uploaded file could not be read");
+        return false;
+    }
+    BIO* bio = BIO_new_mem_buf(contents, length);
+    upload->ca_key = PEM_read_bio_PrivateKey(bio, NULL, no_passphrase, NULL);
+    BIO_reset(bio);
+    upload->ca_certs = read_certs(bio);
+    BIO_reset(bio);
+    upload->client_request = PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    ERR_clear_error();
+
+    if (!upload->ca_key && sk_X509_num(upload->ca_certs) > 0) {
+        g_snprintf(reason, reason_size, "a CA certificate can only be uploaded with its key");
+        return false;
+    }
+    if (!upload->ca_key && !upload->client_request) {
+        g_snprintf(reason,
+                   reason_size,
+                   "no unencrypted PEM private key or certificate request found");
+        return false;
+    }
+    X509_REQ* request = upload->client_request;
+    if (request && X509_REQ_verify(request, X509_REQ_get0_pubkey(request)) != 1) {
+        ERR_clear_error();
+        g_snprintf(reason, reason_size, "the certificate request is not signed by its key");
+        return false;
+    }
+    return true;
+}
+
+// Return the certificate in certs of key, or NULL.
+static X509* find_cert_of_key(STACK_OF(X509) * certs, EVP_PKEY* key) {
+    X509* found = NULL;
+    for (int i = 0; certs && i < sk_X509_num(certs) && !found; i++)
+        if (X509_check_private_key(sk_X509_value(certs, i), key) == 1)
+            found = sk_X509_value(certs, i);
+    ERR_clear_error();
+    return found;
+}
+
+static bool read_localdata_file(const char* filename, BIO** bio) {
+    g_autofree char* path = g_build_filename(APP_LOCALDATA, filename, NULL);
+    *bio = BIO_new_file(path, "r");
+    ERR_clear_error();
+    return *bio;
+}
+
+static STACK_OF(X509) * read_ca_pem(void) {
+    BIO* bio;
+    if (!read_localdata_file("ca.pem", &bio))
+        return sk_X509_new_null();
+    STACK_OF(X509)* certs = read_certs(bio);
+    BIO_free(bio);
+    return certs;
+}
+
+static X509_NAME* name_with_common_name(const char* common_name) {
+    X509_NAME* name = X509_NAME_new();
+    X509_NAME_add_entry_by_txt(
+        name, "CN", MBSTRING_UTF8, (const unsigned char*)common_name, -1, -1, 0);
+    return name;
+}
+
+// Return a certificate for key, valid for days from now but not after the issuer, and signed by
+// issuer_key. It is self-signed if issuer is NULL. Log and return NULL on error.
+static X509* new_cert(const X509_NAME* subject,
+                      EVP_PKEY* key,
+                      int days,
+                      X509* issuer,
+                      EVP_PKEY* issuer_key,
+                      const struct extension* extensions,
+                      size_t extension_count) {
+    X509* cert = X509_new();
+    BIGNUM* serial = BN_new();
+    bool success = X509_set_version(cert, X509_VERSION_3) &&
+                   BN_rand(serial, 127, BN_RAND_TOP_ANY, BN_RAND_BOTTOM_ANY) &&
+                   BN_to_ASN1_INTEGER(serial, X509_get_serialNumber(cert)) &&
+                   X509_gmtime_adj(X509_getm_notBefore(cert), -CLOCK_SKEW_SEC) &&
+                   X509_time_adj_ex(X509_getm_notAfter(cert), days, 0, NULL) &&
+                   X509_set_subject_name(cert, subject) &&
+                   X509_set_issuer_name(cert,
+                                        issuer ? X509_get_subject_name(issuer) : subject) &&
+                   X509_set_pubkey(cert, key);
+    BN_free(serial);
+    if (success && issuer &&
+        ASN1_TIME_compare(X509_get0_notAfter(cert), X509_get0_notAfter(issuer)) > 0)
+        success = X509_set1_notAfter(cert, X509_get0_notAfter(issuer));
+
+    X509V3_CTX ctx;
+    X509V3_set_ctx(&ctx, issuer ? issuer : cert, cert, NULL, NULL, 0);
+    for (size_t i = 0; success && i < extension_count; i++) {
+        X509_EXTENSION* extension =
+            X509V3_EXT_conf_nid(NULL, &ctx, extensions[i].nid, extensions[i].value);
+        success = extension && X509_add_ext(cert, extension, -1);
+        X509_EXTENSION_free(extension);
+    }
+
+    // Ed25519 keys sign without a separate digest.
+    const EVP_MD* digest = EVP_PKEY_base_id(issuer_key) == EVP_PKEY_ED25519 ? NULL : EVP_sha256();
+    if (success)
+        success = X509_sign(cert, issuer_key, digest) > 0;
+    if (!success) {
+        const char* error = ERR_reason_error_string(ERR_get_error());
+        log_error("Failed to create a certificate: %s", error ? error : "unknown error");
+        ERR_clear_error();
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+typedef bool (*pem_writer)(FILE* fp, const void* data);
+
+static bool write_key(FILE* fp, const void* key) {
+    return PEM_write_PrivateKey(fp, (EVP_PKEY*)key, NULL, NULL, 0, NULL, NULL) == 1;
+}
+
+static bool write_certs(FILE* fp, const void* certs_void_ptr) {
+    const STACK_OF(X509)* certs = certs_void_ptr;
+    for (int i = 0; i < sk_X509_num(certs); i++)
+        if (PEM_write_X509(fp, sk_X509_value(certs, i)) != 1)
+            return false;
+    return true;
+}
+
+static bool write_cert(FILE* fp, const void* cert) {
+    return PEM_write_X509(fp, (X509*)cert) == 1;
+}
+
+// Replace filename in localdata with a rename, so that neither dockerd nor the localdata index
+// ever read a partly written file.
+static bool write_localdata_file(const char* filename,
+                                 mode_t mode,
+                                 pem_writer write,
+                                 const void* data,
+                                 char* reason,
+                                 size_t reason_size) {
+    g_autofree char* path = g_build_filename(APP_LOCALDATA, filename, NULL);
+    g_autofree char* temp_path = g_strdup_printf("%s.tmp", path);
+    const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    FILE* fp = fd >= 0 && fchmod(fd, mode) == 0 ? fdopen(fd, "w") : NULL;
+    if (!fp) {
+        g_snprintf(reason, reason_size, "%s could not be written: %s", filename, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        unlink(temp_path);
+        return false;
+    }
+    bool success = write(fp, data);
+    success = fclose(fp) == 0 && success;
+    if (success && rename(temp_path, path) != 0)
+        success = false;
+    if (!success) {
+        g_snprintf(reason, reason_size, "%s could not be written", filename);
+        unlink(temp_path);
+    }
+    ERR_clear_error();
+    return success;
+}
+
+static enum tls_generate_status
+use_uploaded_ca(struct upload* upload, struct ca* ca, char* reason, size_t reason_size) {
+    ca->certs_changed = sk_X509_num(upload->ca_certs) > 0;
+    if (ca->certs_changed) {
+        ca->certs = upload->ca_certs;
+        upload->ca_certs = NULL;
+    } else {
+        ca->certs = read_ca_pem();
+    }
+    ca->key = upload->ca_key;
+    upload->ca_key = NULL;
+
+    ca->cert = find_cert_of_key(ca->certs, ca->key);
+    if (!ca->cert) {
+        g_snprintf(reason,
+                   reason_size,
+                   "the CA key does not match the %s",
+                   ca->certs_changed ? "uploaded CA certificate" : "CA certificate in localdata");
+        return tls_generate_bad_upload;
+    }
+    if (X509_check_ca(ca->cert) == 0) {
+        g_snprintf(reason, reason_size, "the certificate of the CA key is not a CA certificate");
+        return tls_generate_bad_upload;
+    }
+    if (X509_cmp_current_time(X509_get0_notAfter(ca->cert)) < 0) {
+        g_snprintf(reason, reason_size, "the CA certificate has expired");
+        return tls_generate_bad_upload;
+    }
+    return tls_generate_ok;
+}
+
+// Use the CA on the device if ca.pem is still its certificate, or create it if there is no ca.pem.
+static enum tls_generate_status use_device_ca(const char* hostname,
+                                              struct ca* ca,
+                                              enum tls_generate_ca* ca_kind,
+                                              char* reason,
+                                              size_t reason_size) {
+    ca->certs = read_ca_pem();
+    BIO* bio;
+    if (read_localdata_file(CA_KEY_FILENAME, &bio)) {
+        ca->key = PEM_read_bio_PrivateKey(bio, NULL, no_passphrase, NULL);
+        BIO_free(bio);
+        ERR_clear_error();
+    }
+    ca->cert = ca->key ? find_cert_of_key(ca->certs, ca->key) : NULL;
+    if (ca->cert && X509_cmp_current_time(X509_get0_notAfter(ca->cert)) > 0) {
+        *ca_kind = tls_generate_ca_device;
+        return tls_generate_ok;
+    }
+    if (sk_X509_num(ca->certs) > 0 && !ca->cert) {
+        g_snprintf(reason,
+                   reason_size,
+                   "ca.pem is not from a CA on the device, so upload its key, or delete ca.pem to "
+                   "create a new CA");
+        return tls_generate_conflict;
+    }
+
+    // No ca.pem, or an expired one from the CA on the device
+    log_info("Creating a new CA on the device");
+    static const struct extension ca_extensions[] = {
+        {NID_basic_constraints, "critical,CA:TRUE,pathlen:0"},
+        {NID_key_usage, "critical,keyCertSign,cRLSign"},
+        {NID_subject_key_identifier, "hash"},
+    };
+    EVP_PKEY_free(ca->key);
+    sk_X509_pop_free(ca->certs, X509_free);
+    ca->certs = sk_X509_new_null();
+    ca->key = EVP_EC_gen("P-256");
+    g_autofree char* common_name = g_strdup_printf("%s CA on %s", APP_NAME, hostname);
+    X509_NAME* subject = name_with_common_name(common_name);
+    ca->cert = ca->key ? new_cert(subject,
+                                  ca->key,
+                                  CA_VALIDITY_DAYS,
+                                  NULL,
+                                  ca->key,
+                                  ca_extensions,
+                                  G_N_ELEMENTS(ca_extensions))
+                       : NULL;
+    X509_NAME_free(subject);
+    if (!ca->cert) {
+        g_snprintf(reason, reason_size, "a CA could not be created");
+        return tls_generate_failed;
+    }
+    sk_X509_push(ca->certs, ca->cert);
+    ca->certs_changed = true;
+    *ca_kind = tls_generate_ca_created;
+
+    if (!write_localdata_file(CA_KEY_FILENAME, 0600, write_key, ca->key, reason, reason_size))
+        return tls_generate_failed;
+    return tls_generate_ok;
+}
+
+static void add_san(struct tls_generate_result* result, const char* type, const char* value) {
+    char san[sizeof(result->sans[0])];
+    g_snprintf(san, sizeof(san), "%s:%s", type, value);
+    for (int i = 0; i < result->san_count; i++)
+        if (strcmp(result->sans[i], san) == 0)
+            return;
+    if (result->san_count < TLS_GENERATE_MAX_SANS)
+        g_strlcpy(result->sans[result->san_count++], san, sizeof(san));
+}
+
+// Add the host name and the addresses of the interfaces that are up, except loopback and IPv6
+// link-local addresses, which clients on other hosts cannot use without a zone.
+static void add_device_sans(struct tls_generate_result* result, const char* hostname) {
+    add_san(result, "DNS", hostname);
+
+    struct ifaddrs* interfaces;
+    if (getifaddrs(&interfaces) != 0) {
+        log_warning("Failed to list the network interfaces: %s", strerror(errno));
+        return;
+    }
+    for (const struct ifaddrs* interface = interfaces; interface; interface = interface->ifa_next) {
+        const struct sockaddr* address = interface->ifa_addr;
+        if (!address || !(interface->ifa_flags & IFF_UP) || (interface->ifa_flags & IFF_LOOPBACK))
+            continue;
+        char text[INET6_ADDRSTRLEN];
+        if (address->sa_family == AF_INET) {
+            inet_ntop(AF_INET,
+                      &((const struct sockaddr_in*)address)->sin_addr,
+                      text,
+                      sizeof(text));
+        } else if (address->sa_family == AF_INET6) {
+            const struct in6_addr* address6 = &((const struct sockaddr_in6*)address)->sin6_addr;
+            if (IN6_IS_ADDR_LINKLOCAL(address6))
+                continue;
+            inet_ntop(AF_INET6, address6, text, sizeof(text));
+        } else {
+            continue;
+        }
+        add_san(result, "IP", text);
+    }
+    freeifaddrs(interfaces);
+}
+
+// Return the subject alternative names in the openssl.cnf syntax.
+static char* join_sans(const struct tls_generate_result* result) {
+    GString* list = g_string_new(NULL);
+    for (int i = 0; i < result->san_count; i++)
+        g_string_append_printf(list, "%s%s", i ? "," : "", result->sans[i]);
+    return g_string_free(list, FALSE);
+}
+
+static char* certs_to_pem(STACK_OF(X509) * certs) {
+    BIO* bio = BIO_new(BIO_s_mem());
+    for (int i = 0; i < sk_X509_num(certs); i++)
+        PEM_write_bio_X509(bio, sk_X509_value(certs, i));
+    char* data;
+    const long length = BIO_get_mem_data(bio, &data);
+    char* pem = g_strndup(data, length);
+    BIO_free(bio);
+    return pem;
+}
+
+static char* cert_to_pem(X509* cert) {
+    STACK_OF(X509)* certs = sk_X509_new_null();
+    sk_X509_push(certs, cert);
+    char* pem = certs_to_pem(certs);
+    sk_X509_free(certs);
+    return pem;
+}
+
+static enum tls_generate_status generate_with_ca(struct ca* ca,
+                                                 X509_REQ* client_request,
+                                                 const char* hostname,
+                                                 struct tls_generate_result* result,
+                                                 char* reason,
+                                                 size_t reason_size) {
+    add_device_sans(result, hostname);
+    g_autofree char* san_list = join_sans(result);
+    const struct extension server_extensions[] = {
+        {NID_basic_constraints, "critical,CA:FALSE"},
+        {NID_key_usage, "critical,digitalSignature"},
+        {NID_ext_key_usage, "serverAuth"},
+        {NID_subject_key_identifier, "hash"},
+        {NID_authority_key_identifier, "keyid"},
+        {NID_subject_alt_name, san_list},
+    };
+    static const struct extension client_extensions[] = {
+        {NID_basic_constraints, "critical,CA:FALSE"},
+        {NID_key_usage, "critical,digitalSignature"},
+        {NID_ext_key_usage, "clientAuth"},
+        {NID_subject_key_identifier, "hash"},
+        {NID_authority_key_identifier, "keyid"},
+    };
+
+    EVP_PKEY* server_key = EVP_EC_gen("P-256");
+    X509_NAME* subject = name_with_common_name(hostname);
+    X509* server_cert = server_key ? new_cert(subject,
+                                              server_key,
+                                              CERT_VALIDITY_DAYS,
+                                              ca->cert,
+                                              ca->key,
+                                              server_extensions,
+                                              G_N_ELEMENTS(server_extensions))
+                                   : NULL;
+    X509_NAME_free(subject);
+    X509* client_cert = client_request ? new_cert(X509_REQ_get_subject_name(client_request),
+                                                  X509_REQ_get0_pubkey(client_request),
+                                                  CERT_VALIDITY_DAYS,
+                                                  ca->cert,
+                                                  ca->key,
+                                                  client_extensions,
+                                                  G_N_ELEMENTS(client_extensions))
+                                       : NULL;
+
+    enum tls_generate_status status = tls_generate_ok;
+    if (!server_cert || (client_request && !client_cert)) {
+        g_snprintf(reason, reason_size, "the certificates could not be created");
+        status = tls_generate_failed;
+    } else if ((ca->certs_changed &&
+                !write_localdata_file(
+                    "ca.pem", 0644, write_certs, ca->certs, reason, reason_size)) ||
+               !write_localdata_file(
+                   "server-key.pem", 0600, write_key, server_key, reason, reason_size) ||
+               !write_localdata_file(
+                   "server-cert.pem", 0644, write_cert, server_cert, reason, reason_size)) {
+        status = tls_generate_failed;
+    } else {
+        result->ca_cert_pem = certs_to_pem(ca->certs);
+        result->client_cert_pem = client_cert ? cert_to_pem(client_cert) : NULL;
+        X509_NAME_oneline(
+            X509_get_subject_name(server_cert), result->subject, sizeof(result->subject));
+        struct tm tm;
+        if (ASN1_TIME_to_tm(X509_get0_notAfter(server_cert), &tm) == 1)
+            result->not_after = timegm(&tm);
+        log_info("Generated a server key and certificate for %s", san_list);
+    }
+
+    // Refresh the index even after a failure, since some of the files may have been replaced.
+    localdata_index_refresh("ca.pem");
+    localdata_index_refresh("server-key.pem");
+    localdata_index_refresh("server-cert.pem");
+
+    X509_free(client_cert);
+    X509_free(server_cert);
+    EVP_PKEY_free(server_key);
+    return status;
+}
+
+enum tls_generate_status tls_generate(const char* upload_path,
+                                      struct tls_generate_result* result,
+                                      char* reason,
+                                      size_t reason_size) {
+    *result = (struct tls_generate_result){0};
+    struct upload upload = {0};
+    if (upload_path && !read_upload(upload_path, &upload, reason, reason_size)) {
+        free_upload(&upload);
+        log_warning("Cannot generate TLS files: %s", reason);
+        return tls_generate_bad_upload;
+    }
+
+    char hostname[HOST_NAME_MAX + 1] = "";
+    if (gethostname(hostname, sizeof(hostname)) != 0 || !*hostname)
+        g_strlcpy(hostname, "localhost", sizeof(hostname));
+
+    g_mutex_lock(&generate_mutex);
+    struct ca ca = {0};
+    enum tls_generate_status status;
+    if (upload.ca_key) {
+        result->ca = tls_generate_ca_uploaded;
+        status = use_uploaded_ca(&upload, &ca, reason, reason_size);
+    } else {
+        status = use_device_ca(hostname, &ca, &result->ca, reason, reason_size);
+    }
+    if (status == tls_generate_ok)
+        status =
+            generate_with_ca(&ca, upload.client_request, hostname, result, reason, reason_size);
+    g_mutex_unlock(&generate_mutex);
+
+    if (status != tls_generate_ok) {
+        log_warning("Cannot generate TLS files: %s", reason);
+        tls_generate_result_clear(result);
+    }
+    free_ca(&ca);
+    free_upload(&upload);
+    return status;
+}
+
+void tls_generate_result_clear(struct tls_generate_result* result) {
+    g_free(result->ca_cert_pem);
+    g_free(result->client_cert_pem);
+    result->ca_cert_pem = NULL;
+    result->client_cert_pem = NULL;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+#define TLS_GENERATE_MAX_SANS 16
+
+enum tls_generate_ca {
+    tls_generate_ca_created,   // A new CA was created, and its key stored on the device
+    tls_generate_ca_device,    // The CA created on the device earlier was used
+    tls_generate_ca_uploaded,  // The uploaded CA key was used once, and not stored
+};
+
+struct tls_generate_result {
+    enum tls_generate_ca ca;
+    char* ca_cert_pem;      // The new ca.pem, for clients to trust. Free with g_free().
+    char* client_cert_pem;  // Signed from the uploaded request, or NULL. Free with g_free().
+    char subject[256];      // Of the server certificate
+    char sans[TLS_GENERATE_MAX_SANS][64];  // Of the server certificate, e.g. "IP:192.168.0.90"
+    int san_count;
+    gint64 not_after;  // Of the server certificate, in seconds since the epoch
+};
+
+enum tls_generate_status {
+    tls_generate_ok,
+    tls_generate_bad_upload,  // The uploaded file cannot be used
+    tls_generate_conflict,    // No CA key was uploaded, and ca.pem is not from a CA on the device
+    tls_generate_failed,
+};
+
+// Generate an EC P-256 server key on the device, and a server certificate for the host name and
+// the current addresses of the device, and store them, and the CA certificate, in localdata.
+//
+// upload_path is NULL, or a PEM file with a CA key, optionally followed by its certificate, and/or
+// a certificate signing request for a client. Without a CA key, the certificate is signed by a CA
+// on the device, which is created the first time and kept in localdata, unless ca.pem is already
+// there and belongs to some other CA, since clients may trust it. A client request is
+// signed by the same CA, so that clients of a CA on the device can get certificates without its
+// key leaving the device.
+//
+// On success, fill in result, which the caller frees with tls_generate_result_clear(). Otherwise
+// write the reason to reason.
+enum tls_generate_status tls_generate(const char* upload_path,
+                                      struct tls_generate_result* result,
+                                      char* reason,
+                                      size_t reason_size);
+
+void tls_generate_result_clear(struct tls_generate_result* result);
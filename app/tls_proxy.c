@@ -0,0 +1,383 @@
+#define _GNU_SOURCE  // For accept4() and pipe2()
+#define LOG_MODULE log_module_tls
+#include "tls_proxy.h"
+#include "log.h"
+#include "tls.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define TLS_PROXY_MAX_CONNECTIONS      32
+#define TLS_PROXY_LISTEN_BACKLOG       16
+#define TLS_PROXY_BUFFER_SIZE          16384  // The largest TLS record
+#define TLS_PROXY_HANDSHAKE_TIMEOUT_MS 10000
+
+// Shared by the thread that starts and stops the proxy, the listener thread, the connection
+// threads, and the FCGI thread through tls_proxy_reload().
+static struct {
+    GMutex mutex;
+    GCond all_closed;              // Signaled when stats.connections drops to zero
+    SSL_CTX* ctx;                  // Guarded by mutex. NULL when not running.
+    struct tls_proxy_stats stats;  // Guarded by mutex
+    int listen_fd;
+    int stop_pipe[2];  // Closing the write end wakes up and stops all threads
+    GThread* listener;
+    struct sockaddr_un backend;
+} proxy = {.listen_fd = -1, .stop_pipe = {-1, -1}};
+
+// Bytes read from one side of a connection, not yet written to the other side.
+struct stream_buffer {
+    char data[TLS_PROXY_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+    bool eof;  // The side it is read from has closed
+};
+
+struct connection {
+    SSL* ssl;
+    int client_fd;
+    int backend_fd;
+    struct stream_buffer upstream;    // From the client to dockerd
+    struct stream_buffer downstream;  // From dockerd to the client
+};
+
+static bool is_empty(const struct stream_buffer* buffer) {
+    return buffer->start == buffer->end;
+}
+
+// Translate the result of an SSL call on a non-blocking socket into the poll events it waits
+// for. Return false if the connection has failed.
+static bool ssl_wants(SSL* ssl, int result, short* events) {
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+            *events |= POLLIN;
+            return true;
+        case SSL_ERROR_WANT_WRITE:
+            *events |= POLLOUT;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Wait for events on fds[0..count-2]. The last entry is filled in with the stop pipe. Return false
+// if the proxy is stopping, or on timeout.
+static bool wait_for(struct pollfd* fds, nfds_t count, int timeout_ms) {
+    fds[count - 1] = (struct pollfd){.fd = proxy.stop_pipe[0], .events = POLLIN};
+    int ready;
+    while ((ready = poll(fds, count, timeout_ms)) < 0 && errno == EINTR) continue;
+    return ready > 0 && !fds[count - 1].revents;
+}
+
+static bool handshake(struct connection* c) {
+    const gint64 deadline = g_get_monotonic_time() + TLS_PROXY_HANDSHAKE_TIMEOUT_MS * 1000;
+    int result;
+    while ((result = SSL_accept(c->ssl)) != 1) {
+        struct pollfd fds[2] = {{.fd = c->client_fd}};
+        const int remaining_ms = (deadline - g_get_monotonic_time()) / 1000;
+        if (remaining_ms <= 0 || !ssl_wants(c->ssl, result, &fds[0].events) ||
+            !wait_for(fds, G_N_ELEMENTS(fds), remaining_ms)) {
+            char reason[256] = "connection closed";
+            if (remaining_ms <= 0)
+                g_strlcpy(reason, "timeout", sizeof(reason));
+            else if (ERR_peek_error())
+                ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+            log_info("TLS handshake failed: %s", reason);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool connect_to_backend(struct connection* c) {
+    const struct sockaddr* address = (const struct sockaddr*)&proxy.backend;
+    c->backend_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->backend_fd < 0 || connect(c->backend_fd, address, sizeof(proxy.backend)) != 0 ||
+        fcntl(c->backend_fd, F_SETFL, O_NONBLOCK) != 0) {
+        log_warning("Failed to connect to %s: %s", proxy.backend.sun_path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Move data both ways until dockerd closes the connection, either side fails, or the proxy is
+// stopped. Each pass tries every transfer that has room or data, and the poll events are those
+// that the transfers of the last pass, which made no progress, were blocked on.
+static void forward(struct connection* c) {
+    struct stream_buffer* up = &c->upstream;
+    struct stream_buffer* down = &c->downstream;
+    struct pollfd fds[3];
+    while (true) {
+        short client_events;
+        short backend_events;
+        bool progress;
+        do {
+            client_events = 0;
+            backend_events = 0;
+            progress = false;
+
+            if (is_empty(up) && !up->eof) {
+                const int n = SSL_read(c->ssl, up->data, sizeof(up->data));
+                up->start = 0;
+                up->end = n > 0 ? n : 0;
+                if (n > 0) {
+                    progress = true;
+                } else if (SSL_get_error(c->ssl, n) == SSL_ERROR_ZERO_RETURN) {
+                    // The client sent close_notify. Let dockerd finish its response.
+                    up->eof = true;
+                    shutdown(c->backend_fd, SHUT_WR);
+                    progress = true;
+                } else if (!ssl_wants(c->ssl, n, &client_events)) {
+                    return;
+                }
+            }
+            if (!is_empty(up)) {
+                const ssize_t n =
+                    send(c->backend_fd, up->data + up->start, up->end - up->start, MSG_NOSIGNAL);
+                if (n > 0) {
+                    up->start += n;
+                    progress = true;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    backend_events |= POLLOUT;
+                } else {
+                    return;
+                }
+            }
+
+            if (is_empty(down) && !down->eof) {
+                const ssize_t n = recv(c->backend_fd, down->data, sizeof(down->data), 0);
+                down->start = 0;
+                down->end = n > 0 ? n : 0;
+                if (n >= 0) {
+                    down->eof = n == 0;
+                    progress = true;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    backend_events |= POLLIN;
+                } else {
+                    return;
+                }
+            }
+            if (!is_empty(down)) {
+                const int n =
+                    SSL_write(c->ssl, down->data + down->start, down->end - down->start);
+                if (n > 0) {
+                    down->start += n;
+                    progress = true;
+                } else if (!ssl_wants(c->ssl, n, &client_events)) {
+                    return;
+                }
+            }
+
+            if (down->eof && is_empty(down)) {
+                SSL_shutdown(c->ssl);  // Best effort close_notify
+                return;
+            }
+        } while (progress);
+
+        // A negative fd is ignored by poll(), so a hangup on a side that is not waited for does
+        // not wake the loop up over and over.
+        fds[0] = (struct pollfd){.fd = client_events ? c->client_fd : -1, .events = client_events};
+        fds[1] =
+            (struct pollfd){.fd = backend_events ? c->backend_fd : -1, .events = backend_events};
+        if (!wait_for(fds, G_N_ELEMENTS(fds), -1))
+            return;
+    }
+}
+
+static void close_connection(struct connection* c) {
+    SSL_free(c->ssl);
+    close(c->client_fd);
+    if (c->backend_fd >= 0)
+        close(c->backend_fd);
+    g_free(c);
+
+    g_mutex_lock(&proxy.mutex);
+    if (--proxy.stats.connections == 0)
+        g_cond_broadcast(&proxy.all_closed);
+    g_mutex_unlock(&proxy.mutex);
+}
+
+static void* serve_connection(void* connection_void_ptr) {
+    struct connection* c = connection_void_ptr;
+    const bool established = handshake(c);
+
+    g_mutex_lock(&proxy.mutex);
+    if (!established) {
+        proxy.stats.failed_handshakes++;
+    } else {
+        proxy.stats.handshakes++;
+        if (SSL_session_reused(c->ssl))
+            proxy.stats.resumed_handshakes++;
+    }
+    g_mutex_unlock(&proxy.mutex);
+
+    if (established && connect_to_backend(c))
+        forward(c);
+
+    close_connection(c);
+    return NULL;
+}
+
+static void accept_connection(int fd) {
+    g_mutex_lock(&proxy.mutex);
+    const bool full = proxy.stats.connections >= TLS_PROXY_MAX_CONNECTIONS;
+    SSL* ssl = full ? NULL : SSL_new(proxy.ctx);
+    if (full)
+        proxy.stats.rejected_connections++;
+    else if (ssl)
+        proxy.stats.connections++;
+    g_mutex_unlock(&proxy.mutex);
+
+    if (!ssl) {
+        if (full)
+            log_warning("Closed TLS connection, since %d are already open",
+                        TLS_PROXY_MAX_CONNECTIONS);
+        close(fd);
+        return;
+    }
+
+    struct connection* c = g_new(struct connection, 1);
+    c->ssl = ssl;
+    c->client_fd = fd;
+    c->backend_fd = -1;
+    c->upstream.start = c->upstream.end = 0;
+    c->upstream.eof = false;
+    c->downstream.start = c->downstream.end = 0;
+    c->downstream.eof = false;
+    SSL_set_fd(ssl, fd);
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);  // Return to poll() after non-application records
+
+    GError* error = NULL;
+    GThread* thread = g_thread_try_new("tls_connection", serve_connection, c, &error);
+    if (!thread) {
+        log_error("Failed to start TLS connection thread: %s", error->message);
+        g_clear_error(&error);
+        close_connection(c);
+        return;
+    }
+    g_thread_unref(thread);  // The thread cleans up after itself
+}
+
+static void* accept_connections(void*) {
+    // Make writes to a closed connection fail with EPIPE rather than kill the application. The
+    // connection threads inherit the signal mask.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    struct pollfd fds[2] = {{.fd = proxy.listen_fd, .events = POLLIN}};
+    while (wait_for(fds, G_N_ELEMENTS(fds), -1)) {
+        const int fd = accept4(proxy.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0)
+            accept_connection(fd);
+        else
+            log_debug("accept4() failed: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+static void close_fd(int* fd) {
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+bool tls_proxy_start(guint16 port, const char* backend_path) {
+    SSL_CTX* ctx = tls_server_context_new();
+    if (!ctx)
+        return false;
+
+    proxy.backend.sun_family = AF_UNIX;
+    g_strlcpy(proxy.backend.sun_path, backend_path, sizeof(proxy.backend.sun_path));
+
+    const struct sockaddr_in address = {
+        .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    const int reuse = 1;
+    if ((proxy.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(proxy.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(proxy.listen_fd, (const struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(proxy.listen_fd, TLS_PROXY_LISTEN_BACKLOG) != 0) {
+        log_error("Failed to listen on port %u: %s", port, strerror(errno));
+        goto error;
+    }
+    if (pipe2(proxy.stop_pipe, O_CLOEXEC) != 0) {
+        log_error("Failed to create pipe: %s", strerror(errno));
+        goto error;
+    }
+
+    g_mutex_lock(&proxy.mutex);
+    proxy.ctx = ctx;
+    proxy.stats.running = true;
+    g_mutex_unlock(&proxy.mutex);
+    proxy.listener = g_thread_new("tls_proxy", accept_connections, NULL);
+    log_info("Terminating TLS on port %u and forwarding to %s", port, backend_path);
+    return true;
+
+error:
+    close_fd(&proxy.listen_fd);
+    SSL_CTX_free(ctx);
+    return false;
+}
+
+bool tls_proxy_reload(void) {
+    g_mutex_lock(&proxy.mutex);
+    const bool running = proxy.stats.running;
+    g_mutex_unlock(&proxy.mutex);
+    if (!running)
+        return false;
+
+    SSL_CTX* ctx = tls_server_context_new();
+    if (!ctx) {
+        log_error("Keeping the previous TLS certificates");
+        return false;
+    }
+
+    g_mutex_lock(&proxy.mutex);
+    SSL_CTX* old_ctx = proxy.ctx;  // NULL if the proxy was stopped meanwhile
+    if (old_ctx)
+        proxy.ctx = ctx;
+    g_mutex_unlock(&proxy.mutex);
+
+    // Open connections hold references to the old context through their SSL objects.
+    SSL_CTX_free(old_ctx ? old_ctx : ctx);
+    if (old_ctx)
+        log_info("Switched to the TLS certificates in localdata");
+    return old_ctx;
+}
+
+void tls_proxy_stop(void) {
+    if (!proxy.listener)
+        return;
+
+    close_fd(&proxy.stop_pipe[1]);
+    g_thread_join(proxy.listener);
+    proxy.listener = NULL;
+
+    g_mutex_lock(&proxy.mutex);
+    while (proxy.stats.connections) g_cond_wait(&proxy.all_closed, &proxy.mutex);
+    SSL_CTX_free(proxy.ctx);
+    proxy.ctx = NULL;
+    proxy.stats.running = false;
+    g_mutex_unlock(&proxy.mutex);
+
+    close_fd(&proxy.stop_pipe[0]);
+    close_fd(&proxy.listen_fd);
+    log_info("Stopped terminating TLS");
+}
+
+void tls_proxy_get_stats(struct tls_proxy_stats* stats) {
+    g_mutex_lock(&proxy.mutex);
+    *stats = proxy.stats;
+    g_mutex_unlock(&proxy.mutex);
+}
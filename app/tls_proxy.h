@@ -0,0 +1,29 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// Counters since the application started.
+struct tls_proxy_stats {
+    bool running;
+    guint connections;  // Currently open
+    guint64 handshakes;
+    guint64 resumed_handshakes;  // Included in handshakes
+    guint64 failed_handshakes;
+    guint64 rejected_connections;  // Because TLS_PROXY_MAX_CONNECTIONS were already open
+};
+
+// Terminate TLS on port, using the files in localdata, and forward the plaintext of each
+// connection to the Unix socket at backend_path. Connections are served by threads of their own.
+// Log and return false on error.
+bool tls_proxy_start(guint16 port, const char* backend_path);
+
+// Switch to the files now in localdata for new connections. Connections already open keep the
+// certificates they were established with. Return false if the proxy is not running, or if the
+// files could not be loaded, in which case the previous certificates are still used.
+bool tls_proxy_reload(void);
+
+// Close the listening socket and all connections. Return when all threads have ended.
+void tls_proxy_stop(void);
+
+// Can be called from any thread.
+void tls_proxy_get_stats(struct tls_proxy_stats* stats);
@@ -0,0 +1,77 @@
+#include "trace.h"
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define TRACE_SPANS     1024
+#define TRACE_NAME_SIZE 48
+
+struct recorded_span {
+    char name[TRACE_NAME_SIZE];
+    gint64 start;
+    gint64 duration;
+    pid_t tid;
+};
+
+static GMutex mutex;
+static struct recorded_span spans[TRACE_SPANS];
+static guint64 recorded;  // Span n is stored at index n % TRACE_SPANS.
+
+static pid_t thread_id(void) {
+    static __thread pid_t tid = 0;
+    if (!tid)
+        tid = syscall(SYS_gettid);
+    return tid;
+}
+
+struct trace_span trace_begin(const char* name) {
+    return (struct trace_span){name, g_get_monotonic_time()};
+}
+
+void trace_end(struct trace_span* span) {
+    if (!span->name)
+        return;
+
+    const gint64 end = g_get_monotonic_time();
+    const pid_t tid = thread_id();
+
+    g_mutex_lock(&mutex);
+    struct recorded_span* recorded_span = &spans[recorded % TRACE_SPANS];
+    g_strlcpy(recorded_span->name, span->name, sizeof(recorded_span->name));
+    recorded_span->start = span->start;
+    recorded_span->duration = end - span->start;
+    recorded_span->tid = tid;
+    recorded++;
+    g_mutex_unlock(&mutex);
+
+    span->name = NULL;
+}
+
+char* trace_to_json(guint limit) {
+    GString* json = g_string_sized_new(128 + 128 * MIN(limit, TRACE_SPANS));
+    const pid_t pid = getpid();
+
+    g_string_append(json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    g_mutex_lock(&mutex);
+    const guint64 first = recorded - MIN(MIN(recorded, TRACE_SPANS), limit);
+    for (guint64 n = first; n < recorded; n++) {
+        const struct recorded_span* span = &spans[n % TRACE_SPANS];
+        // Span names are identifiers and request lines, so replacing the few characters that
+        // would need escaping is good enough.
+        char name[TRACE_NAME_SIZE];
+        g_strlcpy(name, span->name, sizeof(name));
+        g_strdelimit(name, "\"\\\n\r\t", '_');
+        g_string_append_printf(json,
+                               "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+                               ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d}",
+                               n == first ? "" : ",",
+                               name,
+                               span->start,
+                               span->duration,
+                               pid,
+                               span->tid);
+    }
+    g_mutex_unlock(&mutex);
+    g_string_append(json, "]}");
+
+    return g_string_free(json, FALSE);
+}
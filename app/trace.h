@@ -0,0 +1,26 @@
+#pragma once
+#include <glib.h>
+
+// Lightweight span tracer. Completed spans are recorded in a preallocated ring buffer and can be
+// exported in the Chrome trace event format, which can be opened in Perfetto or chrome://tracing.
+
+struct trace_span {
+    const char* name;
+    gint64 start;  // g_get_monotonic_time()
+};
+
+struct trace_span trace_begin(const char* name);
+
+// Record a span that began with trace_begin(). Thread safe. Ending a span that never began, i.e.
+// one with a NULL name, is a no-op.
+void trace_end(struct trace_span* span);
+
+// Trace the rest of the enclosing scope.
+#define TRACE_SCOPE(name) \
+    __attribute__((cleanup(trace_end))) struct trace_span trace_scope_span = trace_begin(name)
+
+// Trace the rest of the enclosing function.
+#define TRACE_FUNCTION() TRACE_SCOPE(__func__)
+
+// Return the last 'limit' spans as a Chrome trace JSON object. Free with g_free().
+char* trace_to_json(guint limit);
@@ -43,7 +43,9 @@ done
 docker buildx build --build-arg ARCH="$arch" \
 	--build-arg HTTP_PROXY="${HTTP_PROXY:-}" \
 	--build-arg HTTPS_PROXY="${HTTPS_PROXY:-}" \
+	--build-arg ALLOC_STATS="${ALLOC_STATS:-}" \
 	--build-arg BUILD_WITH_SANITIZERS="${BUILD_WITH_SANITIZERS:-}" \
+	--build-arg LOG_MIN_LEVEL="${LOG_MIN_LEVEL:-}" \
 	--file Dockerfile \
 	$progress_arg \
 	$cache_arg \